@@ -0,0 +1,213 @@
+// $Id$
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+#include "../licut_io.h"
+#include "../licut_time.h"
+#include "device_emu.h"
+
+DeviceEmu::DeviceEmu()
+{
+	m_fd = -1;
+	m_started = false;
+	m_capacity = 32;
+	m_inTransaction = false;
+	m_pending = NULL;
+	m_pendingCount = 0;
+	m_executed = NULL;
+	m_executedCount = 0;
+	m_executedAlloc = 0;
+	m_lost = 0;
+	m_invalid = 0;
+	m_transactions = 0;
+	m_lose = 0;
+	m_dropReply = 0;
+	m_truncate = 0;
+	m_seed = 1;
+	m_faults = 0;
+	m_gaps = 0;
+	m_shortGaps = 0;
+}
+
+DeviceEmu::~DeviceEmu()
+{
+	Join();
+	free( m_pending );
+	free( m_executed );
+}
+
+void DeviceEmu::SetFaults( double lose, double dropReply, double truncate, unsigned int seed )
+{
+	m_lose = lose;
+	m_dropReply = dropReply;
+	m_truncate = truncate;
+	m_seed = seed ? seed : 1;
+}
+
+// True with probability p, from a xorshift sequence
+bool DeviceEmu::Chance( double p )
+{
+	if (p <= 0) return false;
+	m_seed ^= m_seed << 13;
+	m_seed ^= m_seed >> 17;
+	m_seed ^= m_seed << 5;
+	return m_seed < p * 4294967296.0;
+}
+
+// Serve fd in a thread. Returns 0 if successful
+int DeviceEmu::Start( int fd )
+{
+	if (m_started) return -1;
+	m_pending = (emuCmd_t *)malloc( (m_capacity > 0 ? m_capacity : 1) * sizeof(emuCmd_t) );
+	if (!m_pending) return -1;
+	m_fd = fd;
+	if (pthread_create( &m_thread, NULL, Thread, this ) != 0) return -1;
+	m_started = true;
+	return 0;
+}
+
+void DeviceEmu::Join()
+{
+	if (!m_started) return;
+	pthread_join( m_thread, NULL );
+	m_started = false;
+}
+
+void *DeviceEmu::Thread( void *arg )
+{
+	((DeviceEmu *)arg)->Serve();
+	return NULL;
+}
+
+// Read one length-prefixed packet at a time and answer it
+void DeviceEmu::Serve()
+{
+	unsigned char packet[256];
+	for (;;)
+	{
+		if (read( m_fd, packet, 1 ) != 1) break;
+		int length = packet[0];
+		// A byte at a time, timing the gaps as the device's UART would see them
+		double last = licut_now() * 1e6;
+		for (int got = 0; got < length; got++)
+		{
+			if (read( m_fd, &packet[1 + got], 1 ) != 1) return;
+			double now = licut_now() * 1e6;
+			m_gaps++;
+			if (now - last < LICUT_BYTE_DELAY_US / 2) m_shortGaps++;
+			last = now;
+		}
+		if (length < 1) continue;
+		switch (packet[1])
+		{
+			case 0x14: // Cartridge and mat loaded
+			{
+				static const unsigned char reply[] = { 4, 0, 1, 0, 1 };
+				Reply( reply, sizeof(reply) );
+				break;
+			}
+			case 0x12: // Model 2, firmware 1.9
+			{
+				static const unsigned char reply[] = { 6, 0, 2, 0, 1, 0, 9 };
+				Reply( reply, sizeof(reply) );
+				break;
+			}
+			case 0x11: // 6 x 12 mat
+			{
+				static const unsigned char reply[] = { 8, 0, 0, 0, 0, 0x17, 0x70, 0x2e, 0xe0 };
+				Reply( reply, sizeof(reply) );
+				break;
+			}
+			case 0x18: // No cartridge name
+			{
+				unsigned char reply[39];
+				memset( reply, 0, sizeof(reply) );
+				reply[0] = 38;
+				Reply( reply, sizeof(reply) );
+				break;
+			}
+			case 0x21:
+				// A start inside a transaction abandons what was held
+				m_inTransaction = true;
+				m_pendingCount = 0;
+				break;
+			case 0x22:
+				if (!m_inTransaction) break;
+				for (int n = 0; n < m_pendingCount; n++) Execute( m_pending[n] );
+				m_pendingCount = 0;
+				m_inTransaction = false;
+				m_transactions++;
+				break;
+			case 0x40:
+			{
+				static const unsigned char reply[] = { 3, 0, 0, 0 };
+				emuCmd_t c;
+				if (Chance( m_lose ))
+				{
+					m_faults++;
+					break;
+				}
+				if (length + 1 != LICUT_MOVECUT_PACKET || LicutIO::DecodeMoveCut( packet, c.subCmd, c.x, c.y ) != 0)
+				{
+					m_invalid++;
+				}
+				else if (!m_inTransaction)
+				{
+					Execute( c );
+				}
+				else if (m_pendingCount < m_capacity)
+				{
+					m_pending[m_pendingCount++] = c;
+				}
+				else
+				{
+					m_lost++;
+				}
+				if (Chance( m_dropReply ))
+				{
+					m_faults++;
+				}
+				else if (Chance( m_truncate ))
+				{
+					m_faults++;
+					Reply( reply, 1 );
+				}
+				else
+				{
+					Reply( reply, sizeof(reply) );
+				}
+				break;
+			}
+			default:
+				m_invalid++;
+				break;
+		}
+	}
+}
+
+// Write reply. Returns 0 if successful
+int DeviceEmu::Reply( const unsigned char *reply, int length )
+{
+	return write( m_fd, reply, length ) == length ? 0 : -1;
+}
+
+void DeviceEmu::Execute( emuCmd_t const& c )
+{
+	if (m_executedCount >= m_executedAlloc)
+	{
+		int alloc = m_executedAlloc ? m_executedAlloc * 2 : 256;
+		emuCmd_t *executed = (emuCmd_t *)realloc( m_executed, alloc * sizeof(emuCmd_t) );
+		if (!executed)
+		{
+			m_lost++;
+			return;
+		}
+		m_executed = executed;
+		m_executedAlloc = alloc;
+	}
+	m_executed[m_executedCount++] = c;
+}
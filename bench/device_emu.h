@@ -0,0 +1,81 @@
+// $Id$
+// Device emulator for benchmarks: serves one end of a socket pair or pty, answering
+// status, firmware, mat and cartridge queries and 0x40 move/cut packets
+
+#ifndef _DEVICE_EMU_H_
+#define _DEVICE_EMU_H_
+
+#include <pthread.h>
+
+// One 0x40 command as decoded by the emulator
+typedef struct _emuCmd
+{
+	unsigned int subCmd;
+	unsigned int x;
+	unsigned int y;
+} emuCmd_t;
+
+// Transactions (0x21 ... 0x22) are modelled as the host assumes them: packets are
+// acknowledged as they arrive and carried out when the transaction ends. Packets
+// beyond the transaction capacity are acknowledged but lost
+class DeviceEmu
+{
+public:
+	DeviceEmu();
+	~DeviceEmu();
+
+	// Packets held by one transaction (default 32)
+	void SetCapacity( int packets ) { m_capacity = packets; }
+
+	// Inject faults into 0x40 packets with these probabilities (0.0 - 1.0): lose
+	// the packet (not carried out, no reply), lose the reply to a packet carried
+	// out, or send only the first byte of the reply. Same seed, same faults
+	void SetFaults( double lose, double dropReply, double truncate, unsigned int seed );
+
+	// Serve fd in a thread until the other end closes. Returns 0 if successful
+	int Start( int fd );
+	// Wait for the thread to finish
+	void Join();
+
+	int GetExecutedCount() const { return m_executedCount; }
+	emuCmd_t const *GetExecuted( int index ) const { return (index >= 0 && index < m_executedCount) ? &m_executed[index] : NULL; }
+	int GetLost() const { return m_lost; }
+	int GetInvalid() const { return m_invalid; }
+	int GetTransactions() const { return m_transactions; }
+	int GetFaultCount() const { return m_faults; }
+	// Gaps between bytes of one packet, and those shorter than half the byte
+	// delay the device needs
+	long GetGapCount() const { return m_gaps; }
+	long GetShortGapCount() const { return m_shortGaps; }
+
+protected:
+	static void *Thread( void *arg );
+	void Serve();
+	int Reply( const unsigned char *reply, int length );
+	void Execute( emuCmd_t const& c );
+	// True with probability p
+	bool Chance( double p );
+
+	int m_fd;
+	pthread_t m_thread;
+	bool m_started;
+	int m_capacity;
+	bool m_inTransaction;
+	emuCmd_t *m_pending;
+	int m_pendingCount;
+	emuCmd_t *m_executed;
+	int m_executedCount;
+	int m_executedAlloc;
+	int m_lost;
+	int m_invalid;
+	int m_transactions;
+	double m_lose;
+	double m_dropReply;
+	double m_truncate;
+	unsigned int m_seed;
+	int m_faults;
+	long m_gaps;
+	long m_shortGaps;
+};
+
+#endif // _DEVICE_EMU_H_
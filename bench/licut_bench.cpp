@@ -0,0 +1,1249 @@
+// $Id$
+// Parser and geometry micro-benchmarks
+//
+// Each case runs in a forked child so peak RSS is per case. Results are
+// written one per line as
+// {case}	{metric}	{value}
+// and may be compared against a previous results file with --baseline
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <malloc.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include <gflags/gflags.h>
+
+#include "../licut_svg.h"
+#include "../licut_io.h"
+#include "../licut_log.h"
+#include "../licut_cmdlist.h"
+#include "../licut_encode.h"
+#include "../licut_pipeline.h"
+#include "../licut_transport.h"
+#include "../licut_relay.h"
+#include "../licut_input.h"
+#include "../licut_time.h"
+#include "svg_corpus.h"
+#include "device_emu.h"
+
+DEFINE_string( out, "", "Write results to file (default stderr)" );
+DEFINE_string( baseline, "", "Compare results against baseline results file" );
+DEFINE_int32( tolerance, 10, "Percent change against baseline reported as a regression" );
+DEFINE_int32( min_time, 500, "Minimum time per case in ms" );
+DEFINE_string( cases, "", "Comma-separated list of cases to run (default all)" );
+DEFINE_string( write_corpus, "", "Write generated svg files to this directory and exit" );
+DEFINE_int32( log_commands, 40, "Commands sent per mode by the log case" );
+DEFINE_int32( txn_capacity, 32, "Packets one transaction holds on the device emulated by the txn case" );
+DEFINE_int32( loss_timeout, 100, "Reply timeout in the loss case (in ms)" );
+DEFINE_int32( pipeline_depth, 16, "Draw sets queued between stages in the pipeline case" );
+
+// Count allocations by interposing on the C library allocator
+#ifdef __GLIBC__
+extern "C" void *__libc_malloc( size_t size );
+extern "C" void *__libc_calloc( size_t n, size_t size );
+extern "C" void *__libc_realloc( void *p, size_t size );
+static unsigned long g_allocs = 0;
+extern "C" void *malloc( size_t size ) { g_allocs++; return __libc_malloc( size ); }
+extern "C" void *calloc( size_t n, size_t size ) { g_allocs++; return __libc_calloc( n, size ); }
+extern "C" void *realloc( void *p, size_t size ) { g_allocs++; return __libc_realloc( p, size ); }
+#else
+static unsigned long g_allocs = 0;
+#endif
+
+static const svgCorpusParams_t g_cases[] = {
+	// name		paths	cmds	depth	curves	delim	seed
+	{ "small",	50,	20,	2,	0.3,	',',	1 },
+	{ "inkscape",	5000,	20,	4,	0.3,	',',	2 },
+	{ "nested",	4000,	4,	4000,	0.3,	',',	3 },
+	{ "curves",	2000,	50,	2,	1.0,	',',	4 },
+	{ "lines",	2000,	50,	2,	0.0,	',',	5 },
+	{ "spaces",	2000,	20,	2,	0.3,	' ',	6 },
+	{ "drawlist",	1,	200000,	0,	0.3,	',',	7 },
+	{ NULL,	0,	0,	0,	0,	0,	0 }
+};
+
+static bool _case_selected( const char *name )
+{
+	if (FLAGS_cases.empty()) return true;
+	const char *s = FLAGS_cases.c_str();
+	int nameLength = strlen( name );
+	while (*s)
+	{
+		int length = strcspn( s, "," );
+		if (length == nameLength && !strncmp( s, name, length )) return true;
+		s += length;
+		if (*s == ',') s++;
+	}
+	return false;
+}
+
+// Run case and write results to f. Called in child process
+static void _run_case( const svgCorpusParams_t *params, FILE *f )
+{
+	size_t length;
+	char *original = svg_corpus_generate( params, &length );
+	char *data = (char *)malloc( length + 1 );
+	int passes = 0;
+	double elapsed = 0;
+	unsigned long allocs = 0;
+	int paths = 0;
+	long commands = 0;
+	long points = 0;
+	int n;
+
+	// Parse is destructive so each pass starts from a fresh copy
+	while (elapsed < FLAGS_min_time / 1000.0 || passes < 2)
+	{
+		memcpy( data, original, length + 1 );
+		LicutSVG svg( 0 );
+		unsigned long allocsBefore = g_allocs;
+		double t0 = licut_now();
+		svg.ParseBuffer( data, length );
+		elapsed += licut_now() - t0;
+		allocs += g_allocs - allocsBefore;
+		passes++;
+		if (passes == 1)
+		{
+			paths = svg.GetDrawSetCount();
+			for (n = 0; n < paths; n++)
+			{
+				drawSet_t const *set = svg.GetDrawSet( n );
+				for (; set->type; set++, commands++) points += set->numPoints;
+			}
+		}
+	}
+	fprintf( f, "%s\tbytes\t%lu\n", params->name, (unsigned long)length );
+	fprintf( f, "%s\tparse_ms\t%.3f\n", params->name, elapsed * 1000 / passes );
+	fprintf( f, "%s\tparse_mb_s\t%.2f\n", params->name, length * (double)passes / elapsed / (1024 * 1024) );
+	fprintf( f, "%s\tpaths_s\t%.0f\n", params->name, paths * (double)passes / elapsed );
+	fprintf( f, "%s\tcommands_s\t%.0f\n", params->name, commands * (double)passes / elapsed );
+	fprintf( f, "%s\tallocs_per_parse\t%lu\n", params->name, allocs / passes );
+
+	// Scale every point onto a 12 x 12 mat
+	memcpy( data, original, length + 1 );
+	LicutSVG svg( 0 );
+	svg.ParseBuffer( data, length );
+	svg.SetScaling( 316, 50, 4646, 4646 );
+	unsigned int x, y;
+	unsigned long checksum = 0;
+	long scaled = 0;
+	double t0 = licut_now();
+	do
+	{
+		for (n = 0; n < svg.GetDrawSetCount(); n++)
+		{
+			drawSet_t const *set = svg.GetDrawSet( n );
+			for (; set->type; set++)
+			{
+				for (int i = 0; i < set->numPoints; i++)
+				{
+					svg.ScalePoint( (double *)set->pt[i], x, y );
+					checksum += x + y;
+				}
+				scaled += set->numPoints;
+			}
+		}
+	} while (licut_now() - t0 < FLAGS_min_time / 1000.0 / 4 && scaled > 0);
+	fprintf( f, "%s\tscale_points_s\t%.0f\n", params->name, scaled / (licut_now() - t0) );
+	if (checksum == 1) fprintf( f, "\n" ); // Keep scaling from being optimized away
+
+	struct rusage usage;
+	getrusage( RUSAGE_SELF, &usage );
+	fprintf( f, "%s\tpeak_rss_kb\t%ld\n", params->name, usage.ru_maxrss );
+
+	free( data );
+	free( original );
+}
+
+// Parse throughput in MB/s with verbose output written directly or through the log thread
+static double _log_parse( const char *original, size_t length, int verbose, bool async )
+{
+	char *data = (char *)malloc( length + 1 );
+	int passes = 0;
+	double elapsed = 0;
+	if (async) LicutLog::Start();
+	while (elapsed < FLAGS_min_time / 1000.0 || passes < 2)
+	{
+		memcpy( data, original, length + 1 );
+		LicutSVG svg( verbose );
+		double t0 = licut_now();
+		svg.ParseBuffer( data, length );
+		elapsed += licut_now() - t0;
+		passes++;
+	}
+	if (async) LicutLog::Stop();
+	free( data );
+	return length * (double)passes / elapsed / (1024 * 1024);
+}
+
+static int _compare_double( const void *a, const void *b )
+{
+	double d = *(const double *)a - *(const double *)b;
+	return d < 0 ? -1 : (d > 0 ? 1 : 0);
+}
+
+// Time verbose 0x40 sends to /dev/null against the time spent in intercharacter
+// delays, writing median and worst excess in us
+static void _log_jitter( FILE *f, const char *mode, int verbose, bool async )
+{
+	int handle = open( "/dev/null", O_WRONLY );
+	LicutIO lio( handle );
+	lio.SetVerbose( verbose );
+	LicutIO::SetFixedNoiseStart( 10001 );
+	double *excess = (double *)malloc( FLAGS_log_commands * sizeof(double) );
+	if (async) LicutLog::Start();
+	for (int n = 0; n < FLAGS_log_commands; n++)
+	{
+		double t0 = licut_now();
+		lio.SendCmd_MoveCut( n & 3 ? 0 : 2, 1000 + n, 2000 + n );
+		excess[n] = (licut_now() - t0) * 1e6 - LICUT_MOVECUT_PACKET * LICUT_BYTE_DELAY_US;
+	}
+	if (async) LicutLog::Stop();
+	close( handle );
+	qsort( excess, FLAGS_log_commands, sizeof(double), _compare_double );
+	fprintf( f, "log\tcmd_%s_jitter_p50_us\t%.1f\n", mode, excess[FLAGS_log_commands / 2] );
+	fprintf( f, "log\tcmd_%s_jitter_max_us\t%.1f\n", mode, excess[FLAGS_log_commands - 1] );
+	free( excess );
+}
+
+// Logging overhead: parse and send with output off, written directly and queued.
+// Called in child process
+static void _run_log_case( FILE *f )
+{
+	size_t length;
+	char *original = svg_corpus_generate( &g_cases[1], &length );
+	fprintf( f, "log\tparse_quiet_mb_s\t%.2f\n", _log_parse( original, length, 0, false ) );
+	fprintf( f, "log\tparse_verbose_mb_s\t%.2f\n", _log_parse( original, length, 1, false ) );
+	fprintf( f, "log\tparse_verbose_async_mb_s\t%.2f\n", _log_parse( original, length, 1, true ) );
+	fprintf( f, "log\tdropped\t%lu\n", LicutLog::GetDropped() );
+	free( original );
+	_log_jitter( f, "quiet", 0, false );
+	_log_jitter( f, "verbose", 1, false );
+	_log_jitter( f, "verbose_async", 1, true );
+	fprintf( f, "# log level %d compiled in\n", LICUT_LOG_LEVEL );
+}
+
+static int _emu_matched( DeviceEmu& emu, LicutCmdList const& cmds );
+
+// Send cmds to emu over a socket pair, setting seconds taken. Returns number of
+// commands the device carried out in order, not counting repeats
+static int _emu_send( DeviceEmu& emu, LicutCmdList& cmds, int replyTimeout, double *elapsed )
+{
+	int sv[2];
+	if (socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) != 0)
+	{
+		fprintf( stderr, "socketpair() failed (%s)\n", strerror(errno) );
+		*elapsed = 1;
+		return 0;
+	}
+	emu.Start( sv[1] );
+	LicutIO lio( sv[0] );
+	lio.SetReplyTimeout( replyTimeout );
+	double t0 = licut_now();
+	cmds.Send( lio );
+	*elapsed = licut_now() - t0;
+	close( sv[0] );
+	emu.Join();
+	close( sv[1] );
+	return _emu_matched( emu, cmds );
+}
+
+// Commands the device carried out in order, not counting repeats
+static int _emu_matched( DeviceEmu& emu, LicutCmdList const& cmds )
+{
+	// Each command is looked for a few places on from the last one found
+	int matched = 0;
+	int next = 0;
+	for (int n = 0; n < cmds.GetCount(); n++)
+	{
+		loweredCmd_t const *c = cmds.GetCmd( n );
+		for (int k = next; k < emu.GetExecutedCount() && k < next + 8; k++)
+		{
+			emuCmd_t const *e = emu.GetExecuted( k );
+			if (e->subCmd != c->subCmd || e->x != c->x || e->y != c->y) continue;
+			matched++;
+			next = k + 1;
+			break;
+		}
+	}
+	return matched;
+}
+
+// Two draw sets of 40 commands at the shortest delays licut accepts, with a
+// curve every curveEvery commands if nonzero
+static void _emu_job( LicutCmdList& cmds, int curveEvery )
+{
+	for (int set = 0; set < 2; set++)
+	{
+		int x = 1000 + set * 2000;
+		cmds.Add( 2, x, 1000, 1, true );
+		for (int k = 1; k <= 40; k++)
+		{
+			if (curveEvery && k % curveEvery == 0)
+			{
+				cmds.Add( 1, x, 1000 + (k & 1) * 500, 1, false );
+				cmds.Add( 1, x + 10, 1200, 1, false );
+				cmds.Add( 1, x + 30, 1300, 1, false );
+				cmds.Add( 1, x + 40, 1000 + ((k + 1) & 1) * 500, 1, false );
+			}
+			else
+			{
+				cmds.Add( 0, x + 40, 1000 + ((k + 1) & 1) * 500, 1, false );
+			}
+			x += 40;
+		}
+	}
+	cmds.Encode();
+}
+
+// Transaction batching against an emulated device: one packet per reply, then
+// batches of increasing size and whole draw sets. Called in child process
+static void _run_txn_case( FILE *f )
+{
+	static const struct { const char *mode; int batch; } modes[] = {
+		{ "off", 0 }, { "b1", 1 }, { "b4", 4 }, { "b16", 16 }, { "b64", 64 }, { "set", -1 }
+	};
+	LicutCmdList cmds( 0 );
+	_emu_job( cmds, 0 );
+	// Unbatched sends wait 250ms per reply, so time a few only
+	LicutCmdList one( 0 );
+	for (int n = 0; n < 12; n++) one.Add( n ? 0 : 2, 1000 + n * 40, 1000 + (n & 1) * 500, 1, n == 0 );
+	one.Encode();
+	for (int n = 0; n < (int)(sizeof(modes) / sizeof(modes[0])); n++)
+	{
+		LicutCmdList& job = modes[n].batch ? cmds : one;
+		DeviceEmu emu;
+		emu.SetCapacity( FLAGS_txn_capacity );
+		job.SetTransaction( modes[n].batch, 5 );
+		double elapsed;
+		int matched = _emu_send( emu, job, 0, &elapsed );
+		fprintf( f, "txn\t%s_packets_s\t%.1f\n", modes[n].mode, job.GetCount() / elapsed );
+		fprintf( f, "txn\t%s_lost\t%d\n", modes[n].mode, job.GetCount() - matched + emu.GetInvalid() );
+	}
+	fprintf( f, "# txn device capacity %d packets\n", FLAGS_txn_capacity );
+}
+
+// Throughput and recovery under injected faults: packets lost, replies lost and
+// replies truncated in equal parts, sent in transactions of 16 so replies are
+// not drained for 250ms. Called in child process
+static void _run_loss_case( FILE *f )
+{
+	static const struct { const char *mode; double rate; int retries; } modes[] = {
+		{ "p0", 0, 3 }, { "p1", 0.01, 3 }, { "p5", 0.05, 3 }, { "p10", 0.10, 3 }, { "p5_noretry", 0.05, 0 }
+	};
+	LicutCmdList cmds( 0 );
+	_emu_job( cmds, 5 );
+	for (int n = 0; n < (int)(sizeof(modes) / sizeof(modes[0])); n++)
+	{
+		DeviceEmu emu;
+		emu.SetFaults( modes[n].rate / 3, modes[n].rate / 3, modes[n].rate / 3, 1234 );
+		cmds.SetTransaction( 16, 5 );
+		cmds.SetRetries( modes[n].retries );
+		double elapsed;
+		int matched = _emu_send( emu, cmds, FLAGS_loss_timeout, &elapsed );
+		const char *mode = modes[n].mode;
+		fprintf( f, "loss\t%s_packets_s\t%.1f\n", mode, cmds.GetCount() / elapsed );
+		fprintf( f, "loss\t%s_faults\t%d\n", mode, emu.GetFaultCount() );
+		fprintf( f, "loss\t%s_retries\t%d\n", mode, cmds.GetRetryCount() );
+		fprintf( f, "loss\t%s_resyncs\t%d\n", mode, cmds.GetResyncCount() );
+		fprintf( f, "loss\t%s_missing\t%d\n", mode, cmds.GetCount() - matched );
+		fprintf( f, "loss\t%s_repeated\t%d\n", mode, emu.GetExecutedCount() - matched );
+	}
+	fprintf( f, "# loss reply timeout %dms\n", FLAGS_loss_timeout );
+}
+
+// Relay thread argument
+typedef struct _relayThread
+{
+	LicutRelay *relay;
+	int device;
+} relayThread_t;
+
+static void *_relay_thread( void *arg )
+{
+	relayThread_t *r = (relayThread_t *)arg;
+	r->relay->Run( r->device );
+	return NULL;
+}
+
+// Open a pty for the emulator, setting spec for the host's end. Returns master or -1
+static int _emu_pty( char *spec, int size )
+{
+	int master = posix_openpt( O_RDWR | O_NOCTTY );
+	if (master < 0 || grantpt( master ) != 0 || unlockpt( master ) != 0)
+	{
+		fprintf( stderr, "Cannot open pty (%s)\n", strerror(errno) );
+		if (master >= 0) close( master );
+		return -1;
+	}
+	snprintf( spec, size, "pty:%s", ptsname( master ) );
+	return master;
+}
+
+// One job through each transport to the emulator: a socket pair paced as
+// before, a pty, licut_relay on loopback TCP in front of a pty, and whole
+// packets written unpaced, as over TCP without the relay. Gaps between bytes
+// too short for the device show whether pacing survived. Called in child process
+static void _run_transport_case( FILE *f )
+{
+	static const char *modes[] = { "socket", "pty", "relay", "unpaced" };
+	LicutCmdList cmds( 0 );
+	_emu_job( cmds, 5 );
+	cmds.SetTransaction( 16, 5 );
+	for (int mode = 0; mode < (int)(sizeof(modes) / sizeof(modes[0])); mode++)
+	{
+		DeviceEmu emu;
+		int device = -1; // Emulator's end
+		int host = -1;
+		LicutTransport *transport = NULL;
+		LicutTransport *relayDevice = NULL;
+		LicutRelay relay( 0 );
+		relayThread_t relayArgs;
+		pthread_t relayThread;
+		char spec[256];
+		if (mode == 0 || mode == 3)
+		{
+			int sv[2];
+			if (socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) != 0) _exit( 1 );
+			device = sv[1];
+			host = sv[0];
+			if (mode == 3) transport = new LicutTcpTransport( host, "tcp", false );
+		}
+		else
+		{
+			device = _emu_pty( spec, sizeof(spec) );
+			if (device < 0) _exit( 1 );
+			if (mode == 2)
+			{
+				relayDevice = LicutTransport::Open( spec );
+				if (!relayDevice || relay.Listen( "127.0.0.1", 0 ) != 0) _exit( 1 );
+				relayArgs.relay = &relay;
+				relayArgs.device = relayDevice->GetFd();
+				pthread_create( &relayThread, NULL, _relay_thread, &relayArgs );
+				snprintf( spec, sizeof(spec), "tcp:127.0.0.1:%d", relay.GetPort() );
+			}
+			transport = LicutTransport::Open( spec );
+			if (!transport)
+			{
+				fprintf( stderr, "Cannot open %s (%s)\n", spec, LicutTransport::Errmsg() );
+				_exit( 1 );
+			}
+			host = transport->GetFd();
+		}
+		emu.Start( device );
+		LicutIO lio( host );
+		lio.SetTransport( transport );
+		lio.SetReplyTimeout( 1000 );
+		double t0 = licut_now();
+		cmds.Send( lio );
+		double elapsed = licut_now() - t0;
+		if (transport) delete transport;
+		else close( host );
+		if (relayDevice)
+		{
+			relay.Stop();
+			pthread_join( relayThread, NULL );
+			delete relayDevice;
+		}
+		emu.Join();
+		close( device );
+		int matched = _emu_matched( emu, cmds );
+		fprintf( f, "transport\t%s_packets_s\t%.1f\n", modes[mode], cmds.GetCount() / elapsed );
+		fprintf( f, "transport\t%s_lost\t%d\n", modes[mode], cmds.GetCount() - matched + emu.GetInvalid() );
+		fprintf( f, "transport\t%s_short_gap_pct\t%.1f\n", modes[mode], emu.GetGapCount() ? 100.0 * emu.GetShortGapCount() / emu.GetGapCount() : 0 );
+		if (relayDevice) fprintf( f, "transport\trelay_max_late_us\t%ld\n", relay.GetMaxLateUs() );
+	}
+}
+
+// Packets sent by the commands in _encode_vectors() with fixed noise from 10001,
+// from SendCmd() before the encoders were specialized
+static const char *g_encodeVectors[] = {
+	"0411000000", "0412000000", "0414000000", "0418000000", "0421000000", "0422000000",
+	"0d40f808081084842ca63a51777d",
+	"0d40f84cb27f65ec945ea3be7c06",
+	"0d40b991402772da5cfea8ebdf74",
+	"0d4095e25826f28b0dc6ff100672",
+	"0d400ff58b43e2e6972e34516bd6",
+	"0d4002a0b42b5e1997f72e210bec",
+	"0d401c16b6718d5bd4006918f7ef",
+	"0d40fa7b9806266cd5d532e705ff",
+	"0d40c9b26651dcec64aba2dd7081",
+	NULL
+};
+static const unsigned int g_encodeMoveCuts[][3] = {
+	{ 2, 0, 0 }, { 0, 1000, 2000 }, { 1, 4646, 4646 }, { 3, 1, 2 }, { 4, 65535, 0 },
+	{ 5, 316, 50 }, { 6, 123456, 7 }, { 7, 0xffffffff, 0x80000000 }, { 2, 10, 20 }
+};
+#define ENCODE_QUERIES	6
+#define ENCODE_MOVECUTS	(int)(sizeof(g_encodeMoveCuts) / sizeof(g_encodeMoveCuts[0]))
+
+// Check packet against vector n. Returns 1 if it differs
+static int _encode_check( const char *path, int n, const unsigned char *packet, int length )
+{
+	char hex[64];
+	for (int k = 0; k < length && k < 31; k++) sprintf( &hex[k * 2], "%02x", packet[k] );
+	hex[length < 31 ? length * 2 : 62] = '\0';
+	if (!strcmp( hex, g_encodeVectors[n] )) return 0;
+	fprintf( stderr, "encode: %s packet %d is %s, expected %s\n", path, n, hex, g_encodeVectors[n] );
+	return 1;
+}
+
+// Encode every vector directly, through EncodeMoveCut() and through the send
+// path. Returns number of packets that differ
+static int _encode_vectors()
+{
+	unsigned char packet[LICUT_MOVECUT_PACKET];
+	int failed = 0;
+	int n;
+	failed += _encode_check( "direct", 0, packet, LicutCmd_MatBoundaries::Encode( packet ) );
+	failed += _encode_check( "direct", 1, packet, LicutCmd_FirmwareVersion::Encode( packet ) );
+	failed += _encode_check( "direct", 2, packet, LicutCmd_StatusRequest::Encode( packet ) );
+	failed += _encode_check( "direct", 3, packet, LicutCmd_CartridgeName::Encode( packet ) );
+	failed += _encode_check( "direct", 4, packet, LicutCmd_StartTransaction::Encode( packet ) );
+	failed += _encode_check( "direct", 5, packet, LicutCmd_EndTransaction::Encode( packet ) );
+	static int (* const direct[8])( unsigned int, unsigned int, unsigned int, unsigned char * ) = {
+		LicutCmd_MoveCut<0>::Encode, LicutCmd_MoveCut<1>::Encode, LicutCmd_MoveCut<2>::Encode, LicutCmd_MoveCut<3>::Encode,
+		LicutCmd_MoveCut<4>::Encode, LicutCmd_MoveCut<5>::Encode, LicutCmd_MoveCut<6>::Encode, LicutCmd_MoveCut<7>::Encode
+	};
+	for (n = 0; n < ENCODE_MOVECUTS; n++)
+	{
+		unsigned int const *c = g_encodeMoveCuts[n];
+		failed += _encode_check( "direct", ENCODE_QUERIES + n, packet, direct[c[0]]( 10001 + n, c[1], c[2], packet ) );
+	}
+	LicutIO::SetFixedNoiseStart( 10001 );
+	for (n = 0; n < ENCODE_MOVECUTS; n++)
+	{
+		unsigned int const *c = g_encodeMoveCuts[n];
+		failed += _encode_check( "EncodeMoveCut", ENCODE_QUERIES + n, packet, LicutIO::EncodeMoveCut( c[0], c[1], c[2], packet ) );
+	}
+	if (LicutIO::EncodeMoveCut( 8, 0, 0, packet ) != -1)
+	{
+		fprintf( stderr, "encode: subcommand 8 accepted\n" );
+		failed++;
+	}
+
+	int sv[2];
+	if (socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) != 0) return failed + 1;
+	LicutIO lio( sv[0] );
+	unsigned int u[4];
+	char name[64];
+	LicutIO::SetFixedNoiseStart( 10001 );
+	lio.SendCmd_MatBoundaries( &u[0], &u[1], &u[2], &u[3] );
+	lio.SendCmd_FirmwareVersion( u );
+	lio.SendCmd_StatusRequest( &u[0], &u[1] );
+	lio.SendCmd_CartridgeName( &u[0], name, &u[1] );
+	lio.SendCmd_StartTransaction();
+	lio.SendCmd_EndTransaction();
+	for (n = 0; n < ENCODE_MOVECUTS; n++) lio.SendCmd_MoveCut( g_encodeMoveCuts[n][0], g_encodeMoveCuts[n][1], g_encodeMoveCuts[n][2] );
+	if (lio.SendCmd_MoveCut( 8, 0, 0 ) != -1)
+	{
+		fprintf( stderr, "encode: subcommand 8 sent\n" );
+		failed++;
+	}
+	close( sv[0] );
+	unsigned char sent[512];
+	int length = 0;
+	int r;
+	while ((r = read( sv[1], &sent[length], sizeof(sent) - length )) > 0) length += r;
+	close( sv[1] );
+	int offset = 0;
+	for (n = 0; g_encodeVectors[n]; n++)
+	{
+		int packetLength = strlen( g_encodeVectors[n] ) / 2;
+		if (offset + packetLength > length)
+		{
+			fprintf( stderr, "encode: send path stopped after %d packets\n", n );
+			return failed + 1;
+		}
+		failed += _encode_check( "send", n, &sent[offset], packetLength );
+		offset += packetLength;
+	}
+	if (offset != length)
+	{
+		fprintf( stderr, "encode: send path wrote %d extra bytes\n", length - offset );
+		failed++;
+	}
+	return failed;
+}
+
+// SendCmd() before the encoders were specialized, without the send: arguments
+// decoded at run time, a zeroed buffer and the key looked up by subcommand
+static int _encode_varargs( unsigned char *packet, unsigned char cmd, ... )
+{
+	static uint32_t const keys[8][4] = {
+#define KEY_ROW( subCmd ) { LicutMoveCutKey<subCmd>::K0, LicutMoveCutKey<subCmd>::K1, LicutMoveCutKey<subCmd>::K2, LicutMoveCutKey<subCmd>::K3 }
+		KEY_ROW( 0 ), KEY_ROW( 1 ), KEY_ROW( 2 ), KEY_ROW( 3 ),
+		KEY_ROW( 4 ), KEY_ROW( 5 ), KEY_ROW( 6 ), KEY_ROW( 7 )
+#undef KEY_ROW
+	};
+	unsigned char sendBuffer[64];
+	unsigned char dataLength = 4;
+	int packetLength = 5;
+	va_list arglist;
+	va_start( arglist, cmd );
+	memset( sendBuffer, 0, sizeof(sendBuffer) );
+	if (cmd == 0x40)
+	{
+		dataLength = 13;
+		packetLength = dataLength + 1;
+		unsigned int subCmd = va_arg( arglist, unsigned int );
+		unsigned int x = va_arg( arglist, unsigned int );
+		unsigned int y = va_arg( arglist, unsigned int );
+		unsigned int n = LicutIO::noise();
+		if (subCmd <= 7)
+		{
+			LicutIO::unsigned_to_leu32( n, &sendBuffer[4] );
+			LicutIO::unsigned_to_leu32( x, &sendBuffer[8] );
+			LicutIO::unsigned_to_leu32( y, &sendBuffer[12] );
+			LicutIO::btea( (uint32_t *)&sendBuffer[4], 3, keys[subCmd] );
+		}
+	}
+	va_end( arglist );
+	sendBuffer[2] = dataLength;
+	sendBuffer[3] = cmd;
+	memcpy( packet, &sendBuffer[2], packetLength );
+	return packetLength;
+}
+
+// Packets encoded per second by mode, for a job of lines with a move every 4th
+// and curves, with fixed noise so /dev/urandom is not timed
+static double _encode_rate( int mode, unsigned long *checksum )
+{
+	unsigned char packet[LICUT_MOVECUT_PACKET];
+	long packets = 0;
+	double elapsed = 0;
+	LicutIO::SetFixedNoiseStart( 10001 );
+	while (elapsed < FLAGS_min_time / 1000.0)
+	{
+		double t0 = licut_now();
+		for (unsigned int n = 0; n < 100000; n++)
+		{
+			unsigned int subCmd = (n & 3) ? (n & 4) >> 2 : 2;
+			switch (mode)
+			{
+				case 0: _encode_varargs( packet, 0x40, subCmd, n, n + 1 ); break;
+				case 1: LicutIO::EncodeMoveCut( subCmd, n, n + 1, packet ); break;
+				default:
+					if (subCmd == 2) LicutCmd_MoveCut<2>::Encode( LicutIO::noise(), n, n + 1, packet );
+					else if (subCmd == 1) LicutCmd_MoveCut<1>::Encode( LicutIO::noise(), n, n + 1, packet );
+					else LicutCmd_MoveCut<0>::Encode( LicutIO::noise(), n, n + 1, packet );
+					break;
+			}
+			*checksum += packet[2 + (n % 12)];
+		}
+		elapsed += licut_now() - t0;
+		packets += 100000;
+	}
+	return packets / elapsed;
+}
+
+// Command encoding: byte-exact vectors, then 0x40 throughput of the old varargs
+// encoder against EncodeMoveCut() and the encoders called directly. Fails if any
+// vector differs. Called in child process
+static void _run_encode_case( FILE *f )
+{
+	int failed = _encode_vectors();
+	fprintf( f, "encode\tvectors_failed\t%d\n", failed );
+	unsigned long checksum = 0;
+	fprintf( f, "encode\tvarargs_packets_s\t%.0f\n", _encode_rate( 0, &checksum ) );
+	fprintf( f, "encode\tdispatch_packets_s\t%.0f\n", _encode_rate( 1, &checksum ) );
+	fprintf( f, "encode\tdirect_packets_s\t%.0f\n", _encode_rate( 2, &checksum ) );
+	fprintf( f, "# encode checksum %lu\n", checksum );
+	if (failed)
+	{
+		fclose( f );
+		_exit( 1 );
+	}
+}
+
+// FNV-1a offset basis and one step, for hashing results compared across modes
+#define FNV_OFFSET	14695981039346656037ULL
+
+static inline unsigned long long _fnv( unsigned long long hash, unsigned long long value )
+{
+	return (hash ^ value) * 1099511628211ULL;
+}
+
+// Write data to a new temporary file from template path (ending in suffixLength
+// characters kept as is), gzip-compressed if level > 0. Returns 0 if successful
+static int _write_temp( char *path, const char *data, size_t length, int level, size_t *written, int suffixLength = 0 )
+{
+	int fd = mkstemps( path, suffixLength );
+	if (fd < 0) return -1;
+	if (level == 0)
+	{
+		*written = length;
+		int r = (write( fd, data, length ) == (ssize_t)length) ? 0 : -1;
+		close( fd );
+		return r;
+	}
+	char mode[] = "wb6";
+	mode[2] = (char)('0' + level);
+	gzFile gz = gzdopen( fd, mode );
+	if (!gz || gzwrite( gz, data, length ) != (int)length || gzclose( gz ) != Z_OK) return -1;
+	struct stat info;
+	if (stat( path, &info ) != 0) return -1;
+	*written = info.st_size;
+	return 0;
+}
+
+// Write data to a new temporary file from template path, or exit
+static void _write_temp_or_exit( char *path, const char *data, size_t length, int level, size_t *written, int suffixLength = 0 )
+{
+	if (_write_temp( path, data, length, level, written, suffixLength ) != 0)
+	{
+		fprintf( stderr, "Cannot write %s (%s)\n", path, strerror(errno) );
+		_exit( 1 );
+	}
+}
+
+// Run prepare( path, mode, result ) in a child process, so that peak RSS is its
+// own, and copy its result back (zeroed if the child failed). Returns the
+// child's peak RSS in kB
+template <class Result>
+static long _run_child( void (*prepare)( const char *path, int mode, Result *result ), const char *path, int mode, Result *result )
+{
+	memset( result, 0, sizeof(*result) );
+	int pv[2];
+	if (pipe( pv ) != 0) _exit( 1 );
+	fflush( NULL );
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		Result r;
+		prepare( path, mode, &r );
+		write( pv[1], &r, sizeof(r) );
+		_exit( 0 );
+	}
+	close( pv[1] );
+	if (pid < 0 || read( pv[0], result, sizeof(*result) ) != (ssize_t)sizeof(*result)) memset( result, 0, sizeof(*result) );
+	close( pv[0] );
+	if (pid < 0) return 0;
+	int status;
+	struct rusage usage;
+	memset( &usage, 0, sizeof(usage) );
+	wait4( pid, &status, 0, &usage );
+	return usage.ru_maxrss;
+}
+
+// Write mismatch metric for name, exiting with failure if results differ
+static void _check_mismatch( FILE *f, const char *name, bool mismatch )
+{
+	fprintf( f, "%s\tmismatch\t%d\n", name, mismatch ? 1 : 0 );
+	if (mismatch)
+	{
+		fclose( f );
+		_exit( 1 );
+	}
+}
+
+// Time to the first draw set ready to send and to all of them, and a hash of
+// every packet, as written by a pipeline case grandchild
+typedef struct _pipelineResult
+{
+	double firstReady;
+	double total;
+	int sets;
+	int packets;
+	unsigned long long hash;
+} pipelineResult_t;
+
+static unsigned long long _pipeline_hash( unsigned long long hash, LicutCmdList const& cmds )
+{
+	for (int n = 0; n < cmds.GetCount(); n++)
+	{
+		unsigned char const *packet = cmds.GetPacket( n );
+		for (int i = 0; packet && i < LICUT_MOVECUT_PACKET; i++) hash = _fnv( hash, packet[i] );
+	}
+	return hash;
+}
+
+// Prepare path for sending with fixed noise: whole file parsed, lowered,
+// collapsed and encoded in turn (mode 0) or through LicutPipeline (mode 1)
+static void _pipeline_prepare( const char *path, int mode, pipelineResult_t *result )
+{
+	static const unsigned int mat[4] = { 316, 50, 4962, 4696 };
+	LicutIO::SetFixedNoiseStart( 10001 );
+	memset( result, 0, sizeof(*result) );
+	result->hash = FNV_OFFSET;
+	double t0 = licut_now();
+	if (mode == 0)
+	{
+		LicutSVG svg( 0 );
+		if (svg.Parse( path ) != 0) return;
+		svg.SetScaling( mat[0], mat[1], mat[2] - mat[0], mat[3] - mat[1] );
+		LicutCmdList cmds( 0 );
+		cmds.Lower( svg, mat[0], mat[1], mat[2] - mat[0], mat[3] - mat[1], 50, 10 );
+		cmds.Collapse();
+		cmds.Encode();
+		result->total = result->firstReady = licut_now() - t0;
+		result->sets = svg.GetDrawSetCount();
+		result->packets = cmds.GetCount();
+		result->hash = _pipeline_hash( result->hash, cmds );
+		return;
+	}
+	LicutPipeline pipeline( 0, FLAGS_pipeline_depth );
+	pipeline.SetDelays( 50, 10 );
+	pipeline.SetCollapse( true );
+	if (pipeline.Start( path ) != 0) return;
+	pipeline.SetMat( mat );
+	while (LicutCmdList *cmds = pipeline.Next())
+	{
+		result->sets++;
+		result->packets += cmds->GetCount();
+		result->hash = _pipeline_hash( result->hash, *cmds );
+		delete cmds;
+	}
+	result->firstReady = pipeline.GetFirstReady();
+	result->total = licut_now() - t0;
+}
+
+static void _run_pipeline_case( FILE *f )
+{
+	static const svgCorpusParams_t params = { "pipeline", 20000, 20, 4, 0.3, ',', 8 };
+	static const char *modes[] = { "sequential", "pipeline" };
+	size_t length;
+	char *data = svg_corpus_generate( &params, &length );
+	char path[] = "/tmp/licut_bench_XXXXXX";
+	_write_temp_or_exit( path, data, length, 0, &length );
+	free( data );
+	fprintf( f, "pipeline\tbytes\t%lu\n", (unsigned long)length );
+
+	pipelineResult_t results[2];
+	for (int mode = 0; mode < 2; mode++)
+	{
+		long rssKb = _run_child( _pipeline_prepare, path, mode, &results[mode] );
+		pipelineResult_t const& r = results[mode];
+		fprintf( f, "pipeline\t%s_first_ready_ms\t%.1f\n", modes[mode], r.firstReady * 1000 );
+		fprintf( f, "pipeline\t%s_total_ms\t%.1f\n", modes[mode], r.total * 1000 );
+		fprintf( f, "pipeline\t%s_peak_rss_kb\t%ld\n", modes[mode], rssKb );
+	}
+	unlink( path );
+	fprintf( f, "# pipeline %d draw sets, %d packets\n", results[1].sets, results[1].packets );
+	_check_mismatch( f, "pipeline", results[0].sets == 0 || results[0].packets != results[1].packets || results[0].hash != results[1].hash );
+}
+
+typedef struct _useResult
+{
+	double parse;
+	double lower;
+	long heapKb;
+	int sets;
+	int instances;
+	int packets;
+	unsigned long long hash;
+} useResult_t;
+
+// Heap in use, or 0 if unknown
+static long _heap_kb()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	return (long)(mallinfo2().uordblks / 1024);
+#else
+	return 0;
+#endif
+}
+
+// Parse path (best of 3) and lower it for the mat
+static void _use_prepare( const char *path, int mode, useResult_t *result )
+{
+	(void)mode;
+	static const unsigned int mat[4] = { 316, 50, 4962, 4696 };
+	memset( result, 0, sizeof(*result) );
+	result->hash = FNV_OFFSET;
+	LicutSVG *svg = NULL;
+	long heapBefore = _heap_kb();
+	for (int run = 0; run < 3; run++)
+	{
+		delete svg;
+		svg = new LicutSVG( 0 );
+		double t0 = licut_now();
+		if (svg->Parse( path ) != 0) return;
+		double t = licut_now() - t0;
+		if (run == 0 || t < result->parse) result->parse = t;
+	}
+	// Draw sets and what they share, the file buffer being freed by now
+	result->heapKb = _heap_kb() - heapBefore;
+	result->sets = svg->GetDrawSetCount();
+	result->instances = svg->GetInstanceCount();
+	LicutCmdList cmds( 0 );
+	double t0 = licut_now();
+	cmds.Lower( *svg, mat[0], mat[1], mat[2] - mat[0], mat[3] - mat[1], 50, 10 );
+	result->lower = licut_now() - t0;
+	result->packets = cmds.GetCount();
+	for (int n = 0; n < cmds.GetCount(); n++)
+	{
+		loweredCmd_t const *cmd = cmds.GetCmd( n );
+		result->hash = _fnv( result->hash, (unsigned long long)cmd->subCmd << 40 ^ (unsigned long long)cmd->x << 20 ^ cmd->y );
+	}
+	delete svg;
+}
+
+// Instance-heavy file with <use> against the same design expanded to paths
+static void _run_use_case( FILE *f )
+{
+	static const svgCorpusParams_t params = { "use", 20000, 20, 0, 0.3, ',', 9 };
+	static const int shapes = 40;
+	static const char *modes[] = { "expanded", "instanced" };
+	useResult_t results[2];
+	for (int mode = 0; mode < 2; mode++)
+	{
+		size_t length;
+		char *data = svg_corpus_generate_instances( &params, shapes, mode == 0, &length );
+		char path[] = "/tmp/licut_bench_XXXXXX";
+		_write_temp_or_exit( path, data, length, 0, &length );
+		free( data );
+		fprintf( f, "use\t%s_bytes\t%lu\n", modes[mode], (unsigned long)length );
+
+		long rssKb = _run_child( _use_prepare, path, mode, &results[mode] );
+		unlink( path );
+		useResult_t const& r = results[mode];
+		fprintf( f, "use\t%s_parse_ms\t%.1f\n", modes[mode], r.parse * 1000 );
+		fprintf( f, "use\t%s_lower_ms\t%.1f\n", modes[mode], r.lower * 1000 );
+		fprintf( f, "use\t%s_heap_kb\t%ld\n", modes[mode], r.heapKb );
+		fprintf( f, "use\t%s_peak_rss_kb\t%ld\n", modes[mode], rssKb );
+	}
+	fprintf( f, "# use %d draw sets, %d instances of %d shapes, %d packets\n", results[1].sets, results[1].instances,
+		shapes, results[1].packets );
+	_check_mismatch( f, "use", results[0].sets == 0 || results[0].sets != results[1].sets || results[1].instances != results[1].sets
+		|| results[0].packets != results[1].packets || results[0].hash != results[1].hash );
+}
+
+typedef struct _svgzResult
+{
+	double total;
+	double read;
+	size_t compressed;
+	size_t length;
+	int sets;
+	unsigned long commands;
+} svgzResult_t;
+
+// Parse path as licut would, best of 3: plain (mode 0), .svgz (1), or .svgz
+// decompressed to a temporary file first (2)
+static void _svgz_prepare( const char *path, int mode, svgzResult_t *result )
+{
+	memset( result, 0, sizeof(*result) );
+	for (int run = 0; run < 3; run++)
+	{
+		double t0 = licut_now();
+		char temp[] = "/tmp/licut_bench_XXXXXX";
+		const char *parsePath = path;
+		if (mode == 2)
+		{
+			// As gunzip -c would
+			gzFile gz = gzopen( path, "rb" );
+			int fd = mkstemp( temp );
+			char buff[65536];
+			int n;
+			while (gz && fd >= 0 && (n = gzread( gz, buff, sizeof(buff) )) > 0)
+			{
+				if (write( fd, buff, n ) != n) break;
+			}
+			if (gz) gzclose( gz );
+			if (fd >= 0) close( fd );
+			parsePath = temp;
+		}
+		LicutSVG svg( 0 );
+		int r = svg.Parse( parsePath );
+		double t = licut_now() - t0;
+		if (mode == 2) unlink( temp );
+		if (r != 0) return;
+		if (run == 0 || t < result->total) result->total = t;
+		if (run > 0) continue;
+		result->sets = svg.GetDrawSetCount();
+		for (int n = 0; n < svg.GetDrawSetCount(); n++)
+		{
+			for (drawSet_t const *d = svg.GetDrawSet( n ); d->type; d++) result->commands++;
+		}
+	}
+	// Reading alone, for decompression rates
+	for (int run = 0; mode == 1 && run < 3; run++)
+	{
+		LicutInput input( 0 );
+		if (input.Read( path ) != 0) return;
+		if (run == 0 || input.GetSeconds() < result->read) result->read = input.GetSeconds();
+		result->compressed = input.GetCompressedLength();
+		result->length = input.GetLength();
+	}
+}
+
+static void _run_svgz_case( FILE *f )
+{
+	static const svgCorpusParams_t params = { "svgz", 20000, 20, 4, 0.3, ',', 10 };
+	static const char *modes[] = { "plain", "svgz", "tempfile" };
+	size_t length;
+	char *data = svg_corpus_generate( &params, &length );
+	char plainPath[] = "/tmp/licut_bench_XXXXXX";
+	char svgzPath[] = "/tmp/licut_bench_XXXXXX";
+	size_t plainLength = 0, svgzLength = 0;
+	_write_temp_or_exit( plainPath, data, length, 0, &plainLength );
+	_write_temp_or_exit( svgzPath, data, length, 6, &svgzLength );
+	free( data );
+	fprintf( f, "svgz\tplain_bytes\t%lu\n", (unsigned long)plainLength );
+	fprintf( f, "svgz\tsvgz_bytes\t%lu\n", (unsigned long)svgzLength );
+
+	svgzResult_t results[3];
+	for (int mode = 0; mode < 3; mode++)
+	{
+		long rssKb = _run_child( _svgz_prepare, mode ? svgzPath : plainPath, mode, &results[mode] );
+		svgzResult_t const& r = results[mode];
+		fprintf( f, "svgz\t%s_total_ms\t%.1f\n", modes[mode], r.total * 1000 );
+		fprintf( f, "svgz\t%s_peak_rss_kb\t%ld\n", modes[mode], rssKb );
+		if (mode == 1 && r.read > 0)
+		{
+			fprintf( f, "svgz\tcompressed_mb_s\t%.1f\n", r.compressed / 1e6 / r.read );
+			fprintf( f, "svgz\tuncompressed_mb_s\t%.1f\n", r.length / 1e6 / r.read );
+		}
+	}
+	unlink( plainPath );
+	unlink( svgzPath );
+	fprintf( f, "# svgz %d draw sets, %lu commands, %.1fx compression\n", results[0].sets, results[0].commands,
+		svgzLength ? (double)plainLength / svgzLength : 0 );
+	bool mismatch = results[0].sets == 0 || results[1].length != plainLength;
+	for (int mode = 1; mode < 3; mode++)
+	{
+		if (results[mode].sets != results[0].sets || results[mode].commands != results[0].commands) mismatch = true;
+	}
+	_check_mismatch( f, "svgz", mismatch );
+}
+
+typedef struct _hpglResult
+{
+	double parse;
+	int sets;
+	unsigned long commands;
+	unsigned long long hash; // Of every command type and point
+	int sinkSets; // Passed to a draw set sink instead
+} hpglResult_t;
+
+// Counts draw sets streamed to it
+class HpglCountSink : public LicutDrawSetSink
+{
+public:
+	HpglCountSink() : m_count( 0 ) {}
+	virtual int DrawSetParsed( LicutSVG& svg, drawSet_t *set )
+	{
+		(void)svg;
+		m_count++;
+		free( set );
+		return 0;
+	}
+	int m_count;
+};
+
+// Parse path as licut would, best of 3
+static void _hpgl_prepare( const char *path, int mode, hpglResult_t *result )
+{
+	(void)mode;
+	memset( result, 0, sizeof(*result) );
+	for (int run = 0; run < 3; run++)
+	{
+		LicutSVG svg( 0 );
+		double t0 = licut_now();
+		if (svg.Parse( path ) != 0) return;
+		double t = licut_now() - t0;
+		if (run == 0 || t < result->parse) result->parse = t;
+		if (run > 0) continue;
+		result->sets = svg.GetDrawSetCount();
+		result->hash = FNV_OFFSET;
+		for (int n = 0; n < svg.GetDrawSetCount(); n++)
+		{
+			for (drawSet_t const *d = svg.GetDrawSet( n ); d->type; d++)
+			{
+				result->commands++;
+				result->hash = _fnv( result->hash, (unsigned char)d->type );
+				for (int i = 0; i < d->numPoints; i++)
+				{
+					result->hash = _fnv( result->hash, (unsigned long long)(long long)(d->pt[i][0] * 1000) );
+					result->hash = _fnv( result->hash, (unsigned long long)(long long)(d->pt[i][1] * 1000) );
+				}
+			}
+		}
+	}
+	LicutSVG svg( 0 );
+	HpglCountSink sink;
+	svg.SetDrawSetSink( &sink );
+	if (svg.Parse( path ) == 0) result->sinkSets = sink.m_count;
+}
+
+static void _run_hpgl_case( FILE *f )
+{
+	static const svgCorpusParams_t params = { "hpgl", 20000, 20, 0, 0, ',', 11 };
+	static const char *modes[] = { "svg", "hpgl" };
+	char paths[2][32] = { "/tmp/licut_bench_XXXXXX.svg", "/tmp/licut_bench_XXXXXX.plt" };
+	size_t lengths[2];
+	for (int mode = 0; mode < 2; mode++)
+	{
+		char *data = svg_corpus_generate_hpgl( &params, mode == 0, &lengths[mode] );
+		_write_temp_or_exit( paths[mode], data, lengths[mode], 0, &lengths[mode], 4 );
+		free( data );
+		fprintf( f, "hpgl\t%s_bytes\t%lu\n", modes[mode], (unsigned long)lengths[mode] );
+	}
+
+	hpglResult_t results[2];
+	for (int mode = 0; mode < 2; mode++)
+	{
+		long rssKb = _run_child( _hpgl_prepare, paths[mode], mode, &results[mode] );
+		hpglResult_t const& r = results[mode];
+		fprintf( f, "hpgl\t%s_parse_ms\t%.1f\n", modes[mode], r.parse * 1000 );
+		fprintf( f, "hpgl\t%s_mb_s\t%.1f\n", modes[mode], r.parse > 0 ? lengths[mode] / 1e6 / r.parse : 0 );
+		fprintf( f, "hpgl\t%s_mcommands_s\t%.2f\n", modes[mode], r.parse > 0 ? r.commands / 1e6 / r.parse : 0 );
+		fprintf( f, "hpgl\t%s_peak_rss_kb\t%ld\n", modes[mode], rssKb );
+		unlink( paths[mode] );
+	}
+	fprintf( f, "# hpgl %d draw sets, %lu commands\n", results[1].sets, results[1].commands );
+	_check_mismatch( f, "hpgl", results[0].sets == 0 || results[0].sets != results[1].sets || results[0].commands != results[1].commands ||
+		results[0].hash != results[1].hash || results[1].sinkSets != results[1].sets );
+}
+
+// Higher is better for rates, lower for everything else
+static bool _higher_is_better( const char *metric )
+{
+	int length = strlen( metric );
+	return length > 2 && !strcmp( &metric[length - 2], "_s" );
+}
+
+// Compare results against baseline. Returns number of regressions
+static int _compare( const char *resultsPath, const char *baselinePath )
+{
+	FILE *base = fopen( baselinePath, "r" );
+	if (!base)
+	{
+		fprintf( stderr, "Cannot open baseline %s (%s)\n", baselinePath, strerror(errno) );
+		return -1;
+	}
+	char line[256];
+	char baseCase[64], baseMetric[64];
+	double baseValue;
+	int regressions = 0;
+	while (fgets( line, sizeof(line), base ))
+	{
+		if (line[0] == '#' || sscanf( line, "%63s %63s %lf", baseCase, baseMetric, &baseValue ) != 3) continue;
+		if (!strcmp( baseMetric, "bytes" ) || baseValue == 0) continue;
+		FILE *results = fopen( resultsPath, "r" );
+		if (!results) break;
+		char resultCase[64], resultMetric[64];
+		double value;
+		while (fgets( line, sizeof(line), results ))
+		{
+			if (line[0] == '#' || sscanf( line, "%63s %63s %lf", resultCase, resultMetric, &value ) != 3) continue;
+			if (strcmp( resultCase, baseCase ) || strcmp( resultMetric, baseMetric )) continue;
+			double change = (value - baseValue) * 100.0 / baseValue;
+			bool worse = _higher_is_better( baseMetric ) ? (change < -FLAGS_tolerance) : (change > FLAGS_tolerance);
+			fprintf( stderr, "%-10s %-18s %14.2f %14.2f %+7.1f%%%s\n", baseCase, baseMetric, baseValue, value, change,
+				worse ? "  REGRESSION" : "" );
+			if (worse) regressions++;
+		}
+		fclose( results );
+	}
+	fclose( base );
+	return regressions;
+}
+
+// Cases not run on a corpus file
+static const struct { const char *name; void (*run)( FILE *f ); } g_otherCases[] = {
+	{ "log", _run_log_case },
+	{ "txn", _run_txn_case },
+	{ "loss", _run_loss_case },
+	{ "encode", _run_encode_case },
+	{ "pipeline", _run_pipeline_case },
+	{ "transport", _run_transport_case },
+	{ "use", _run_use_case },
+	{ "svgz", _run_svgz_case },
+	{ "hpgl", _run_hpgl_case },
+};
+
+int main( int argc, char *argv[] )
+{
+	google::ParseCommandLineFlags( &argc, &argv, true );
+	int n;
+
+	if (!FLAGS_write_corpus.empty())
+	{
+		for (n = 0; g_cases[n].name; n++)
+		{
+			if (!_case_selected( g_cases[n].name )) continue;
+			size_t length;
+			char *data = svg_corpus_generate( &g_cases[n], &length );
+			char path[1024];
+			snprintf( path, sizeof(path), "%s/%s.svg", FLAGS_write_corpus.c_str(), g_cases[n].name );
+			FILE *f = fopen( path, "w" );
+			if (!f || fwrite( data, 1, length, f ) != length)
+			{
+				fprintf( stderr, "Failed to write %s (%s)\n", path, strerror(errno) );
+				return -1;
+			}
+			fclose( f );
+			free( data );
+			fprintf( stderr, "Wrote %s (%lu bytes)\n", path, (unsigned long)length );
+		}
+		return 0;
+	}
+
+	const char *outPath = FLAGS_out.empty() ? NULL : FLAGS_out.c_str();
+	if (outPath)
+	{
+		FILE *f = fopen( outPath, "w" );
+		if (!f)
+		{
+			fprintf( stderr, "Cannot create %s (%s)\n", outPath, strerror(errno) );
+			return -1;
+		}
+		fprintf( f, "# case\tmetric\tvalue\n" );
+		fclose( f );
+	}
+
+	// Corpus cases, then the others
+	int corpusCases = sizeof(g_cases) / sizeof(g_cases[0]) - 1;
+	int otherCases = sizeof(g_otherCases) / sizeof(g_otherCases[0]);
+	for (n = 0; n < corpusCases + otherCases; n++)
+	{
+		const char *name = n < corpusCases ? g_cases[n].name : g_otherCases[n - corpusCases].name;
+		if (!_case_selected( name )) continue;
+		fprintf( stderr, "Running %s...\n", name );
+		fflush( NULL );
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			// Parser progress goes to stdout, results to out file or stderr
+			FILE *f = outPath ? fopen( outPath, "a" ) : stderr;
+			if (n < corpusCases) _run_case( &g_cases[n], f );
+			else g_otherCases[n - corpusCases].run( f );
+			fclose( f );
+			_exit( 0 );
+		}
+		int status;
+		waitpid( pid, &status, 0 );
+		if (!WIFEXITED( status ) || WEXITSTATUS( status ))
+		{
+			fprintf( stderr, "Case %s failed (status %d)\n", name, status );
+			return -1;
+		}
+	}
+
+	if (!FLAGS_baseline.empty())
+	{
+		if (!outPath)
+		{
+			fprintf( stderr, "--baseline requires --out\n" );
+			return -1;
+		}
+		int regressions = _compare( outPath, FLAGS_baseline.c_str() );
+		fprintf( stderr, "%d regressions against %s (tolerance %d%%)\n", regressions, FLAGS_baseline.c_str(), FLAGS_tolerance );
+		if (regressions != 0) return 1;
+	}
+
+	return 0;
+}
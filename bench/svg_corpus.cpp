@@ -0,0 +1,279 @@
+// $Id$
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "svg_corpus.h"
+
+#define CORPUS_WIDTH	744
+#define CORPUS_HEIGHT	1052
+// Plotter units, a 1m square
+#define HPGL_CORPUS_SIZE	40000
+
+// Simple buffer which grows by doubling
+typedef struct _corpusBuff
+{
+	char *data;
+	size_t length;
+	size_t alloc;
+} corpusBuff_t;
+
+static void _append( corpusBuff_t *b, const char *fmt, ... )
+{
+	va_list args;
+	for (;;)
+	{
+		va_start( args, fmt );
+		int n = vsnprintf( &b->data[b->length], b->alloc - b->length, fmt, args );
+		va_end( args );
+		if (n >= 0 && b->length + n < b->alloc)
+		{
+			b->length += n;
+			return;
+		}
+		b->alloc *= 2;
+		b->data = (char *)realloc( b->data, b->alloc );
+	}
+}
+
+// LCG from Numerical Recipes - portable and reproducible
+static unsigned int _next( unsigned int *state )
+{
+	*state = *state * 1664525 + 1013904223;
+	return *state >> 8;
+}
+
+static double _coord( unsigned int *state, int range )
+{
+	return (_next( state ) % (range * 1000)) / 1000.0;
+}
+
+// Exact in binary, so adding an integer offset gives the same double as
+// parsing the sum
+static double _grid_coord( unsigned int *state, int range )
+{
+	return (_next( state ) % (range * 8)) / 8.0;
+}
+
+// Generate Inkscape-style svg. Paths are spread evenly over the nesting levels.
+// Returns malloc'd NUL-terminated buffer and sets length
+char *svg_corpus_generate( const svgCorpusParams_t *params, size_t *length )
+{
+	corpusBuff_t b;
+	b.alloc = 4096;
+	b.length = 0;
+	b.data = (char *)malloc( b.alloc );
+	unsigned int state = params->seed;
+	char delim = params->delim == ' ' ? ' ' : ',';
+	int curveThreshold = (int)(params->curveRatio * 1000);
+	int levels = params->depth + 1;
+	int pathIndex = 0;
+	int level, n, c;
+
+	_append( &b, "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"no\"?>\n"
+		"<!-- Created with Inkscape (http://www.inkscape.org/) -->\n"
+		"<svg xmlns:svg=\"http://www.w3.org/2000/svg\" xmlns=\"http://www.w3.org/2000/svg\"\n"
+		"   width=\"%d\" height=\"%d\" id=\"svg2\" version=\"1.1\">\n"
+		"  <defs id=\"defs4\" />\n"
+		"  <metadata id=\"metadata7\">\n"
+		"    <rdf:RDF><cc:Work rdf:about=\"\"><dc:format>image/svg+xml</dc:format><dc:title></dc:title></cc:Work></rdf:RDF>\n"
+		"  </metadata>\n"
+		"  <g inkscape:label=\"Layer 1\" inkscape:groupmode=\"layer\" id=\"layer1\">\n",
+		CORPUS_WIDTH, CORPUS_HEIGHT );
+
+	for (level = 0; level < levels; level++)
+	{
+		// Indent like Inkscape but don't let deep nesting dominate file size
+		int indent = level < 16 ? level : 16;
+		if (level > 0) _append( &b, "%*s<g id=\"g%d\" transform=\"translate(0,0)\">\n", indent, "", level );
+		int pathsAtLevel = params->paths / levels + (level < params->paths % levels ? 1 : 0);
+		for (n = 0; n < pathsAtLevel; n++, pathIndex++)
+		{
+			_append( &b, "%*s<path\n%*s   style=\"fill:none;stroke:#000000;stroke-width:1px\"\n%*s   d=\"M %.3f%c%.3f",
+				indent, "", indent, "", indent, "",
+				_coord( &state, CORPUS_WIDTH ), delim, _coord( &state, CORPUS_HEIGHT ) );
+			for (c = 1; c < params->commandsPerPath; c++)
+			{
+				if ((int)(_next( &state ) % 1000) < curveThreshold)
+				{
+					_append( &b, " C %.3f%c%.3f %.3f%c%.3f %.3f%c%.3f",
+						_coord( &state, CORPUS_WIDTH ), delim, _coord( &state, CORPUS_HEIGHT ),
+						_coord( &state, CORPUS_WIDTH ), delim, _coord( &state, CORPUS_HEIGHT ),
+						_coord( &state, CORPUS_WIDTH ), delim, _coord( &state, CORPUS_HEIGHT ) );
+				}
+				else
+				{
+					_append( &b, " L %.3f%c%.3f", _coord( &state, CORPUS_WIDTH ), delim, _coord( &state, CORPUS_HEIGHT ) );
+				}
+			}
+			_append( &b, " z\"\n%*s   id=\"path%d\" />\n", indent, "", pathIndex );
+		}
+	}
+	for (level = levels - 1; level > 0; level--)
+	{
+		_append( &b, "%*s</g>\n", level < 16 ? level : 16, "" );
+	}
+	_append( &b, "  </g>\n</svg>\n" );
+
+	*length = b.length;
+	return b.data;
+}
+
+// Generate svg with params->paths instances of shapes symbols, placed by <use>
+// or expanded. Returns malloc'd NUL-terminated buffer and sets length
+char *svg_corpus_generate_instances( const svgCorpusParams_t *params, int shapes, bool expand, size_t *length )
+{
+	corpusBuff_t b;
+	b.alloc = 4096;
+	b.length = 0;
+	b.data = (char *)malloc( b.alloc );
+	unsigned int state = params->seed;
+	int curveThreshold = (int)(params->curveRatio * 1000);
+	int size = 24; // Of each shape, in user units
+	int n, c, i;
+
+	// Shapes are generated first so both forms draw the same ones
+	int points = params->commandsPerPath * 3;
+	double *shape = (double *)malloc( shapes * points * 2 * sizeof(double) );
+	char *type = (char *)malloc( shapes * params->commandsPerPath );
+	for (n = 0; n < shapes; n++)
+	{
+		for (c = 0; c < params->commandsPerPath; c++)
+		{
+			char t = (c == 0) ? 'M' : ((int)(_next( &state ) % 1000) < curveThreshold ? 'C' : 'L');
+			type[n * params->commandsPerPath + c] = t;
+			for (i = 0; i < (t == 'C' ? 3 : 1); i++)
+			{
+				double *pt = &shape[(n * points + c * 3 + i) * 2];
+				pt[0] = _grid_coord( &state, size );
+				pt[1] = _grid_coord( &state, size );
+			}
+		}
+	}
+
+	_append( &b, "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"no\"?>\n"
+		"<svg xmlns=\"http://www.w3.org/2000/svg\" xmlns:xlink=\"http://www.w3.org/1999/xlink\"\n"
+		"   width=\"%d\" height=\"%d\" id=\"svg2\" version=\"1.1\">\n",
+		CORPUS_WIDTH, CORPUS_HEIGHT );
+	if (!expand)
+	{
+		_append( &b, "  <defs id=\"defs4\">\n" );
+		for (n = 0; n < shapes; n++)
+		{
+			_append( &b, "    <symbol id=\"shape%d\">\n      <path style=\"fill:none;stroke:#000000;stroke-width:1px\" d=\"", n );
+			for (c = 0; c < params->commandsPerPath; c++)
+			{
+				char t = type[n * params->commandsPerPath + c];
+				_append( &b, c ? " %c" : "%c", t );
+				for (i = 0; i < (t == 'C' ? 3 : 1); i++)
+				{
+					double *pt = &shape[(n * points + c * 3 + i) * 2];
+					_append( &b, " %.3f,%.3f", pt[0], pt[1] );
+				}
+			}
+			_append( &b, " z\" id=\"shapepath%d\" />\n    </symbol>\n", n );
+		}
+		_append( &b, "  </defs>\n" );
+	}
+	_append( &b, "  <g inkscape:label=\"Layer 1\" inkscape:groupmode=\"layer\" id=\"layer1\">\n" );
+
+	// Instances on a grid covering the page
+	int columns = (CORPUS_WIDTH - size) / 8;
+	for (n = 0; n < params->paths; n++)
+	{
+		int s = _next( &state ) % shapes;
+		int x = (n % columns) * 8 % (CORPUS_WIDTH - size);
+		int y = (n / columns) * 8 % (CORPUS_HEIGHT - size);
+		if (!expand)
+		{
+			_append( &b, "    <use xlink:href=\"#shape%d\" x=\"%d\" y=\"%d\" id=\"use%d\" />\n", s, x, y, n );
+			continue;
+		}
+		_append( &b, "    <path style=\"fill:none;stroke:#000000;stroke-width:1px\" d=\"" );
+		for (c = 0; c < params->commandsPerPath; c++)
+		{
+			char t = type[s * params->commandsPerPath + c];
+			_append( &b, c ? " %c" : "%c", t );
+			for (i = 0; i < (t == 'C' ? 3 : 1); i++)
+			{
+				double *pt = &shape[(s * points + c * 3 + i) * 2];
+				_append( &b, " %.3f,%.3f", pt[0] + x, pt[1] + y );
+			}
+		}
+		_append( &b, " z\" id=\"path%d\" />\n", n );
+	}
+	_append( &b, "  </g>\n</svg>\n" );
+	free( shape );
+	free( type );
+
+	*length = b.length;
+	return b.data;
+}
+
+// Generate plotter output of params->paths polylines, or the equivalent svg.
+// Returns malloc'd NUL-terminated buffer and sets length
+char *svg_corpus_generate_hpgl( const svgCorpusParams_t *params, bool svg, size_t *length )
+{
+	corpusBuff_t b;
+	b.alloc = 4096;
+	b.length = 0;
+	b.data = (char *)malloc( b.alloc );
+	unsigned int state = params->seed;
+	int points = params->paths * params->commandsPerPath;
+	int *xy = (int *)malloc( points * 2 * sizeof(int) );
+	int maxX = 0, maxY = 0;
+	int n, c;
+
+	// Polylines wander from a random start, in plotter units
+	for (n = 0; n < params->paths; n++)
+	{
+		int x = _next( &state ) % HPGL_CORPUS_SIZE;
+		int y = _next( &state ) % HPGL_CORPUS_SIZE;
+		for (c = 0; c < params->commandsPerPath; c++)
+		{
+			if (c > 0)
+			{
+				x += (int)(_next( &state ) % 801) - 400;
+				y += (int)(_next( &state ) % 801) - 400;
+				if (x < 0) x = -x;
+				if (y < 0) y = -y;
+			}
+			xy[(n * params->commandsPerPath + c) * 2] = x;
+			xy[(n * params->commandsPerPath + c) * 2 + 1] = y;
+			if (x > maxX) maxX = x;
+			if (y > maxY) maxY = y;
+		}
+	}
+
+	if (svg)
+	{
+		// As an HPGL import would convert it: one user unit per plotter unit, y down
+		_append( &b, "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"no\"?>\n"
+			"<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%d\" id=\"svg2\" version=\"1.1\">\n"
+			"  <g inkscape:label=\"Layer 1\" inkscape:groupmode=\"layer\" id=\"layer1\">\n", maxX, maxY );
+	}
+	else
+	{
+		_append( &b, "IN;SP1;\n" );
+	}
+	for (n = 0; n < params->paths; n++)
+	{
+		int *pt = &xy[n * params->commandsPerPath * 2];
+		if (svg) _append( &b, "    <path style=\"fill:none;stroke:#000000;stroke-width:1px\" d=\"M %d,%d", pt[0], maxY - pt[1] );
+		else _append( &b, "PU%d,%d;PD", pt[0], pt[1] );
+		for (c = 1; c < params->commandsPerPath; c++)
+		{
+			if (svg) _append( &b, " L %d,%d", pt[c * 2], maxY - pt[c * 2 + 1] );
+			else _append( &b, c > 1 ? ",%d,%d" : "%d,%d", pt[c * 2], pt[c * 2 + 1] );
+		}
+		if (svg) _append( &b, "\" id=\"path%d\" />\n", n );
+		else _append( &b, ";\n" );
+	}
+	_append( &b, svg ? "  </g>\n</svg>\n" : "PU;SP0;\n" );
+	free( xy );
+
+	*length = b.length;
+	return b.data;
+}
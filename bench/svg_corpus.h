@@ -0,0 +1,36 @@
+// $Id$
+// Deterministic synthetic svg generator for benchmarks
+
+#ifndef _SVG_CORPUS_H_
+#define _SVG_CORPUS_H_
+
+#include <stddef.h>
+
+typedef struct _svgCorpusParams
+{
+	const char *name; // Case name used in reports
+	int paths; // Number of path elements
+	int commandsPerPath; // Draw commands per path including initial M
+	int depth; // Group nesting depth inside the layer
+	double curveRatio; // Fraction of commands which are C (0.0 - 1.0)
+	char delim; // ',' or ' ' between x and y
+	unsigned int seed; // Same seed and params give identical output
+} svgCorpusParams_t;
+
+// Generate Inkscape-style svg. Paths are spread evenly over the nesting levels.
+// Returns malloc'd NUL-terminated buffer and sets length
+char *svg_corpus_generate( const svgCorpusParams_t *params, size_t *length );
+
+// Generate svg placing params->paths instances of shapes symbols in <defs> with
+// <use>, or with each instance expanded to a path of its own. Coordinates are
+// multiples of 1/8 so both forms give exactly the same points.
+// Returns malloc'd NUL-terminated buffer and sets length
+char *svg_corpus_generate_instances( const svgCorpusParams_t *params, int shapes, bool expand, size_t *length );
+
+// Generate HPGL plotter output of params->paths polylines of
+// params->commandsPerPath points as CAM software writes it (IN, PU, PD), or the
+// equivalent svg with one user unit per plotter unit, so both give exactly the
+// same draw sets. Returns malloc'd NUL-terminated buffer and sets length
+char *svg_corpus_generate_hpgl( const svgCorpusParams_t *params, bool svg, size_t *length );
+
+#endif // _SVG_CORPUS_H_
@@ -0,0 +1,403 @@
+// $Id$
+// C interface to liblicut
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "licut_api.h"
+#include "licut_transport.h"
+#include "licut_io.h"
+#include "licut_svg.h"
+#include "licut_input.h"
+#include "licut_cmdlist.h"
+#include "licut_log.h"
+#include "licut_time.h"
+
+// Options from callers built against older versions end before later fields
+#define OPTIONS_SIZE_1_0	offsetof( licut_options, transaction )
+#define OPTIONS_SIZE_1_1	offsetof( licut_options, reply_timeout_ms )
+
+// Defaults for options callers built against older versions cannot set
+#define DEFAULT_REPLY_TIMEOUT	3000
+#define DEFAULT_RETRIES		3
+
+struct licut_session
+{
+	int handle;
+	LicutTransport *transport; // Opened by the session, NULL for a caller's fd
+	LicutIO *lio;
+	char error[256];
+};
+
+struct licut_design
+{
+	LicutSVG *svg;
+};
+
+static licut_log_fn g_logFn = NULL;
+static void *g_logCtx = NULL;
+static int g_verbose = 0;
+static pthread_once_t g_once = PTHREAD_ONCE_INIT;
+
+static void _log_sink( void *ctx, int level, const char *text )
+{
+	(void)ctx;
+	licut_log_fn fn = g_logFn;
+	if (fn) fn( g_logCtx, level, text );
+}
+
+// Library messages go to the log callback, never to stdout
+static void _init_once()
+{
+	LicutLog::SetSink( _log_sink, NULL );
+}
+
+static void _init()
+{
+	pthread_once( &g_once, _init_once );
+}
+
+// Record error for licut_session_error(). Returns status
+static int _fail( licut_session *session, int status, const char *fmt, ... )
+{
+	if (!session) return status;
+	va_list args;
+	va_start( args, fmt );
+	vsnprintf( session->error, sizeof(session->error), fmt, args );
+	va_end( args );
+	// Probe messages end with a newline
+	int length = strlen( session->error );
+	if (length > 0 && session->error[length - 1] == '\n') session->error[length - 1] = '\0';
+	return status;
+}
+
+// Progress callback adapter
+class _ApiListener : public LicutSendListener
+{
+public:
+	_ApiListener( licut_progress_fn progress, void *ctx, int total )
+	{
+		m_progress = progress;
+		m_ctx = ctx;
+		m_total = total;
+		m_acked = 0;
+		m_cancelled = false;
+	}
+	void Acked( int index )
+	{
+		m_acked = index + 1;
+		if (m_progress && m_progress( m_ctx, m_acked, m_total )) m_cancelled = true;
+	}
+	bool Cancelled() { return m_cancelled; }
+
+	int m_acked;
+
+protected:
+	licut_progress_fn m_progress;
+	void *m_ctx;
+	int m_total;
+	bool m_cancelled;
+};
+
+unsigned int licut_api_version( void )
+{
+	return LICUT_API_VERSION;
+}
+
+const char *licut_strerror( int status )
+{
+	switch (status)
+	{
+		case LICUT_OK: return "ok";
+		case LICUT_ERR_ARGUMENT: return "invalid argument";
+		case LICUT_ERR_DEVICE: return "device not found or cannot be opened";
+		case LICUT_ERR_IO: return "no reply from device";
+		case LICUT_ERR_PARSE: return "design cannot be parsed or has nothing to cut";
+		case LICUT_ERR_SIZE: return "design has no width and height";
+		case LICUT_ERR_MAT: return "no mat loaded";
+		case LICUT_ERR_MEMORY: return "out of memory";
+		case LICUT_ERR_CANCELLED: return "cancelled";
+	}
+	return "unknown error";
+}
+
+void licut_set_log( licut_log_fn fn, void *ctx, int verbose )
+{
+	_init();
+	g_logCtx = ctx;
+	g_logFn = fn;
+	g_verbose = verbose;
+}
+
+// Set up session for handle, owning transport if given
+static int _session_start( int handle, LicutTransport *transport, licut_session **session )
+{
+	licut_session *s = (licut_session *)calloc( 1, sizeof(licut_session) );
+	LicutIO *lio = s ? new LicutIO( handle ) : NULL;
+	if (!lio)
+	{
+		free( s );
+		delete transport;
+		return LICUT_ERR_MEMORY;
+	}
+	s->handle = handle;
+	s->transport = transport;
+	s->lio = lio;
+	s->lio->SetTransport( transport );
+	s->lio->SetVerbose( g_verbose );
+	s->lio->SetReplyTimeout( DEFAULT_REPLY_TIMEOUT );
+	// Drain anything waiting in read buffer
+	s->lio->Drain( g_verbose, 500 );
+	*session = s;
+	return LICUT_OK;
+}
+
+int licut_session_open( const char *path, licut_session **session )
+{
+	_init();
+	if (!session) return LICUT_ERR_ARGUMENT;
+	*session = NULL;
+	LicutTransport *transport = LicutTransport::Open( path, g_verbose );
+	if (!transport)
+	{
+		LICUT_ERROR( "%s", LicutTransport::Errmsg() );
+		return LICUT_ERR_DEVICE;
+	}
+	return _session_start( transport->GetFd(), transport, session );
+}
+
+int licut_session_open_fd( int fd, licut_session **session )
+{
+	_init();
+	if (!session || fd < 0) return LICUT_ERR_ARGUMENT;
+	*session = NULL;
+	return _session_start( fd, NULL, session );
+}
+
+int licut_session_info( licut_session *session, licut_device_info *info )
+{
+	if (!session || !info) return LICUT_ERR_ARGUMENT;
+	LicutIO& lio = *session->lio;
+	unsigned int cartridgeLoaded = 0, matLoaded = 0;
+	unsigned int version[3] = { 0, 0, 0 };
+	memset( info, 0, sizeof(*info) );
+	lio.SendCmd_StatusRequest( &cartridgeLoaded, &matLoaded );
+	if (lio.ReadCmdReply( g_verbose ) < 0) return _fail( session, LICUT_ERR_IO, "no reply to status request" );
+	lio.SendCmd_FirmwareVersion( version );
+	if (lio.ReadCmdReply( g_verbose ) < 0) return _fail( session, LICUT_ERR_IO, "no reply to firmware version request" );
+	info->mat_loaded = matLoaded != 0;
+	info->cartridge_loaded = cartridgeLoaded != 0;
+	info->model = version[0];
+	info->firmware[0] = version[1];
+	info->firmware[1] = version[2];
+	if (matLoaded)
+	{
+		lio.SendCmd_MatBoundaries( &info->mat[0], &info->mat[1], &info->mat[2], &info->mat[3] );
+		if (lio.ReadCmdReply( g_verbose ) < 0) return _fail( session, LICUT_ERR_IO, "no reply to mat boundaries request" );
+	}
+	session->error[0] = '\0';
+	return LICUT_OK;
+}
+
+const char *licut_session_error( licut_session *session )
+{
+	return session ? session->error : "";
+}
+
+void licut_session_close( licut_session *session )
+{
+	if (!session) return;
+	delete session->lio;
+	delete session->transport;
+	free( session );
+}
+
+int licut_design_load( const char *data, size_t length, licut_design **design )
+{
+	_init();
+	if (!design || !data || length < 1) return LICUT_ERR_ARGUMENT;
+	*design = NULL;
+	// Parsing modifies the buffer, so it is copied, or decompressed if gzip
+	LicutInput input( g_verbose );
+	char *copy = NULL;
+	if (LicutInput::IsGzip( data, length ))
+	{
+		if (input.Inflate( data, length ) != 0) return LICUT_ERR_PARSE;
+	}
+	else if ((copy = (char *)malloc( length + 1 )) != NULL)
+	{
+		memcpy( copy, data, length );
+		copy[length] = '\0';
+	}
+	licut_design *d = (licut_design *)calloc( 1, sizeof(licut_design) );
+	if ((!copy && !input.GetData()) || !d)
+	{
+		free( copy );
+		free( d );
+		return LICUT_ERR_MEMORY;
+	}
+	d->svg = new LicutSVG( g_verbose );
+	int r = copy ? d->svg->ParseBuffer( copy, length ) : d->svg->ParseBuffer( input.GetData(), input.GetLength() );
+	free( copy );
+	if (r != 0 || d->svg->GetDrawSetCount() == 0)
+	{
+		licut_design_free( d );
+		return LICUT_ERR_PARSE;
+	}
+	if (!d->svg->GetWidth() || !d->svg->GetHeight())
+	{
+		licut_design_free( d );
+		return LICUT_ERR_SIZE;
+	}
+	*design = d;
+	return LICUT_OK;
+}
+
+int licut_design_size( licut_design *design, double *width, double *height, int *draw_sets )
+{
+	if (!design) return LICUT_ERR_ARGUMENT;
+	if (width) *width = design->svg->GetWidth();
+	if (height) *height = design->svg->GetHeight();
+	if (draw_sets) *draw_sets = design->svg->GetDrawSetCount();
+	return LICUT_OK;
+}
+
+void licut_design_free( licut_design *design )
+{
+	if (!design) return;
+	delete design->svg;
+	free( design );
+}
+
+// Fill in options of size bytes
+static void _options_init( licut_options *options, size_t size )
+{
+	if (!options) return;
+	memset( options, 0, size );
+	options->size = size;
+	// Same defaults as the licut command
+	options->intercommand_ms = 50;
+	options->intercurve_ms = 10;
+	options->collapse = 1;
+	options->eject = 1;
+	if (size >= OPTIONS_SIZE_1_1) options->transaction_drain_ms = 5;
+	if (size >= sizeof(*options))
+	{
+		options->reply_timeout_ms = DEFAULT_REPLY_TIMEOUT;
+		options->retries = DEFAULT_RETRIES;
+	}
+}
+
+// Callers linked against 1.0 get licut_options_init@LICUT_1, which must not write
+// past their smaller structure
+extern "C" void _licut_options_init_1_0( licut_options *options )
+{
+	_options_init( options, OPTIONS_SIZE_1_0 );
+}
+
+extern "C" void _licut_options_init_1_1( licut_options *options )
+{
+	_options_init( options, OPTIONS_SIZE_1_1 );
+}
+
+void licut_options_init( licut_options *options )
+{
+	_options_init( options, sizeof(*options) );
+}
+__asm__( ".symver _licut_options_init_1_0,licut_options_init@LICUT_1" );
+__asm__( ".symver _licut_options_init_1_1,licut_options_init@LICUT_1.1" );
+__asm__( ".symver licut_options_init,licut_options_init@@@LICUT_1.2" );
+
+void licut_result_init( licut_result *result )
+{
+	if (!result) return;
+	memset( result, 0, sizeof(*result) );
+	result->size = sizeof(*result);
+}
+
+// Fill in result error and status. Returns status
+static int _result( licut_session *session, licut_result *result, int status )
+{
+	result->status = status;
+	if (status == LICUT_OK) result->error[0] = '\0';
+	else snprintf( result->error, sizeof(result->error), "%s", session->error[0] ? session->error : licut_strerror( status ) );
+	return status;
+}
+
+int licut_run( licut_session *session, licut_design *design, const licut_options *options,
+	licut_progress_fn progress, void *ctx, licut_result *result )
+{
+	licut_result local;
+	if (!result)
+	{
+		licut_result_init( &local );
+		result = &local;
+	}
+	if (result->size < sizeof(licut_result)) return LICUT_ERR_ARGUMENT;
+	licut_result_init( result );
+	if (!session || !design || !options || options->size < OPTIONS_SIZE_1_0)
+	{
+		result->status = LICUT_ERR_ARGUMENT;
+		snprintf( result->error, sizeof(result->error), "%s", licut_strerror( LICUT_ERR_ARGUMENT ) );
+		return LICUT_ERR_ARGUMENT;
+	}
+	session->error[0] = '\0';
+	double t0 = licut_now() * 1e3;
+	LicutSVG& svg = *design->svg;
+	LicutIO& lio = *session->lio;
+	lio.SetReplyTimeout( options->size >= sizeof(licut_options) ? options->reply_timeout_ms : DEFAULT_REPLY_TIMEOUT );
+
+	unsigned int area[4];
+	memcpy( area, options->area, sizeof(area) );
+	if (area[2] == 0)
+	{
+		licut_device_info info;
+		int r = licut_session_info( session, &info );
+		if (r != LICUT_OK) return _result( session, result, r );
+		if (!info.mat_loaded) return _result( session, result, _fail( session, LICUT_ERR_MAT, "no mat loaded" ) );
+		area[0] = info.mat[0];
+		area[1] = info.mat[1];
+		area[2] = info.mat[2] - info.mat[0];
+		area[3] = info.mat[3] - info.mat[1];
+	}
+	if (area[3] == 0) return _result( session, result, _fail( session, LICUT_ERR_ARGUMENT, "area has no height" ) );
+
+	svg.SetScaling( area[0], area[1], area[2], area[3] );
+	LicutCmdList cmds( g_verbose );
+	if (cmds.Lower( svg, area[0], area[1], area[2], area[3], options->intercommand_ms, options->intercurve_ms ) != 0)
+	{
+		return _result( session, result, _fail( session, LICUT_ERR_SIZE, "cannot scale design" ) );
+	}
+	result->packets_collapsed = options->collapse ? cmds.Collapse() : 0;
+	if (cmds.Encode() != 0) return _result( session, result, _fail( session, LICUT_ERR_MEMORY, "cannot encode packets" ) );
+	result->draw_sets = cmds.GetGroupCount();
+	result->packets = cmds.GetCount();
+
+	if (options->size >= OPTIONS_SIZE_1_1) cmds.SetTransaction( options->transaction, options->transaction_drain_ms );
+	cmds.SetRetries( options->size >= sizeof(licut_options) ? options->retries : DEFAULT_RETRIES );
+	_ApiListener listener( progress, ctx, cmds.GetCount() );
+	int r = cmds.Send( lio, 0, &listener );
+	result->packets_acked = listener.m_acked;
+	if (r < 0)
+	{
+		result->elapsed_ms = licut_now() * 1e3 - t0;
+		if (listener.Cancelled()) return _result( session, result, _fail( session, LICUT_ERR_CANCELLED,
+			"cancelled after %d of %d packets", listener.m_acked, cmds.GetCount() ) );
+		return _result( session, result, _fail( session, LICUT_ERR_IO,
+			"no reply after %d of %d packets", listener.m_acked, cmds.GetCount() ) );
+	}
+	if (options->eject)
+	{
+		// Move to 0, 0, effectively ejecting
+		lio.SendCmd_MoveCut( 2, 0, 0 );
+		lio.ReadCmdReply( g_verbose );
+	}
+	result->elapsed_ms = licut_now() * 1e3 - t0;
+	return _result( session, result, LICUT_OK );
+}
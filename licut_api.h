@@ -0,0 +1,122 @@
+/* $Id$
+ * C interface to liblicut for cutting in-process.
+ *
+ * No call prints to stdout or exits; messages go to the callback given to
+ * licut_set_log(). A session may be used from any thread, one call at a time.
+ * Structures with a size member are versioned by it: set it with the
+ * matching _init() call.
+ */
+
+#ifndef _LICUT_API_H_
+#define _LICUT_API_H_
+
+#include <stddef.h>
+
+/* Major changes when existing calls or structure layouts change, minor when calls or
+ * trailing structure members are added */
+#define LICUT_API_VERSION_MAJOR	1
+#define LICUT_API_VERSION_MINOR	2
+#define LICUT_API_VERSION	((LICUT_API_VERSION_MAJOR << 16) | LICUT_API_VERSION_MINOR)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Status returned by calls and in licut_result */
+#define LICUT_OK		0
+#define LICUT_ERR_ARGUMENT	-1	/* Invalid argument or structure size */
+#define LICUT_ERR_DEVICE	-2	/* Device not found or cannot be opened */
+#define LICUT_ERR_IO		-3	/* Device did not reply */
+#define LICUT_ERR_PARSE		-4	/* Design could not be parsed or has nothing to cut */
+#define LICUT_ERR_SIZE		-5	/* Design has no width and height */
+#define LICUT_ERR_MAT		-6	/* No mat loaded */
+#define LICUT_ERR_MEMORY	-7
+#define LICUT_ERR_CANCELLED	-8	/* Stopped by the progress callback */
+
+/* Log levels, as in licut_log.h */
+#define LICUT_LEVEL_ERROR	0
+#define LICUT_LEVEL_WARN	1
+#define LICUT_LEVEL_INFO	2
+#define LICUT_LEVEL_DEBUG	3
+#define LICUT_LEVEL_TRACE	4
+
+typedef struct licut_session licut_session;
+typedef struct licut_design licut_design;
+
+typedef struct licut_device_info
+{
+	int mat_loaded;
+	int cartridge_loaded;
+	unsigned int model;
+	unsigned int firmware[2];	/* Major, minor */
+	unsigned int mat[4];		/* xmin, ymin, xmax, ymax in device units, if mat_loaded */
+} licut_device_info;
+
+typedef struct licut_options
+{
+	size_t size;
+	int intercommand_ms;		/* Delay after moves and lines, and 6 times this before each draw set */
+	int intercurve_ms;		/* Delay between curve packets */
+	int collapse;			/* Drop commands with no effect at device resolution */
+	int eject;			/* Eject the mat after a complete job */
+	unsigned int area[4];		/* x, y, width, height to cut into in device units, width 0 for the whole mat */
+	/* 1.1 */
+	int transaction;		/* Packets per transaction, -1 for one per draw set, 0 for none */
+	int transaction_drain_ms;	/* Wait after each reply inside a transaction */
+	/* 1.2 */
+	int reply_timeout_ms;		/* Time allowed for each reply before resynchronizing, 0 to wait indefinitely */
+	int retries;			/* Times a command with a missing reply is sent again before the run fails */
+} licut_options;
+
+typedef struct licut_result
+{
+	size_t size;
+	int status;
+	int draw_sets;
+	int packets;			/* Packets in the job */
+	int packets_acked;		/* Packets the device acknowledged */
+	int packets_collapsed;		/* Packets dropped by collapse */
+	double elapsed_ms;
+	char error[256];		/* Empty if status is LICUT_OK */
+} licut_result;
+
+/* Called for every message. Applies to the whole process */
+typedef void (*licut_log_fn)( void *ctx, int level, const char *message );
+/* Called as packets are acknowledged. Return nonzero to stop before the next draw set */
+typedef int (*licut_progress_fn)( void *ctx, int packets_acked, int packets_total );
+
+/* LICUT_API_VERSION the library was built with */
+unsigned int licut_api_version( void );
+const char *licut_strerror( int status );
+/* Send messages to fn (NULL to discard them, the default). verbose is used by
+ * sessions and designs created afterwards */
+void licut_set_log( licut_log_fn fn, void *ctx, int verbose );
+
+/* Open device at path (a serial tty), or find the USB device if path is NULL.
+ * path may also be pty:path, tcp:host:port of a licut_relay or ser2net:host:port
+ * of a raw serial server */
+int licut_session_open( const char *path, licut_session **session );
+/* Use fd already open to the device. It is not closed by licut_session_close() */
+int licut_session_open_fd( int fd, licut_session **session );
+/* Query mat, cartridge, model and firmware */
+int licut_session_info( licut_session *session, licut_device_info *info );
+/* Message for the last error in session */
+const char *licut_session_error( licut_session *session );
+void licut_session_close( licut_session *session );
+
+/* Parse svg, gzip-compressed svg (.svgz) or HPGL from a buffer, which is not kept */
+int licut_design_load( const char *data, size_t length, licut_design **design );
+int licut_design_size( licut_design *design, double *width, double *height, int *draw_sets );
+void licut_design_free( licut_design *design );
+
+void licut_options_init( licut_options *options );
+void licut_result_init( licut_result *result );
+/* Cut design. progress may be NULL. Returns the status also set in result */
+int licut_run( licut_session *session, licut_design *design, const licut_options *options,
+	licut_progress_fn progress, void *ctx, licut_result *result );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _LICUT_API_H_ */
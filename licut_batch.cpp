@@ -0,0 +1,424 @@
+// $Id$
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "licut_batch.h"
+#include "licut_daemon.h"
+#include "licut_io.h"
+#include "licut_log.h"
+#include "licut_svg.h"
+#include "licut_time.h"
+
+// True if rectangles x, y, width, height overlap
+static bool _overlaps( unsigned int const a[4], unsigned int const b[4] )
+{
+	return a[0] < b[0] + b[2] && b[0] < a[0] + a[2] && a[1] < b[1] + b[3] && b[1] < a[1] + a[3];
+}
+
+LicutBatch::LicutBatch( LicutDaemonHandler& handler, int verbose )
+	: m_handler( handler )
+{
+	m_verbose = verbose;
+	m_files = NULL;
+	m_count = 0;
+	m_alloc = 0;
+	m_intercommand = 50;
+	m_intercurve = 10;
+	m_collapse = true;
+	m_transaction = 0;
+	m_transactionDrain = 5;
+	m_retries = 0;
+	m_threads = NULL;
+	m_threadCount = 0;
+	m_lookahead = 1;
+	pthread_mutex_init( &m_lock, NULL );
+	pthread_cond_init( &m_changed, NULL );
+	pthread_mutex_init( &m_encodeLock, NULL );
+	m_next = 0;
+	m_cutting = 0;
+	m_matSet = false;
+	m_stopping = false;
+	memset( m_mat, 0, sizeof(m_mat) );
+	m_elapsed = 0;
+}
+
+LicutBatch::~LicutBatch()
+{
+	pthread_mutex_lock( &m_lock );
+	m_stopping = true;
+	pthread_cond_broadcast( &m_changed );
+	pthread_mutex_unlock( &m_lock );
+	for (int n = 0; n < m_threadCount; n++) pthread_join( m_threads[n], NULL );
+	free( m_threads );
+	for (int n = 0; n < m_count; n++) delete m_files[n].cmds;
+	free( m_files );
+	pthread_mutex_destroy( &m_encodeLock );
+	pthread_cond_destroy( &m_changed );
+	pthread_mutex_destroy( &m_lock );
+}
+
+// Add file to cut into area of the mat. Returns 0 if successful
+int LicutBatch::Add( const char *path, unsigned int const *area /* = NULL */ )
+{
+	// Workers index m_files without the lock
+	if (m_threadCount > 0) return -1;
+	if (m_count >= m_alloc)
+	{
+		int newAlloc = m_alloc ? m_alloc * 2 : 16;
+		batchFile_t *newFiles = (batchFile_t *)realloc( m_files, newAlloc * sizeof(batchFile_t) );
+		if (!newFiles)
+		{
+			LICUT_ERROR( "%s() failed to allocate %d files\n", __FUNCTION__, newAlloc );
+			return -1;
+		}
+		m_files = newFiles;
+		m_alloc = newAlloc;
+	}
+	batchFile_t& file = m_files[m_count++];
+	memset( &file, 0, sizeof(file) );
+	snprintf( file.path, sizeof(file.path), "%s", path );
+	if (area) memcpy( file.area, area, sizeof(file.area) );
+	file.state = FILE_QUEUED;
+	return 0;
+}
+
+// Add files listed in manifest. Returns number of files added or -1 on error
+int LicutBatch::LoadManifest( const char *path )
+{
+	FILE *f = fopen( path, "r" );
+	if (!f)
+	{
+		LICUT_ERROR( "Cannot open manifest %s (%s)\n", path, strerror( errno ) );
+		return -1;
+	}
+	// Relative paths are relative to the manifest
+	const char *slash = strrchr( path, '/' );
+	int dirLength = slash ? (int)(slash - path) + 1 : 0;
+	char line[1024];
+	int lineNumber = 0;
+	int added = 0;
+	while (fgets( line, sizeof(line), f ))
+	{
+		lineNumber++;
+		int length = strlen( line );
+		while (length > 0 && strchr( " \t\r\n", line[length - 1] )) line[--length] = '\0';
+		char *start = line + strspn( line, " \t" );
+		if (!*start || *start == '#') continue;
+		// Optional area after the last space
+		unsigned int area[4] = { 0, 0, 0, 0 };
+		unsigned int *fileArea = NULL;
+		char *space = strrchr( start, ' ' );
+		if (!space) space = strrchr( start, '\t' );
+		if (space)
+		{
+			int used = 0;
+			if (sscanf( space + 1, "%u,%u,%u,%u%n", &area[0], &area[1], &area[2], &area[3], &used ) == 4 && !space[1 + used])
+			{
+				if (area[2] == 0 || area[3] == 0)
+				{
+					LICUT_ERROR( "%s:%d: area has no width or height\n", path, lineNumber );
+					fclose( f );
+					return -1;
+				}
+				fileArea = area;
+				while (space > start && strchr( " \t", space[-1] )) space--;
+				*space = '\0';
+			}
+		}
+		char filePath[1024];
+		if (*start == '/' || !dirLength) snprintf( filePath, sizeof(filePath), "%s", start );
+		else snprintf( filePath, sizeof(filePath), "%.*s%s", dirLength, path, start );
+		if (Add( filePath, fileArea ) != 0)
+		{
+			fclose( f );
+			return -1;
+		}
+		added++;
+	}
+	fclose( f );
+	return added;
+}
+
+// Start parsing on worker threads. Returns 0 if started
+int LicutBatch::Start( int threads )
+{
+	if (m_threadCount > 0 || threads < 1) return -1;
+	m_threads = (pthread_t *)calloc( threads, sizeof(pthread_t) );
+	if (!m_threads) return -1;
+	m_lookahead = threads;
+	for (int n = 0; n < threads; n++)
+	{
+		if (pthread_create( &m_threads[n], NULL, WorkerThread, this ) != 0)
+		{
+			LICUT_ERROR( "%s() failed to start thread %d\n", __FUNCTION__, n );
+			break;
+		}
+		m_threadCount++;
+	}
+	return m_threadCount > 0 ? 0 : -1;
+}
+
+void LicutBatch::SetMat( unsigned int const mat[4] )
+{
+	pthread_mutex_lock( &m_lock );
+	memcpy( m_mat, mat, sizeof(m_mat) );
+	m_matSet = true;
+	pthread_cond_broadcast( &m_changed );
+	pthread_mutex_unlock( &m_lock );
+}
+
+void *LicutBatch::WorkerThread( void *arg )
+{
+	((LicutBatch *)arg)->Work();
+	return NULL;
+}
+
+// Take files in order, keeping within the lookahead of the file being cut
+void LicutBatch::Work()
+{
+	pthread_mutex_lock( &m_lock );
+	for (;;)
+	{
+		while (!m_stopping && m_next < m_count && m_next > m_cutting + m_lookahead) pthread_cond_wait( &m_changed, &m_lock );
+		if (m_stopping || m_next >= m_count) break;
+		int index = m_next++;
+		m_files[index].state = FILE_PARSING;
+		pthread_mutex_unlock( &m_lock );
+		Prepare( index );
+		pthread_mutex_lock( &m_lock );
+		pthread_cond_broadcast( &m_changed );
+	}
+	pthread_mutex_unlock( &m_lock );
+}
+
+// Parse file, wait for the mat and prepare it
+void LicutBatch::Prepare( int index )
+{
+	batchFile_t& file = m_files[index];
+	double t0 = licut_now();
+	LicutSVG svg( m_verbose );
+	m_handler.JobSetup( svg );
+	int r = svg.Parse( file.path );
+	file.parseMs = (int)((licut_now() - t0) * 1000);
+	const char *error = NULL;
+	if (r != 0 || svg.GetDrawSetCount() == 0) error = "parse failed or nothing to cut";
+	else if (!svg.GetWidth() || !svg.GetHeight()) error = "no svg width and height";
+
+	pthread_mutex_lock( &m_lock );
+	if (!error)
+	{
+		file.state = FILE_PARSED;
+		pthread_cond_broadcast( &m_changed );
+		while (!m_matSet && !m_stopping) pthread_cond_wait( &m_changed, &m_lock );
+		if (m_stopping) error = "batch stopped";
+	}
+	if (error)
+	{
+		snprintf( file.error, sizeof(file.error), "%s", error );
+		file.state = FILE_FAILED;
+		pthread_mutex_unlock( &m_lock );
+		return;
+	}
+	file.state = FILE_PREPARING;
+	pthread_mutex_unlock( &m_lock );
+
+	t0 = licut_now();
+	unsigned int area[4];
+	FileArea( file, area );
+	svg.SetScaling( area[0], area[1], area[2], area[3] );
+	LicutCmdList *cmds = NULL;
+	if (m_handler.JobPrepare( svg ) != 0)
+	{
+		error = "prepare failed";
+	}
+	else
+	{
+		cmds = new LicutCmdList( m_verbose );
+		if (cmds->Lower( svg, area[0], area[1], area[2], area[3], m_intercommand, m_intercurve ) != 0)
+		{
+			error = "cannot scale to area";
+		}
+		else
+		{
+			file.collapsed = m_collapse ? cmds->Collapse() : 0;
+			pthread_mutex_lock( &m_encodeLock );
+			if (cmds->Encode() != 0) error = "cannot encode packets";
+			pthread_mutex_unlock( &m_encodeLock );
+		}
+	}
+	file.prepareMs = (int)((licut_now() - t0) * 1000);
+
+	pthread_mutex_lock( &m_lock );
+	if (error)
+	{
+		delete cmds;
+		snprintf( file.error, sizeof(file.error), "%s", error );
+		file.state = FILE_FAILED;
+	}
+	else
+	{
+		file.cmds = cmds;
+		file.drawSets = cmds->GetGroupCount();
+		file.packets = cmds->GetCount();
+		file.state = FILE_READY;
+	}
+	pthread_mutex_unlock( &m_lock );
+}
+
+// Wait for file index to be prepared. Returns its state
+int LicutBatch::WaitReady( int index )
+{
+	pthread_mutex_lock( &m_lock );
+	m_cutting = index;
+	pthread_cond_broadcast( &m_changed );
+	while (m_files[index].state != FILE_READY && m_files[index].state != FILE_FAILED) pthread_cond_wait( &m_changed, &m_lock );
+	int state = m_files[index].state;
+	pthread_mutex_unlock( &m_lock );
+	return state;
+}
+
+// Area of file on the mat: x, y, width, height
+void LicutBatch::FileArea( batchFile_t const& file, unsigned int area[4] ) const
+{
+	if (file.area[2] > 0)
+	{
+		memcpy( area, file.area, sizeof(file.area) );
+		return;
+	}
+	area[0] = m_mat[0];
+	area[1] = m_mat[1];
+	area[2] = m_mat[2] - m_mat[0];
+	area[3] = m_mat[3] - m_mat[1];
+}
+
+// Cut files in order. Returns number of files cut
+int LicutBatch::Run( LicutIO& lio, bool eject )
+{
+	double start = licut_now();
+	// Areas cut on the current mat
+	unsigned int (*used)[4] = (unsigned int (*)[4])calloc( m_count + 1, sizeof(*used) );
+	int usedCount = 0;
+	int mat = 1;
+	int cut = 0;
+	int n;
+	bool stopped = !used;
+	for (n = 0; n < m_count && !stopped; n++)
+	{
+		batchFile_t& file = m_files[n];
+		double t0 = licut_now();
+		int state = WaitReady( n );
+		file.waitMs = (int)((licut_now() - t0) * 1000);
+		if (state == FILE_FAILED)
+		{
+			LICUT_WARN( "Skipping %s: %s\n", file.path, file.error );
+			continue;
+		}
+		unsigned int area[4];
+		FileArea( file, area );
+		bool overlap = false;
+		for (int u = 0; u < usedCount && !overlap; u++) overlap = _overlaps( area, used[u] );
+		if (overlap)
+		{
+			if (eject)
+			{
+				LICUT_INFO( "Ejecting mat %d...\n", mat );
+				lio.SendCmd_MoveCut( 2, 0, 0 );
+				lio.ReadCmdReply( m_verbose );
+			}
+			mat++;
+			char matName[32];
+			snprintf( matName, sizeof(matName), "mat %d", mat );
+			if (lio.WaitMatChange( m_verbose, matName ) != 0)
+			{
+				pthread_mutex_lock( &m_lock );
+				delete file.cmds;
+				file.cmds = NULL;
+				snprintf( file.error, sizeof(file.error), "mat not loaded" );
+				file.state = FILE_NOT_CUT;
+				pthread_mutex_unlock( &m_lock );
+				stopped = true;
+				continue;
+			}
+			usedCount = 0;
+		}
+		LICUT_INFO( "Cutting %s (%d of %d) on mat %d: %d draw sets, %d packets (%d removed at device resolution), waited %dms\n",
+			file.path, n + 1, m_count, mat, file.drawSets, file.packets, file.collapsed, file.waitMs );
+		t0 = licut_now();
+		file.cmds->SetTransaction( m_transaction, m_transactionDrain );
+		file.cmds->SetRetries( m_retries );
+		int r = file.cmds->Send( lio );
+		file.cutMs = (int)((licut_now() - t0) * 1000);
+		file.retries = file.cmds->GetRetryCount();
+		file.mat = mat;
+		pthread_mutex_lock( &m_lock );
+		delete file.cmds;
+		file.cmds = NULL;
+		if (r < 0)
+		{
+			// The device state is unknown, so the mat stays in for inspection
+			snprintf( file.error, sizeof(file.error), "cut interrupted" );
+			file.state = FILE_NOT_CUT;
+			stopped = true;
+		}
+		else
+		{
+			file.state = FILE_CUT;
+			cut++;
+		}
+		pthread_mutex_unlock( &m_lock );
+		if (!stopped) memcpy( used[usedCount++], area, sizeof(area) );
+	}
+	free( used );
+
+	pthread_mutex_lock( &m_lock );
+	m_stopping = true;
+	pthread_cond_broadcast( &m_changed );
+	pthread_mutex_unlock( &m_lock );
+	for (int t = 0; t < m_threadCount; t++) pthread_join( m_threads[t], NULL );
+	m_threadCount = 0;
+	for (; n < m_count; n++)
+	{
+		if (m_files[n].state == FILE_FAILED) continue;
+		delete m_files[n].cmds;
+		m_files[n].cmds = NULL;
+		snprintf( m_files[n].error, sizeof(m_files[n].error), "batch stopped" );
+		m_files[n].state = FILE_NOT_CUT;
+	}
+
+	if (eject && !stopped && cut > 0)
+	{
+		LICUT_INFO( "Ejecting mat %d...\n", mat );
+		lio.SendCmd_MoveCut( 2, 0, 0 );
+		lio.ReadCmdReply( m_verbose );
+	}
+	m_elapsed = licut_now() - start;
+	return cut;
+}
+
+// Write per-file timing table
+void LicutBatch::WriteReport( FILE *f ) const
+{
+	static const char *states[] = { "queued", "parsing", "parsed", "preparing", "ready", "failed", "cut", "not cut" };
+	int cut = 0, mats = 0;
+	int prepareMs = 0, waitMs = 0, cutMs = 0;
+	fprintf( f, "%-4s %5s %8s %8s %10s %8s %8s %7s %4s  %-8s %s\n", "#", "sets", "packets", "parse_ms", "prepare_ms", "wait_ms", "cut_ms", "retries", "mat", "status", "file" );
+	for (int n = 0; n < m_count; n++)
+	{
+		batchFile_t const& file = m_files[n];
+		fprintf( f, "%-4d %5d %8d %8d %10d %8d %8d %7d %4d  %-8s %s%s%s%s\n", n + 1, file.drawSets, file.packets,
+			file.parseMs, file.prepareMs, file.waitMs, file.cutMs, file.retries, file.mat, states[file.state], file.path,
+			file.error[0] ? " (" : "", file.error, file.error[0] ? ")" : "" );
+		if (file.state == FILE_CUT) cut++;
+		if (file.mat > mats) mats = file.mat;
+		prepareMs += file.parseMs + file.prepareMs;
+		waitMs += file.waitMs;
+		cutMs += file.cutMs;
+	}
+	fprintf( f, "Batch: %d of %d files cut on %d mats in %.1fs, %dms cutting; preparation took %dms of which the device waited %dms\n",
+		cut, m_count, mats, m_elapsed, cutMs, prepareMs, waitMs );
+}
@@ -0,0 +1,130 @@
+// $Id$
+// Several files cut in one device session, prepared on worker threads while
+// earlier files are cut
+
+#ifndef _LICUT_BATCH_H_
+#define _LICUT_BATCH_H_
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "licut_cmdlist.h"
+
+class LicutIO;
+class LicutSVG;
+class LicutDaemonHandler;
+
+// One file of the batch
+typedef struct _batchFile
+{
+	char path[1024];
+	unsigned int area[4]; // x, y, width, height in device units, width 0 for the whole mat
+	int state; // LicutBatch::FILE_...
+	char error[128];
+	LicutCmdList *cmds; // Prepared commands until the file is cut
+	int drawSets;
+	int packets;
+	int collapsed;
+	int parseMs; // Reading and parsing
+	int prepareMs; // Geometry passes, lowering and encoding
+	int waitMs; // Time the device waited for preparation
+	int cutMs;
+	int retries; // Commands sent again after a missing reply
+	int mat; // Mat the file was cut on, from 1
+} batchFile_t;
+
+class LicutBatch
+{
+public:
+	enum
+	{
+		FILE_QUEUED,
+		FILE_PARSING,
+		FILE_PARSED,
+		FILE_PREPARING,
+		FILE_READY,
+		FILE_FAILED,
+		FILE_CUT,
+		FILE_NOT_CUT // Cut failed or batch stopped first
+	};
+
+	// Files are parsed and prepared with the same per-job processing as the daemon
+	LicutBatch( LicutDaemonHandler& handler, int verbose );
+	~LicutBatch();
+
+	// Add file to cut into area x, y, width, height of the mat in device units, or
+	// the whole mat if area is NULL or its width is 0. Returns 0 if successful
+	int Add( const char *path, unsigned int const *area = NULL );
+
+	// Add files listed in manifest, one per line as
+	// path [x,y,width,height]
+	// Blank lines and lines starting with # are ignored. Returns number of files
+	// added or -1 on error
+	int LoadManifest( const char *path );
+
+	void SetDelays( int intercommand, int intercurve ) { m_intercommand = intercommand; m_intercurve = intercurve; }
+	// Remove commands with no effect at device resolution
+	void SetCollapse( bool collapse ) { m_collapse = collapse; }
+	// See LicutCmdList::SetTransaction()
+	void SetTransaction( int batch, int replyDrainMs ) { m_transaction = batch; m_transactionDrain = replyDrainMs; }
+	// See LicutCmdList::SetRetries()
+	void SetRetries( int retries ) { m_retries = retries; }
+
+	// Start parsing on threads worker threads. Files are prepared once SetMat() is
+	// called, at most threads files ahead of the one being cut. Returns 0 if
+	// started
+	int Start( int threads );
+
+	// Mat bounds xmin, ymin, xmax, ymax used for every mat of the batch
+	void SetMat( unsigned int const mat[4] );
+
+	// Cut files in order on the mat already loaded. A mat is finished, ejected if
+	// eject is set and replaced, when the next file's area overlaps one already
+	// cut on it. Stops at the first failed send. Returns number of files cut
+	int Run( LicutIO& lio, bool eject );
+
+	// Write per-file timing table
+	void WriteReport( FILE *f ) const;
+
+	int GetCount() const { return m_count; }
+	batchFile_t const *GetFile( int index ) const { return (index >= 0 && index < m_count) ? &m_files[index] : NULL; }
+
+protected:
+	static void *WorkerThread( void *arg );
+	void Work();
+	// Parse file, wait for the mat and prepare it. Called on a worker thread
+	// without m_lock held
+	void Prepare( int index );
+	// Wait for file index to be prepared. Returns its state
+	int WaitReady( int index );
+	// Area of file on the mat: x, y, width, height
+	void FileArea( batchFile_t const& file, unsigned int area[4] ) const;
+
+protected:
+	LicutDaemonHandler& m_handler;
+	int m_verbose;
+	batchFile_t *m_files;
+	int m_count;
+	int m_alloc;
+	int m_intercommand;
+	int m_intercurve;
+	bool m_collapse;
+	int m_transaction;
+	int m_transactionDrain;
+	int m_retries;
+
+	pthread_t *m_threads;
+	int m_threadCount;
+	int m_lookahead; // Files prepared ahead of the one being cut
+	pthread_mutex_t m_lock;
+	pthread_cond_t m_changed; // Broadcast on any state change
+	pthread_mutex_t m_encodeLock; // Packet noise is not thread-safe
+	int m_next; // Next file for a worker
+	int m_cutting; // File being cut
+	bool m_matSet;
+	bool m_stopping;
+	unsigned int m_mat[4];
+	double m_elapsed; // Seconds for the whole batch
+};
+
+#endif // _LICUT_BATCH_H_
@@ -0,0 +1,463 @@
+// $Id$
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "licut_cmdlist.h"
+#include "licut_log.h"
+#include "licut_svg.h"
+
+LicutCmdList::LicutCmdList( int verbose )
+{
+	m_verbose = verbose;
+	m_cmds = NULL;
+	m_count = 0;
+	m_alloc = 0;
+	m_groups = 0;
+	m_intercommand = 100;
+	m_transaction = 0;
+	m_transactionDrain = 5;
+	m_transactions = 0;
+	m_retries = 0;
+	m_retryCount = 0;
+	m_resyncCount = 0;
+	m_packets = NULL;
+	m_encoded = 0;
+	m_packetAlloc = 0;
+}
+
+LicutCmdList::~LicutCmdList()
+{
+	free( m_cmds );
+	free( m_packets );
+}
+
+// Remove all commands
+void LicutCmdList::Clear()
+{
+	m_count = 0;
+	m_groups = 0;
+	m_encoded = 0;
+}
+
+// Append command. Returns 0 if successful
+int LicutCmdList::Add( unsigned int subCmd, unsigned int x, unsigned int y, int delay, bool groupStart )
+{
+	if (m_count >= m_alloc)
+	{
+		int newAlloc = m_alloc ? m_alloc * 2 : 1024;
+		loweredCmd_t *newCmds = (loweredCmd_t *)realloc( m_cmds, newAlloc * sizeof(loweredCmd_t) );
+		if (!newCmds)
+		{
+			LICUT_ERROR( "%s() failed to allocate %d commands\n", __FUNCTION__, newAlloc );
+			return -1;
+		}
+		m_cmds = newCmds;
+		m_alloc = newAlloc;
+	}
+	loweredCmd_t& c = m_cmds[m_count++];
+	c.subCmd = subCmd;
+	c.groupStart = groupStart;
+	c.delay = delay;
+	c.x = x;
+	c.y = y;
+	if (groupStart) m_groups++;
+	return 0;
+}
+
+// True if control points c1, c2 of cubic p0..p3 lie on the segment p0-p3, so the
+// curve traces no more than a line would
+static bool _flat_curve( loweredCmd_t const *p )
+{
+	long long dx = (long long)p[3].x - p[0].x;
+	long long dy = (long long)p[3].y - p[0].y;
+	long long len2 = dx * dx + dy * dy;
+	for (int i = 1; i <= 2; i++)
+	{
+		long long cx = (long long)p[i].x - p[0].x;
+		long long cy = (long long)p[i].y - p[0].y;
+		if (len2 == 0)
+		{
+			if (cx != 0 || cy != 0) return false;
+			continue;
+		}
+		if (dx * cy - dy * cx != 0) return false;
+		long long dot = dx * cx + dy * cy;
+		if (dot < 0 || dot > len2) return false;
+	}
+	return true;
+}
+
+// Remove commands with no effect at device resolution. Returns number removed
+int LicutCmdList::Collapse( bool havePen, unsigned int penX, unsigned int penY )
+{
+	int out = 0;
+	int removed = 0;
+	bool lastLine = false; // Last command kept is a line from lineX, lineY
+	unsigned int lineX = 0, lineY = 0;
+	bool pendingGroup = false; // Group start of a removed command moves to the next
+	for (int n = 0; n < m_count; n++)
+	{
+		loweredCmd_t c = m_cmds[n];
+		if (pendingGroup) c.groupStart = 1;
+		if (c.subCmd == 1 && n + 3 < m_count)
+		{
+			loweredCmd_t const *p = &m_cmds[n];
+			if (!havePen || p[0].x != penX || p[0].y != penY || !_flat_curve( p ))
+			{
+				memmove( &m_cmds[out], p, 4 * sizeof(loweredCmd_t) );
+				m_cmds[out].groupStart = c.groupStart;
+				out += 4;
+				n += 3;
+				penX = p[3].x;
+				penY = p[3].y;
+				havePen = true;
+				lastLine = false;
+				pendingGroup = false;
+				continue;
+			}
+			// Same as a line to the end point
+			c.subCmd = 0;
+			c.x = p[3].x;
+			c.y = p[3].y;
+			c.delay = p[3].delay;
+			removed += 3;
+			n += 3;
+		}
+		if (c.subCmd != 0 && c.subCmd != 2)
+		{
+			m_cmds[out++] = c;
+			havePen = false;
+			lastLine = false;
+			pendingGroup = false;
+			continue;
+		}
+		if (havePen && c.x == penX && c.y == penY)
+		{
+			removed++;
+			pendingGroup = c.groupStart;
+			continue;
+		}
+		pendingGroup = false;
+		if (c.subCmd == 2)
+		{
+			// Only the last of consecutive moves has any effect
+			if (out > 0 && m_cmds[out - 1].subCmd == 2)
+			{
+				out--;
+				c.groupStart |= m_cmds[out].groupStart;
+				removed++;
+			}
+			lastLine = false;
+		}
+		else if (lastLine && !c.groupStart)
+		{
+			long long ax = (long long)penX - lineX, ay = (long long)penY - lineY;
+			long long bx = (long long)c.x - penX, by = (long long)c.y - penY;
+			if (ax * by - ay * bx == 0 && ax * bx + ay * by > 0)
+			{
+				// Extend the last line
+				m_cmds[out - 1].x = c.x;
+				m_cmds[out - 1].y = c.y;
+				m_cmds[out - 1].delay = c.delay;
+				penX = c.x;
+				penY = c.y;
+				removed++;
+				continue;
+			}
+		}
+		if (c.subCmd == 0)
+		{
+			lastLine = havePen;
+			lineX = penX;
+			lineY = penY;
+		}
+		m_cmds[out++] = c;
+		penX = c.x;
+		penY = c.y;
+		havePen = true;
+	}
+	m_count = out;
+	m_encoded = 0;
+	m_groups = 0;
+	for (int n = 0; n < m_count; n++)
+	{
+		if (m_cmds[n].groupStart) m_groups++;
+	}
+	if (m_verbose) LICUT_DEBUG( "%s() removed %d of %d commands\n", __FUNCTION__, removed, m_count + removed );
+	return removed;
+}
+
+// Lower all draw sets of svg to device commands. Returns 0 if successful
+int LicutCmdList::Lower( LicutSVG& svg, int x, int y, int width, int height, int intercommand, int intercurve )
+{
+	if (!svg.GetWidth() || !svg.GetHeight())
+	{
+		LICUT_ERROR( "%s() cannot scale, no svg width and height\n", __FUNCTION__ );
+		return -1;
+	}
+	svg.SetScaling( x, y, width, height );
+	for (int set = 0; set < svg.GetDrawSetCount(); set++)
+	{
+		// Instances share geometry and are only transformed here
+		double const *m;
+		drawSet_t const *d = svg.GetDrawSetGeometry( set, &m );
+		if (!d || LowerDrawSet( svg, d, x, y, intercommand, intercurve, m ) != 0) return -1;
+	}
+	return 0;
+}
+
+// Append one draw set with scaling already set. Returns 0 if successful
+int LicutCmdList::LowerDrawSet( LicutSVG& svg, drawSet_t const *d, int x, int y, int intercommand, int intercurve, double const *m /*= NULL*/ )
+{
+	m_intercommand = intercommand;
+	unsigned int lastX = x, lastY = y, curX, curY, ctl1X, ctl1Y, ctl2X, ctl2Y;
+	bool groupStart = true;
+	int r = 0;
+	for (int n = 0; d[n].type != 0 && r == 0; n++)
+	{
+		double pt[3][2];
+		memcpy( pt, d[n].pt, sizeof(pt) );
+		if (m) for (int i = 0; i < d[n].numPoints; i++) LicutSVG::TransformPoint( m, d[n].pt[i], pt[i] );
+		switch (d[n].type)
+		{
+			case 'M':	// Move
+				svg.ScalePoint( pt[0], lastX, lastY );
+				r = Add( 2, lastX, lastY, intercommand, groupStart );
+				break;
+			case 'L':	// Straight line from previous point
+				svg.ScalePoint( pt[0], lastX, lastY );
+				r = Add( 0, lastX, lastY, intercommand, groupStart );
+				break;
+			case 'C':	// Bezier curve from previous point, sent in sets of 4
+				svg.ScalePoint( pt[0], ctl1X, ctl1Y );
+				svg.ScalePoint( pt[1], ctl2X, ctl2Y );
+				svg.ScalePoint( pt[2], curX, curY );
+				r = Add( 1, lastX, lastY, intercurve, groupStart );
+				if (r == 0) r = Add( 1, ctl1X, ctl1Y, intercurve, false );
+				if (r == 0) r = Add( 1, ctl2X, ctl2Y, intercurve, false );
+				if (r == 0) r = Add( 1, curX, curY, intercommand, false );
+				lastX = curX;
+				lastY = curY;
+				break;
+			default:
+				LICUT_WARN( "%s() warning: unhandled cut type %c at index %d\n",
+					__FUNCTION__, d[n].type, n );
+				continue;
+		}
+		groupStart = false;
+	}
+	return r != 0 ? -1 : 0;
+}
+
+// Encode packets for all commands not yet encoded. Returns 0 if successful
+int LicutCmdList::Encode()
+{
+	if (m_count > m_packetAlloc)
+	{
+		unsigned char (*newPackets)[LICUT_MOVECUT_PACKET] = (unsigned char (*)[LICUT_MOVECUT_PACKET])realloc( m_packets, m_alloc * sizeof(m_packets[0]) );
+		if (!newPackets)
+		{
+			LICUT_ERROR( "%s() failed to allocate %d packets\n", __FUNCTION__, m_alloc );
+			return -1;
+		}
+		m_packets = newPackets;
+		m_packetAlloc = m_alloc;
+	}
+	for (; m_encoded < m_count; m_encoded++)
+	{
+		loweredCmd_t const& c = m_cmds[m_encoded];
+		if (LicutIO::EncodeMoveCut( c.subCmd, c.x, c.y, m_packets[m_encoded] ) < 0) return -1;
+	}
+	return 0;
+}
+
+// Command to continue from after command lastAcked
+int LicutCmdList::ResumeIndex( int lastAcked ) const
+{
+	if (lastAcked < 0) return 0;
+	if (lastAcked >= m_count - 1) return m_count;
+	// Curves are sent as runs of 4 packets and the device only cuts once it has all of them
+	int n = 0;
+	while (n <= lastAcked)
+	{
+		int length = (m_cmds[n].subCmd == 1 && n + 3 < m_count) ? 4 : 1;
+		if (n + length - 1 > lastAcked) break;
+		n += length;
+	}
+	return n;
+}
+
+// Send commands from start. Returns number of draw sets sent or -1 on error
+int LicutCmdList::Send( LicutIO& lio, int start, LicutSendListener *listener )
+{
+	if (Encode() != 0) return -1;
+	if (start < 0 || start > m_count) return -1;
+	int oldVerbose = lio.GetVerbose();
+	lio.SetVerbose( m_verbose );
+	int groups = 0;
+	if (start > 0 && start < m_count && m_cmds[start].subCmd != 2)
+	{
+		// The previous command (a move, line or last packet of a curve) ends where the pen should be
+		unsigned char packet[LICUT_MOVECUT_PACKET];
+		loweredCmd_t const& p = m_cmds[start - 1];
+		if (m_verbose) LICUT_DEBUG( "%s() resuming at command %d from %u,%u\n", __FUNCTION__, start, p.x, p.y );
+		lio.Drain( m_verbose, m_intercommand * 6 );
+		LicutIO::EncodeMoveCut( 2, p.x, p.y, packet );
+		lio.SendPacket_MoveCut( packet );
+		if (lio.ReadCmdReply( m_verbose ) < 0 && listener)
+		{
+			lio.SetVerbose( oldVerbose );
+			return -1;
+		}
+		lio.Drain( m_verbose, m_intercommand );
+	}
+	m_transactions = 0;
+	m_retryCount = 0;
+	m_resyncCount = 0;
+	for (int n = start; n < m_count; n++)
+	{
+		loweredCmd_t const& c = m_cmds[n];
+		if (c.groupStart)
+		{
+			if (m_verbose && groups > 0) LICUT_DEBUG( "%s() draw set %d done\n", __FUNCTION__, groups - 1 );
+			if (listener && listener->Cancelled())
+			{
+				LICUT_INFO( "%s() cancelled before command %d of %d\n", __FUNCTION__, n, m_count );
+				lio.SetVerbose( oldVerbose );
+				return -1;
+			}
+			// Settle for six intercommand delays before each set, as preflight counts
+			lio.Drain( m_verbose, m_intercommand * 6 );
+			groups++;
+		}
+		if (m_transaction != 0)
+		{
+			int end = TransactionEnd( n );
+			if (SendTransaction( lio, n, end, listener ) != 0)
+			{
+				lio.SetVerbose( oldVerbose );
+				return -1;
+			}
+			n = end - 1;
+			continue;
+		}
+		int end = CommandEnd( n );
+		bool stop = listener || m_retries > 0;
+		if (SendCommand( lio, n, end, LICUT_REPLY_DRAIN_MS, true, stop, true ) != 0 && stop)
+		{
+			LICUT_ERROR( "%s() no reply to command %d of %d, stopping\n", __FUNCTION__, n, m_count );
+			lio.SetVerbose( oldVerbose );
+			return -1;
+		}
+		if (listener)
+		{
+			for (; n < end; n++) listener->Acked( n );
+		}
+		n = end - 1;
+	}
+	lio.SetVerbose( oldVerbose );
+	return groups;
+}
+
+// End of transaction starting at command first
+int LicutCmdList::TransactionEnd( int first ) const
+{
+	int end = first;
+	do
+	{
+		int next = CommandEnd( end );
+		// A curve is never split, even if it makes the batch larger
+		if (m_transaction > 0 && end > first && next - first > m_transaction) break;
+		end = next;
+	} while (end < m_count && !m_cmds[end].groupStart);
+	return end;
+}
+
+// Transactions Send() uses with the batch size set, if every reply arrives
+int LicutCmdList::CountTransactions() const
+{
+	if (m_transaction == 0) return 0;
+	int count = 0;
+	for (int n = 0; n < m_count; n = TransactionEnd( n )) count++;
+	return count;
+}
+
+// Send packets of one command. Returns 0 if every reply arrived
+int LicutCmdList::SendCommand( LicutIO& lio, int first, int end, int drainMs, bool delays, bool stop, bool retry )
+{
+	for (int attempt = 0; ; attempt++)
+	{
+		bool failed = false;
+		int n;
+		for (n = first; n < end; n++)
+		{
+			lio.SendPacket_MoveCut( m_packets[n] );
+			if (lio.ReadCmdReply( m_verbose, drainMs ) < 0)
+			{
+				failed = true;
+				if (stop) break;
+			}
+			if (delays) lio.Drain( m_verbose, m_cmds[n].delay );
+		}
+		if (n == end) return failed ? -1 : 0;
+		if (!retry || attempt >= m_retries) return -1;
+		// Resend even if the probe went unanswered; another miss costs a retry
+		m_resyncCount++;
+		lio.Resync( m_verbose );
+		// Same positions with fresh noise, so the device does not see a repeat
+		for (n = first; n < end; n++) LicutIO::EncodeMoveCut( m_cmds[n].subCmd, m_cmds[n].x, m_cmds[n].y, m_packets[n] );
+		m_retryCount++;
+		LICUT_WARN( "%s() resending command %d of %d (retry %d of %d)\n", __FUNCTION__, first, m_count, attempt + 1, m_retries );
+	}
+}
+
+// Send commands first to end - 1 as one transaction. Returns 0 if successful
+int LicutCmdList::SendTransaction( LicutIO& lio, int first, int end, LicutSendListener *listener )
+{
+	bool stop = listener || m_retries > 0;
+	int failed = -1; // Command retried, each up to m_retries times
+	int attempt = 0;
+	for (;;)
+	{
+		// The device moves once the transaction ends, so the delays that would
+		// follow each command are waited out together afterwards. Resync is not
+		// used inside, as its status request would go into the transaction
+		lio.SendCmd_StartTransaction();
+		int n;
+		for (n = first; n < end; n = CommandEnd( n ))
+		{
+			if (SendCommand( lio, n, CommandEnd( n ), m_transactionDrain, false, stop, false ) != 0 && stop) break;
+		}
+		// There is no abort, so commands before a missing reply are committed too
+		lio.SendCmd_EndTransaction();
+		m_transactions++;
+		int delay = 0;
+		for (int k = first; k < n; k++) delay += m_cmds[k].delay;
+		if (m_verbose) LICUT_DEBUG( "%s() commands %d to %d sent, waiting %dms\n", __FUNCTION__, first, n - 1, delay );
+		lio.Drain( m_verbose, delay );
+		if (listener)
+		{
+			for (int k = first; k < n; k++) listener->Acked( k );
+		}
+		if (n >= end) return 0;
+		if (n != failed)
+		{
+			failed = n;
+			attempt = 0;
+		}
+		if (attempt++ >= m_retries)
+		{
+			LICUT_ERROR( "%s() no reply to command %d of %d in transaction, stopping\n", __FUNCTION__, n, m_count );
+			return -1;
+		}
+		// The rest again with fresh noise, as SendCommand() would
+		m_resyncCount++;
+		lio.Resync( m_verbose );
+		for (int k = n; k < end; k++) LicutIO::EncodeMoveCut( m_cmds[k].subCmd, m_cmds[k].x, m_cmds[k].y, m_packets[k] );
+		m_retryCount++;
+		LICUT_WARN( "%s() resending commands %d to %d of %d (retry %d of %d)\n", __FUNCTION__, n, end - 1, m_count, attempt, m_retries );
+		first = n;
+	}
+}
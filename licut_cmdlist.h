@@ -0,0 +1,135 @@
+// $Id$
+// Draw sets lowered to device move/cut commands, with packets encoded ahead of sending
+
+#ifndef _LICUT_CMDLIST_H_
+#define _LICUT_CMDLIST_H_
+
+#include "licut_io.h"
+#include "licut_svg.h"
+
+// Notified by LicutCmdList::Send() as commands are acknowledged
+class LicutSendListener
+{
+public:
+	virtual ~LicutSendListener() {}
+	virtual void Acked( int index ) = 0;
+	// Checked before each draw set; true stops the send
+	virtual bool Cancelled() { return false; }
+};
+
+// One 0x40 command in device coordinates
+typedef struct _loweredCmd
+{
+	unsigned char subCmd; // 0 = line, 1 = curve element, 2 = move
+	unsigned char groupStart; // First command of a draw set
+	unsigned short delay; // Drain time after reply in ms
+	unsigned int x;
+	unsigned int y;
+} loweredCmd_t;
+
+class LicutCmdList
+{
+public:
+	LicutCmdList( int verbose );
+	~LicutCmdList();
+
+	// Lower all draw sets of svg scaled to the output area to 0x40 commands, with
+	// their delays. Returns 0 if successful
+	int Lower( LicutSVG& svg, int x, int y, int width, int height, int intercommand, int intercurve );
+
+	// Append draw set d of svg as Lower() would, with the scaling already set on
+	// svg and x, y its output origin. Points are transformed by m first if not
+	// NULL, see LicutSVG::GetDrawSetGeometry(). Returns 0 if successful
+	int LowerDrawSet( LicutSVG& svg, drawSet_t const *d, int x, int y, int intercommand, int intercurve, double const *m = NULL );
+
+	// Append command. Returns 0 if successful
+	int Add( unsigned int subCmd, unsigned int x, unsigned int y, int delay, bool groupStart );
+
+	// Remove all commands
+	void Clear();
+
+	// Remove commands with no effect at device resolution: moves and lines to the
+	// current position, consecutive moves, curves whose control points lie on the
+	// line between their ends (sent as one line), and collinear lines in the same
+	// direction (merged). Cut geometry in device units is unchanged. If havePen is
+	// set the list continues from commands already sent which left the pen at
+	// penX, penY. Returns number of commands removed
+	int Collapse( bool havePen = false, unsigned int penX = 0, unsigned int penY = 0 );
+
+	// Encode packets for all commands not yet encoded, so that Send() only writes.
+	// Returns 0 if successful
+	int Encode();
+
+	// Send commands from start, encoding any not yet encoded. If start is not the
+	// beginning of the list the pen is first moved to where the previous command
+	// left it. If listener is given it is told of each acknowledged command, and
+	// sending stops at the first missing reply. Returns number of draw sets sent
+	// or -1 on error
+	int Send( LicutIO& lio, int start = 0, LicutSendListener *listener = NULL );
+
+	// Send in transactions (0x21 ... 0x22) of up to batch commands within a draw
+	// set, or a whole draw set if batch is -1; 0 sends each command on its own.
+	// Inside a transaction each reply is drained for replyDrainMs instead of
+	// 250ms, and the delays of the batch are waited out after it ends. Commands
+	// are reported to the listener when their transaction ends
+	void SetTransaction( int batch, int replyDrainMs ) { m_transaction = batch; m_transactionDrain = replyDrainMs; }
+	int GetTransactionCount() const { return m_transactions; }
+	// Transactions Send() uses with the batch size set, if every reply arrives
+	int CountTransactions() const;
+
+	// When a reply is missing or truncated (see LicutIO::SetReplyTimeout()),
+	// resynchronize with LicutIO::Resync() and send the command again with fresh
+	// noise, up to retries times before Send() fails. Moves and lines go to
+	// absolute positions so repeating one is safe; a curve is sent again from its
+	// first packet. With 0 (the default) a missing reply stops Send() only if it
+	// has a listener
+	void SetRetries( int retries ) { m_retries = retries; }
+	// Retransmissions and resynchronizations by the last Send()
+	int GetRetryCount() const { return m_retryCount; }
+	int GetResyncCount() const { return m_resyncCount; }
+
+	// Command to continue from after command lastAcked was acknowledged: the next
+	// one, or the first packet of a curve only partly sent
+	int ResumeIndex( int lastAcked ) const;
+
+	int GetCount() const { return m_count; }
+	int GetGroupCount() const { return m_groups; }
+	loweredCmd_t const *GetCmd( int index ) const { return (index >= 0 && index < m_count) ? &m_cmds[index] : NULL; }
+	// Packet encoded for command index, NULL if not yet encoded
+	unsigned char const *GetPacket( int index ) const { return (index >= 0 && index < m_encoded) ? m_packets[index] : NULL; }
+
+protected:
+	// End of the command starting at first: first + 4 for a curve, else first + 1
+	int CommandEnd( int first ) const { return (m_cmds[first].subCmd == 1 && first + 3 < m_count) ? first + 4 : first + 1; }
+	// Send packets first to end - 1 of one command, reading each reply with
+	// drainMs and waiting out each command's delay if delays is set. Stops at a
+	// missing reply if stop is set, retrying as set by SetRetries() if retry is
+	// set. Returns 0 if every reply arrived
+	int SendCommand( LicutIO& lio, int first, int end, int drainMs, bool delays, bool stop, bool retry );
+	// End of the transaction starting at command first: a whole number of
+	// commands (curves are 4 packets) up to the batch size or end of draw set
+	int TransactionEnd( int first ) const;
+	// Send commands first to end - 1 as one transaction. A missing reply ends it
+	// early, since it cannot be aborted, and the commands before it are reported
+	// as committed; the rest are retried in a new transaction after resynchronizing.
+	// Returns 0 if successful
+	int SendTransaction( LicutIO& lio, int first, int end, LicutSendListener *listener );
+
+	int m_verbose;
+	loweredCmd_t *m_cmds;
+	int m_count;
+	int m_alloc;
+	int m_groups;
+	int m_intercommand; // For drain before each draw set
+	int m_transaction;
+	int m_transactionDrain;
+	int m_transactions; // Sent by the last Send()
+	int m_retries;
+	int m_retryCount;
+	int m_resyncCount;
+	unsigned char (*m_packets)[LICUT_MOVECUT_PACKET];
+	int m_encoded; // Commands with packets encoded
+	int m_packetAlloc;
+};
+
+#endif // _LICUT_CMDLIST_H_
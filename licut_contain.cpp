@@ -0,0 +1,430 @@
+// $Id$
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <algorithm>
+
+#include "licut_contain.h"
+#include "licut_svg.h"
+#include "licut_geom.h"
+#include "licut_log.h"
+#include "licut_time.h"
+
+// Steps used to flatten curves for point-in-polygon tests
+#define CURVE_FLATTEN_STEPS	8
+
+// Contours with more edges than this get a band index for point-in-polygon tests
+#define BAND_MIN_EDGES	32
+
+// Average edges per band
+#define BAND_EDGES	8
+
+// Compare contours by bounding box center along x or y for tree construction
+template <class C> class _center_less
+{
+public:
+	_center_less( C const *contour, int axis ) : m_contour( contour ), m_axis( axis ) {}
+	bool operator()( int a, int b ) const
+	{
+		return m_contour[a].box[m_axis] + m_contour[a].box[m_axis + 2] < m_contour[b].box[m_axis] + m_contour[b].box[m_axis + 2];
+	}
+	C const *m_contour;
+	int m_axis;
+};
+
+LicutContain::LicutContain( int verbose )
+{
+	m_verbose = verbose;
+	m_sets = 0;
+	m_parent = NULL;
+	m_contour = NULL;
+	m_contours = 0;
+	m_items = NULL;
+	m_nodeBox = NULL;
+	m_pts = NULL;
+	m_ptCount = 0;
+	m_ptAlloc = 0;
+	m_bandStart = NULL;
+	m_bandStartCount = 0;
+	m_bandStartAlloc = 0;
+	m_bandEdges = NULL;
+	m_bandEdgeCount = 0;
+	m_bandEdgeAlloc = 0;
+	m_containers = 0;
+	m_nested = 0;
+	m_maxDepth = 0;
+	m_moved = 0;
+	m_elapsedMs = 0;
+}
+
+LicutContain::~LicutContain()
+{
+	Free();
+}
+
+// Release working arrays
+void LicutContain::Free()
+{
+	free( m_parent );
+	free( m_contour );
+	free( m_items );
+	free( m_nodeBox );
+	free( m_pts );
+	free( m_bandStart );
+	free( m_bandEdges );
+	m_parent = NULL;
+	m_contour = NULL;
+	m_items = NULL;
+	m_nodeBox = NULL;
+	m_pts = NULL;
+	m_bandStart = NULL;
+	m_bandEdges = NULL;
+	m_sets = 0;
+	m_contours = 0;
+	m_ptCount = 0;
+	m_ptAlloc = 0;
+	m_bandStartCount = 0;
+	m_bandStartAlloc = 0;
+	m_bandEdgeCount = 0;
+	m_bandEdgeAlloc = 0;
+}
+
+// Add flattened point to m_pts
+void LicutContain::AddPoint( double const pt[2] )
+{
+	if (m_ptCount >= m_ptAlloc)
+	{
+		m_ptAlloc = m_ptAlloc ? m_ptAlloc * 2 : 4096;
+		m_pts = (double (*)[2])realloc( m_pts, m_ptAlloc * sizeof(m_pts[0]) );
+	}
+	memcpy( m_pts[m_ptCount++], pt, sizeof(m_pts[0]) );
+}
+
+// Index edges of a contour with many edges by horizontal band, so that a
+// point-in-polygon test only visits edges crossing the band of the point
+void LicutContain::BuildBands( int contour )
+{
+	contour_t& c = m_contour[contour];
+	int edges = c.count - 1;
+	c.bandFirst = -1;
+	c.bands = 0;
+	if (edges <= BAND_MIN_EDGES || c.box[3] <= c.box[1]) return;
+	int bands = edges / BAND_EDGES;
+	double height = (c.box[3] - c.box[1]) / bands;
+	int e, b;
+
+	// Count edges per band then fill, as compressed rows
+	if (m_bandStartCount + bands + 1 > m_bandStartAlloc)
+	{
+		m_bandStartAlloc = (m_bandStartCount + bands + 1) * 2;
+		m_bandStart = (int *)realloc( m_bandStart, m_bandStartAlloc * sizeof(int) );
+	}
+	int *start = m_bandStart + m_bandStartCount;
+	memset( start, 0, (bands + 1) * sizeof(int) );
+	int total = 0;
+	for (e = 0; e < edges; e++)
+	{
+		double const *p = m_pts[c.first + e];
+		double const *q = m_pts[c.first + e + 1];
+		int b0 = (int)(((p[1] < q[1] ? p[1] : q[1]) - c.box[1]) / height);
+		int b1 = (int)(((p[1] < q[1] ? q[1] : p[1]) - c.box[1]) / height);
+		if (b1 >= bands) b1 = bands - 1;
+		for (b = b0; b <= b1; b++) start[b + 1]++;
+		total += b1 - b0 + 1;
+	}
+	if (m_bandEdgeCount + total > m_bandEdgeAlloc)
+	{
+		m_bandEdgeAlloc = (m_bandEdgeCount + total) * 2;
+		m_bandEdges = (int *)realloc( m_bandEdges, m_bandEdgeAlloc * sizeof(int) );
+	}
+	start[0] = m_bandEdgeCount;
+	for (b = 0; b < bands; b++) start[b + 1] += start[b];
+	int *fill = (int *)malloc( bands * sizeof(int) );
+	memcpy( fill, start, bands * sizeof(int) );
+	for (e = 0; e < edges; e++)
+	{
+		double const *p = m_pts[c.first + e];
+		double const *q = m_pts[c.first + e + 1];
+		int b0 = (int)(((p[1] < q[1] ? p[1] : q[1]) - c.box[1]) / height);
+		int b1 = (int)(((p[1] < q[1] ? q[1] : p[1]) - c.box[1]) / height);
+		if (b1 >= bands) b1 = bands - 1;
+		for (b = b0; b <= b1; b++) m_bandEdges[fill[b]++] = c.first + e;
+	}
+	free( fill );
+	m_bandEdgeCount += total;
+	c.bandFirst = m_bandStartCount;
+	c.bands = bands;
+	m_bandStartCount += bands + 1;
+}
+
+// Returns true if pt is inside flattened contour (even-odd rule)
+bool LicutContain::Inside( int contour, double const pt[2] ) const
+{
+	contour_t const& c = m_contour[contour];
+	bool inside = false;
+	if (c.bands > 0)
+	{
+		int b = (int)((pt[1] - c.box[1]) / ((c.box[3] - c.box[1]) / c.bands));
+		if (b < 0 || b >= c.bands) return false;
+		int const *start = m_bandStart + c.bandFirst;
+		for (int i = start[b]; i < start[b + 1]; i++)
+		{
+			double const *p = m_pts[m_bandEdges[i]];
+			double const *q = m_pts[m_bandEdges[i] + 1];
+			if ((p[1] > pt[1]) != (q[1] > pt[1]) &&
+				pt[0] < p[0] + (q[0] - p[0]) * (pt[1] - p[1]) / (q[1] - p[1]))
+			{
+				inside = !inside;
+			}
+		}
+		return inside;
+	}
+	for (int i = c.first; i < c.first + c.count - 1; i++)
+	{
+		double const *p = m_pts[i];
+		double const *q = m_pts[i + 1];
+		if ((p[1] > pt[1]) != (q[1] > pt[1]) &&
+			pt[0] < p[0] + (q[0] - p[0]) * (pt[1] - p[1]) / (q[1] - p[1]))
+		{
+			inside = !inside;
+		}
+	}
+	return inside;
+}
+
+// Build bounding volume tree over m_items[lo..hi). Like a k-d tree, the item at
+// the median is the node and m_nodeBox holds the bounds of the whole range
+void LicutContain::BuildTree( int lo, int hi, int axis )
+{
+	if (hi <= lo) return;
+	int mid = (lo + hi) / 2;
+	if (hi - lo > 1)
+	{
+		std::nth_element( m_items + lo, m_items + mid, m_items + hi, _center_less<contour_t>( m_contour, axis ) );
+		BuildTree( lo, mid, 1 - axis );
+		BuildTree( mid + 1, hi, 1 - axis );
+	}
+	double *box = m_nodeBox[mid];
+	memcpy( box, m_contour[m_items[mid]].box, sizeof(m_nodeBox[0]) );
+	for (int k = 0; k < 2; k++)
+	{
+		int child = k ? (mid + 1 + hi) / 2 : (lo + mid) / 2;
+		if ((k ? hi - (mid + 1) : mid - lo) <= 0) continue;
+		double const *cb = m_nodeBox[child];
+		if (cb[0] < box[0]) box[0] = cb[0];
+		if (cb[1] < box[1]) box[1] = cb[1];
+		if (cb[2] > box[2]) box[2] = cb[2];
+		if (cb[3] > box[3]) box[3] = cb[3];
+	}
+}
+
+// Find innermost contour in m_items[lo..hi) with area greater than minArea whose
+// bounds contain box and which contains pt, other than the contour of set
+void LicutContain::Innermost( int lo, int hi, double const box[4], double const pt[2], double minArea, int set, int& best ) const
+{
+	if (hi <= lo) return;
+	int mid = (lo + hi) / 2;
+	double const *nb = m_nodeBox[mid];
+	if (box[0] < nb[0] || box[1] < nb[1] || box[2] > nb[2] || box[3] > nb[3]) return;
+	int k = m_items[mid];
+	contour_t const& c = m_contour[k];
+	if (c.set != set && c.area > minArea && (best < 0 || c.area < m_contour[best].area) &&
+		box[0] >= c.box[0] && box[1] >= c.box[1] && box[2] <= c.box[2] && box[3] <= c.box[3] &&
+		Inside( k, pt ))
+	{
+		best = k;
+	}
+	Innermost( lo, mid, box, pt, minArea, set, best );
+	Innermost( mid + 1, hi, box, pt, minArea, set, best );
+}
+
+// Find the innermost closed contour containing each draw set. Returns 0 if successful
+int LicutContain::Analyze( LicutSVG const& svg )
+{
+	double t0 = licut_now();
+	Free();
+	m_containers = 0;
+	m_nested = 0;
+	m_maxDepth = 0;
+	m_sets = svg.GetDrawSetCount();
+	m_parent = (int *)malloc( (m_sets + 1) * sizeof(int) );
+	m_contour = (contour_t *)malloc( (m_sets + 1) * sizeof(contour_t) );
+	int *setFirst = (int *)malloc( (m_sets + 1) * sizeof(int) );
+	int *setCount = (int *)calloc( m_sets + 1, sizeof(int) );
+	double (*setBox)[4] = (double (*)[4])malloc( (m_sets + 1) * sizeof(setBox[0]) );
+	if (!m_parent || !m_contour || !setFirst || !setCount || !setBox)
+	{
+		LICUT_ERROR( "%s() failed to allocate for %d draw sets\n", __FUNCTION__, m_sets );
+		free( setFirst );
+		free( setCount );
+		free( setBox );
+		Free();
+		return -1;
+	}
+	int n, i;
+
+	// Flatten all sets, recording closed contours with their bounds and area
+	for (n = 0; n < m_sets; n++)
+	{
+		m_parent[n] = -1;
+		drawSet_t const *set = svg.GetDrawSet( n );
+		setFirst[n] = m_ptCount;
+		if (!LicutGeom::IsReversible( set )) continue;
+		double pos[2] = { 0, 0 };
+		for (i = 0; set[i].type != 0; i++)
+		{
+			if (set[i].type == 'C')
+			{
+				for (int s = 1; s <= CURVE_FLATTEN_STEPS; s++)
+				{
+					double p[2];
+					LicutGeom::Bezier( pos, set[i].pt[0], set[i].pt[1], set[i].pt[2], (double)s / CURVE_FLATTEN_STEPS, p );
+					AddPoint( p );
+				}
+			}
+			else
+			{
+				AddPoint( set[i].pt[0] );
+			}
+			memcpy( pos, LicutGeom::EndPoint( &set[i] ), sizeof(pos) );
+		}
+		setCount[n] = m_ptCount - setFirst[n];
+		double *box = setBox[n];
+		box[0] = box[2] = m_pts[setFirst[n]][0];
+		box[1] = box[3] = m_pts[setFirst[n]][1];
+		double area = 0;
+		for (i = setFirst[n]; i < m_ptCount; i++)
+		{
+			double const *p = m_pts[i];
+			if (p[0] < box[0]) box[0] = p[0];
+			if (p[1] < box[1]) box[1] = p[1];
+			if (p[0] > box[2]) box[2] = p[0];
+			if (p[1] > box[3]) box[3] = p[1];
+			if (i > setFirst[n]) area += m_pts[i - 1][0] * p[1] - p[0] * m_pts[i - 1][1];
+		}
+		if (!LicutGeom::IsClosed( set, 1e-3 )) continue;
+		// Close exactly so the contour has no gap
+		AddPoint( m_pts[setFirst[n]] );
+		contour_t& c = m_contour[m_contours++];
+		c.set = n;
+		c.first = setFirst[n];
+		c.count = m_ptCount - setFirst[n];
+		memcpy( c.box, box, sizeof(c.box) );
+		c.area = fabs( area ) / 2;
+		BuildBands( m_contours - 1 );
+	}
+
+	m_items = (int *)malloc( (m_contours + 1) * sizeof(int) );
+	m_nodeBox = (double (*)[4])malloc( (m_contours + 1) * sizeof(m_nodeBox[0]) );
+	int *contourOf = (int *)malloc( (m_sets + 1) * sizeof(int) );
+	if (!m_items || !m_nodeBox || !contourOf)
+	{
+		LICUT_ERROR( "%s() failed to allocate for %d contours\n", __FUNCTION__, m_contours );
+		free( setFirst );
+		free( setCount );
+		free( setBox );
+		free( contourOf );
+		Free();
+		return -1;
+	}
+	for (n = 0; n < m_sets; n++) contourOf[n] = -1;
+	for (i = 0; i < m_contours; i++)
+	{
+		m_items[i] = i;
+		contourOf[m_contour[i].set] = i;
+	}
+	BuildTree( 0, m_contours, 0 );
+
+	// Innermost container of each set, tested at its first point
+	for (n = 0; n < m_sets; n++)
+	{
+		if (setCount[n] == 0) continue;
+		double minArea = contourOf[n] >= 0 ? m_contour[contourOf[n]].area : 0;
+		int best = -1;
+		Innermost( 0, m_contours, setBox[n], m_pts[setFirst[n]], minArea, n, best );
+		if (best < 0) continue;
+		m_parent[n] = m_contour[best].set;
+		m_nested++;
+	}
+
+	// Depth by walking up; parents always have greater area so there are no cycles
+	for (n = 0; n < m_sets; n++)
+	{
+		if (contourOf[n] >= 0) contourOf[n] = -1;
+	}
+	for (n = 0; n < m_sets; n++)
+	{
+		if (m_parent[n] < 0) continue;
+		if (contourOf[m_parent[n]] == -1) m_containers++;
+		contourOf[m_parent[n]] = -2;
+	}
+	for (n = 0; n < m_sets; n++)
+	{
+		int depth = 0;
+		for (int p = m_parent[n]; p >= 0; p = m_parent[p]) depth++;
+		if (depth > m_maxDepth) m_maxDepth = depth;
+	}
+	free( setFirst );
+	free( setCount );
+	free( setBox );
+	free( contourOf );
+	m_elapsedMs = (int)((licut_now() - t0) * 1000);
+	return 0;
+}
+
+// Move each contour which contains other sets to just after the last of them.
+// Returns 0 if successful
+int LicutContain::OrderInsideOut( LicutSVG& svg )
+{
+	m_moved = 0;
+	double t0 = licut_now();
+	if (Analyze( svg ) != 0) return -1;
+	int n = m_sets;
+	int *pending = (int *)calloc( n + 1, sizeof(int) );
+	bool *deferred = (bool *)calloc( n + 1, sizeof(bool) );
+	int *order = (int *)malloc( (n + 1) * sizeof(int) );
+	if (!pending || !deferred || !order)
+	{
+		LICUT_ERROR( "%s() failed to allocate for %d draw sets\n", __FUNCTION__, n );
+		free( pending );
+		free( deferred );
+		free( order );
+		return -1;
+	}
+	int u;
+	for (u = 0; u < n; u++)
+	{
+		if (m_parent[u] >= 0) pending[m_parent[u]]++;
+	}
+	int out = 0;
+	for (u = 0; u < n; u++)
+	{
+		if (pending[u] > 0)
+		{
+			deferred[u] = true;
+			continue;
+		}
+		// Emit set, then any deferred containers it was the last remaining child of
+		int v = u;
+		for (;;)
+		{
+			order[out++] = v;
+			int p = m_parent[v];
+			if (p < 0 || --pending[p] > 0 || !deferred[p]) break;
+			v = p;
+		}
+	}
+	for (u = 0; u < n; u++)
+	{
+		if (order[u] != u) m_moved++;
+	}
+	int r = (m_moved > 0) ? svg.ReorderDrawSets( order ) : 0;
+	free( pending );
+	free( deferred );
+	free( order );
+	m_elapsedMs = (int)((licut_now() - t0) * 1000);
+	return r;
+}
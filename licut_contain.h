@@ -0,0 +1,86 @@
+// $Id$
+// Containment analysis of closed contours for inside-out cut ordering
+
+#ifndef _LICUT_CONTAIN_H_
+#define _LICUT_CONTAIN_H_
+
+class LicutSVG;
+
+class LicutContain
+{
+public:
+	LicutContain( int verbose );
+	~LicutContain();
+
+	// Find the innermost closed contour containing each draw set, using a bounding
+	// volume tree over closed contours and point-in-polygon tests on flattened
+	// contours. Returns 0 if successful
+	int Analyze( LicutSVG const& svg );
+
+	// Analyze svg, then move each contour which contains others to just after the
+	// last set inside it, so nested work is cut first. Other sets keep their current
+	// relative order, so this can follow any travel ordering. Returns 0 if successful
+	int OrderInsideOut( LicutSVG& svg );
+
+	// Results of last Analyze()
+	int GetParent( int set ) const { return (set >= 0 && set < m_sets) ? m_parent[set] : -1; }
+	int GetContourCount() const { return m_contours; }
+	int GetContainerCount() const { return m_containers; }
+	int GetNestedCount() const { return m_nested; }
+	int GetMaxDepth() const { return m_maxDepth; }
+	// Sets moved by last OrderInsideOut()
+	int GetMovedCount() const { return m_moved; }
+	int GetElapsedMs() const { return m_elapsedMs; }
+
+protected:
+	// Build tree over m_items[lo..hi) splitting on axis
+	void BuildTree( int lo, int hi, int axis );
+	// Find innermost contour in m_items[lo..hi) with area over minArea containing box and pt, other than set
+	void Innermost( int lo, int hi, double const box[4], double const pt[2], double minArea, int set, int& best ) const;
+	// Returns true if pt is inside flattened contour
+	bool Inside( int contour, double const pt[2] ) const;
+	// Add flattened point to m_pts
+	void AddPoint( double const pt[2] );
+	// Index edges of large contours by horizontal band
+	void BuildBands( int contour );
+
+	// Release working arrays
+	void Free();
+
+protected:
+	// Closed contour
+	typedef struct _contour
+	{
+		int set;
+		int first; // Index of first point in m_pts, last point equals first
+		int count;
+		double box[4]; // xmin, ymin, xmax, ymax
+		double area;
+		int bandFirst; // Index of first band in m_bandStart, or -1 if not banded
+		int bands;
+	} contour_t;
+
+	int m_verbose;
+	int m_sets;
+	int *m_parent; // Innermost closed set containing each set, or -1
+	contour_t *m_contour;
+	int m_contours;
+	int *m_items; // Contour index at each tree position
+	double (*m_nodeBox)[4]; // Bounds of subtree whose median is at this position
+	double (*m_pts)[2];
+	int m_ptCount;
+	int m_ptAlloc;
+	int *m_bandStart; // Per band, first entry in m_bandEdges (one extra per contour)
+	int m_bandStartCount;
+	int m_bandStartAlloc;
+	int *m_bandEdges; // Index into m_pts of first point of each edge
+	int m_bandEdgeCount;
+	int m_bandEdgeAlloc;
+	int m_containers;
+	int m_nested;
+	int m_maxDepth;
+	int m_moved;
+	int m_elapsedMs;
+};
+
+#endif // _LICUT_CONTAIN_H_
@@ -0,0 +1,526 @@
+// $Id$
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "licut_daemon.h"
+#include "licut_io.h"
+#include "licut_svg.h"
+#include "licut_input.h"
+#include "licut_log.h"
+#include "licut_time.h"
+
+// First line of a submission, followed by the job name
+#define JOB_MAGIC	"licut-job 1 "
+
+// Seconds allowed for pressure adjustment after a mat is loaded
+#define PRESSURE_WAIT	15
+
+static volatile sig_atomic_t g_stop = 0;
+
+static void _stop_handler( int sig )
+{
+	(void)sig;
+	g_stop = 1;
+}
+
+// Fill sockaddr for path. Returns 0 if path fits
+static int _socket_address( const char *path, struct sockaddr_un& addr )
+{
+	memset( &addr, 0, sizeof(addr) );
+	addr.sun_family = AF_UNIX;
+	if (strlen( path ) >= sizeof(addr.sun_path))
+	{
+		LICUT_ERROR( "Socket path %s too long\n", path );
+		return -1;
+	}
+	strcpy( addr.sun_path, path );
+	return 0;
+}
+
+LicutDaemon::LicutDaemon( LicutIO& lio, LicutDaemonHandler& handler, int verbose )
+	: m_lio( lio ), m_handler( handler )
+{
+	m_verbose = verbose;
+	m_listen = -1;
+	m_path[0] = '\0';
+	memset( m_mat, 0, sizeof(m_mat) );
+	m_matLoaded = false;
+	m_matEjected = false;
+	m_matPrompted = false;
+	m_waitClient = -1;
+	m_intercommand = 100;
+	m_intercurve = 5;
+	m_collapse = false;
+	m_eject = true;
+	m_transaction = 0;
+	m_transactionDrain = 5;
+	m_retries = 0;
+	m_quick = false;
+	m_clients = NULL;
+	m_clientCount = 0;
+	m_clientAlloc = 0;
+	m_queue = NULL;
+	m_queueCount = 0;
+	m_queueAlloc = 0;
+	m_current = -1;
+	m_currentPackets = 0;
+	m_lastProgress = 0;
+}
+
+LicutDaemon::~LicutDaemon()
+{
+	int n;
+	for (n = 0; n < m_clientCount; n++) close( m_clients[n] );
+	for (n = 0; n < m_queueCount; n++)
+	{
+		Event( m_queue[n].client, "done error daemon stopped\n" );
+		close( m_queue[n].client );
+		close( m_queue[n].file );
+	}
+	free( m_clients );
+	free( m_queue );
+	if (m_listen >= 0)
+	{
+		close( m_listen );
+		unlink( m_path );
+	}
+}
+
+void LicutDaemon::SetMat( unsigned int const mat[4], bool loaded )
+{
+	memcpy( m_mat, mat, sizeof(m_mat) );
+	m_matLoaded = loaded;
+}
+
+// Create socket at path. Returns 0 if successful
+int LicutDaemon::Listen( const char *path )
+{
+	struct sockaddr_un addr;
+	if (_socket_address( path, addr ) != 0) return -1;
+	m_listen = socket( AF_UNIX, SOCK_STREAM, 0 );
+	if (m_listen < 0)
+	{
+		LICUT_ERROR( "%s() socket failed: %s\n", __FUNCTION__, strerror( errno ) );
+		return -1;
+	}
+	// A socket nobody answers on is left over from a daemon that died
+	if (connect( m_listen, (struct sockaddr *)&addr, sizeof(addr) ) == 0)
+	{
+		LICUT_ERROR( "%s() a daemon is already listening on %s\n", __FUNCTION__, path );
+		close( m_listen );
+		m_listen = -1;
+		return -1;
+	}
+	close( m_listen );
+	unlink( path );
+	m_listen = socket( AF_UNIX, SOCK_STREAM, 0 );
+	if (m_listen < 0 || bind( m_listen, (struct sockaddr *)&addr, sizeof(addr) ) != 0 || listen( m_listen, 16 ) != 0)
+	{
+		LICUT_ERROR( "%s() cannot listen on %s: %s\n", __FUNCTION__, path, strerror( errno ) );
+		if (m_listen >= 0) close( m_listen );
+		m_listen = -1;
+		return -1;
+	}
+	fcntl( m_listen, F_SETFL, fcntl( m_listen, F_GETFL ) | O_NONBLOCK );
+	strncpy( m_path, path, sizeof(m_path) - 1 );
+	m_path[sizeof(m_path) - 1] = '\0';
+	LICUT_INFO( "Listening for jobs on %s\n", path );
+	return 0;
+}
+
+// Send progress line to client
+void LicutDaemon::Event( int client, const char *fmt, ... )
+{
+	if (client < 0) return;
+	char line[512];
+	va_list args;
+	va_start( args, fmt );
+	int len = vsnprintf( line, sizeof(line), fmt, args );
+	va_end( args );
+	if (len >= (int)sizeof(line)) len = sizeof(line) - 1;
+	send( client, line, len, MSG_NOSIGNAL | MSG_DONTWAIT );
+}
+
+// Read submission from connection index. Returns 0 if still waiting
+int LicutDaemon::Receive( int index )
+{
+	int client = m_clients[index];
+	char data[512];
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { data, sizeof(data) - 1 };
+	struct msghdr msg;
+	memset( &msg, 0, sizeof(msg) );
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	ssize_t len = recvmsg( client, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC );
+	if (len < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+	int file = -1;
+	for (struct cmsghdr *c = CMSG_FIRSTHDR( &msg ); len > 0 && c; c = CMSG_NXTHDR( &msg, c ))
+	{
+		if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) memcpy( &file, CMSG_DATA( c ), sizeof(int) );
+	}
+	m_clients[index] = m_clients[--m_clientCount];
+	if (len <= 0)
+	{
+		if (file >= 0) close( file );
+		close( client );
+		return -1;
+	}
+	data[len] = '\0';
+	if (file < 0 || strncmp( data, JOB_MAGIC, strlen( JOB_MAGIC ) ))
+	{
+		Event( client, "done error expected %sname with a file descriptor\n", JOB_MAGIC );
+		if (file >= 0) close( file );
+		close( client );
+		return -1;
+	}
+	if (m_queueCount >= m_queueAlloc)
+	{
+		m_queueAlloc = m_queueAlloc ? m_queueAlloc * 2 : 8;
+		m_queue = (job_t *)realloc( m_queue, m_queueAlloc * sizeof(job_t) );
+	}
+	job_t& job = m_queue[m_queueCount++];
+	job.client = client;
+	job.file = file;
+	job.submitted = licut_now();
+	char *name = data + strlen( JOB_MAGIC );
+	name[strcspn( name, "\r\n" )] = '\0';
+	strncpy( job.name, name, sizeof(job.name) - 1 );
+	job.name[sizeof(job.name) - 1] = '\0';
+	LICUT_INFO( "Job %s queued at position %d\n", job.name, m_queueCount );
+	Event( client, "queued %d\n", m_queueCount );
+	return 1;
+}
+
+// Accept connections and read submissions for up to timeoutMs
+void LicutDaemon::Pump( int timeoutMs )
+{
+	struct pollfd *fds = (struct pollfd *)malloc( (m_clientCount + 1) * sizeof(struct pollfd) );
+	if (!fds) return;
+	int count = 0;
+	fds[count].fd = m_listen;
+	fds[count++].events = POLLIN;
+	for (int n = 0; n < m_clientCount; n++)
+	{
+		fds[count].fd = m_clients[n];
+		fds[count++].events = POLLIN;
+	}
+	if (poll( fds, count, timeoutMs ) > 0)
+	{
+		// Connections from the back so removal does not skip any
+		for (int n = count - 1; n >= 1; n--)
+		{
+			if (fds[n].revents) Receive( n - 1 );
+		}
+		if (fds[0].revents & POLLIN)
+		{
+			int client;
+			while ((client = accept( m_listen, NULL, NULL )) >= 0)
+			{
+				if (m_clientCount >= m_clientAlloc)
+				{
+					m_clientAlloc = m_clientAlloc ? m_clientAlloc * 2 : 8;
+					m_clients = (int *)realloc( m_clients, m_clientAlloc * sizeof(int) );
+				}
+				m_clients[m_clientCount++] = client;
+			}
+		}
+	}
+	free( fds );
+}
+
+// Wait until a mat is loaded, after the ejected one is removed. Returns 0 if loaded
+int LicutDaemon::WaitMat( job_t const& job )
+{
+	m_waitClient = job.client;
+	m_matPrompted = false;
+	if (m_lio.WaitMatChange( m_verbose, "mat", m_matEjected, this, 1000 ) != 0 || g_stop) return -1;
+	m_matEjected = false;
+	m_lio.SendCmd_MatBoundaries( &m_mat[0], &m_mat[1], &m_mat[2], &m_mat[3] );
+	if (m_lio.ReadCmdReply( m_verbose ) < 0) return -1;
+	LICUT_INFO( "Mat boundaries: (%u,%u) to (%u,%u)\n", m_mat[0], m_mat[1], m_mat[2], m_mat[3] );
+	if (m_matPrompted && !m_quick)
+	{
+		// Allow operator to set pressure
+		Event( job.client, "pressure %d\n", PRESSURE_WAIT );
+		double until = licut_now() + PRESSURE_WAIT;
+		while (!g_stop && licut_now() < until) Pump( (int)((until - licut_now()) * 1000) + 1 );
+	}
+	m_matLoaded = true;
+	return g_stop ? -1 : 0;
+}
+
+// Tell the waiting client what the operator has to do
+void LicutDaemon::MatPrompt( int phase )
+{
+	if (phase == 0)
+	{
+		LICUT_INFO( "Mat ejected, remove it and press 'Unload mat' key\n" );
+		Event( m_waitClient, "waiting unload\n" );
+		return;
+	}
+	LICUT_INFO( "Mat not loaded, insert and press 'Load mat' key\n" );
+	Event( m_waitClient, "waiting mat\n" );
+	m_matPrompted = true;
+}
+
+// Pick up new submissions while the operator changes mats
+bool LicutDaemon::MatWait( int ms )
+{
+	Pump( ms );
+	return !g_stop;
+}
+
+// Cut one job. Returns 0 if successful
+int LicutDaemon::RunJob( job_t& job )
+{
+	LICUT_INFO( "Job %s starting\n", job.name );
+	if (!m_matLoaded && WaitMat( job ) != 0)
+	{
+		Event( job.client, "done error mat not loaded\n" );
+		return -1;
+	}
+
+	// The design is mapped rather than copied where possible. Parsing modifies it
+	// in place, which a private mapping keeps from the submitter's file
+	struct stat info;
+	if (fstat( job.file, &info ) != 0 || info.st_size < 1)
+	{
+		Event( job.client, "done error empty or unreadable file\n" );
+		return -1;
+	}
+	size_t size = info.st_size;
+	long page = sysconf( _SC_PAGESIZE );
+	char *data = NULL;
+	bool mapped = false;
+	// Compressed designs are decompressed straight into the parse buffer
+	LicutInput input( m_verbose );
+	unsigned char magic[2];
+	bool gzip = (pread( job.file, magic, sizeof(magic), 0 ) == sizeof(magic) && LicutInput::IsGzip( magic, sizeof(magic) ));
+	if (gzip)
+	{
+		if (lseek( job.file, 0, SEEK_SET ) != 0 || input.ReadFd( job.file, job.name ) != 0)
+		{
+			Event( job.client, "done error cannot decompress file\n" );
+			return -1;
+		}
+		data = input.GetData();
+		size = input.GetLength();
+	}
+	else if (size % page != 0)
+	{
+		// The rest of the last page reads as zero, terminating the data
+		data = (char *)mmap( NULL, size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE, job.file, 0 );
+		if (data == MAP_FAILED) data = NULL;
+		else mapped = true;
+	}
+	if (!data)
+	{
+		data = (char *)malloc( size + 1 );
+		if (!data || pread( job.file, data, size, 0 ) != (ssize_t)size)
+		{
+			free( data );
+			Event( job.client, "done error cannot read file\n" );
+			return -1;
+		}
+	}
+	data[size] = '\0';
+	LicutSVG svg( m_verbose );
+	m_handler.JobSetup( svg );
+	int r = svg.ParseBuffer( data, size );
+	if (mapped) munmap( data, size + 1 );
+	else if (!gzip) free( data );
+	if (r != 0 || svg.GetDrawSetCount() == 0 || !svg.GetWidth() || !svg.GetHeight())
+	{
+		Event( job.client, "done error nothing to cut\n" );
+		return -1;
+	}
+	svg.SetScaling( m_mat[0], m_mat[1], m_mat[2] - m_mat[0], m_mat[3] - m_mat[1] );
+	if (m_handler.JobPrepare( svg ) != 0)
+	{
+		Event( job.client, "done error prepare failed\n" );
+		return -1;
+	}
+
+	LicutCmdList cmds( m_verbose );
+	if (cmds.Lower( svg, m_mat[0], m_mat[1], m_mat[2] - m_mat[0], m_mat[3] - m_mat[1], m_intercommand, m_intercurve ) != 0)
+	{
+		Event( job.client, "done error cannot lower\n" );
+		return -1;
+	}
+	if (m_collapse) cmds.Collapse();
+	cmds.Encode();
+	double t0 = licut_now();
+	int startMs = (int)((t0 - job.submitted) * 1000);
+	LICUT_INFO( "Job %s: %d draw sets, %d packets, started %dms after submission\n", job.name, cmds.GetGroupCount(), cmds.GetCount(), startMs );
+	Event( job.client, "start %d %d %d\n", cmds.GetGroupCount(), cmds.GetCount(), startMs );
+	m_current = job.client;
+	m_currentPackets = cmds.GetCount();
+	m_lastProgress = 0;
+	cmds.SetTransaction( m_transaction, m_transactionDrain );
+	cmds.SetRetries( m_retries );
+	r = cmds.Send( m_lio, 0, this );
+	m_current = -1;
+	if (r < 0)
+	{
+		// The device state is unknown, so check the mat before the next job
+		m_matLoaded = false;
+		Event( job.client, "done error cut interrupted\n" );
+		return -1;
+	}
+	if (m_eject)
+	{
+		m_lio.SendCmd_MoveCut( 2, 0, 0 );
+		m_lio.ReadCmdReply( m_verbose );
+		// The ejected mat may still report loaded until the operator removes it
+		m_matLoaded = false;
+		m_matEjected = true;
+	}
+	int ms = (int)((licut_now() - t0) * 1000);
+	LICUT_INFO( "Job %s done in %dms (%d retries, %d resyncs)\n", job.name, ms, cmds.GetRetryCount(), cmds.GetResyncCount() );
+	Event( job.client, "done ok %d %d\n", cmds.GetCount(), ms );
+	return 0;
+}
+
+// Tell client of progress and pick up new submissions between commands
+void LicutDaemon::Acked( int index )
+{
+	Event( m_current, "progress %d %d\n", index + 1, m_currentPackets );
+	Pump( 0 );
+}
+
+// Stop between draw sets on SIGINT or SIGTERM
+bool LicutDaemon::Cancelled()
+{
+	return g_stop != 0;
+}
+
+// Accept and cut jobs until SIGINT or SIGTERM. Returns number of jobs cut
+int LicutDaemon::Run()
+{
+	if (m_listen < 0) return -1;
+	struct sigaction sa;
+	memset( &sa, 0, sizeof(sa) );
+	sa.sa_handler = _stop_handler;
+	// No SA_RESTART, so poll() returns when stopped
+	sigaction( SIGINT, &sa, NULL );
+	sigaction( SIGTERM, &sa, NULL );
+	signal( SIGPIPE, SIG_IGN );
+	int jobs = 0;
+	while (!g_stop)
+	{
+		if (m_queueCount == 0)
+		{
+			Pump( -1 );
+			continue;
+		}
+		job_t job = m_queue[0];
+		memmove( &m_queue[0], &m_queue[1], (m_queueCount - 1) * sizeof(job_t) );
+		m_queueCount--;
+		if (RunJob( job ) == 0) jobs++;
+		close( job.file );
+		close( job.client );
+	}
+	LICUT_INFO( "Daemon stopping after %d jobs\n", jobs );
+	return jobs;
+}
+
+// Submit file to daemon and print progress. Returns 0 if the job was cut
+int LicutDaemon::Submit( const char *socketPath, const char *path )
+{
+	int file;
+	const char *name = strrchr( path, '/' ) ? strrchr( path, '/' ) + 1 : path;
+	if (!strcmp( path, "-" ))
+	{
+		// Standard input may be a pipe, which cannot be mapped, so it goes in a memfd
+		name = "stdin";
+		file = memfd_create( "licut-job", MFD_CLOEXEC );
+		char buffer[65536];
+		ssize_t len;
+		while (file >= 0 && (len = read( 0, buffer, sizeof(buffer) )) > 0)
+		{
+			if (write( file, buffer, len ) != len)
+			{
+				close( file );
+				file = -1;
+			}
+		}
+	}
+	else
+	{
+		file = open( path, O_RDONLY | O_CLOEXEC );
+	}
+	if (file < 0)
+	{
+		LICUT_ERROR( "Cannot open %s: %s\n", path, strerror( errno ) );
+		return -1;
+	}
+	struct sockaddr_un addr;
+	int s = -1;
+	if (_socket_address( socketPath, addr ) == 0) s = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+	if (s < 0 || connect( s, (struct sockaddr *)&addr, sizeof(addr) ) != 0)
+	{
+		LICUT_ERROR( "Cannot connect to daemon at %s: %s\n", socketPath, strerror( errno ) );
+		if (s >= 0) close( s );
+		close( file );
+		return -1;
+	}
+	char data[512];
+	snprintf( data, sizeof(data), "%s%s\n", JOB_MAGIC, name );
+	char control[CMSG_SPACE(sizeof(int))];
+	memset( control, 0, sizeof(control) );
+	struct iovec iov = { data, strlen( data ) };
+	struct msghdr msg;
+	memset( &msg, 0, sizeof(msg) );
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	struct cmsghdr *c = CMSG_FIRSTHDR( &msg );
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN( sizeof(int) );
+	memcpy( CMSG_DATA( c ), &file, sizeof(int) );
+	ssize_t sent = sendmsg( s, &msg, MSG_NOSIGNAL );
+	close( file );
+	if (sent < 0)
+	{
+		LICUT_ERROR( "Cannot submit %s: %s\n", path, strerror( errno ) );
+		close( s );
+		return -1;
+	}
+	// Progress is echoed straight to stdout, after anything already logged
+	LicutLog::Flush();
+	FILE *f = fdopen( s, "r" );
+	char line[512];
+	int r = -1;
+	while (f && fgets( line, sizeof(line), f ))
+	{
+		printf( "%s: %s", name, line );
+		fflush( stdout );
+		if (!strncmp( line, "done ", 5 ))
+		{
+			r = strncmp( line, "done ok", 7 ) ? -1 : 0;
+			break;
+		}
+	}
+	if (f) fclose( f );
+	else close( s );
+	return r;
+}
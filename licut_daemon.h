@@ -0,0 +1,114 @@
+// $Id$
+// Daemon holding the device open and cutting jobs submitted over a Unix socket
+
+#ifndef _LICUT_DAEMON_H_
+#define _LICUT_DAEMON_H_
+
+#include "licut_cmdlist.h"
+#include "licut_io.h"
+
+class LicutSVG;
+
+// Job processing supplied by the daemon's owner
+class LicutDaemonHandler
+{
+public:
+	virtual ~LicutDaemonHandler() {}
+	// Called before a job is parsed, e.g. to add selections
+	virtual void JobSetup( LicutSVG& svg ) = 0;
+	// Called after parsing with scaling set to the mat. Returns 0 to cut the job
+	virtual int JobPrepare( LicutSVG& svg ) = 0;
+};
+
+class LicutDaemon : public LicutSendListener, public LicutMatListener
+{
+public:
+	LicutDaemon( LicutIO& lio, LicutDaemonHandler& handler, int verbose );
+	~LicutDaemon();
+
+	// Device state already queried by the caller: mat bounds xmin, ymin, xmax, ymax
+	// and whether the mat is loaded. Kept across jobs until a mat is ejected
+	void SetMat( unsigned int const mat[4], bool loaded );
+	void SetDelays( int intercommand, int intercurve ) { m_intercommand = intercommand; m_intercurve = intercurve; }
+	// Remove commands with no effect at device resolution, eject after each job,
+	// skip wait for pressure adjustment after a mat is loaded
+	void SetOptions( bool collapse, bool eject, bool quick ) { m_collapse = collapse; m_eject = eject; m_quick = quick; }
+	// See LicutCmdList::SetTransaction()
+	void SetTransaction( int batch, int replyDrainMs ) { m_transaction = batch; m_transactionDrain = replyDrainMs; }
+	// See LicutCmdList::SetRetries()
+	void SetRetries( int retries ) { m_retries = retries; }
+
+	// Create socket at path, replacing a stale one. Returns 0 if successful
+	int Listen( const char *path );
+
+	// Accept and cut jobs in order of submission until SIGINT or SIGTERM.
+	// Returns number of jobs cut
+	int Run();
+
+	// Submit file (- for stdin) to daemon at socketPath as a file descriptor, and
+	// print progress until the job is done. Returns 0 if the job was cut
+	static int Submit( const char *socketPath, const char *path );
+
+	// LicutSendListener
+	void Acked( int index );
+	bool Cancelled();
+
+	// LicutMatListener
+	void MatPrompt( int phase );
+	bool MatWait( int ms );
+
+protected:
+	typedef struct _job
+	{
+		int client; // Connection for progress events
+		int file; // Design received from client
+		char name[256];
+		double submitted;
+	} job_t;
+
+	// Accept connections and read submissions for up to timeoutMs (0 to poll)
+	void Pump( int timeoutMs );
+	// Read submission from connection index of m_clients. Returns 0 if still waiting
+	int Receive( int index );
+	// Wait until a mat is loaded, pumping submissions meanwhile. Returns 0 if loaded
+	int WaitMat( job_t const& job );
+	// Cut one job. Returns 0 if successful
+	int RunJob( job_t& job );
+	// Send progress line to client, ignoring clients that went away
+	static void Event( int client, const char *fmt, ... );
+
+protected:
+	LicutIO& m_lio;
+	LicutDaemonHandler& m_handler;
+	int m_verbose;
+	int m_listen;
+	char m_path[256];
+	unsigned int m_mat[4];
+	bool m_matLoaded;
+	bool m_matEjected; // Wait for removal before the next mat
+	bool m_matPrompted; // Operator had to load the mat
+	int m_waitClient; // Client of the job waiting for a mat
+	int m_intercommand;
+	int m_intercurve;
+	bool m_collapse;
+	bool m_eject;
+	bool m_quick;
+	int m_transaction;
+	int m_transactionDrain;
+	int m_retries;
+
+	// Connections that have not submitted yet
+	int *m_clients;
+	int m_clientCount;
+	int m_clientAlloc;
+	job_t *m_queue;
+	int m_queueCount;
+	int m_queueAlloc;
+
+	// Job being cut
+	int m_current;
+	int m_currentPackets;
+	int m_lastProgress;
+};
+
+#endif // _LICUT_DAEMON_H_
@@ -0,0 +1,485 @@
+// $Id$
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "licut_dedupe.h"
+#include "licut_geom.h"
+#include "licut_log.h"
+
+// Minimum number of hash buckets
+#define MIN_BUCKETS	1024
+
+LicutDedupe::LicutDedupe( int verbose )
+{
+	m_verbose = verbose;
+	m_tolerance = 0;
+	m_cellSize = 1;
+	m_segs = NULL;
+	m_segCount = 0;
+	m_stamp = NULL;
+	m_queryId = 0;
+	m_found = NULL;
+	m_foundCount = 0;
+	m_buckets = NULL;
+	m_bucketMask = 0;
+	m_entries = NULL;
+	m_entryCount = 0;
+	m_entryAlloc = 0;
+	m_spans = NULL;
+	m_spanAlloc = 0;
+	m_out = NULL;
+	m_outCount = 0;
+	m_outAlloc = 0;
+	m_penPos[0] = m_penPos[1] = 0;
+	m_cutLength = 0;
+	m_removedLength = 0;
+	m_segmentsRemoved = 0;
+	m_setsChanged = 0;
+}
+
+LicutDedupe::~LicutDedupe()
+{
+	Free();
+}
+
+// Release working arrays
+void LicutDedupe::Free()
+{
+	free( m_segs );
+	free( m_stamp );
+	free( m_found );
+	free( m_buckets );
+	free( m_entries );
+	free( m_spans );
+	free( m_out );
+	m_segs = NULL;
+	m_stamp = NULL;
+	m_found = NULL;
+	m_buckets = NULL;
+	m_entries = NULL;
+	m_spans = NULL;
+	m_out = NULL;
+	m_segCount = 0;
+	m_entryCount = 0;
+	m_entryAlloc = 0;
+	m_spanAlloc = 0;
+	m_outCount = 0;
+	m_outAlloc = 0;
+}
+
+// Hash bucket of grid cell ix,iy
+unsigned int LicutDedupe::Bucket( long long ix, long long iy ) const
+{
+	unsigned int h = (unsigned int)(ix * 73856093LL) ^ (unsigned int)(iy * 19349663LL);
+	h ^= h >> 15;
+	h *= 0x2c1b3c6dU;
+	h ^= h >> 12;
+	return h & m_bucketMask;
+}
+
+// Add seg to, or if seg < 0 collect candidates from, each bucket whose cell is
+// touched by segment a-b expanded by tolerance. The segment is split into pieces
+// no longer than a cell so diagonals only visit cells along their length
+void LicutDedupe::Visit( double const a[2], double const b[2], int seg )
+{
+	double length = LicutGeom::Distance( a, b );
+	int pieces = (int)ceil( length / m_cellSize );
+	if (pieces < 1) pieces = 1;
+	for (int i = 0; i < pieces; i++)
+	{
+		double t0 = (double)i / pieces;
+		double t1 = (double)(i + 1) / pieces;
+		double lo[2], hi[2];
+		for (int k = 0; k < 2; k++)
+		{
+			double p = a[k] + (b[k] - a[k]) * t0;
+			double q = a[k] + (b[k] - a[k]) * t1;
+			lo[k] = (p < q ? p : q) - m_tolerance;
+			hi[k] = (p < q ? q : p) + m_tolerance;
+		}
+		long long ix0 = (long long)floor( lo[0] / m_cellSize );
+		long long ix1 = (long long)floor( hi[0] / m_cellSize );
+		long long iy0 = (long long)floor( lo[1] / m_cellSize );
+		long long iy1 = (long long)floor( hi[1] / m_cellSize );
+		for (long long ix = ix0; ix <= ix1; ix++)
+		{
+			for (long long iy = iy0; iy <= iy1; iy++)
+			{
+				unsigned int bucket = Bucket( ix, iy );
+				if (seg >= 0)
+				{
+					// Consecutive cells of one segment often share a bucket
+					if (m_buckets[bucket] >= 0 && m_entries[m_buckets[bucket]].seg == seg) continue;
+					if (m_entryCount >= m_entryAlloc)
+					{
+						m_entryAlloc = m_entryAlloc ? m_entryAlloc * 2 : 4096;
+						m_entries = (entry_t *)realloc( m_entries, m_entryAlloc * sizeof(entry_t) );
+					}
+					m_entries[m_entryCount].seg = seg;
+					m_entries[m_entryCount].next = m_buckets[bucket];
+					m_buckets[bucket] = m_entryCount++;
+				}
+				else
+				{
+					for (int e = m_buckets[bucket]; e >= 0; e = m_entries[e].next)
+					{
+						int s = m_entries[e].seg;
+						if (m_stamp[s] == m_queryId) continue;
+						m_stamp[s] = m_queryId;
+						m_found[m_foundCount++] = s;
+					}
+				}
+			}
+		}
+	}
+}
+
+// Start collecting candidates
+void LicutDedupe::BeginQuery()
+{
+	m_queryId++;
+	m_foundCount = 0;
+}
+
+// Record segment as cut
+void LicutDedupe::AddSegment( char type, double const a[2], drawSet_t const& cmd )
+{
+	segment_t& s = m_segs[m_segCount];
+	s.type = type;
+	memcpy( s.a, a, sizeof(s.a) );
+	if (type == 'C')
+	{
+		memcpy( s.c[0], cmd.pt[0], sizeof(s.c[0]) );
+		memcpy( s.c[1], cmd.pt[1], sizeof(s.c[1]) );
+		memcpy( s.b, cmd.pt[2], sizeof(s.b) );
+		// Curves are only matched end to end so are found from their start point
+		Visit( a, a, m_segCount );
+	}
+	else
+	{
+		memcpy( s.b, cmd.pt[0], sizeof(s.b) );
+		Visit( a, s.b, m_segCount );
+	}
+	m_segCount++;
+}
+
+// Append command to m_out
+void LicutDedupe::Append( drawSet_t const& cmd )
+{
+	if (m_outCount >= m_outAlloc)
+	{
+		m_outAlloc = m_outAlloc ? m_outAlloc * 2 : 256;
+		m_out = (drawSet_t *)realloc( m_out, m_outAlloc * sizeof(drawSet_t) );
+	}
+	m_out[m_outCount++] = cmd;
+	memcpy( m_penPos, LicutGeom::EndPoint( &cmd ), sizeof(m_penPos) );
+}
+
+// Append move to p, merging with a preceding move
+void LicutDedupe::EmitMove( double const p[2] )
+{
+	if (m_outCount > 0 && m_out[m_outCount - 1].type == 'M')
+	{
+		memcpy( m_out[m_outCount - 1].pt[0], p, sizeof(m_out[0].pt[0]) );
+		memcpy( m_penPos, p, sizeof(m_penPos) );
+		return;
+	}
+	drawSet_t move;
+	memset( &move, 0, sizeof(move) );
+	move.type = 'M';
+	move.numPoints = 1;
+	memcpy( move.pt[0], p, sizeof(move.pt[0]) );
+	Append( move );
+}
+
+// Append command, preceded by a move to start if not already there
+void LicutDedupe::EmitCut( double const start[2], drawSet_t const& cmd )
+{
+	if (m_outCount == 0 || m_penPos[0] != start[0] || m_penPos[1] != start[1]) EmitMove( start );
+	Append( cmd );
+}
+
+// Emit parts of line a-b not covered by collinear lines already cut, then record it
+void LicutDedupe::CutLine( double const a[2], double const b[2] )
+{
+	drawSet_t line;
+	memset( &line, 0, sizeof(line) );
+	line.type = 'L';
+	line.numPoints = 1;
+	memcpy( line.pt[0], b, sizeof(line.pt[0]) );
+	double length = LicutGeom::Distance( a, b );
+	if (length <= m_tolerance)
+	{
+		// Too short to have a direction
+		EmitCut( a, line );
+		return;
+	}
+
+	// Parameter range of a-b within tolerance of each candidate line
+	double u[2] = { (b[0] - a[0]) / length, (b[1] - a[1]) / length };
+	int spanCount = 0;
+	BeginQuery();
+	Visit( a, b, -1 );
+	int i;
+	for (i = 0; i < m_foundCount; i++)
+	{
+		segment_t const& s = m_segs[m_found[i]];
+		if (s.type != 'L') continue;
+		double ca[2] = { s.a[0] - a[0], s.a[1] - a[1] };
+		double cb[2] = { s.b[0] - a[0], s.b[1] - a[1] };
+		if (fabs( u[0] * ca[1] - u[1] * ca[0] ) > m_tolerance) continue;
+		if (fabs( u[0] * cb[1] - u[1] * cb[0] ) > m_tolerance) continue;
+		double t0 = (u[0] * ca[0] + u[1] * ca[1]) / length;
+		double t1 = (u[0] * cb[0] + u[1] * cb[1]) / length;
+		double lo = t0 < t1 ? t0 : t1;
+		double hi = t0 < t1 ? t1 : t0;
+		if (lo < 0) lo = 0;
+		if (hi > 1) hi = 1;
+		if (hi <= lo) continue;
+		if (spanCount >= m_spanAlloc)
+		{
+			m_spanAlloc = m_spanAlloc ? m_spanAlloc * 2 : 16;
+			m_spans = (double (*)[2])realloc( m_spans, m_spanAlloc * sizeof(m_spans[0]) );
+		}
+		m_spans[spanCount][0] = lo;
+		m_spans[spanCount][1] = hi;
+		spanCount++;
+	}
+
+	// Sort and merge spans, closing gaps and dropping overlaps shorter than tolerance
+	double gap = m_tolerance / length;
+	for (i = 1; i < spanCount; i++)
+	{
+		double lo = m_spans[i][0], hi = m_spans[i][1];
+		int j = i - 1;
+		for (; j >= 0 && m_spans[j][0] > lo; j--)
+		{
+			m_spans[j + 1][0] = m_spans[j][0];
+			m_spans[j + 1][1] = m_spans[j][1];
+		}
+		m_spans[j + 1][0] = lo;
+		m_spans[j + 1][1] = hi;
+	}
+	int merged = 0;
+	for (i = 0; i < spanCount; i++)
+	{
+		if (merged > 0 && m_spans[i][0] <= m_spans[merged - 1][1] + gap)
+		{
+			if (m_spans[i][1] > m_spans[merged - 1][1]) m_spans[merged - 1][1] = m_spans[i][1];
+			continue;
+		}
+		m_spans[merged][0] = m_spans[i][0];
+		m_spans[merged][1] = m_spans[i][1];
+		merged++;
+	}
+	spanCount = 0;
+	for (i = 0; i < merged; i++)
+	{
+		double lo = m_spans[i][0] <= gap ? 0 : m_spans[i][0];
+		double hi = m_spans[i][1] >= 1 - gap ? 1 : m_spans[i][1];
+		if (hi - lo < gap) continue;
+		m_spans[spanCount][0] = lo;
+		m_spans[spanCount][1] = hi;
+		spanCount++;
+	}
+
+	if (spanCount == 0)
+	{
+		EmitCut( a, line );
+	}
+	else
+	{
+		double t = 0;
+		double covered = 0;
+		for (i = 0; i <= spanCount; i++)
+		{
+			double end = i < spanCount ? m_spans[i][0] : 1;
+			if (end > t)
+			{
+				double p[2] = { a[0] + (b[0] - a[0]) * t, a[1] + (b[1] - a[1]) * t };
+				if (t == 0) memcpy( p, a, sizeof(p) );
+				drawSet_t piece = line;
+				if (end < 1)
+				{
+					piece.pt[0][0] = a[0] + (b[0] - a[0]) * end;
+					piece.pt[0][1] = a[1] + (b[1] - a[1]) * end;
+				}
+				EmitCut( p, piece );
+			}
+			if (i < spanCount)
+			{
+				covered += m_spans[i][1] - m_spans[i][0];
+				t = m_spans[i][1];
+			}
+		}
+		m_removedLength += covered * length;
+		m_segmentsRemoved++;
+	}
+	AddSegment( 'L', a, line );
+}
+
+// Returns true if curve from a is a duplicate of a curve already cut
+bool LicutDedupe::IsDuplicateCurve( double const a[2], drawSet_t const& cmd )
+{
+	double const *b = cmd.pt[2];
+	BeginQuery();
+	Visit( a, a, -1 );
+	Visit( b, b, -1 );
+	for (int i = 0; i < m_foundCount; i++)
+	{
+		segment_t const& s = m_segs[m_found[i]];
+		if (s.type != 'C') continue;
+		if (LicutGeom::Distance( a, s.a ) <= m_tolerance && LicutGeom::Distance( b, s.b ) <= m_tolerance &&
+			LicutGeom::Distance( cmd.pt[0], s.c[0] ) <= m_tolerance && LicutGeom::Distance( cmd.pt[1], s.c[1] ) <= m_tolerance)
+		{
+			return true;
+		}
+		if (LicutGeom::Distance( a, s.b ) <= m_tolerance && LicutGeom::Distance( b, s.a ) <= m_tolerance &&
+			LicutGeom::Distance( cmd.pt[0], s.c[1] ) <= m_tolerance && LicutGeom::Distance( cmd.pt[1], s.c[0] ) <= m_tolerance)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// Restart closed contour after its first gap if it still ends where it began,
+// so that the piece before the gap follows on from the piece after it
+void LicutDedupe::Rejoin()
+{
+	if (m_outCount < 3 || m_out[0].type != 'M') return;
+	if (LicutGeom::Distance( m_penPos, m_out[0].pt[0] ) > m_tolerance) return;
+	int k;
+	for (k = 1; k < m_outCount && m_out[k].type != 'M'; k++)
+		;
+	if (k >= m_outCount) return;
+	drawSet_t *t = (drawSet_t *)malloc( m_outCount * sizeof(drawSet_t) );
+	if (!t) return;
+	int out = 0;
+	for (int n = k; n < m_outCount; n++) t[out++] = m_out[n];
+	for (int n = 1; n < k; n++) t[out++] = m_out[n];
+	memcpy( m_out, t, out * sizeof(drawSet_t) );
+	m_outCount = out;
+	free( t );
+}
+
+// Remove duplicated edges from all draw sets of svg. Returns 0 if successful
+int LicutDedupe::Run( LicutSVG& svg, double tolerance, double quantum )
+{
+	Free();
+	m_tolerance = tolerance;
+	m_cutLength = 0;
+	m_removedLength = 0;
+	m_segmentsRemoved = 0;
+	m_setsChanged = 0;
+	if (tolerance <= 0) return -1;
+
+	// Size the hash from the number and average length of lines
+	int n, i;
+	int total = 0;
+	int lines = 0;
+	double lineLength = 0;
+	for (n = 0; n < svg.GetDrawSetCount(); n++)
+	{
+		drawSet_t const *set = svg.GetDrawSet( n );
+		if (!LicutGeom::IsReversible( set )) continue;
+		for (i = 1; set[i].type != 0; i++)
+		{
+			if (set[i].type == 'M') continue;
+			total++;
+			if (set[i].type == 'L')
+			{
+				lineLength += LicutGeom::Distance( LicutGeom::EndPoint( &set[i - 1] ), set[i].pt[0] );
+				lines++;
+			}
+		}
+	}
+	m_cellSize = lines > 0 ? lineLength / lines : 0;
+	if (m_cellSize < 4 * tolerance) m_cellSize = 4 * tolerance;
+	if (quantum > 0) m_cellSize = ceil( m_cellSize / quantum ) * quantum;
+	unsigned int buckets = MIN_BUCKETS;
+	while (buckets < (unsigned int)total * 4 && buckets < 0x40000000U) buckets *= 2;
+	m_bucketMask = buckets - 1;
+	m_segs = (segment_t *)malloc( (total + 1) * sizeof(segment_t) );
+	m_stamp = (int *)malloc( (total + 1) * sizeof(int) );
+	m_found = (int *)malloc( (total + 1) * sizeof(int) );
+	m_buckets = (int *)malloc( buckets * sizeof(int) );
+	if (!m_segs || !m_stamp || !m_found || !m_buckets)
+	{
+		LICUT_ERROR( "%s() failed to allocate for %d segments\n", __FUNCTION__, total );
+		Free();
+		return -1;
+	}
+	memset( m_stamp, 0xff, (total + 1) * sizeof(int) );
+	memset( m_buckets, 0xff, buckets * sizeof(int) );
+	m_queryId = 0;
+
+	for (n = 0; n < svg.GetDrawSetCount(); n++)
+	{
+		drawSet_t const *set = svg.GetDrawSet( n );
+		if (!LicutGeom::IsReversible( set ))
+		{
+			m_cutLength += LicutGeom::CutLength( set );
+			continue;
+		}
+		double removedBefore = m_removedLength;
+		m_outCount = 0;
+		double pos[2] = { 0, 0 };
+		for (i = 0; set[i].type != 0; i++)
+		{
+			if (set[i].type == 'M')
+			{
+				EmitMove( set[i].pt[0] );
+			}
+			else if (set[i].type == 'L')
+			{
+				m_cutLength += LicutGeom::Distance( pos, set[i].pt[0] );
+				CutLine( pos, set[i].pt[0] );
+			}
+			else
+			{
+				drawSet_t curve[3];
+				memset( curve, 0, sizeof(curve) );
+				curve[0].type = 'M';
+				curve[0].numPoints = 1;
+				memcpy( curve[0].pt[0], pos, sizeof(pos) );
+				curve[1] = set[i];
+				double length = LicutGeom::CutLength( curve );
+				m_cutLength += length;
+				if (IsDuplicateCurve( pos, set[i] ))
+				{
+					m_removedLength += length;
+					m_segmentsRemoved++;
+				}
+				else
+				{
+					EmitCut( pos, set[i] );
+					AddSegment( 'C', pos, set[i] );
+				}
+			}
+			memcpy( pos, LicutGeom::EndPoint( &set[i] ), sizeof(pos) );
+		}
+		if (m_removedLength == removedBefore) continue;
+
+		// Trailing moves go nowhere useful
+		while (m_outCount > 0 && m_out[m_outCount - 1].type == 'M') m_outCount--;
+		if (m_outCount > 0 && LicutGeom::IsClosed( set, 1e-3 )) Rejoin();
+		drawSet_t *newSet = (drawSet_t *)malloc( (m_outCount + 1) * sizeof(drawSet_t) );
+		if (!newSet)
+		{
+			LICUT_ERROR( "%s() failed to allocate draw set %d\n", __FUNCTION__, n );
+			Free();
+			return -1;
+		}
+		memcpy( newSet, m_out, m_outCount * sizeof(drawSet_t) );
+		memset( &newSet[m_outCount], 0, sizeof(drawSet_t) );
+		svg.ReplaceDrawSet( n, newSet );
+		m_setsChanged++;
+		if (m_verbose) LICUT_DEBUG( "Draw set %d: %d commands after removing shared edges\n", n, m_outCount );
+	}
+	Free();
+	return 0;
+}
@@ -0,0 +1,102 @@
+// $Id$
+// Removal of edges shared by adjacent shapes so they are cut only once
+
+#ifndef _LICUT_DEDUPE_H_
+#define _LICUT_DEDUPE_H_
+
+#include "licut_svg.h"
+
+class LicutDedupe
+{
+public:
+	LicutDedupe( int verbose );
+	~LicutDedupe();
+
+	// Find lines which coincide with or overlap lines already cut, and curves which
+	// coincide with curves already cut (in either direction), within tolerance across
+	// all draw sets of svg. Duplicated parts are replaced by moves, and closed contours
+	// which lose an edge are restarted after the gap so they remain one piece where
+	// possible. Candidates are found using a spatial hash with cells which are a
+	// multiple of quantum (size of one device unit). Both arguments are in svg units.
+	// Returns 0 if successful
+	int Run( LicutSVG& svg, double tolerance, double quantum );
+
+	// Results of last Run() in svg units
+	double GetCutLength() const { return m_cutLength; }
+	double GetRemovedLength() const { return m_removedLength; }
+	int GetSegmentsRemoved() const { return m_segmentsRemoved; }
+	int GetSetsChanged() const { return m_setsChanged; }
+
+protected:
+	// Line or curve already cut
+	typedef struct _segment
+	{
+		char type; // 'L' or 'C'
+		double a[2]; // Start
+		double c[2][2]; // Curve control points
+		double b[2]; // End
+	} segment_t;
+
+	// Spatial hash entry
+	typedef struct _entry
+	{
+		int seg;
+		int next;
+	} entry_t;
+
+	// Hash bucket of grid cell ix,iy
+	unsigned int Bucket( long long ix, long long iy ) const;
+	// Add seg to, or if seg < 0 collect candidates from, buckets touched by segment a-b
+	void Visit( double const a[2], double const b[2], int seg );
+	// Start collecting candidates into m_found
+	void BeginQuery();
+	// Record line or curve from a as cut
+	void AddSegment( char type, double const a[2], drawSet_t const& cmd );
+
+	// Parts of line a-b not covered by lines already cut, emitted to m_out
+	void CutLine( double const a[2], double const b[2] );
+
+	// Returns true if curve from a is a duplicate of a curve already cut
+	bool IsDuplicateCurve( double const a[2], drawSet_t const& cmd );
+
+	// Append command to m_out
+	void Append( drawSet_t const& cmd );
+	// Append move to p, merging with a preceding move
+	void EmitMove( double const p[2] );
+	// Append command, preceded by a move to start if not already there
+	void EmitCut( double const start[2], drawSet_t const& cmd );
+
+	// Restart closed contour set after its first gap if it still ends where it began
+	void Rejoin();
+
+	// Release working arrays
+	void Free();
+
+protected:
+	int m_verbose;
+	double m_tolerance;
+	double m_cellSize;
+	segment_t *m_segs;
+	int m_segCount;
+	int *m_stamp; // Last query which visited segment
+	int m_queryId;
+	int *m_found; // Candidates of current query
+	int m_foundCount;
+	int *m_buckets;
+	unsigned int m_bucketMask;
+	entry_t *m_entries;
+	int m_entryCount;
+	int m_entryAlloc;
+	double (*m_spans)[2]; // Covered parameter ranges of current line
+	int m_spanAlloc;
+	drawSet_t *m_out;
+	int m_outCount;
+	int m_outAlloc;
+	double m_penPos[2]; // End of last command emitted
+	double m_cutLength;
+	double m_removedLength;
+	int m_segmentsRemoved;
+	int m_setsChanged;
+};
+
+#endif // _LICUT_DEDUPE_H_
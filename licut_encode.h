@@ -0,0 +1,124 @@
+// $Id$
+// Command encoders specialized at compile time. Each command is a type with its
+// packet length, reply and (for 0x40) XXTEA key fixed, and encodes straight into
+// a buffer supplied by the caller. Send with LicutIO::SendEncoded()
+
+#ifndef _LICUT_ENCODE_H_
+#define _LICUT_ENCODE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+// Key for each 0x40 subcommand. There is no key above 7, so LicutCmd_MoveCut<8>
+// does not compile
+template <unsigned int SubCmd> struct LicutMoveCutKey;
+
+#define LICUT_MOVECUT_KEY( subCmd, k0, k1, k2, k3 ) \
+	template <> struct LicutMoveCutKey<subCmd> \
+	{ \
+		static const uint32_t K0 = k0, K1 = k1, K2 = k2, K3 = k3; \
+	}
+
+LICUT_MOVECUT_KEY( 0, 0x272D6C37, 0x342A6173, 0x3663255B, 0x2B265A4D );
+LICUT_MOVECUT_KEY( 1, 0x7D316E22, 0x4A4A7133, 0x5A3C5C5F, 0x78613A61 );
+LICUT_MOVECUT_KEY( 2, 0x47302A23, 0x5D31482F, 0x3B257A61, 0x3671382F );
+LICUT_MOVECUT_KEY( 3, 0x303F6863, 0x71646D30, 0x4769457B, 0x6D342569 );
+LICUT_MOVECUT_KEY( 4, 0x45356650, 0x3A386D69, 0x575A7037, 0x335F357D );
+LICUT_MOVECUT_KEY( 5, 0x343A2148, 0x614F3925, 0x753F6953, 0x47463626 );
+LICUT_MOVECUT_KEY( 6, 0x3F62626D, 0x7E555F44, 0x7E29425A, 0x52246268 );
+LICUT_MOVECUT_KEY( 7, 0x47302A23, 0x342A6173, 0x4769457B, 0x335F357D );
+
+#undef LICUT_MOVECUT_KEY
+
+// Commands with no data: length byte, command and 3 zero bytes. Reply is 1 if
+// the device sends a length-prefixed reply
+template <unsigned char Cmd, int Reply>
+struct LicutQueryCmd
+{
+	enum { CMD = Cmd, LENGTH = 5, REPLY = Reply };
+
+	// Returns packet length
+	static int Encode( unsigned char *packet )
+	{
+		packet[0] = LENGTH - 1;
+		packet[1] = Cmd;
+		packet[2] = 0;
+		packet[3] = 0;
+		packet[4] = 0;
+		return LENGTH;
+	}
+};
+
+typedef LicutQueryCmd<0x11, 1> LicutCmd_MatBoundaries;
+typedef LicutQueryCmd<0x12, 1> LicutCmd_FirmwareVersion;
+typedef LicutQueryCmd<0x14, 1> LicutCmd_StatusRequest;
+typedef LicutQueryCmd<0x18, 1> LicutCmd_CartridgeName;
+typedef LicutQueryCmd<0x21, 0> LicutCmd_StartTransaction;
+typedef LicutQueryCmd<0x22, 0> LicutCmd_EndTransaction;
+
+// XXTEA encryption of N words, as LicutIO::btea( v, N, k ) with the round count
+// known to the compiler
+template <int N>
+inline void licut_btea_encode( uint32_t v[N], uint32_t const k[4] )
+{
+	uint32_t y, z = v[N - 1], sum = 0;
+	unsigned int p, e;
+	for (int rounds = 6 + 52 / N; rounds > 0; rounds--)
+	{
+		sum += 0x9e3779b9;
+		e = (sum >> 2) & 3;
+		for (p = 0; p < N - 1; p++)
+		{
+			y = v[p + 1];
+			z = v[p] += (((z >> 5 ^ y << 2) + (y >> 3 ^ z << 4)) ^ ((sum ^ y) + (k[(p & 3) ^ e] ^ z)));
+		}
+		y = v[0];
+		z = v[N - 1] += (((z >> 5 ^ y << 2) + (y >> 3 ^ z << 4)) ^ ((sum ^ y) + (k[(p & 3) ^ e] ^ z)));
+	}
+}
+
+// Framing of every 0x40 packet, whatever its subcommand. The subcommand is only
+// in the key, so an encoded packet is sent as this type
+struct LicutCmd_MoveCutPacket
+{
+	enum { CMD = 0x40, LENGTH = 14, REPLY = 1 };
+};
+
+// 0x40 move (subcommand 2), line (0) or one of 4 curve packets (1): noise, x and y
+// as little-endian int32, encrypted with the subcommand's key
+template <unsigned int SubCmd>
+struct LicutCmd_MoveCut : public LicutCmd_MoveCutPacket
+{
+	enum { SUBCMD = SubCmd };
+
+	// Encode with noise n from LicutIO::noise(). Returns packet length
+	static int Encode( unsigned int n, unsigned int x, unsigned int y, unsigned char *packet )
+	{
+		typedef LicutMoveCutKey<SubCmd> Key;
+		uint32_t const k[4] = { Key::K0, Key::K1, Key::K2, Key::K3 };
+		// Words are loaded from little-endian bytes and stored back in host order,
+		// as LicutIO always has
+		unsigned char data[12];
+		uint32_t v[3];
+		PutLE( n, &data[0] );
+		PutLE( x, &data[4] );
+		PutLE( y, &data[8] );
+		memcpy( v, data, sizeof(v) );
+		licut_btea_encode<3>( v, k );
+		packet[0] = LENGTH - 1;
+		packet[1] = CMD;
+		memcpy( &packet[2], v, sizeof(v) );
+		return LENGTH;
+	}
+
+protected:
+	static void PutLE( unsigned int u, unsigned char *leu )
+	{
+		leu[0] = u & 0xff;
+		leu[1] = (u >> 8) & 0xff;
+		leu[2] = (u >> 16) & 0xff;
+		leu[3] = (u >> 24) & 0xff;
+	}
+};
+
+#endif // _LICUT_ENCODE_H_
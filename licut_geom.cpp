@@ -0,0 +1,217 @@
+// $Id$
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "licut_geom.h"
+
+// Segments used to approximate curve length
+#define CURVE_LENGTH_STEPS	16
+
+// Get number of commands in draw set, not including terminator
+int LicutGeom::Count( drawSet_t const *set )
+{
+	int n = 0;
+	if (set) while (set[n].type != 0) n++;
+	return n;
+}
+
+// Get start and end point of draw set. Returns false if set is empty
+bool LicutGeom::Ends( drawSet_t const *set, double start[2], double end[2] )
+{
+	int count = Count( set );
+	if (count == 0) return false;
+	start[0] = set[0].pt[0][0];
+	start[1] = set[0].pt[0][1];
+	double const *last = EndPoint( &set[count - 1] );
+	end[0] = last[0];
+	end[1] = last[1];
+	return true;
+}
+
+// Returns true if set can be cut in either direction
+bool LicutGeom::IsReversible( drawSet_t const *set )
+{
+	if (!set || set[0].type != 'M') return false;
+	for (int n = 0; set[n].type != 0; n++)
+	{
+		if (set[n].type != 'M' && set[n].type != 'L' && set[n].type != 'C') return false;
+	}
+	return true;
+}
+
+// Returns true if set is a single subpath ending where it starts (within tolerance)
+bool LicutGeom::IsClosed( drawSet_t const *set, double tolerance /*= 1e-6*/ )
+{
+	if (!IsReversible( set )) return false;
+	int count = Count( set );
+	if (count < 3) return false;
+	for (int n = 1; n < count; n++)
+	{
+		if (set[n].type == 'M') return false;
+	}
+	return Distance( set[0].pt[0], EndPoint( &set[count - 1] ) ) <= tolerance;
+}
+
+// Reverse cut direction of draw set in place. Returns false if not reversible
+// Each command i runs from the end of i-1 to its own end point. Reversed, the set
+// starts with M to the last end point and each command runs back to the end of i-1.
+// An M within the set becomes an M to the end of the preceding subpath.
+bool LicutGeom::Reverse( drawSet_t *set )
+{
+	if (!IsReversible( set )) return false;
+	int count = Count( set );
+	drawSet_t *t = (drawSet_t *)malloc( count * sizeof(drawSet_t) );
+	if (!t) return false;
+	int out = 0;
+	t[out].type = 'M';
+	t[out].numPoints = 1;
+	memcpy( t[out].pt[0], EndPoint( &set[count - 1] ), sizeof(t[out].pt[0]) );
+	out++;
+	for (int n = count - 1; n >= 1; n--)
+	{
+		double const *prev = EndPoint( &set[n - 1] );
+		t[out].type = set[n].type;
+		t[out].numPoints = set[n].numPoints;
+		if (set[n].type == 'C')
+		{
+			memcpy( t[out].pt[0], set[n].pt[1], sizeof(t[out].pt[0]) );
+			memcpy( t[out].pt[1], set[n].pt[0], sizeof(t[out].pt[1]) );
+			memcpy( t[out].pt[2], prev, sizeof(t[out].pt[2]) );
+		}
+		else
+		{
+			memcpy( t[out].pt[0], prev, sizeof(t[out].pt[0]) );
+		}
+		out++;
+	}
+	memcpy( set, t, count * sizeof(drawSet_t) );
+	free( t );
+	return true;
+}
+
+// Rotate closed draw set in place so it starts at the end point of command index
+bool LicutGeom::Rotate( drawSet_t *set, int index )
+{
+	if (!IsClosed( set, 1e-3 )) return false;
+	int count = Count( set );
+	if (index <= 0 || index >= count - 1) return index == 0 || index == count - 1;
+	drawSet_t *t = (drawSet_t *)malloc( count * sizeof(drawSet_t) );
+	if (!t) return false;
+	int out = 0;
+	t[out].type = 'M';
+	t[out].numPoints = 1;
+	memcpy( t[out].pt[0], EndPoint( &set[index] ), sizeof(t[out].pt[0]) );
+	out++;
+	for (int n = index + 1; n < count; n++) t[out++] = set[n];
+	for (int n = 1; n <= index; n++) t[out++] = set[n];
+	memcpy( set, t, count * sizeof(drawSet_t) );
+	free( t );
+	return true;
+}
+
+// Total pen-up travel cutting all sets of svg in order from start x,y (svg units)
+double LicutGeom::TravelLength( LicutSVG const& svg, double startX /*= 0*/, double startY /*= 0*/ )
+{
+	double pos[2] = { startX, startY };
+	double travel = 0;
+	for (int n = 0; n < svg.GetDrawSetCount(); n++)
+	{
+		drawSet_t const *set = svg.GetDrawSet( n );
+		for (; set && set->type != 0; set++)
+		{
+			if (set->type == 'M') travel += Distance( pos, set->pt[0] );
+			double const *end = EndPoint( set );
+			pos[0] = end[0];
+			pos[1] = end[1];
+		}
+	}
+	return travel;
+}
+
+// Total movement along the mat feed (y) axis cutting all sets of svg in order
+double LicutGeom::FeedTravel( LicutSVG const& svg, double startY, int& reversals )
+{
+	double pos[2] = { 0, startY };
+	double travel = 0;
+	int direction = 0;
+	reversals = 0;
+	for (int n = 0; n < svg.GetDrawSetCount(); n++)
+	{
+		drawSet_t const *set = svg.GetDrawSet( n );
+		for (; set && set->type != 0; set++)
+		{
+			int steps = (set->type == 'C') ? CURVE_LENGTH_STEPS : 1;
+			double y = pos[1];
+			for (int i = 1; i <= steps; i++)
+			{
+				double p[2];
+				if (set->type == 'C') Bezier( pos, set->pt[0], set->pt[1], set->pt[2], (double)i / steps, p );
+				else memcpy( p, set->pt[0], sizeof(p) );
+				double dy = p[1] - y;
+				y = p[1];
+				if (dy == 0) continue;
+				travel += fabs( dy );
+				int d = (dy > 0) ? 1 : -1;
+				if (direction != 0 && d != direction) reversals++;
+				direction = d;
+			}
+			double const *end = EndPoint( set );
+			pos[0] = end[0];
+			pos[1] = end[1];
+		}
+	}
+	return travel;
+}
+
+// Total cut length of draw set (curves flattened) in svg units
+double LicutGeom::CutLength( drawSet_t const *set )
+{
+	double length = 0;
+	double pos[2] = { 0, 0 };
+	for (; set && set->type != 0; set++)
+	{
+		if (set->type == 'L')
+		{
+			length += Distance( pos, set->pt[0] );
+		}
+		else if (set->type == 'C')
+		{
+			double prev[2] = { pos[0], pos[1] };
+			for (int i = 1; i <= CURVE_LENGTH_STEPS; i++)
+			{
+				double p[2];
+				Bezier( pos, set->pt[0], set->pt[1], set->pt[2], (double)i / CURVE_LENGTH_STEPS, p );
+				length += Distance( prev, p );
+				prev[0] = p[0];
+				prev[1] = p[1];
+			}
+		}
+		double const *end = EndPoint( set );
+		pos[0] = end[0];
+		pos[1] = end[1];
+	}
+	return length;
+}
+
+// Distance between points
+double LicutGeom::Distance( double const a[2], double const b[2] )
+{
+	double dx = a[0] - b[0];
+	double dy = a[1] - b[1];
+	return sqrt( dx * dx + dy * dy );
+}
+
+// Evaluate cubic bezier p0,p1,p2,p3 at t
+void LicutGeom::Bezier( double const p0[2], double const p1[2], double const p2[2], double const p3[2], double t, double out[2] )
+{
+	double u = 1 - t;
+	double b0 = u * u * u;
+	double b1 = 3 * u * u * t;
+	double b2 = 3 * u * t * t;
+	double b3 = t * t * t;
+	out[0] = b0 * p0[0] + b1 * p1[0] + b2 * p2[0] + b3 * p3[0];
+	out[1] = b0 * p0[1] + b1 * p1[1] + b2 * p2[1] + b3 * p3[1];
+}
@@ -0,0 +1,53 @@
+// $Id$
+// Geometry helpers for draw sets
+
+#ifndef _LICUT_GEOM_H_
+#define _LICUT_GEOM_H_
+
+#include "licut_svg.h"
+
+class LicutGeom
+{
+public:
+	// Get number of commands in draw set, not including terminator
+	static int Count( drawSet_t const *set );
+
+	// Get end point of a single command
+	static double const *EndPoint( drawSet_t const *cmd ) { return cmd->pt[cmd->numPoints - 1]; }
+
+	// Get start and end point of draw set. Returns false if set is empty
+	static bool Ends( drawSet_t const *set, double start[2], double end[2] );
+
+	// Returns true if set can be cut in either direction (starts with M and
+	// has only M, L and C commands)
+	static bool IsReversible( drawSet_t const *set );
+
+	// Returns true if set is a single subpath ending where it starts (within tolerance)
+	static bool IsClosed( drawSet_t const *set, double tolerance = 1e-6 );
+
+	// Reverse cut direction of draw set in place. Returns false if not reversible
+	static bool Reverse( drawSet_t *set );
+
+	// Rotate closed draw set in place so it starts at the end point of command
+	// index (1..count-1). Returns false if not closed
+	static bool Rotate( drawSet_t *set, int index );
+
+	// Total pen-up travel cutting all sets of svg in order from start x,y (svg units)
+	static double TravelLength( LicutSVG const& svg, double startX = 0, double startY = 0 );
+
+	// Total movement along the mat feed (y) axis cutting all sets of svg in order from
+	// startY, curves flattened, in svg units. Sets reversals to the number of changes
+	// of feed direction
+	static double FeedTravel( LicutSVG const& svg, double startY, int& reversals );
+
+	// Total cut length of draw set (curves flattened) in svg units
+	static double CutLength( drawSet_t const *set );
+
+	// Distance between points
+	static double Distance( double const a[2], double const b[2] );
+
+	// Evaluate cubic bezier p0,p1,p2,p3 at t
+	static void Bezier( double const p0[2], double const p1[2], double const p2[2], double const p3[2], double t, double out[2] );
+};
+
+#endif // _LICUT_GEOM_H_
@@ -0,0 +1,465 @@
+// $Id$
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <math.h>
+
+#include "licut_hpgl.h"
+#include "licut_log.h"
+
+// Commands in a draw set before it first grows
+#define INITIAL_SET_COMMANDS	64
+
+// Two-letter instruction mnemonic as a switch case
+#define HPGL_OP( a, b )	((a) << 8 | (b))
+
+// Control points of a quarter circle Bezier are this far along the tangents, per unit radius
+#define HPGL_KAPPA	0.5522847498
+
+#define HPGL_ESC	0x1b
+
+LicutHPGL::LicutHPGL( int verbose )
+{
+	m_verbose = verbose;
+	m_set = NULL;
+	m_setAlloc = 0;
+	m_sets = NULL;
+	m_setsAlloc = 0;
+	Free();
+}
+
+LicutHPGL::~LicutHPGL()
+{
+	Free();
+	free( m_set );
+}
+
+void LicutHPGL::Free()
+{
+	for (int n = 0; n < m_setsCount && m_sets; n++) free( m_sets[n] );
+	free( m_sets );
+	m_sets = NULL;
+	m_setsCount = 0;
+	m_setsAlloc = 0;
+	m_setCount = 0;
+	m_penDown = false;
+	m_relative = false;
+	m_pos[0] = m_pos[1] = 0;
+	m_min[0] = m_min[1] = HUGE_VAL;
+	m_max[0] = m_max[1] = -HUGE_VAL;
+	m_instructions = 0;
+	m_ignored = 0;
+	m_firstIgnored[0] = '\0';
+}
+
+// Returns true if data starts with an instruction or escape sequence instead of markup
+bool LicutHPGL::IsHPGL( const char *data, size_t length )
+{
+	const char *end = data + length;
+	const char *p = data;
+	while (p < end && (isspace( (unsigned char)*p ) || *p == ';')) p++;
+	if (p < end && *p == HPGL_ESC) return true;
+	// Two upper case letters then a parameter, terminator or the next instruction
+	if (end - p < 2 || !isupper( (unsigned char)p[0] ) || !isupper( (unsigned char)p[1] )) return false;
+	return (p + 2 == end || !islower( (unsigned char)p[2] ));
+}
+
+// Returns true if path has an HPGL extension
+bool LicutHPGL::IsHPGLPath( const char *path )
+{
+	static const char *extensions[] = { ".plt", ".hpgl", ".hpg", ".hgl" };
+	const char *dot = strrchr( path, '.' );
+	if (!dot || strchr( dot, '/' )) return false;
+	for (unsigned int n = 0; n < sizeof(extensions) / sizeof(extensions[0]); n++)
+	{
+		if (!strcasecmp( dot, extensions[n] )) return true;
+	}
+	return false;
+}
+
+// Scan the next parameter of an instruction, skipping separators. Returns
+// characters consumed or 0 if the instruction has no more parameters
+static int _scan_number( const char *s, double *v )
+{
+	const char *p = s;
+	while (*p == ',' || *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+	const char *start = p;
+	bool negative = (*p == '-');
+	if (*p == '-' || *p == '+') p++;
+	if ((*p < '0' || *p > '9') && *p != '.') return 0;
+	// Plotter units are nearly always integers, which need not go through strtod()
+	long long n = 0;
+	while (*p >= '0' && *p <= '9' && n < (1LL << 50)) n = n * 10 + (*p++ - '0');
+	if (*p == '.' || *p == 'e' || *p == 'E' || (*p >= '0' && *p <= '9'))
+	{
+		char *e;
+		*v = strtod( start, &e );
+		if (e == start) return 0;
+		return e - s;
+	}
+	*v = negative ? -(double)n : (double)n;
+	return p - s;
+}
+
+// Skip what is left of an instruction up to the next one. Returns new position
+static const char *_skip_params( const char *p, const char *end )
+{
+	while (p < end)
+	{
+		if (*p == ';') return p + 1;
+		if (isalpha( (unsigned char)*p ) || *p == HPGL_ESC) return p;
+		if (*p == '"')
+		{
+			// Quoted string, as in CO and BP
+			const char *q = (const char *)memchr( p + 1, '"', end - p - 1 );
+			p = q ? q + 1 : end;
+			continue;
+		}
+		p++;
+	}
+	return p;
+}
+
+// Skip escape sequence at p: device control (ESC . x params :) or PCL, as used
+// to switch printers into HP-GL/2. Returns new position
+static const char *_skip_escape( const char *p, const char *end )
+{
+	p++;
+	if (p < end && *p == '.')
+	{
+		p += 2;
+		while (p < end && ((*p >= '0' && *p <= '9') || *p == ';' || *p == ' ')) p++;
+		if (p < end && *p == ':') p++;
+		return p < end ? p : end;
+	}
+	// PCL ends with an upper case letter or @
+	while (p < end && !(*p >= '@' && *p <= 'Z')) p++;
+	return p < end ? p + 1 : end;
+}
+
+// Include xy in the extent of the plot
+void LicutHPGL::Extend( double const xy[2] )
+{
+	if (xy[0] < m_min[0]) m_min[0] = xy[0];
+	if (xy[0] > m_max[0]) m_max[0] = xy[0];
+	if (xy[1] < m_min[1]) m_min[1] = xy[1];
+	if (xy[1] > m_max[1]) m_max[1] = xy[1];
+}
+
+// Append command. Returns 0 if successful
+int LicutHPGL::Append( char type, int numPoints, double const pt[3][2] )
+{
+	// Room for the command, a move to start the set and the terminator
+	if (m_setCount + 3 > m_setAlloc)
+	{
+		int newAlloc = m_setAlloc ? m_setAlloc * 2 : INITIAL_SET_COMMANDS;
+		drawSet_t *newSet = (drawSet_t *)realloc( m_set, newAlloc * sizeof(drawSet_t) );
+		if (!newSet)
+		{
+			LICUT_ERROR( "%s() failed to allocate %d commands\n", __FUNCTION__, newAlloc );
+			return -1;
+		}
+		m_set = newSet;
+		m_setAlloc = newAlloc;
+	}
+	if (m_setCount == 0)
+	{
+		// Pen-up move to where the pen went down
+		drawSet_t& m = m_set[m_setCount++];
+		memset( &m, 0, sizeof(m) );
+		m.type = 'M';
+		m.numPoints = 1;
+		m.pt[0][0] = m_pos[0];
+		m.pt[0][1] = m_pos[1];
+		Extend( m_pos );
+	}
+	drawSet_t& d = m_set[m_setCount++];
+	memset( &d, 0, sizeof(d) );
+	d.type = type;
+	d.numPoints = numPoints;
+	for (int i = 0; i < numPoints; i++)
+	{
+		d.pt[i][0] = pt[i][0];
+		d.pt[i][1] = pt[i][1];
+		Extend( pt[i] );
+	}
+	return 0;
+}
+
+// End the current draw set. Returns 0 if successful
+int LicutHPGL::EndSet()
+{
+	if (m_setCount == 0) return 0;
+	int count = m_setCount;
+	m_setCount = 0;
+	if (m_setsCount >= m_setsAlloc)
+	{
+		int newAlloc = m_setsAlloc ? m_setsAlloc * 2 : INITIAL_SET_COMMANDS;
+		drawSet_t **newSets = (drawSet_t **)realloc( m_sets, newAlloc * sizeof(drawSet_t *) );
+		if (!newSets)
+		{
+			LICUT_ERROR( "Failed to allocate %d draw sets\n", newAlloc );
+			return -1;
+		}
+		m_sets = newSets;
+		m_setsAlloc = newAlloc;
+	}
+	drawSet_t *t = (drawSet_t *)malloc( (count + 1) * sizeof(drawSet_t) );
+	if (!t)
+	{
+		LICUT_ERROR( "%s() failed to allocate %d commands\n", __FUNCTION__, count + 1 );
+		return -1;
+	}
+	memcpy( t, m_set, count * sizeof(drawSet_t) );
+	memset( &t[count], 0, sizeof(drawSet_t) );
+	m_sets[m_setsCount++] = t;
+	return 0;
+}
+
+// Move to x,y, drawing a line if the pen is down. Returns 0 if successful
+int LicutHPGL::MoveTo( double x, double y )
+{
+	int r = 0;
+	if (m_penDown)
+	{
+		double pt[3][2] = { { x, y } };
+		r = Append( 'L', 1, pt );
+	}
+	else
+	{
+		r = EndSet();
+	}
+	m_pos[0] = x;
+	m_pos[1] = y;
+	return r;
+}
+
+// Draw a Bezier curve from the pen position, or move to its end if the pen is up.
+// Returns 0 if successful
+int LicutHPGL::CurveTo( double const pt[3][2] )
+{
+	if (!m_penDown) return MoveTo( pt[2][0], pt[2][1] );
+	if (Append( 'C', 3, pt ) != 0) return -1;
+	m_pos[0] = pt[2][0];
+	m_pos[1] = pt[2][1];
+	return 0;
+}
+
+// Draw a circle of radius r around the pen position as four Bezier curves.
+// The pen is down for the circle only. Returns 0 if successful
+int LicutHPGL::Circle( double r )
+{
+	static const int c[4] = { 1, 0, -1, 0 };
+	static const int s[4] = { 0, 1, 0, -1 };
+	double center[2] = { m_pos[0], m_pos[1] };
+	bool penDown = m_penDown;
+	r = fabs( r );
+	double k = r * HPGL_KAPPA;
+	if (EndSet() != 0) return -1;
+	m_pos[0] = center[0] + r;
+	m_pos[1] = center[1];
+	m_penDown = true;
+	for (int n = 0; n < 4; n++)
+	{
+		// From angle n * 90 degrees to the next, along u then w
+		double u[2] = { (double)c[n], (double)s[n] };
+		double w[2] = { -u[1], u[0] };
+		double pt[3][2] = {
+			{ center[0] + r * u[0] + k * w[0], center[1] + r * u[1] + k * w[1] },
+			{ center[0] + r * w[0] + k * u[0], center[1] + r * w[1] + k * u[1] },
+			{ center[0] + r * w[0], center[1] + r * w[1] } };
+		if (CurveTo( pt ) != 0) return -1;
+	}
+	m_penDown = penDown;
+	m_pos[0] = center[0];
+	m_pos[1] = center[1];
+	return EndSet();
+}
+
+// Parse data into draw sets of svg. Returns 0 if successful
+int LicutHPGL::Parse( const char *data, size_t length, LicutSVG& svg )
+{
+	Free();
+	const char *p = data;
+	const char *end = data + length;
+	char labelEnd = 0x03; // ETX unless DT sets another
+	int odd = 0;
+	int r = 0;
+	int n;
+	while (p < end && r == 0)
+	{
+		if (*p == HPGL_ESC)
+		{
+			p = _skip_escape( p, end );
+			continue;
+		}
+		if (*p == '@')
+		{
+			// PJL line ahead of HP-GL/2
+			const char *eol = (const char *)memchr( p, '\n', end - p );
+			p = eol ? eol + 1 : end;
+			continue;
+		}
+		if (!isalpha( (unsigned char)p[0] ) || p + 1 >= end || !isalpha( (unsigned char)p[1] ))
+		{
+			p++;
+			continue;
+		}
+		int op = HPGL_OP( toupper( (unsigned char)p[0] ), toupper( (unsigned char)p[1] ) );
+		p += 2;
+		m_instructions++;
+		double v[6];
+		switch (op)
+		{
+			case HPGL_OP( 'I', 'N' ):
+			case HPGL_OP( 'D', 'F' ):
+				r = EndSet();
+				m_penDown = false;
+				m_relative = false;
+				if (op == HPGL_OP( 'I', 'N' )) m_pos[0] = m_pos[1] = 0;
+				if (op == HPGL_OP( 'D', 'F' )) labelEnd = 0x03;
+				break;
+			case HPGL_OP( 'P', 'U' ):
+			case HPGL_OP( 'P', 'D' ):
+			case HPGL_OP( 'P', 'A' ):
+			case HPGL_OP( 'P', 'R' ):
+				if (op == HPGL_OP( 'P', 'U' )) m_penDown = false;
+				else if (op == HPGL_OP( 'P', 'D' )) m_penDown = true;
+				else m_relative = (op == HPGL_OP( 'P', 'R' ));
+				// Each pair moves with the pen as it is
+				while (r == 0 && (n = _scan_number( p, &v[0] )) > 0)
+				{
+					p += n;
+					if ((n = _scan_number( p, &v[1] )) == 0)
+					{
+						odd++;
+						break;
+					}
+					p += n;
+					if (m_relative) r = MoveTo( m_pos[0] + v[0], m_pos[1] + v[1] );
+					else r = MoveTo( v[0], v[1] );
+				}
+				break;
+			case HPGL_OP( 'B', 'Z' ):
+			case HPGL_OP( 'B', 'R' ):
+				// Control points and end, relative to the start of each curve for BR
+				for (;;)
+				{
+					for (n = 0; n < 6; n++)
+					{
+						int used = _scan_number( p, &v[n] );
+						if (used == 0) break;
+						p += used;
+					}
+					if (n < 6)
+					{
+						if (n > 0) odd++;
+						break;
+					}
+					double pt[3][2];
+					for (n = 0; n < 3; n++)
+					{
+						pt[n][0] = v[n * 2] + (op == HPGL_OP( 'B', 'R' ) ? m_pos[0] : 0);
+						pt[n][1] = v[n * 2 + 1] + (op == HPGL_OP( 'B', 'R' ) ? m_pos[1] : 0);
+					}
+					if ((r = CurveTo( pt )) != 0) break;
+				}
+				break;
+			case HPGL_OP( 'C', 'I' ):
+				if ((n = _scan_number( p, &v[0] )) > 0)
+				{
+					p += n;
+					r = Circle( v[0] );
+				}
+				break;
+			case HPGL_OP( 'L', 'B' ):
+			{
+				const char *q = (const char *)memchr( p, labelEnd, end - p );
+				p = q ? q + 1 : end;
+				break;
+			}
+			case HPGL_OP( 'D', 'T' ):
+				if (p < end && *p != ';') labelEnd = *p++;
+				break;
+			case HPGL_OP( 'P', 'E' ):
+			{
+				// Encoded polyline data may contain anything but its terminator
+				const char *q = (const char *)memchr( p, ';', end - p );
+				p = q ? q : end;
+			}
+			// Fall through
+			case HPGL_OP( 'A', 'A' ): case HPGL_OP( 'A', 'R' ): case HPGL_OP( 'A', 'T' ):
+			case HPGL_OP( 'R', 'T' ): case HPGL_OP( 'E', 'A' ): case HPGL_OP( 'E', 'R' ):
+			case HPGL_OP( 'R', 'A' ): case HPGL_OP( 'R', 'R' ): case HPGL_OP( 'E', 'W' ):
+			case HPGL_OP( 'W', 'G' ): case HPGL_OP( 'E', 'P' ): case HPGL_OP( 'F', 'P' ):
+			case HPGL_OP( 'P', 'M' ): case HPGL_OP( 'S', 'C' ): case HPGL_OP( 'I', 'P' ):
+			case HPGL_OP( 'I', 'R' ): case HPGL_OP( 'R', 'O' ):
+				// Would change what is cut
+				if (m_ignored++ == 0)
+				{
+					m_firstIgnored[0] = (char)(op >> 8);
+					m_firstIgnored[1] = (char)op;
+					m_firstIgnored[2] = '\0';
+				}
+				break;
+			default:
+				// Pens, line types, fonts and the like do not matter to a cutter
+				break;
+		}
+		p = _skip_params( p, end );
+	}
+	if (r == 0) r = EndSet();
+	if (r != 0)
+	{
+		Free();
+		return -1;
+	}
+	if (m_instructions == 0)
+	{
+		LICUT_ERROR( "No HPGL instructions found\n" );
+		return -1;
+	}
+	if (m_ignored) LICUT_WARN( "Ignored %d unsupported HPGL instructions (first %s)\n", m_ignored, m_firstIgnored );
+	if (odd && m_verbose) LICUT_DEBUG( "%s() ignored %d incomplete coordinate lists\n", __FUNCTION__, odd );
+	if (m_setsCount == 0)
+	{
+		LICUT_WARN( "Nothing is drawn by %d HPGL instructions\n", m_instructions );
+		return 0;
+	}
+
+	// The plot spans its origin and everything drawn. HPGL y is up, so it is
+	// flipped to run down from the top as in svg
+	double x0 = m_min[0] < 0 ? m_min[0] : 0;
+	double y0 = m_min[1] < 0 ? m_min[1] : 0;
+	double top = m_max[1] > 0 ? m_max[1] : 0;
+	double width = ceil( m_max[0] - x0 );
+	double height = ceil( top - y0 );
+	if (width < 1) width = 1;
+	if (height < 1) height = 1;
+	svg.SetSize( (unsigned int)width, (unsigned int)height );
+	svg.SetPhysicalSize( width / HPGL_UNITS_PER_INCH, height / HPGL_UNITS_PER_INCH );
+	if (m_verbose)
+	{
+		LICUT_DEBUG( "Parsed %d HPGL instructions into %d draw sets, %.0f x %.0f plotter units\n",
+			m_instructions, m_setsCount, width, height );
+	}
+	for (n = 0; n < m_setsCount && r == 0; n++)
+	{
+		drawSet_t *t = m_sets[n];
+		for (drawSet_t *d = t; d->type; d++)
+		{
+			for (int i = 0; i < d->numPoints; i++)
+			{
+				d->pt[i][0] -= x0;
+				d->pt[i][1] = top - d->pt[i][1];
+			}
+		}
+		// Taken by svg, or its sink, either way
+		m_sets[n] = NULL;
+		r = svg.AppendDrawSet( t );
+	}
+	return r;
+}
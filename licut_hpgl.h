@@ -0,0 +1,76 @@
+// $Id$
+// HPGL (.plt) plotter files read straight into draw sets, as CAM software writes
+// them for cutters. Pen-up moves become M and pen-down moves L, so they are cut
+// as subCmd 2 and 0 like moves and lines of an svg path; HP-GL/2 Bezier curves
+// become C. Each pen-down run is one draw set
+
+#ifndef _LICUT_HPGL_H_
+#define _LICUT_HPGL_H_
+
+#include <stddef.h>
+
+#include "licut_svg.h"
+
+// Plotter units per inch (40 per mm)
+#define HPGL_UNITS_PER_INCH	1016
+
+class LicutHPGL
+{
+public:
+	LicutHPGL( int verbose );
+	~LicutHPGL();
+
+	// Returns true if data looks like HPGL rather than svg: it starts with an
+	// instruction mnemonic or an escape sequence instead of markup
+	static bool IsHPGL( const char *data, size_t length );
+
+	// Returns true if path has an HPGL extension (.plt, .hpgl, .hpg or .hgl)
+	static bool IsHPGLPath( const char *path );
+
+	// Parse NUL-terminated data into draw sets of svg, in plotter units with y
+	// down from the top of the plot like svg user units. Width, height and
+	// physical size are set from the extent of the plot and its origin before
+	// the draw sets are added, or passed to the draw set sink of svg if it has
+	// one. Returns 0 if successful
+	int Parse( const char *data, size_t length, LicutSVG& svg );
+
+	// Results of last Parse()
+	int GetInstructionCount() const { return m_instructions; }
+	int GetIgnoredCount() const { return m_ignored; }
+
+protected:
+	// Move to x,y, drawing a line if the pen is down. Returns 0 if successful
+	int MoveTo( double x, double y );
+	// Draw a Bezier curve from the pen position. Returns 0 if successful
+	int CurveTo( double const pt[3][2] );
+	// Draw a circle of radius r around the pen position, leaving the pen there.
+	// Returns 0 if successful
+	int Circle( double r );
+	// Append command to the current draw set, starting one at the pen position if
+	// needed. Returns 0 if successful
+	int Append( char type, int numPoints, double const pt[3][2] );
+	// Include xy in the extent of the plot
+	void Extend( double const xy[2] );
+	// End the current draw set, keeping it if anything was drawn. Returns 0 if successful
+	int EndSet();
+	void Free();
+
+protected:
+	int m_verbose;
+	bool m_penDown;
+	bool m_relative;
+	double m_pos[2];
+	double m_min[2]; // Extent of everything drawn
+	double m_max[2];
+	drawSet_t *m_set; // Current draw set
+	int m_setCount;
+	int m_setAlloc;
+	drawSet_t **m_sets; // Completed draw sets
+	int m_setsCount;
+	int m_setsAlloc;
+	int m_instructions;
+	int m_ignored;
+	char m_firstIgnored[3];
+};
+
+#endif // _LICUT_HPGL_H_
@@ -0,0 +1,325 @@
+// $Id$
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "licut_input.h"
+#include "licut_log.h"
+#include "licut_time.h"
+
+// Compressed input is read this much at a time
+#define INPUT_CHUNK	65536
+
+// Read up to length bytes, retrying interrupted and short reads. Returns bytes
+// read, less at end of file, or -1 on error
+static ssize_t _read_full( int fd, void *buff, size_t length )
+{
+	size_t total = 0;
+	while (total < length)
+	{
+		ssize_t res = read( fd, (char *)buff + total, length - total );
+		if (res < 0 && errno == EINTR) continue;
+		if (res < 0) return -1;
+		if (res == 0) break;
+		total += res;
+	}
+	return total;
+}
+
+LicutInput::LicutInput( int verbose )
+{
+	m_verbose = verbose;
+	m_data = NULL;
+	m_length = 0;
+	m_alloc = 0;
+	m_maxLength = LICUT_INPUT_MAX;
+	m_compressed = false;
+	m_compressedLength = 0;
+	m_seconds = 0;
+}
+
+LicutInput::~LicutInput()
+{
+	Free();
+}
+
+void LicutInput::Free()
+{
+	free( m_data );
+	m_data = NULL;
+	m_length = 0;
+	m_alloc = 0;
+	m_compressed = false;
+	m_compressedLength = 0;
+	m_seconds = 0;
+}
+
+// Returns true if data starts with the gzip magic number
+bool LicutInput::IsGzip( const void *data, size_t length )
+{
+	const unsigned char *p = (const unsigned char *)data;
+	return length >= 2 && p[0] == 0x1f && p[1] == 0x8b;
+}
+
+// Make room for at least need bytes and a terminator. Returns 0 if successful
+int LicutInput::Reserve( size_t need, const char *name )
+{
+	if (need > m_maxLength)
+	{
+		LICUT_ERROR( "%s is longer than %lu MB\n", name, (unsigned long)(m_maxLength >> 20) );
+		return -1;
+	}
+	if (need + 1 <= m_alloc) return 0;
+	// Exactly as asked first, since that is usually the whole document
+	size_t newAlloc = m_alloc ? m_alloc * 2 : need + 1;
+	while (newAlloc < need + 1) newAlloc *= 2;
+	if (newAlloc > m_maxLength + 1) newAlloc = m_maxLength + 1;
+	char *newData = (char *)realloc( m_data, newAlloc );
+	if (!newData)
+	{
+		LICUT_ERROR( "Failed to allocate %lu bytes for %s\n", (unsigned long)newAlloc, name );
+		return -1;
+	}
+	m_data = newData;
+	m_alloc = newAlloc;
+	return 0;
+}
+
+// Read file, - for standard input. Returns 0 if successful
+int LicutInput::Read( const char *path )
+{
+	if (!strcmp( path, "-" )) return ReadFd( STDIN_FILENO, "standard input" );
+	int fd = open( path, O_RDONLY );
+	if (fd < 0)
+	{
+		LICUT_ERROR( "Failed to open %s (errno=%d: %s)\n", path, errno, strerror(errno) );
+		return -1;
+	}
+	int r = ReadFd( fd, path );
+	close( fd );
+	return r;
+}
+
+// Read from descriptor fd to end of file. Returns 0 if successful
+int LicutInput::ReadFd( int fd, const char *name )
+{
+	Free();
+	double t0 = licut_now();
+	struct stat fileInfo;
+	size_t fileSize = 0;
+	if (fstat( fd, &fileInfo ) == 0 && S_ISREG( fileInfo.st_mode ))
+	{
+		if (fileInfo.st_size < 1)
+		{
+			LICUT_ERROR( "Invalid file size %lu for %s - must be > 0\n", (unsigned long)fileInfo.st_size, name );
+			return -1;
+		}
+		fileSize = fileInfo.st_size;
+	}
+
+	// The first bytes tell whether to decompress
+	unsigned char first[2];
+	ssize_t firstLength = _read_full( fd, first, sizeof(first) );
+	if (firstLength < 0)
+	{
+		LICUT_ERROR( "Failed to read contents of %s (errno=%d: %s)\n", name, errno, strerror(errno) );
+		return -1;
+	}
+	int r;
+	if (IsGzip( first, firstLength ))
+	{
+		r = InflateFd( fd, name, first, firstLength, fileSize );
+	}
+	else
+	{
+		// Plain file in one read if its size is known
+		r = Reserve( fileSize ? fileSize : INPUT_CHUNK, name );
+		if (r == 0)
+		{
+			memcpy( m_data, first, firstLength );
+			m_length = firstLength;
+		}
+		// A regular file is read to its size
+		while (r == 0 && !(fileSize && m_length >= fileSize))
+		{
+			if (m_length + 1 >= m_alloc && (r = Reserve( m_alloc, name )) != 0) break;
+			ssize_t res = _read_full( fd, &m_data[m_length], m_alloc - 1 - m_length );
+			if (res < 0)
+			{
+				LICUT_ERROR( "Failed to read contents of %s (%lu read, errno=%d: %s)\n",
+					name, (unsigned long)m_length, errno, strerror(errno) );
+				r = -1;
+			}
+			if (res <= 0) break;
+			m_length += res;
+		}
+		if (r == 0 && m_length == 0)
+		{
+			LICUT_ERROR( "%s is empty\n", name );
+			r = -1;
+		}
+	}
+	if (r != 0)
+	{
+		Free();
+		return -1;
+	}
+	m_data[m_length] = '\0';
+	m_seconds = licut_now() - t0;
+	return 0;
+}
+
+// Decompress gzip data in memory. Returns 0 if successful
+int LicutInput::Inflate( const void *data, size_t length )
+{
+	Free();
+	double t0 = licut_now();
+	if (!IsGzip( data, length ))
+	{
+		LICUT_ERROR( "%s() data is not gzip\n", __FUNCTION__ );
+		return -1;
+	}
+	if (InflateFd( -1, "gzip data", (const unsigned char *)data, length, 0 ) != 0)
+	{
+		Free();
+		return -1;
+	}
+	m_data[m_length] = '\0';
+	m_seconds = licut_now() - t0;
+	return 0;
+}
+
+// Decompress first then the rest of fd, if not -1, straight into the document
+// buffer. Returns 0 if successful
+int LicutInput::InflateFd( int fd, const char *name, const unsigned char *first, size_t firstLength, size_t fileSize )
+{
+	m_compressed = true;
+	m_compressedLength = firstLength;
+
+	// The gzip trailer has the length of the last member (modulo 4GB), which for
+	// the usual single member sizes the buffer exactly
+	unsigned char trailer[4];
+	const unsigned char *isize = NULL;
+	if (fd < 0 && firstLength >= 18) isize = &first[firstLength - 4];
+	else if (fd >= 0 && fileSize >= 18 && pread( fd, trailer, 4, fileSize - 4 ) == 4) isize = trailer;
+	size_t hint = isize ? (isize[0] | isize[1] << 8 | isize[2] << 16 | (size_t)isize[3] << 24) : 0;
+	if (hint == 0 || hint > m_maxLength)
+	{
+		// Compressed svg is usually 5-10 times smaller
+		hint = (fileSize ? fileSize : firstLength) * 4;
+		if (hint < INPUT_CHUNK) hint = INPUT_CHUNK;
+	}
+	if (Reserve( hint, name ) != 0) return -1;
+
+	unsigned char *chunk = NULL;
+	if (fd >= 0)
+	{
+		chunk = (unsigned char *)malloc( INPUT_CHUNK );
+		if (!chunk)
+		{
+			LICUT_ERROR( "Failed to allocate %d bytes for %s\n", INPUT_CHUNK, name );
+			return -1;
+		}
+		memcpy( chunk, first, firstLength );
+	}
+	z_stream z;
+	memset( &z, 0, sizeof(z) );
+	z.next_in = chunk ? chunk : (Bytef *)first;
+	z.avail_in = firstLength;
+	// 16 + maximum window for gzip format only
+	if (inflateInit2( &z, 16 + MAX_WBITS ) != Z_OK)
+	{
+		LICUT_ERROR( "%s() cannot start decompressing %s\n", __FUNCTION__, name );
+		free( chunk );
+		return -1;
+	}
+	bool eof = (fd < 0);
+	bool full = false;
+	int r = 0;
+	for (;;)
+	{
+		if (z.avail_in == 0 && !eof)
+		{
+			ssize_t res = _read_full( fd, chunk, INPUT_CHUNK );
+			if (res < 0)
+			{
+				LICUT_ERROR( "Failed to read contents of %s (errno=%d: %s)\n", name, errno, strerror(errno) );
+				r = -1;
+				break;
+			}
+			eof = (res < INPUT_CHUNK);
+			z.next_in = chunk;
+			z.avail_in = res;
+			m_compressedLength += res;
+		}
+		// Grown only when more output is certain, not for the trailer
+		if (full && (r = Reserve( m_alloc, name )) != 0) break;
+		full = false;
+		z.next_out = (Bytef *)&m_data[m_length];
+		z.avail_out = m_alloc - 1 - m_length;
+		int res = inflate( &z, Z_NO_FLUSH );
+		m_length = m_alloc - 1 - z.avail_out;
+		if (res == Z_STREAM_END)
+		{
+			// Concatenated gzip members make one document
+			if (z.avail_in == 0 && !eof)
+			{
+				ssize_t more = _read_full( fd, chunk, INPUT_CHUNK );
+				if (more > 0)
+				{
+					eof = (more < INPUT_CHUNK);
+					z.next_in = chunk;
+					z.avail_in = more;
+					m_compressedLength += more;
+				}
+				else
+				{
+					eof = true;
+				}
+			}
+			if (z.avail_in == 0) break;
+			if (!IsGzip( z.next_in, z.avail_in ))
+			{
+				LICUT_WARN( "Ignoring %u bytes after gzip data in %s\n", z.avail_in, name );
+				break;
+			}
+			inflateReset( &z );
+		}
+		else if (res == Z_BUF_ERROR && z.avail_out == 0)
+		{
+			full = true;
+		}
+		else if (res == Z_BUF_ERROR && z.avail_in == 0 && eof)
+		{
+			LICUT_ERROR( "%s is truncated after %lu bytes\n", name, (unsigned long)m_length );
+			r = -1;
+			break;
+		}
+		else if (res != Z_OK && res != Z_BUF_ERROR)
+		{
+			LICUT_ERROR( "Failed to decompress %s: %s\n", name, z.msg ? z.msg : "invalid data" );
+			r = -1;
+			break;
+		}
+	}
+	inflateEnd( &z );
+	free( chunk );
+	if (r == 0 && m_length == 0)
+	{
+		LICUT_ERROR( "%s is empty\n", name );
+		r = -1;
+	}
+	if (r == 0 && m_verbose)
+	{
+		LICUT_DEBUG( "Decompressed %s: %lu to %lu bytes\n", name, (unsigned long)m_compressedLength, (unsigned long)m_length );
+	}
+	return r;
+}
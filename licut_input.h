@@ -0,0 +1,67 @@
+// $Id$
+// Whole input document in memory for the parsers, which tokenize it in place.
+// gzip input (.svgz, or any gzip stream) is decompressed as it is read, chunk
+// by chunk straight into the document buffer, so no temporary file is needed
+
+#ifndef _LICUT_INPUT_H_
+#define _LICUT_INPUT_H_
+
+#include <stddef.h>
+
+// Largest document accepted by default, so a small compressed file cannot
+// exhaust memory
+#define LICUT_INPUT_MAX		((size_t)1 << 30)
+
+class LicutInput
+{
+public:
+	LicutInput( int verbose );
+	~LicutInput();
+
+	// Read file, - for standard input. Returns 0 if successful
+	int Read( const char *path );
+
+	// Read from descriptor fd to end of file, named name in messages. Returns 0
+	// if successful
+	int ReadFd( int fd, const char *name );
+
+	// Decompress gzip data in memory. Returns 0 if successful
+	int Inflate( const void *data, size_t length );
+
+	// Returns true if data starts with the gzip magic number
+	static bool IsGzip( const void *data, size_t length );
+
+	// NUL-terminated document, which may be modified in place, and its length
+	char *GetData() { return m_data; }
+	size_t GetLength() const { return m_length; }
+
+	// Input was gzip, its size and time taken to read and decompress it
+	bool IsCompressed() const { return m_compressed; }
+	size_t GetCompressedLength() const { return m_compressedLength; }
+	double GetSeconds() const { return m_seconds; }
+
+	// Refuse documents longer than max bytes (default LICUT_INPUT_MAX)
+	void SetMaxLength( size_t max ) { m_maxLength = max; }
+
+protected:
+	// Make room for at least need bytes and a terminator. Returns 0 if successful
+	int Reserve( size_t need, const char *name );
+
+	// Decompress from fd, with first bytes of it already read. Size of a regular
+	// file or 0. Returns 0 if successful
+	int InflateFd( int fd, const char *name, const unsigned char *first, size_t firstLength, size_t fileSize );
+
+	void Free();
+
+protected:
+	int m_verbose;
+	char *m_data;
+	size_t m_length;
+	size_t m_alloc;
+	size_t m_maxLength;
+	bool m_compressed;
+	size_t m_compressedLength;
+	double m_seconds;
+};
+
+#endif // _LICUT_INPUT_H_
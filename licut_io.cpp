@@ -3,88 +3,93 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <stdarg.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <fcntl.h>
 
 #include "licut_io.h"
+#include "licut_transport.h"
+#include "licut_log.h"
+#include "licut_time.h"
 
+// Range of noise in 0x40 packets
+#define RANGE_BASE	10001
+#define RANGE_TOP	32766
+#define RANGE_SIZE	(RANGE_TOP - RANGE_BASE)
+
+// Same keys as the encoders, for decoding
+#define KEY_ROW( subCmd ) { LicutMoveCutKey<subCmd>::K0, LicutMoveCutKey<subCmd>::K1, LicutMoveCutKey<subCmd>::K2, LicutMoveCutKey<subCmd>::K3 }
 uint32_t LicutIO::g_cmd_keys[8][4] = {
-/*KEY0 -*/{ 0x272D6C37, 0x342A6173, 0x3663255B, 0x2B265A4D },
-/*KEY1 -*/{ 0x7D316E22, 0x4A4A7133, 0x5A3C5C5F, 0x78613A61 },
-/*KEY2 -*/{ 0x47302A23, 0x5D31482F, 0x3B257A61, 0x3671382F },
-/*KEY3 -*/{ 0x303F6863, 0x71646D30, 0x4769457B, 0x6D342569 },
-/*KEY4 -*/{ 0x45356650, 0x3A386D69, 0x575A7037, 0x335F357D },
-/*KEY5 -*/{ 0x343A2148, 0x614F3925, 0x753F6953, 0x47463626 },
-/*KEY6 -*/{ 0x3F62626D, 0x7E555F44, 0x7E29425A, 0x52246268 },
-/*KEY7 -*/{ 0x47302A23, 0x342A6173, 0x4769457B, 0x335F357D }
+	KEY_ROW( 0 ), KEY_ROW( 1 ), KEY_ROW( 2 ), KEY_ROW( 3 ),
+	KEY_ROW( 4 ), KEY_ROW( 5 ), KEY_ROW( 6 ), KEY_ROW( 7 )
 };
 
 // If nonzero, this is a fixed pseudo-noise value which increments on each fetch
 int LicutIO::g_fixedNoise = 0;
 
+// Format bytes as comma-separated hex into buff
+static const char *_fmt_hex( char *buff, int size, const unsigned char *data, int length )
+{
+	int used = 0;
+	buff[0] = '\0';
+	for (int n = 0; n < length && used < size; n++)
+	{
+		used += snprintf( &buff[used], size - used, "%s%02x", n ? ", " : "", data[n] );
+	}
+	return buff;
+}
+
 LicutIO::LicutIO( int handle )
 {
 	m_handle = handle;
+	m_transport = NULL;
 	m_expectedReply = 0;
 	m_expectedReplyCmd = 0;
 	m_verbose = 0;
+	m_replyTimeout = 0;
 }
 
 int LicutIO::Send(  const unsigned char *bytes, int length )
 {
-	int n;
-	int actual_sent = 0;
-	for (n = 0; n < length; n++)
-	{
-		int write_res = write( m_handle, &bytes[n], 1 );
-		if (write_res < 1)
-		{
-			printf( "%s(%p,%u) - write returned %d, errno=%d (%s)\n", __FUNCTION__, bytes, length, write_res, errno, strerror(errno) );
-		}
-		else
-		{
-			actual_sent++;
-		}
-		// Add intercharacter delay after each character, including the last
-		usleep( 1000 );
-	}
-	return actual_sent;
+	if (m_transport) return m_transport->Write( bytes, length );
+	return LicutTransport::WritePaced( m_handle, bytes, length );
 }
 
 int LicutIO::Drain( int verbose, int ms_timeout /* = 50 */ )
 {
-	unsigned char binbuf[256];
-	// Wait 50 ms for data ready
-	fd_set rfds;
-	struct timeval tv;
-	FD_ZERO( &rfds );
-	FD_SET( m_handle, &rfds );
-	tv.tv_sec = 0;
-	tv.tv_usec = ms_timeout * 1000;
-	int res = 0;
-	if (select( m_handle+1, &rfds, NULL, NULL, &tv ) > 0)
-	{
-		res = read( m_handle, binbuf, sizeof(binbuf)-1 );
-	}
+	unsigned char binbuf[256];
+	// Wait 50 ms for data ready
+	fd_set rfds;
+	struct timeval tv;
+	FD_ZERO( &rfds );
+	FD_SET( m_handle, &rfds );
+	tv.tv_sec = 0;
+	tv.tv_usec = ms_timeout * 1000;
+	int res = 0;
+	if (select( m_handle+1, &rfds, NULL, NULL, &tv ) > 0)
+	{
+		res = read( m_handle, binbuf, sizeof(binbuf)-1 );
+	}
 
 	if (res == 0) return res;
 
-	if (verbose > 0) printf( "%s() read %d characters\n", __FUNCTION__, res );
+	if (verbose > 0) LICUT_DEBUG( "%s() read %d characters\n", __FUNCTION__, res );
 
+	// Shown as one line: [hex bytes] followed by the first printable run
 	int n;
 	char *ascii_run = NULL;
 	int ascii_run_length = 0;
 	int in_ascii_run = 0;
+	char line[sizeof(binbuf) * 4 + 8];
+	int lineLength = 0;
+	bool show = verbose >= 0 && LICUT_LOG_INFO <= LICUT_LOG_LEVEL;
+	line[0] = '\0';
 	for (n = 0; n < res; n++)
 	{
-		if (verbose >= 0)
-		{
-			if (n == 0) printf( "[%02x", binbuf[n] );
-			else printf( " %02x", binbuf[n] );
-		}
+		if (show) lineLength += sprintf( &line[lineLength], "%c%02x", n ? ' ' : '[', binbuf[n] );
 		if (in_ascii_run)
 		{
 			if (binbuf[n] < ' ' || binbuf[n] > 126)
@@ -107,124 +112,54 @@ int LicutIO::Drain( int verbose, int ms_timeout /* = 50 */ )
 	if (ascii_run_length > 0)
 	{
 		ascii_run[ascii_run_length] = '\0';
-		if (verbose >= 0) printf( "]   %s\n", ascii_run );
+		if (show) LICUT_INFO( "%s]   %s\n", line, ascii_run );
 	}
 	else
 	{
-		if (verbose >= 0) printf( "]\n" );
+		if (show) LICUT_INFO( "%s]\n", line );
 	}
 
 	return res;
 }
 
-int LicutIO::SendCmd( unsigned char cmd, ... )
+int LicutIO::SendPacket( unsigned char cmd, int reply, const unsigned char *packet, int length )
 {
-	// Try to force xxtea operation to take place on dword-aligned memory
-	// ARM processors are picky about this, and require qword-aligned memory
-	// for strd operations (used with doubles). But we cannot do 32-bit operations
-	// on memory which is not dword aligned...
-	unsigned char sendBuffer[64];
-	int sendBuffStartOff = 2;
-	int sendBuffDataOff = 4;
-	unsigned char dataLength = 4;
-	int packetLength = 5;
-
-	va_list arglist;
-	va_start( arglist, cmd );
-	unsigned int subCmd;
-	unsigned int x, y;
-	unsigned int n;
-
-	m_expectedReply = 0;
+	char hex[LICUT_MOVECUT_PACKET * 4];
+	m_expectedReply = reply;
 	m_expectedReplyCmd = cmd;
+	if (m_verbose > 0) LICUT_DEBUG( "Packet: %s\n", _fmt_hex( hex, sizeof(hex), packet, length ) );
+	return Send( packet, length );
+}
 
-	memset( sendBuffer, 0, sizeof(sendBuffer) );
-
-	switch (cmd)
-	{
-		// subtype, x and y int32 data sent, needs noise and XXTEA encryption
-		case 0x40:
-			dataLength = 13; // Includes cmd
-			packetLength = dataLength + 1;
-			m_expectedReply = 1;
-			subCmd = va_arg( arglist, unsigned int );
-			x = va_arg( arglist, unsigned int );
-			y = va_arg( arglist, unsigned int );
-			n = noise();
-			if (m_verbose > 0) printf( "%s(%u,%u,%u,%u) using noise %u (fixed=%d)\n", __FUNCTION__, cmd, subCmd, x, y, n, g_fixedNoise );
-			// Assemble datablock
-			if (subCmd > 7)
-			{
-				printf( "Invalid subcmd %d\n", subCmd );
-				break;
-			}
-			// Works only on x86
-			/****
-			*((unsigned int *)&sendBuffer[2 + 0 * sizeof(int)]) = n;
-			*((unsigned int *)&sendBuffer[2 + 1 * sizeof(int)]) = x;
-			*((unsigned int *)&sendBuffer[2 + 2 * sizeof(int)]) = y;
-			****/
-			unsigned_to_leu32( n, &sendBuffer[sendBuffDataOff + 0 * sizeof(int)] );
-			unsigned_to_leu32( x, &sendBuffer[sendBuffDataOff + 1 * sizeof(int)] );
-			unsigned_to_leu32( y, &sendBuffer[sendBuffDataOff + 2 * sizeof(int)] );
-			if (m_verbose > 0) dump_hex( "Plaintext: ", &sendBuffer[2], 12, "\n" );
-#if 0 && defined( __arm__ )
-			// Put bytes to be encrypted in big-endian order
-			unsigned_to_beu32( n, &sendBuffer[2 + 0 * sizeof(int)] );
-			unsigned_to_beu32( x, &sendBuffer[2 + 1 * sizeof(int)] );
-			unsigned_to_beu32( y, &sendBuffer[2 + 2 * sizeof(int)] );
-			if (m_verbose > 0) dump_hex( "Plaintext_BE: ", &sendBuffer[2], 12, "\n" );
-#endif
-			// Encrypt using appropriate key
-			btea( (unsigned int *)&sendBuffer[sendBuffDataOff], 3, g_cmd_keys[subCmd] );
-			if (m_verbose > 0)
-			{
-				printf( "k[%d]; ", subCmd );
-				dump_hex( "Cryptext:  ", &sendBuffer[sendBuffDataOff], 12, "\n" );
-			}
-			break;
-		// No data sent, length-prefixed reply expected
-		case 0x18:
-		case 0x11:
-		case 0x12:
-		case 0x14:
-			m_expectedReply = 1;
-			break;
-		// No data sent, no reply
-		case 0x21:
-		case 0x22:
-			break;
-	}
-
-	va_end( arglist );
-
-	sendBuffer[sendBuffStartOff+0] = dataLength;
-	sendBuffer[sendBuffStartOff+1] = cmd;
-
-	return Send( &sendBuffer[sendBuffStartOff], packetLength );
+// Encode and send command with no data
+template <class Cmd> static int _send_query( LicutIO& lio )
+{
+	unsigned char packet[Cmd::LENGTH];
+	Cmd::Encode( packet );
+	return lio.SendEncoded<Cmd>( packet );
 }
 
 int LicutIO::SendCmd_StartTransaction( void ) // 0x21: No reply
 {
-	return SendCmd( 0x21 );
+	return _send_query<LicutCmd_StartTransaction>( *this );
 }
 
 int LicutIO::SendCmd_EndTransaction( void ) // 0x22: No reply
 {
-	return SendCmd( 0x22 );
+	return _send_query<LicutCmd_EndTransaction>( *this );
 }
 
 int LicutIO::SendCmd_StatusRequest( unsigned int *cartridge_loaded, unsigned int *mat_loaded ) // 0x14: 4 byte reply, last byte is mat loaded
 {
 	m_pCartridgeLoaded = cartridge_loaded;
 	m_pMatLoaded = mat_loaded;
-	return SendCmd( 0x14 );
+	return _send_query<LicutCmd_StatusRequest>( *this );
 }
 
 int LicutIO::SendCmd_FirmwareVersion( unsigned int ver[3] ) // 0x12: 6 byte reply, 3 big-endian integer components, model number plus major.minor
 {
 	m_pVer = &ver[0];
-	return SendCmd( 0x12 );
+	return _send_query<LicutCmd_FirmwareVersion>( *this );
 }
 
 int LicutIO::SendCmd_MatBoundaries( unsigned int *x_min, unsigned int *y_min, unsigned int *x_max, unsigned int *y_max ) // 0x11: 8 byte reply, 4 big-endian int components
@@ -233,7 +168,7 @@ int LicutIO::SendCmd_MatBoundaries( unsigned int *x_min, unsigned int *y_min, un
 	m_pYMin = y_min;
 	m_pXMax = x_max;
 	m_pYMax = y_max;
-	return SendCmd( 0x11 );
+	return _send_query<LicutCmd_MatBoundaries>( *this );
 }
 
 int LicutIO::SendCmd_CartridgeName( unsigned int *cartridge_present, char cartridge_name[64], unsigned int *cartridge_version )
@@ -241,44 +176,92 @@ int LicutIO::SendCmd_CartridgeName( unsigned int *cartridge_present, char cartri
 	m_pCartridgePresent = cartridge_present;
 	m_cartridgeName = cartridge_name;
 	m_pCartridgeVersion = cartridge_version;
-	return SendCmd( 0x18 );
+	return _send_query<LicutCmd_CartridgeName>( *this );
 }
 
 int LicutIO::SendCmd_MoveCut( unsigned int subCmd, unsigned int x, unsigned int y ) // 0x40: 4 byte reply
 {
-	return SendCmd( 0x40, subCmd, x, y );
+	unsigned char packet[LICUT_MOVECUT_PACKET];
+	if (EncodeMoveCut( subCmd, x, y, packet ) < 0)
+	{
+		LICUT_ERROR( "Invalid subcmd %u\n", subCmd );
+		return -1;
+	}
+	if (m_verbose > 0) LICUT_DEBUG( "%s(%u,%u,%u)\n", __FUNCTION__, subCmd, x, y );
+	return SendPacket_MoveCut( packet );
+}
+
+// Build 0x40 packet ahead of time. Returns packet length or -1 if subCmd invalid
+int LicutIO::EncodeMoveCut( unsigned int subCmd, unsigned int x, unsigned int y, unsigned char packet[LICUT_MOVECUT_PACKET] )
+{
+	switch (subCmd)
+	{
+		case 0: return LicutCmd_MoveCut<0>::Encode( noise(), x, y, packet );
+		case 1: return LicutCmd_MoveCut<1>::Encode( noise(), x, y, packet );
+		case 2: return LicutCmd_MoveCut<2>::Encode( noise(), x, y, packet );
+		case 3: return LicutCmd_MoveCut<3>::Encode( noise(), x, y, packet );
+		case 4: return LicutCmd_MoveCut<4>::Encode( noise(), x, y, packet );
+		case 5: return LicutCmd_MoveCut<5>::Encode( noise(), x, y, packet );
+		case 6: return LicutCmd_MoveCut<6>::Encode( noise(), x, y, packet );
+		case 7: return LicutCmd_MoveCut<7>::Encode( noise(), x, y, packet );
+	}
+	return -1;
+}
+
+// Recover subCmd, x and y from a 0x40 packet. Returns 0 if successful
+int LicutIO::DecodeMoveCut( const unsigned char packet[LICUT_MOVECUT_PACKET], unsigned int& subCmd, unsigned int& x, unsigned int& y )
+{
+	if (packet[0] != 13 || packet[1] != 0x40) return -1;
+	for (unsigned int key = 0; key < 8; key++)
+	{
+		uint32_t v[3];
+		unsigned char data[12];
+		memcpy( v, &packet[2], sizeof(v) );
+		btea( v, -3, g_cmd_keys[key] );
+		memcpy( data, v, sizeof(data) );
+		unsigned int n = leu32_to_unsigned( &data[0] );
+		if (n < RANGE_BASE || n >= RANGE_TOP) continue;
+		subCmd = key;
+		x = leu32_to_unsigned( &data[4] );
+		y = leu32_to_unsigned( &data[8] );
+		return 0;
+	}
+	return -1;
 }
 
 // Read command reply. If none expected returns 0, but waits for minimum intercommand delay
-int LicutIO::ReadCmdReply( int verbose )
+int LicutIO::ReadCmdReply( int verbose, int drainMs /* = LICUT_REPLY_DRAIN_MS */ )
 {
 	int retValue = 0;
 	if (m_expectedReply > 0)
 	{
 		unsigned char binbuf[256];
+		double deadline = licut_now() * 1e3 + m_replyTimeout;
 		// Read length byte
-		if (verbose > 0) printf( "%s() reading length byte...\n", __FUNCTION__ );
-		int res = read( m_handle, binbuf, 1 );
+		if (verbose > 0) LICUT_DEBUG( "%s() reading length byte...\n", __FUNCTION__ );
+		errno = 0;
+		int res = ReadReply( binbuf, 1, deadline );
 		if (res < 1)
 		{
-			printf( "%s() expected %d length bytes from cmd %x, got %d (errno=%d - %s)\n",
+			if (m_replyTimeout > 0 && errno == 0) LICUT_WARN( "%s() no reply to cmd %x in %dms\n", __FUNCTION__, m_expectedReplyCmd, m_replyTimeout );
+			else LICUT_ERROR( "%s() expected %d length bytes from cmd %x, got %d (errno=%d - %s)\n",
 				__FUNCTION__, m_expectedReply, m_expectedReplyCmd, res, errno, strerror(errno) );
 			retValue = -1;
 		}
 		else
 		{
 			int bytesToRead = binbuf[0];
-			if (verbose > 0) printf( "%s() got length byte %d\n", __FUNCTION__, bytesToRead );
-			if (bytesToRead > sizeof(binbuf))
+			if (verbose > 0) LICUT_DEBUG( "%s() got length byte %d\n", __FUNCTION__, bytesToRead );
+			if (bytesToRead > (int)sizeof(binbuf))
 			{
-				printf( "%s() WARNING: truncating bytes to read from %d to %d\n",
-					__FUNCTION__, bytesToRead, sizeof(binbuf) );
+				LICUT_WARN( "%s() WARNING: truncating bytes to read from %d to %d\n",
+					__FUNCTION__, bytesToRead, (int)sizeof(binbuf) );
 				bytesToRead = sizeof(binbuf);
 			}
-			res = read( m_handle, binbuf, bytesToRead );
+			res = ReadReply( binbuf, bytesToRead, deadline );
 			if (res < bytesToRead || bytesToRead < 1)
 			{
-				printf( "%s() expected %d bytes from cmd %x, got %d (errno=%d - %s)\n",
+				LICUT_ERROR( "%s() expected %d bytes from cmd %x, got %d (errno=%d - %s)\n",
 					__FUNCTION__, m_expectedReply, m_expectedReplyCmd, res, errno, strerror(errno) );
 				retValue = -1;
 			}
@@ -286,15 +269,8 @@ int LicutIO::ReadCmdReply( int verbose )
 			{
 				retValue = 1;
 				unsigned offsetValue;
-				if (verbose > 0)
-				{
-					printf( "{" );
-					for (int n = 0; n < bytesToRead; n++)
-					{
-						printf( "%s%02x", n ? ", " : "", binbuf[n] );
-					}
-					printf( "}\n" );
-				}
+				char hex[sizeof(binbuf) * 4];
+				if (verbose > 0) LICUT_DEBUG( "{%s}\n", _fmt_hex( hex, sizeof(hex), binbuf, bytesToRead ) );
 				switch (m_expectedReplyCmd)
 				{
 					case 0x11: // Mat boundaries
@@ -318,7 +294,7 @@ int LicutIO::ReadCmdReply( int verbose )
 						offsetValue = beu_to_unsigned( &binbuf[2] );
 						if (offsetValue > sizeof(binbuf))
 						{
-							printf( "Error: got invalid offset value %u\n", offsetValue );
+							LICUT_ERROR( "Error: got invalid offset value %u\n", offsetValue );
 							*m_pCartridgeVersion = 0;
 							strcpy( m_cartridgeName, "ERROR" );
 						}
@@ -331,11 +307,83 @@ int LicutIO::ReadCmdReply( int verbose )
 						break;
 				}
 			}
-		}
+		}
+	}
+	// Drain for minimum 250ms unless told otherwise
+	if (drainMs > 0) Drain( verbose - 1, drainMs );
+	return retValue;
+}
+
+// Read up to length reply bytes. Returns bytes read
+int LicutIO::ReadReply( unsigned char *buff, int length, double deadline )
+{
+	// Without a timeout, one blocking read as always
+	if (m_replyTimeout <= 0)
+	{
+		int res = read( m_handle, buff, length );
+		return res < 0 ? 0 : res;
+	}
+	int got = 0;
+	while (got < length)
+	{
+		int ms = (int)(deadline - licut_now() * 1e3);
+		if (ms <= 0) break;
+		struct pollfd p;
+		p.fd = m_handle;
+		p.events = POLLIN;
+		p.revents = 0;
+		if (poll( &p, 1, ms ) <= 0) break;
+		int res = read( m_handle, &buff[got], length - got );
+		if (res <= 0) break;
+		got += res;
+	}
+	return got;
+}
+
+// Discard input until quiet, then probe with a status request. Returns 0 if the device answered
+int LicutIO::Resync( int verbose )
+{
+	int quietMs = m_replyTimeout > 0 && m_replyTimeout < 50 ? m_replyTimeout : 50;
+	int discarded = 0;
+	for (int n = 0; n < 100; n++)
+	{
+		int res = Drain( verbose - 1, quietMs );
+		if (res <= 0) break;
+		discarded += res;
+	}
+	unsigned int cartridgeLoaded = 0, matLoaded = 0;
+	SendCmd_StatusRequest( &cartridgeLoaded, &matLoaded );
+	int r = ReadCmdReply( verbose, 0 );
+	LICUT_WARN( "%s() discarded %d bytes, status probe %s\n", __FUNCTION__, discarded, r > 0 ? "answered" : "not answered" );
+	return r > 0 ? 0 : -1;
+}
+
+int LicutIO::WaitMatChange( int verbose, const char *matName, bool removeFirst /* = true */,
+	LicutMatListener *listener /* = NULL */, int pollMs /* = LICUT_MAT_POLL_MS */ )
+{
+	unsigned int cartridgeLoaded = 0;
+	unsigned int matLoaded = 0;
+	for (int phase = removeFirst ? 0 : 1; phase < 2; phase++)
+	{
+		bool prompted = false;
+		while (true)
+		{
+			SendCmd_StatusRequest( &cartridgeLoaded, &matLoaded );
+			if (ReadCmdReply( verbose ) < 0) return -1;
+			if (phase == 0 ? !matLoaded : matLoaded) break;
+			if (!prompted)
+			{
+				if (listener) listener->MatPrompt( phase );
+				else if (phase == 0) LICUT_INFO( "Remove mat and press 'Unload mat' key\n" );
+				else LICUT_INFO( "Insert %s and press 'Load mat' key\n", matName );
+				prompted = true;
+			}
+			if (!listener) usleep( pollMs * 1000 );
+			else if (!listener->MatWait( pollMs )) return -1;
+		}
 	}
-	// Drain for minimum 250ms
-	Drain( verbose - 1, 250 );
-	return retValue;
+	if (!listener) LICUT_INFO( "Loaded %s\n", matName );
+	return 0;
 }
 
 unsigned int LicutIO::beu_to_unsigned( unsigned char const *beu )
@@ -389,17 +437,13 @@ void LicutIO::unsigned_to_leu32( unsigned int u, unsigned char *leu )
 // Get a random big-endian number in the range Cricut expects (10000 - 32767)
 unsigned int LicutIO::noise()
 {
-#define RANGE_BASE	10001
-#define RANGE_TOP	32766
-#define RANGE_SIZE	(RANGE_TOP - RANGE_BASE)
+	// Counters are atomic so packets may be encoded on several threads
 	unsigned short udata;
 	static int serial = 0x44;
-	serial += 19;
-	udata = (unsigned short)serial;
+	udata = (unsigned short)__sync_add_and_fetch( &serial, 19 );
 	if (g_fixedNoise)
 	{
-		udata = (g_fixedNoise - RANGE_BASE);
-		g_fixedNoise++;
+		udata = (__sync_fetch_and_add( &g_fixedNoise, 1 ) - RANGE_BASE);
 	}
 	else
 	{
@@ -455,12 +499,7 @@ void LicutIO::btea(uint32_t *v, int n, uint32_t const k[4])
 // Dump values in hex to stdout
 void LicutIO::dump_hex( const char *prefix, unsigned char *data, int length, const char *suffix )
 {
-	if (prefix) printf( "%s", prefix );
-	int n;
-	for (n = 0; n < length; n++)
-	{
-		printf( "%s%02x", n ? ", " : "", data[n] );
-	}
-	if (suffix) printf( "%s", suffix );
+	char hex[1024];
+	LICUT_INFO( "%s%s%s", prefix ? prefix : "", _fmt_hex( hex, sizeof(hex), data, length ), suffix ? suffix : "" );
 }
 
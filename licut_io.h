@@ -20,17 +20,46 @@ Recv: 26 00 01 00 21 43 72 69 63 75 74 28 52 29 20 43
       (Cricut(R) Cake Basics)
 
 */
+#ifndef _LICUT_IO_H_
+#define _LICUT_IO_H_
+
+#include <stddef.h>
 #include <stdint.h>
 
+#include "licut_encode.h"
+
+class LicutTransport;
+
+// Length of an encoded 0x40 move/cut packet including length byte
+#define LICUT_MOVECUT_PACKET	14
+
+// Delay after each byte sent
+#define LICUT_BYTE_DELAY_US	1000
+
+// Minimum wait after each reply
+#define LICUT_REPLY_DRAIN_MS	250
+
+// Interval between status requests while waiting for the operator to change mats
+#define LICUT_MAT_POLL_MS	5000
+
+// Operator interaction while LicutIO::WaitMatChange() polls the device
+class LicutMatListener
+{
+public:
+	virtual ~LicutMatListener() {}
+	// Device is waiting for the mat to be removed (phase 0) or loaded (phase 1).
+	// Called once per phase
+	virtual void MatPrompt( int phase ) = 0;
+	// Wait up to ms before the next status request. Returns false to stop waiting
+	virtual bool MatWait( int ms ) = 0;
+};
+
 class LicutIO
 {
 public:
 	LicutIO( int handle );
 	~LicutIO() {};
 
-	// Send command with variable args. Returns bytes written and sets expected reply bytes
-	int SendCmd( unsigned char cmd, ... );
-
 	// Specific commands with args specified. These should be followed by ReadCmdReply()
 	int SendCmd_StartTransaction( void ); // 0x21: No reply
 	int SendCmd_EndTransaction( void ); // 0x22: No reply
@@ -38,14 +67,48 @@ public:
 	int SendCmd_FirmwareVersion( unsigned int ver[3] ); // 0x12: 6 byte reply, 3 big-endian integer components, model number plus major.minor
 	int SendCmd_MatBoundaries( unsigned int *x_min, unsigned int *y_min, unsigned int *x_max, unsigned int *y_max ); // 0x11: 8 byte reply, 4 big-endian int components
 	int SendCmd_CartridgeName( unsigned int *cartridge_present, char cartridge_name[64], unsigned int *cartridge_version ); // 0x18: 38 byte reply
-	int SendCmd_MoveCut( unsigned int subCmd, unsigned int x, unsigned int y ); // 0x40: 4 byte reply
+	int SendCmd_MoveCut( unsigned int subCmd, unsigned int x, unsigned int y ); // 0x40: 4 byte reply, -1 if subCmd invalid
+
+	// Send packet from Cmd::Encode() (see licut_encode.h). Returns bytes written.
+	// Should be followed by ReadCmdReply()
+	template <class Cmd> int SendEncoded( const unsigned char *packet ) { return SendPacket( Cmd::CMD, Cmd::REPLY, packet, Cmd::LENGTH ); }
+
+	// Build 0x40 packet as SendCmd_MoveCut() would send it, with noise and encryption,
+	// so it can be prepared ahead of time. Returns packet length or -1 if subCmd invalid
+	static int EncodeMoveCut( unsigned int subCmd, unsigned int x, unsigned int y, unsigned char packet[LICUT_MOVECUT_PACKET] );
+	// Recover subCmd, x and y from a 0x40 packet, as the device would, by finding the
+	// key which gives noise in range. Returns 0 if successful
+	static int DecodeMoveCut( const unsigned char packet[LICUT_MOVECUT_PACKET], unsigned int& subCmd, unsigned int& x, unsigned int& y );
+	// Send packet from EncodeMoveCut(). Should be followed by ReadCmdReply()
+	int SendPacket_MoveCut( const unsigned char packet[LICUT_MOVECUT_PACKET] ) { return SendEncoded<LicutCmd_MoveCutPacket>( packet ); }
 	
 	// Read command reply. If none expected returns 0, but waits for minimum intercommand delay
-	int ReadCmdReply( int verbose );
+	// (drainMs, 0 for none). Returns -1 if the reply is missing or truncated
+	int ReadCmdReply( int verbose, int drainMs = LICUT_REPLY_DRAIN_MS );
+
+	// Time allowed for a whole reply from the start of ReadCmdReply() in ms, 0 to
+	// wait indefinitely (the default)
+	void SetReplyTimeout( int ms ) { m_replyTimeout = ms; }
+	int GetReplyTimeout() const { return m_replyTimeout; }
+
+	// Recover from a lost or garbled reply: discard whatever arrives until the line
+	// is quiet, then check the device answers a status request. Returns 0 if it did
+	int Resync( int verbose );
+
+	// Wait for the mat to be removed (if removeFirst) and then for a mat to be
+	// loaded, as after an eject. The operator is prompted through listener, or
+	// through the log naming matName (e.g. "mat 2 of 4") if listener is NULL.
+	// Returns 0 once loaded, -1 if a status reply was missing or listener stopped
+	int WaitMatChange( int verbose, const char *matName, bool removeFirst = true,
+		LicutMatListener *listener = NULL, int pollMs = LICUT_MAT_POLL_MS );
 
 	// Low level packet send. Returns bytes sent reported by write()
 	int Send( const unsigned char *bytes, int length );
 
+	// Send through transport instead of pacing writes to the handle here. The
+	// handle must be transport's descriptor. Not owned
+	void SetTransport( LicutTransport *transport ) { m_transport = transport; }
+
 	// Drain whatever is in the receive buffer and display it to stdout as hex (and printable text if found)
 	int Drain( int verbose, int ms_timeout = 50 );
 
@@ -70,6 +133,10 @@ public:
 	// Set starting value for fixed pseudo-noise (linear with no randomness). 0 to use random noise
 	static void SetFixedNoiseStart( int n ) { g_fixedNoise = n; }
 
+	// Read up to length reply bytes, by deadline (CLOCK_MONOTONIC ms) if a reply
+	// timeout is set. Returns bytes read
+	int ReadReply( unsigned char *buff, int length, double deadline );
+
 	// Dump values in hex to stdout
 	static void dump_hex( const char *prefix, unsigned char *data, int length, const char *suffix );
 
@@ -77,8 +144,12 @@ public:
 	int GetVerbose() const { return m_verbose; }
 	void SetVerbose( int level ) { m_verbose = level; }
 protected:
+	// Send packet of length for cmd, setting up reply if one is expected
+	int SendPacket( unsigned char cmd, int reply, const unsigned char *packet, int length );
+
 	int m_handle;
-	int m_expectedReply; // Set by SendCmd - expected bytes in reply
+	LicutTransport *m_transport;
+	int m_expectedReply; // Set by SendPacket - expected bytes in reply
 	int m_expectedReplyCmd; // Command from which we're expecting a reply
 	// Return value pointers
 	unsigned int *m_pCartridgeLoaded; // Set by return from status query (0x14)
@@ -93,9 +164,11 @@ protected:
 	unsigned int *m_pCartridgeVersion;
 
 	int m_verbose; // Default verbosity
+	int m_replyTimeout;
 	// If nonzero, this is a fixed pseudo-noise value which increments on each fetch
 	static int g_fixedNoise;
 
 	static uint32_t g_cmd_keys[8][4];
 };
 
+#endif // _LICUT_IO_H_
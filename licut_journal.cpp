@@ -0,0 +1,179 @@
+// $Id$
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "licut_journal.h"
+#include "licut_cmdlist.h"
+#include "licut_log.h"
+#include "licut_time.h"
+
+// Records are fixed length so a torn last write is easy to spot
+#define JOURNAL_MAGIC	"licut-journal 1"
+#define ACK_FORMAT	"ack %10d\n"
+#define ACK_LENGTH	15
+#define DONE_RECORD	"done\n"
+
+#define FNV_OFFSET	0xcbf29ce484222325ULL
+#define FNV_PRIME	0x100000001b3ULL
+
+static uint64_t _fnv( uint64_t h, const void *data, size_t length )
+{
+	const unsigned char *p = (const unsigned char *)data;
+	for (size_t n = 0; n < length; n++)
+	{
+		h ^= p[n];
+		h *= FNV_PRIME;
+	}
+	return h;
+}
+
+// Hash unsigned value as 4 little-endian bytes so the hash does not depend on the host
+static uint64_t _fnv_u32( uint64_t h, unsigned int v )
+{
+	unsigned char b[4] = { (unsigned char)v, (unsigned char)(v >> 8), (unsigned char)(v >> 16), (unsigned char)(v >> 24) };
+	return _fnv( h, b, 4 );
+}
+
+LicutJournal::LicutJournal( int verbose )
+{
+	m_verbose = verbose;
+	m_handle = -1;
+	m_syncEvery = 16;
+	m_unsynced = 0;
+	m_records = 0;
+	m_syncs = 0;
+	m_overheadUs = 0;
+}
+
+LicutJournal::~LicutJournal()
+{
+	if (m_handle >= 0) close( m_handle );
+}
+
+// Job identity hash
+uint64_t LicutJournal::Hash( LicutCmdList const& cmds, unsigned int const mat[4], const char *options )
+{
+	uint64_t h = FNV_OFFSET;
+	for (int n = 0; n < 4; n++) h = _fnv_u32( h, mat[n] );
+	h = _fnv( h, options, strlen( options ) + 1 );
+	for (int n = 0; n < cmds.GetCount(); n++)
+	{
+		loweredCmd_t const *c = cmds.GetCmd( n );
+		h = _fnv_u32( h, c->subCmd | (c->groupStart << 8) | (c->delay << 16) );
+		h = _fnv_u32( h, c->x );
+		h = _fnv_u32( h, c->y );
+	}
+	return h;
+}
+
+// Read journal. Returns index of last acknowledged command, -1 if none, -2 if not this job
+int LicutJournal::Load( const char *path, uint64_t hash, bool& complete )
+{
+	complete = false;
+	FILE *f = fopen( path, "r" );
+	if (!f) return -2;
+	char line[1024];
+	unsigned long long fileHash = 0;
+	if (!fgets( line, sizeof(line), f ) || strncmp( line, JOURNAL_MAGIC " ", strlen( JOURNAL_MAGIC ) + 1 ) ||
+		sscanf( line + strlen( JOURNAL_MAGIC ), " hash %llx", &fileHash ) != 1)
+	{
+		LICUT_ERROR( "%s() %s is not a licut journal\n", __FUNCTION__, path );
+		fclose( f );
+		return -2;
+	}
+	if (fileHash != hash)
+	{
+		LICUT_ERROR( "%s() %s is for a different job (%016llx, this job is %016llx)\n", __FUNCTION__, path,
+			fileHash, (unsigned long long)hash );
+		fclose( f );
+		return -2;
+	}
+	int last = -1;
+	while (fgets( line, sizeof(line), f ))
+	{
+		int index;
+		// Only whole records count
+		if (strlen( line ) == ACK_LENGTH && line[ACK_LENGTH - 1] == '\n' && sscanf( line, "ack %d", &index ) == 1)
+		{
+			if (index > last) last = index;
+		}
+		else if (!strcmp( line, DONE_RECORD ))
+		{
+			complete = true;
+		}
+	}
+	fclose( f );
+	return last;
+}
+
+// Open journal for job. Returns 0 if successful
+int LicutJournal::Start( const char *path, uint64_t hash, int count, unsigned int const mat[4], const char *options, bool append )
+{
+	if (m_handle >= 0) close( m_handle );
+	m_handle = open( path, O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0644 );
+	if (m_handle < 0)
+	{
+		LICUT_ERROR( "%s() cannot open %s: %s\n", __FUNCTION__, path, strerror( errno ) );
+		return -1;
+	}
+	m_unsynced = 0;
+	m_records = 0;
+	m_syncs = 0;
+	m_overheadUs = 0;
+	if (!append)
+	{
+		char header[1024];
+		int len = snprintf( header, sizeof(header), JOURNAL_MAGIC " hash %016llx commands %d mat %u,%u,%u,%u\noptions %s\n",
+			(unsigned long long)hash, count, mat[0], mat[1], mat[2], mat[3], options );
+		if (len >= (int)sizeof(header)) len = sizeof(header) - 1;
+		if (write( m_handle, header, len ) != len || fsync( m_handle ) != 0)
+		{
+			LICUT_ERROR( "%s() cannot write %s: %s\n", __FUNCTION__, path, strerror( errno ) );
+			close( m_handle );
+			m_handle = -1;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Record command index as acknowledged
+void LicutJournal::Acked( int index )
+{
+	if (m_handle < 0) return;
+	double t0 = licut_now() * 1e6;
+	char record[ACK_LENGTH + 1];
+	snprintf( record, sizeof(record), ACK_FORMAT, index );
+	if (write( m_handle, record, ACK_LENGTH ) == ACK_LENGTH) m_records++;
+	else if (m_verbose) LICUT_ERROR( "%s() write failed: %s\n", __FUNCTION__, strerror( errno ) );
+	if (++m_unsynced >= m_syncEvery)
+	{
+		fdatasync( m_handle );
+		m_syncs++;
+		m_unsynced = 0;
+	}
+	m_overheadUs += licut_now() * 1e6 - t0;
+}
+
+// Sync and close journal. Returns 0 if successful
+int LicutJournal::Finish( bool complete )
+{
+	if (m_handle < 0) return -1;
+	double t0 = licut_now() * 1e6;
+	int r = 0;
+	if (complete && write( m_handle, DONE_RECORD, strlen( DONE_RECORD ) ) != (ssize_t)strlen( DONE_RECORD )) r = -1;
+	if (fsync( m_handle ) != 0) r = -1;
+	m_syncs++;
+	close( m_handle );
+	m_handle = -1;
+	m_overheadUs += licut_now() * 1e6 - t0;
+	return r;
+}
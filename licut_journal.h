@@ -0,0 +1,55 @@
+// $Id$
+// Append-only job journal for resuming an interrupted cut
+
+#ifndef _LICUT_JOURNAL_H_
+#define _LICUT_JOURNAL_H_
+
+#include <stdint.h>
+
+#include "licut_cmdlist.h"
+
+class LicutJournal : public LicutSendListener
+{
+public:
+	LicutJournal( int verbose );
+	~LicutJournal();
+
+	// Job identity: FNV-1a hash of the commands to send (which follow from the
+	// design, mat bounds and options), the mat bounds and the options text
+	static uint64_t Hash( LicutCmdList const& cmds, unsigned int const mat[4], const char *options );
+
+	// Read journal at path. Returns index of the last acknowledged command, -1 if
+	// none was, or -2 if there is no journal for job hash. complete is set if the
+	// job finished
+	int Load( const char *path, uint64_t hash, bool& complete );
+
+	// Open journal for job, truncating it unless append is set (to continue after
+	// Load()). Returns 0 if successful
+	int Start( const char *path, uint64_t hash, int count, unsigned int const mat[4], const char *options, bool append );
+
+	// Record command index as acknowledged. Records are written as they come and
+	// synced to disk every syncEvery records, so a killed process loses none and a
+	// host crash at most syncEvery - 1
+	void Acked( int index );
+
+	// Sync and close journal, marking the job done if complete. Returns 0 if successful
+	int Finish( bool complete );
+
+	void SetSyncEvery( int records ) { m_syncEvery = records > 0 ? records : 1; }
+
+	int GetRecordCount() const { return m_records; }
+	int GetSyncCount() const { return m_syncs; }
+	// Time spent in Acked() and Finish()
+	double GetOverheadMs() const { return m_overheadUs / 1000.0; }
+
+protected:
+	int m_verbose;
+	int m_handle;
+	int m_syncEvery;
+	int m_unsynced;
+	int m_records;
+	int m_syncs;
+	double m_overheadUs;
+};
+
+#endif // _LICUT_JOURNAL_H_
@@ -0,0 +1,194 @@
+// $Id$
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+
+#include "licut_log.h"
+
+#define SLOT_MASK	(LICUT_LOG_SLOTS - 1)
+
+// Bounded queue for any number of writers and one reader. Each slot's sequence
+// tells whose turn it is: pos when free for the writer claiming pos, pos + 1
+// once that message is ready for the reader
+typedef struct _logSlot
+{
+	volatile unsigned long seq;
+	int length;
+	char text[LICUT_LOG_SLOT];
+} logSlot_t;
+
+static logSlot_t g_slots[LICUT_LOG_SLOTS];
+static volatile unsigned long g_head = 0;
+static volatile unsigned long g_tail = 0;
+// Position written and flushed by the log thread
+static volatile unsigned long g_flushed = 0;
+static volatile int g_stopping = 0;
+static sem_t g_wake;
+static pthread_t g_thread;
+
+LicutLogSink volatile LicutLog::g_sink = NULL;
+void * volatile LicutLog::g_sinkCtx = NULL;
+volatile int LicutLog::g_running = 0;
+volatile unsigned long LicutLog::g_dropped = 0;
+
+// Format message and queue it, or write it directly if the log thread is not running
+void LicutLog::Write( int level, const char *fmt, ... )
+{
+	va_list args;
+	va_start( args, fmt );
+	LicutLogSink sink = g_sink;
+	if (sink)
+	{
+		char text[LICUT_LOG_SLOT];
+		vsnprintf( text, sizeof(text), fmt, args );
+		va_end( args );
+		sink( g_sinkCtx, level, text );
+		return;
+	}
+	if (!g_running)
+	{
+		vprintf( fmt, args );
+		va_end( args );
+		return;
+	}
+	unsigned long pos = g_head;
+	logSlot_t *slot;
+	int waited = 0;
+	for (;;)
+	{
+		slot = &g_slots[pos & SLOT_MASK];
+		long diff = (long)(slot->seq - pos);
+		if (diff == 0)
+		{
+			if (__sync_bool_compare_and_swap( &g_head, pos, pos + 1 )) break;
+			pos = g_head;
+		}
+		else if (diff < 0)
+		{
+			// Full: give the log thread a moment, then drop rather than stall the caller
+			if (waited >= LICUT_LOG_FULL_YIELDS)
+			{
+				__sync_fetch_and_add( &g_dropped, 1 );
+				va_end( args );
+				return;
+			}
+			sem_post( &g_wake );
+			sched_yield();
+			waited++;
+			pos = g_head;
+		}
+		else
+		{
+			pos = g_head;
+		}
+	}
+	int length = vsnprintf( slot->text, sizeof(slot->text), fmt, args );
+	va_end( args );
+	if (length >= (int)sizeof(slot->text))
+	{
+		length = sizeof(slot->text) - 1;
+		slot->text[length - 1] = '\n';
+	}
+	slot->length = length < 0 ? 0 : length;
+	__sync_synchronize();
+	slot->seq = pos + 1;
+	sem_post( &g_wake );
+}
+
+// Write messages queued so far. Called only by the log thread, or after it stopped
+int LicutLog::WriteQueued()
+{
+	int written = 0;
+	static unsigned long reportedDrops = 0;
+	for (;;)
+	{
+		logSlot_t *slot = &g_slots[g_tail & SLOT_MASK];
+		if (slot->seq != g_tail + 1) break;
+		__sync_synchronize();
+		fwrite( slot->text, 1, slot->length, stdout );
+		__sync_synchronize();
+		slot->seq = g_tail + LICUT_LOG_SLOTS;
+		g_tail = g_tail + 1;
+		written++;
+	}
+	if (g_dropped != reportedDrops)
+	{
+		unsigned long dropped = g_dropped;
+		printf( "(%lu log messages dropped)\n", dropped - reportedDrops );
+		reportedDrops = dropped;
+		written++;
+	}
+	if (written) fflush( stdout );
+	return written;
+}
+
+void *LicutLog::WriterThread( void *arg )
+{
+	(void)arg;
+	while (!g_stopping)
+	{
+		sem_wait( &g_wake );
+		WriteQueued();
+		g_flushed = g_tail;
+	}
+	WriteQueued();
+	g_flushed = g_tail;
+	return NULL;
+}
+
+// Start log thread. Returns 0 if successful
+int LicutLog::Start()
+{
+	if (g_running) return 0;
+	for (unsigned long n = 0; n < LICUT_LOG_SLOTS; n++) g_slots[n].seq = n;
+	g_head = 0;
+	g_tail = 0;
+	g_flushed = 0;
+	g_stopping = 0;
+	// Output written directly so far goes out first
+	fflush( stdout );
+	if (sem_init( &g_wake, 0, 0 ) != 0) return -1;
+	if (pthread_create( &g_thread, NULL, WriterThread, NULL ) != 0)
+	{
+		sem_destroy( &g_wake );
+		return -1;
+	}
+	g_running = 1;
+	return 0;
+}
+
+// Write queued messages and stop log thread
+void LicutLog::Stop()
+{
+	if (!g_running) return;
+	// Messages from here on are written directly
+	g_running = 0;
+	g_stopping = 1;
+	sem_post( &g_wake );
+	pthread_join( g_thread, NULL );
+	// Any writer that saw g_running just before it was cleared
+	WriteQueued();
+	sem_destroy( &g_wake );
+}
+
+// Wait until messages queued so far are written
+void LicutLog::Flush()
+{
+	if (!g_running)
+	{
+		fflush( stdout );
+		return;
+	}
+	unsigned long pos = g_head;
+	while ((long)(g_flushed - pos) < 0 && g_running)
+	{
+		sem_post( &g_wake );
+		usleep( 500 );
+	}
+}
@@ -0,0 +1,71 @@
+// $Id$
+// Logging with compile-time levels, queued to a background writer
+
+#ifndef _LICUT_LOG_H_
+#define _LICUT_LOG_H_
+
+#define LICUT_LOG_ERROR	0
+#define LICUT_LOG_WARN	1
+#define LICUT_LOG_INFO	2
+#define LICUT_LOG_DEBUG	3
+#define LICUT_LOG_TRACE	4
+
+// Highest level compiled in (make LOG_LEVEL=n). Calls above it generate no
+// code, including evaluation of their arguments
+#ifndef LICUT_LOG_LEVEL
+#define LICUT_LOG_LEVEL	LICUT_LOG_TRACE
+#endif
+
+// Message text is truncated to fit a ring slot
+#define LICUT_LOG_SLOT	1024
+// Ring size, must be a power of 2
+#define LICUT_LOG_SLOTS	256
+// Times a writer yields to the log thread while the ring is full. Messages are
+// dropped (and counted) after that
+#define LICUT_LOG_FULL_YIELDS	1000
+
+#define LICUT_LOG( level, ... ) do { if ((level) <= LICUT_LOG_LEVEL) LicutLog::Write( (level), __VA_ARGS__ ); } while (0)
+#define LICUT_ERROR( ... )	LICUT_LOG( LICUT_LOG_ERROR, __VA_ARGS__ )
+#define LICUT_WARN( ... )	LICUT_LOG( LICUT_LOG_WARN, __VA_ARGS__ )
+#define LICUT_INFO( ... )	LICUT_LOG( LICUT_LOG_INFO, __VA_ARGS__ )
+#define LICUT_DEBUG( ... )	LICUT_LOG( LICUT_LOG_DEBUG, __VA_ARGS__ )
+#define LICUT_TRACE( ... )	LICUT_LOG( LICUT_LOG_TRACE, __VA_ARGS__ )
+
+// Receives each message instead of stdout, see LicutLog::SetSink()
+typedef void (*LicutLogSink)( void *ctx, int level, const char *text );
+
+// Runtime verbosity stays with the callers (m_verbose etc.); levels only
+// decide what is compiled in.
+class LicutLog
+{
+public:
+	// Format message. Until Start() it is written to stdout directly, after that
+	// it is queued without locking or blocking and written by the log thread
+	static void Write( int level, const char *fmt, ... ) __attribute__(( format( printf, 2, 3 ) ));
+
+	// Pass messages to sink, called in the writer's thread, instead of writing
+	// them to stdout. NULL restores stdout
+	static void SetSink( LicutLogSink sink, void *ctx ) { g_sinkCtx = ctx; g_sink = sink; }
+
+	// Start log thread. Returns 0 if successful
+	static int Start();
+	// Write queued messages and stop log thread. Safe to call more than once
+	static void Stop();
+	// Wait until messages queued so far are written, e.g. before printing
+	// directly to stdout
+	static void Flush();
+
+	static unsigned long GetDropped() { return g_dropped; }
+
+protected:
+	static void *WriterThread( void *arg );
+	// Write messages queued so far. Returns number written
+	static int WriteQueued();
+
+	static LicutLogSink volatile g_sink;
+	static void * volatile g_sinkCtx;
+	static volatile int g_running;
+	static volatile unsigned long g_dropped;
+};
+
+#endif // _LICUT_LOG_H_
@@ -0,0 +1,288 @@
+// $Id$
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+#include "licut_nest.h"
+#include "licut_svg.h"
+#include "licut_log.h"
+
+// Slack allowed when comparing positions against the packing area
+#define FIT_EPSILON	1e-6
+
+// Order copies for packing: longest side first, then largest area
+class _pack_less
+{
+public:
+	_pack_less( double const (*size)[2] ) : m_size( size ) {}
+	bool operator()( int a, int b ) const
+	{
+		double la = m_size[a][0] > m_size[a][1] ? m_size[a][0] : m_size[a][1];
+		double lb = m_size[b][0] > m_size[b][1] ? m_size[b][0] : m_size[b][1];
+		if (la != lb) return la > lb;
+		return m_size[a][0] * m_size[a][1] > m_size[b][0] * m_size[b][1];
+	}
+	double const (*m_size)[2];
+};
+
+LicutNest::LicutNest( int verbose )
+{
+	m_verbose = verbose;
+	m_designs = NULL;
+	m_designCount = 0;
+	m_placements = NULL;
+	m_placementCount = 0;
+	m_rotatedCount = 0;
+	m_sky = NULL;
+	m_skyCount = 0;
+	m_skyAlloc = 0;
+	m_width = 0;
+	m_height = 0;
+	m_utilization = 0;
+	m_usedHeight = 0;
+}
+
+LicutNest::~LicutNest()
+{
+	free( m_designs );
+	free( m_placements );
+	free( m_sky );
+}
+
+// Add quantity copies of svg to the queue. Returns 0 if successful
+int LicutNest::AddDesign( LicutSVG const *svg, const char *name, int quantity, double unitsX, double unitsY )
+{
+	if (!svg || quantity <= 0 || unitsX <= 0 || unitsY <= 0) return -1;
+	design_t d;
+	memset( &d, 0, sizeof(d) );
+	bool first = true;
+	for (int n = 0; n < svg->GetDrawSetCount(); n++)
+	{
+		for (drawSet_t const *set = svg->GetDrawSet( n ); set && set->type != 0; set++)
+		{
+			for (int i = 0; i < set->numPoints; i++)
+			{
+				double const *p = set->pt[i];
+				if (first || p[0] < d.box[0]) d.box[0] = p[0];
+				if (first || p[1] < d.box[1]) d.box[1] = p[1];
+				if (first || p[0] > d.box[2]) d.box[2] = p[0];
+				if (first || p[1] > d.box[3]) d.box[3] = p[1];
+				first = false;
+			}
+		}
+	}
+	if (first)
+	{
+		LICUT_ERROR( "%s() %s has nothing to cut\n", __FUNCTION__, name );
+		return -1;
+	}
+	d.svg = svg;
+	strncpy( d.name, name, sizeof(d.name) - 1 );
+	d.quantity = quantity;
+	d.unitsX = unitsX;
+	d.unitsY = unitsY;
+	d.width = (d.box[2] - d.box[0]) * unitsX;
+	d.height = (d.box[3] - d.box[1]) * unitsY;
+	design_t *newDesigns = (design_t *)realloc( m_designs, (m_designCount + 1) * sizeof(design_t) );
+	if (!newDesigns) return -1;
+	m_designs = newDesigns;
+	m_designs[m_designCount++] = d;
+	if (m_verbose) LICUT_DEBUG( "%s() %s: %d copies of %.0f x %.0f\n", __FUNCTION__, name, quantity, d.width, d.height );
+	return 0;
+}
+
+// Lowest position for w x h starting at skyline segment index, or -1 if it does not fit
+double LicutNest::Fit( int index, double w, double h ) const
+{
+	double x = m_sky[index].x;
+	if (x + w > m_width + FIT_EPSILON) return -1;
+	double y = 0;
+	for (int i = index; i < m_skyCount && m_sky[i].x < x + w - FIT_EPSILON; i++)
+	{
+		if (m_sky[i].y > y) y = m_sky[i].y;
+	}
+	if (y + h > m_height + FIT_EPSILON) return -1;
+	return y;
+}
+
+// Raise skyline over x..x+w to y. x is always the start of a segment
+void LicutNest::Place( double x, double w, double y )
+{
+	if (m_skyCount + 2 > m_skyAlloc)
+	{
+		m_skyAlloc = (m_skyCount + 2) * 2;
+		m_sky = (skyline_t *)realloc( m_sky, m_skyAlloc * sizeof(skyline_t) );
+	}
+	int i = 0;
+	while (i < m_skyCount && m_sky[i].x < x - FIT_EPSILON) i++;
+	// Segments covered by the new one are removed, and one straddling its end trimmed
+	int j = i;
+	while (j < m_skyCount && m_sky[j].x + m_sky[j].width <= x + w + FIT_EPSILON) j++;
+	if (j < m_skyCount && m_sky[j].x < x + w)
+	{
+		m_sky[j].width -= x + w - m_sky[j].x;
+		m_sky[j].x = x + w;
+	}
+	memmove( &m_sky[i + 1], &m_sky[j], (m_skyCount - j) * sizeof(skyline_t) );
+	m_skyCount += 1 - (j - i);
+	m_sky[i].x = x;
+	m_sky[i].y = y;
+	m_sky[i].width = w;
+	// Merge neighbours at the same level
+	int out = 0;
+	for (int k = 0; k < m_skyCount; k++)
+	{
+		if (out > 0 && fabs( m_sky[out - 1].y - m_sky[k].y ) <= FIT_EPSILON)
+		{
+			m_sky[out - 1].width += m_sky[k].width;
+			continue;
+		}
+		m_sky[out++] = m_sky[k];
+	}
+	m_skyCount = out;
+}
+
+// Place as many queued copies as fit. Returns number of copies placed
+int LicutNest::Pack( double width, double height, double spacing, bool rotate )
+{
+	m_placementCount = 0;
+	m_rotatedCount = 0;
+	m_utilization = 0;
+	m_usedHeight = 0;
+	m_width = width;
+	m_height = height;
+	int total = 0;
+	int d;
+	for (d = 0; d < m_designCount; d++)
+	{
+		m_designs[d].placed = 0;
+		total += m_designs[d].quantity;
+	}
+	if (total == 0 || width <= 0 || height <= 0) return 0;
+
+	// Copies are packed with the spacing added to their size, and the area grown by
+	// the same amount so the last row and column need no gap
+	int *queue = (int *)malloc( total * sizeof(int) );
+	double (*size)[2] = (double (*)[2])malloc( m_designCount * sizeof(size[0]) );
+	bool *full = (bool *)calloc( m_designCount, sizeof(bool) );
+	free( m_placements );
+	m_placements = (placement_t *)malloc( total * sizeof(placement_t) );
+	if (!queue || !size || !full || !m_placements)
+	{
+		LICUT_ERROR( "%s() failed to allocate for %d copies\n", __FUNCTION__, total );
+		free( queue );
+		free( size );
+		free( full );
+		return 0;
+	}
+	int q = 0;
+	for (d = 0; d < m_designCount; d++)
+	{
+		size[d][0] = m_designs[d].width;
+		size[d][1] = m_designs[d].height;
+		for (int n = 0; n < m_designs[d].quantity; n++) queue[q++] = d;
+	}
+	std::stable_sort( queue, queue + total, _pack_less( size ) );
+	m_width = width + spacing;
+	m_height = height + spacing;
+	m_skyCount = 0;
+	Place( 0, m_width, 0 );
+
+	double covered = 0;
+	double top = 0;
+	for (q = 0; q < total; q++)
+	{
+		d = queue[q];
+		// The skyline only rises, so once a design does not fit no copy of it will
+		if (full[d]) continue;
+		double w = size[d][0] + spacing;
+		double h = size[d][1] + spacing;
+		int bestIndex = -1;
+		bool bestRotated = false;
+		double bestY = 0;
+		double bestTop = 0;
+		for (int turn = 0; turn < (rotate && w != h ? 2 : 1); turn++)
+		{
+			double tw = turn ? h : w;
+			double th = turn ? w : h;
+			for (int i = 0; i < m_skyCount; i++)
+			{
+				double y = Fit( i, tw, th );
+				if (y < 0) continue;
+				// Lowest top edge, then leftmost
+				if (bestIndex < 0 || y + th < bestTop - FIT_EPSILON ||
+					(y + th <= bestTop + FIT_EPSILON && m_sky[i].x < m_sky[bestIndex].x))
+				{
+					bestIndex = i;
+					bestRotated = (turn == 1);
+					bestY = y;
+					bestTop = y + th;
+				}
+			}
+		}
+		if (bestIndex < 0)
+		{
+			full[d] = true;
+			continue;
+		}
+		placement_t& p = m_placements[m_placementCount++];
+		p.design = d;
+		p.x = m_sky[bestIndex].x;
+		p.y = bestY;
+		p.rotated = bestRotated;
+		double pw = bestRotated ? h : w;
+		double ph = bestRotated ? w : h;
+		Place( p.x, pw, p.y + ph );
+		if (p.y + ph - spacing > top) top = p.y + ph - spacing;
+		covered += size[d][0] * size[d][1];
+		m_designs[d].placed++;
+		if (bestRotated) m_rotatedCount++;
+	}
+	m_width = width;
+	m_height = height;
+	m_utilization = covered / (width * height);
+	m_usedHeight = top;
+	free( queue );
+	free( size );
+	free( full );
+	return m_placementCount;
+}
+
+// Add draw sets of all placed copies to sheet. Returns 0 if successful
+int LicutNest::BuildSheet( LicutSVG& sheet ) const
+{
+	sheet.SetSize( (unsigned int)ceil( m_width ), (unsigned int)ceil( m_height ) );
+	for (int k = 0; k < m_placementCount; k++)
+	{
+		placement_t const& p = m_placements[k];
+		design_t const& d = m_designs[p.design];
+		double m[6];
+		if (p.rotated)
+		{
+			// Quarter turn: user y runs along output x, user x along output y
+			m[0] = 0;
+			m[1] = d.unitsX;
+			m[2] = -d.unitsY;
+			m[3] = 0;
+			m[4] = p.x + d.box[3] * d.unitsY;
+			m[5] = p.y - d.box[0] * d.unitsX;
+		}
+		else
+		{
+			m[0] = d.unitsX;
+			m[1] = 0;
+			m[2] = 0;
+			m[3] = d.unitsY;
+			m[4] = p.x - d.box[0] * d.unitsX;
+			m[5] = p.y - d.box[1] * d.unitsY;
+		}
+		for (int n = 0; n < d.svg->GetDrawSetCount(); n++)
+		{
+			if (sheet.AddDrawSet( d.svg->GetDrawSet( n ), m ) != 0) return -1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,87 @@
+// $Id$
+// Nesting of design copies onto a mat at true size
+
+#ifndef _LICUT_NEST_H_
+#define _LICUT_NEST_H_
+
+class LicutSVG;
+
+class LicutNest
+{
+public:
+	LicutNest( int verbose );
+	~LicutNest();
+
+	// Add quantity copies of svg (which must outlive this object) to the queue.
+	// unitsX and unitsY are output units per svg user unit. Returns 0 if successful
+	int AddDesign( LicutSVG const *svg, const char *name, int quantity, double unitsX, double unitsY );
+
+	// Place as many queued copies as fit in width x height (output units) with
+	// spacing between them, largest first, using a bottom-left skyline heuristic on
+	// bounding boxes. Copies may be turned by 90 degrees if rotate is set.
+	// Returns number of copies placed
+	int Pack( double width, double height, double spacing, bool rotate );
+
+	// Add draw sets of all placed copies to sheet in output units, with the sheet
+	// size set to the packing area. Returns 0 if successful
+	int BuildSheet( LicutSVG& sheet ) const;
+
+	// Results of last Pack()
+	int GetDesignCount() const { return m_designCount; }
+	const char *GetDesignName( int design ) const { return m_designs[design].name; }
+	int GetRequested( int design ) const { return m_designs[design].quantity; }
+	int GetPlaced( int design ) const { return m_designs[design].placed; }
+	int GetPlacedCount() const { return m_placementCount; }
+	int GetRotatedCount() const { return m_rotatedCount; }
+	// Fraction of packing area covered by bounding boxes of placed copies
+	double GetUtilization() const { return m_utilization; }
+	// Height used from the start of the mat feed
+	double GetUsedHeight() const { return m_usedHeight; }
+
+protected:
+	typedef struct _design
+	{
+		LicutSVG const *svg;
+		char name[64];
+		int quantity;
+		int placed;
+		double unitsX, unitsY; // Output units per user unit
+		double box[4]; // Bounds in user units: xmin, ymin, xmax, ymax
+		double width, height; // Size in output units
+	} design_t;
+
+	typedef struct _placement
+	{
+		int design;
+		double x, y; // Bottom left in output units
+		bool rotated;
+	} placement_t;
+
+	// Skyline segment: level y from x to x + width
+	typedef struct _skyline
+	{
+		double x, y, width;
+	} skyline_t;
+
+	// Lowest position for w x h starting at skyline segment index, or -1 if it does not fit
+	double Fit( int index, double w, double h ) const;
+	// Raise skyline over x..x+w to y
+	void Place( double x, double w, double y );
+
+protected:
+	int m_verbose;
+	design_t *m_designs;
+	int m_designCount;
+	placement_t *m_placements;
+	int m_placementCount;
+	int m_rotatedCount;
+	skyline_t *m_sky;
+	int m_skyCount;
+	int m_skyAlloc;
+	double m_width;
+	double m_height;
+	double m_utilization;
+	double m_usedHeight;
+};
+
+#endif // _LICUT_NEST_H_
@@ -0,0 +1,586 @@
+// $Id$
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <algorithm>
+
+#include "licut_order.h"
+#include "licut_svg.h"
+#include "licut_geom.h"
+#include "licut_log.h"
+#include "licut_time.h"
+
+// Closed contours offer at most this many start points to the tour
+#define MAX_CONTOUR_STARTS	16
+
+// Tour positions searched by improvement passes
+#define TWO_OPT_WINDOW	50
+#define OR_OPT_WINDOW	30
+#define OR_OPT_MAX_CHAIN	3
+
+// Compare candidates along x or y for k-d tree construction
+class _axis_less
+{
+public:
+	_axis_less( int axis ) : m_axis( axis ) {}
+	template <class T> bool operator()( T const& a, T const& b ) const { return a.pt[m_axis] < b.pt[m_axis]; }
+	int m_axis;
+};
+
+// Compare draw sets by band, then position within band
+class _band_less
+{
+public:
+	_band_less( int const *band, double const *key ) : m_band( band ), m_key( key ) {}
+	bool operator()( int a, int b ) const
+	{
+		if (m_band[a] != m_band[b]) return m_band[a] < m_band[b];
+		return m_key[a] < m_key[b];
+	}
+	int const *m_band;
+	double const *m_key;
+};
+
+LicutOrder::LicutOrder( int verbose )
+{
+	m_verbose = verbose;
+	m_units = 0;
+	m_cand = NULL;
+	m_alive = NULL;
+	m_dead = NULL;
+	m_candCount = 0;
+	m_tour = NULL;
+	m_entry = NULL;
+	m_exit = NULL;
+	m_flipped = NULL;
+	m_closed = NULL;
+	m_fixed = NULL;
+	m_rotate = NULL;
+	m_deadline = 0;
+	m_maxPasses = 0;
+	m_travelBefore = 0;
+	m_travelAfter = 0;
+	m_feedBefore = 0;
+	m_feedAfter = 0;
+	m_feedReversalsBefore = 0;
+	m_feedReversalsAfter = 0;
+	m_elapsedMs = 0;
+}
+
+LicutOrder::~LicutOrder()
+{
+	Free();
+}
+
+void LicutOrder::Free()
+{
+	free( m_cand );
+	free( m_alive );
+	free( m_dead );
+	free( m_tour );
+	free( m_entry );
+	free( m_exit );
+	free( m_flipped );
+	free( m_closed );
+	free( m_fixed );
+	free( m_rotate );
+	m_cand = NULL;
+	m_alive = NULL;
+	m_dead = NULL;
+	m_tour = NULL;
+	m_entry = NULL;
+	m_exit = NULL;
+	m_flipped = NULL;
+	m_closed = NULL;
+	m_fixed = NULL;
+	m_rotate = NULL;
+	m_units = 0;
+	m_candCount = 0;
+}
+
+double LicutOrder::Dist( double const a[2], double const b[2] )
+{
+	double dx = a[0] - b[0];
+	double dy = a[1] - b[1];
+	return sqrt( dx * dx + dy * dy );
+}
+
+bool LicutOrder::OutOfTime() const
+{
+	return m_maxPasses <= 0 && licut_now() > m_deadline;
+}
+
+// Build implicit k-d tree over m_cand[lo..hi). Each index is the median of exactly
+// one subtree, so m_alive[median] holds the live candidate count of that subtree
+void LicutOrder::BuildTree( int lo, int hi, int axis )
+{
+	if (hi <= lo) return;
+	int mid = (lo + hi) / 2;
+	if (hi - lo > 1)
+	{
+		std::nth_element( m_cand + lo, m_cand + mid, m_cand + hi, _axis_less( axis ) );
+		BuildTree( lo, mid, 1 - axis );
+		BuildTree( mid + 1, hi, 1 - axis );
+	}
+	m_alive[mid] = hi - lo;
+}
+
+// Find nearest live candidate to pt in m_cand[lo..hi)
+void LicutOrder::Nearest( int lo, int hi, int axis, double const pt[2], int& best, double& bestDist2 ) const
+{
+	if (hi <= lo) return;
+	int mid = (lo + hi) / 2;
+	if (m_alive[mid] == 0) return;
+	candidate_t const& c = m_cand[mid];
+	double dx = pt[0] - c.pt[0];
+	double dy = pt[1] - c.pt[1];
+	if (!m_dead[mid] && dx * dx + dy * dy < bestDist2)
+	{
+		bestDist2 = dx * dx + dy * dy;
+		best = mid;
+	}
+	double diff = pt[axis] - c.pt[axis];
+	if (diff < 0)
+	{
+		Nearest( lo, mid, 1 - axis, pt, best, bestDist2 );
+		if (diff * diff < bestDist2) Nearest( mid + 1, hi, 1 - axis, pt, best, bestDist2 );
+	}
+	else
+	{
+		Nearest( mid + 1, hi, 1 - axis, pt, best, bestDist2 );
+		if (diff * diff < bestDist2) Nearest( lo, mid, 1 - axis, pt, best, bestDist2 );
+	}
+}
+
+// Remove candidate at index from tree counts
+void LicutOrder::Remove( int index )
+{
+	if (m_dead[index]) return;
+	m_dead[index] = true;
+	int lo = 0;
+	int hi = m_candCount;
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		m_alive[mid]--;
+		if (index == mid) break;
+		if (index < mid) hi = mid;
+		else lo = mid + 1;
+	}
+}
+
+// Reverse tour positions i..j inclusive, flipping open units
+void LicutOrder::ReverseSpan( int i, int j )
+{
+	std::reverse( m_tour + i, m_tour + j + 1 );
+	for (int k = i; k <= j; k++)
+	{
+		int u = m_tour[k];
+		if (m_closed[u]) continue;
+		double t[2] = { m_entry[u][0], m_entry[u][1] };
+		m_entry[u][0] = m_exit[u][0];
+		m_entry[u][1] = m_exit[u][1];
+		m_exit[u][0] = t[0];
+		m_exit[u][1] = t[1];
+		m_flipped[u] = !m_flipped[u];
+	}
+}
+
+// Windowed 2-opt: reversing positions i..j replaces edges (i-1,i) and (j,j+1)
+// with (i-1,j) and (i,j+1). Returns total gain
+double LicutOrder::TwoOptPass( double const start[2] )
+{
+	double gain = 0;
+	int n = m_units;
+	for (int i = 0; i < n - 1; i++)
+	{
+		if ((i & 255) == 0 && OutOfTime()) break;
+		double const *prevExit = i ? m_exit[m_tour[i - 1]] : start;
+		for (int j = i + 1; j < n && j <= i + TWO_OPT_WINDOW; j++)
+		{
+			int a = m_tour[i];
+			int b = m_tour[j];
+			double before = Dist( prevExit, m_entry[a] );
+			double after = Dist( prevExit, m_exit[b] );
+			if (j < n - 1)
+			{
+				double const *nextEntry = m_entry[m_tour[j + 1]];
+				before += Dist( m_exit[b], nextEntry );
+				after += Dist( m_entry[a], nextEntry );
+			}
+			if (after >= before - 1e-9) continue;
+			bool valid = true;
+			for (int k = i; k <= j && valid; k++)
+			{
+				if (m_fixed[m_tour[k]]) valid = false;
+			}
+			if (!valid) continue;
+			ReverseSpan( i, j );
+			gain += before - after;
+		}
+	}
+	return gain;
+}
+
+// Or-opt: move chains of up to OR_OPT_MAX_CHAIN units, optionally reversed, to a
+// better position within OR_OPT_WINDOW. Returns total gain
+double LicutOrder::OrOptPass( double const start[2] )
+{
+	double gain = 0;
+	int n = m_units;
+	for (int length = 1; length <= OR_OPT_MAX_CHAIN; length++)
+	{
+		for (int i = 0; i + length <= n; i++)
+		{
+			if ((i & 255) == 0 && OutOfTime()) return gain;
+			int first = m_tour[i];
+			int last = m_tour[i + length - 1];
+			double const *p = i ? m_exit[m_tour[i - 1]] : start;
+			double const *q = (i + length < n) ? m_entry[m_tour[i + length]] : NULL;
+			double removeGain = Dist( p, m_entry[first] );
+			if (q) removeGain += Dist( m_exit[last], q ) - Dist( p, q );
+			bool canReverse = true;
+			for (int k = i; k < i + length; k++)
+			{
+				if (m_fixed[m_tour[k]]) canReverse = false;
+			}
+
+			int bestK = -1;
+			bool bestReversed = false;
+			double bestCost = removeGain - 1e-9;
+			int kMin = i - OR_OPT_WINDOW < 0 ? 0 : i - OR_OPT_WINDOW;
+			int kMax = i + length + OR_OPT_WINDOW > n ? n : i + length + OR_OPT_WINDOW;
+			// Insert between positions k-1 and k
+			for (int k = kMin; k <= kMax; k++)
+			{
+				if (k >= i && k <= i + length) continue;
+				double const *xp = k ? m_exit[m_tour[k - 1]] : start;
+				double const *xn = k < n ? m_entry[m_tour[k]] : NULL;
+				double base = xn ? Dist( xp, xn ) : 0;
+				double cost = Dist( xp, m_entry[first] ) - base;
+				if (xn) cost += Dist( m_exit[last], xn );
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					bestK = k;
+					bestReversed = false;
+				}
+				if (canReverse)
+				{
+					cost = Dist( xp, m_exit[last] ) - base;
+					if (xn) cost += Dist( m_entry[first], xn );
+					if (cost < bestCost)
+					{
+						bestCost = cost;
+						bestK = k;
+						bestReversed = true;
+					}
+				}
+			}
+			if (bestK < 0) continue;
+
+			int chain[OR_OPT_MAX_CHAIN];
+			memcpy( chain, &m_tour[i], length * sizeof(int) );
+			int dest;
+			if (bestK < i)
+			{
+				memmove( &m_tour[bestK + length], &m_tour[bestK], (i - bestK) * sizeof(int) );
+				dest = bestK;
+			}
+			else
+			{
+				memmove( &m_tour[i], &m_tour[i + length], (bestK - i - length) * sizeof(int) );
+				dest = bestK - length;
+			}
+			memcpy( &m_tour[dest], chain, length * sizeof(int) );
+			if (bestReversed) ReverseSpan( dest, dest + length - 1 );
+			gain += removeGain - bestCost;
+		}
+	}
+	return gain;
+}
+
+// Reorder draw sets of svg to reduce pen-up travel. Returns 0 if successful
+int LicutOrder::OptimizeTravel( LicutSVG& svg, int budgetMs, double startX /*= 0*/, double startY /*= 0*/ )
+{
+	double t0 = licut_now();
+	m_deadline = t0 + budgetMs / 1000.0;
+	m_travelBefore = LicutGeom::TravelLength( svg, startX, startY );
+	m_feedBefore = LicutGeom::FeedTravel( svg, startY, m_feedReversalsBefore );
+	m_travelAfter = m_travelBefore;
+	m_feedAfter = m_feedBefore;
+	m_feedReversalsAfter = m_feedReversalsBefore;
+	Free();
+	int n = svg.GetDrawSetCount();
+	if (n < 2) return 0;
+
+	m_units = n;
+	m_tour = (int *)malloc( n * sizeof(int) );
+	m_entry = (double (*)[2])malloc( n * sizeof(m_entry[0]) );
+	m_exit = (double (*)[2])malloc( n * sizeof(m_exit[0]) );
+	m_flipped = (bool *)calloc( n, sizeof(bool) );
+	m_closed = (bool *)calloc( n, sizeof(bool) );
+	m_fixed = (bool *)calloc( n, sizeof(bool) );
+	m_rotate = (int *)calloc( n, sizeof(int) );
+	int u;
+	int candAlloc = 0;
+	for (u = 0; u < n; u++)
+	{
+		drawSet_t const *set = svg.GetDrawSet( u );
+		m_closed[u] = LicutGeom::IsClosed( set, 1e-3 );
+		m_fixed[u] = !LicutGeom::IsReversible( set );
+		if (m_closed[u])
+		{
+			int count = LicutGeom::Count( set );
+			candAlloc += (count - 1 < MAX_CONTOUR_STARTS ? count - 1 : MAX_CONTOUR_STARTS) + 1;
+		}
+		else
+		{
+			candAlloc += 2;
+		}
+	}
+	m_cand = (candidate_t *)malloc( candAlloc * sizeof(candidate_t) );
+	m_alive = (int *)calloc( candAlloc, sizeof(int) );
+	m_dead = (bool *)calloc( candAlloc, sizeof(bool) );
+	if (!m_tour || !m_entry || !m_exit || !m_flipped || !m_closed || !m_fixed || !m_rotate || !m_cand || !m_alive || !m_dead)
+	{
+		LICUT_ERROR( "%s() failed to allocate for %d draw sets\n", __FUNCTION__, n );
+		Free();
+		return -1;
+	}
+
+	// Entry candidates: either end of open sets, or sampled vertices of closed contours
+	for (u = 0; u < n; u++)
+	{
+		drawSet_t const *set = svg.GetDrawSet( u );
+		double start[2] = { 0, 0 }, end[2] = { 0, 0 };
+		LicutGeom::Ends( set, start, end );
+		if (m_closed[u])
+		{
+			int count = LicutGeom::Count( set );
+			int step = (count - 1 + MAX_CONTOUR_STARTS - 1) / MAX_CONTOUR_STARTS;
+			for (int k = 0; k < count - 1; k += step)
+			{
+				candidate_t& c = m_cand[m_candCount++];
+				memcpy( c.pt, LicutGeom::EndPoint( &set[k] ), sizeof(c.pt) );
+				c.unit = u;
+				c.vertex = k;
+			}
+		}
+		else
+		{
+			candidate_t& c = m_cand[m_candCount++];
+			memcpy( c.pt, start, sizeof(c.pt) );
+			c.unit = u;
+			c.vertex = -1;
+			if (!m_fixed[u])
+			{
+				candidate_t& r = m_cand[m_candCount++];
+				memcpy( r.pt, end, sizeof(r.pt) );
+				r.unit = u;
+				r.vertex = -2;
+			}
+		}
+	}
+	BuildTree( 0, m_candCount, 0 );
+
+	// Candidates of each unit, for removal once the unit is in the tour
+	int *unitCandStart = (int *)calloc( n + 1, sizeof(int) );
+	int *unitCand = (int *)malloc( m_candCount * sizeof(int) );
+	int *fill = (int *)malloc( n * sizeof(int) );
+	if (!unitCandStart || !unitCand || !fill)
+	{
+		LICUT_ERROR( "%s() failed to allocate for %d candidates\n", __FUNCTION__, m_candCount );
+		free( unitCandStart );
+		free( unitCand );
+		free( fill );
+		Free();
+		return -1;
+	}
+	int k;
+	for (k = 0; k < m_candCount; k++) unitCandStart[m_cand[k].unit + 1]++;
+	for (u = 0; u < n; u++) unitCandStart[u + 1] += unitCandStart[u];
+	memcpy( fill, unitCandStart, n * sizeof(int) );
+	for (k = 0; k < m_candCount; k++) unitCand[fill[m_cand[k].unit]++] = k;
+	free( fill );
+
+	// Nearest neighbour tour
+	double pos[2] = { startX, startY };
+	for (int step = 0; step < n; step++)
+	{
+		int best = -1;
+		double bestDist2 = HUGE_VAL;
+		Nearest( 0, m_candCount, 0, pos, best, bestDist2 );
+		if (best < 0) break;
+		candidate_t const& c = m_cand[best];
+		u = c.unit;
+		for (k = unitCandStart[u]; k < unitCandStart[u + 1]; k++) Remove( unitCand[k] );
+		m_tour[step] = u;
+		drawSet_t const *set = svg.GetDrawSet( u );
+		double start[2] = { 0, 0 }, end[2] = { 0, 0 };
+		LicutGeom::Ends( set, start, end );
+		if (c.vertex >= 0)
+		{
+			m_rotate[u] = c.vertex;
+			memcpy( m_entry[u], c.pt, sizeof(m_entry[u]) );
+			memcpy( m_exit[u], c.pt, sizeof(m_exit[u]) );
+		}
+		else
+		{
+			m_flipped[u] = (c.vertex == -2);
+			memcpy( m_entry[u], m_flipped[u] ? end : start, sizeof(m_entry[u]) );
+			memcpy( m_exit[u], m_flipped[u] ? start : end, sizeof(m_exit[u]) );
+		}
+		memcpy( pos, m_exit[u], sizeof(pos) );
+	}
+	free( unitCandStart );
+	free( unitCand );
+	double nnMs = (licut_now() - t0) * 1000;
+
+	// Improve until no gain, out of time or out of passes
+	double start[2] = { startX, startY };
+	int passes = 0;
+	while (!OutOfTime() && (m_maxPasses <= 0 || passes < m_maxPasses))
+	{
+		double gain = TwoOptPass( start );
+		gain += OrOptPass( start );
+		passes++;
+		if (m_verbose) LICUT_DEBUG( "%s() pass %d gain %.3f\n", __FUNCTION__, passes, gain );
+		if (gain < 1e-6) break;
+	}
+
+	// Apply direction and start point, then order
+	for (u = 0; u < n; u++)
+	{
+		drawSet_t *set = svg.ModifyDrawSet( u );
+		if (m_closed[u])
+		{
+			if (m_rotate[u] > 0) LicutGeom::Rotate( set, m_rotate[u] );
+		}
+		else if (m_flipped[u])
+		{
+			LicutGeom::Reverse( set );
+		}
+	}
+	if (svg.ReorderDrawSets( m_tour ) != 0)
+	{
+		LICUT_ERROR( "%s() tour of %d draw sets is not a permutation\n", __FUNCTION__, n );
+		Free();
+		return -1;
+	}
+
+	m_travelAfter = LicutGeom::TravelLength( svg, startX, startY );
+	m_feedAfter = LicutGeom::FeedTravel( svg, startY, m_feedReversalsAfter );
+	m_elapsedMs = (int)((licut_now() - t0) * 1000);
+	if (m_verbose) LICUT_DEBUG( "%s() %d sets, %d candidates, nearest neighbour %.1fms, %d improvement passes\n",
+		__FUNCTION__, n, m_candCount, nnMs, passes );
+	Free();
+	return 0;
+}
+
+// Reorder draw sets into bands along the mat feed axis. Returns 0 if successful
+int LicutOrder::OptimizeBands( LicutSVG& svg, double bandHeight, double startX /*= 0*/, double startY /*= 0*/ )
+{
+	double t0 = licut_now();
+	m_travelBefore = LicutGeom::TravelLength( svg, startX, startY );
+	m_feedBefore = LicutGeom::FeedTravel( svg, startY, m_feedReversalsBefore );
+	m_travelAfter = m_travelBefore;
+	m_feedAfter = m_feedBefore;
+	m_feedReversalsAfter = m_feedReversalsBefore;
+	Free();
+	if (bandHeight <= 0) return -1;
+	int n = svg.GetDrawSetCount();
+	if (n < 1) return 0;
+
+	int *order = (int *)malloc( n * sizeof(int) );
+	int *band = (int *)malloc( n * sizeof(int) );
+	double *key = (double *)malloc( n * sizeof(double) );
+	double (*box)[3] = (double (*)[3])malloc( n * sizeof(box[0]) );
+	if (!order || !band || !key || !box)
+	{
+		LICUT_ERROR( "%s() failed to allocate for %d draw sets\n", __FUNCTION__, n );
+		free( order );
+		free( band );
+		free( key );
+		free( box );
+		return -1;
+	}
+
+	// Top, left and right of each set including control points
+	int u;
+	double top = 0;
+	for (u = 0; u < n; u++)
+	{
+		drawSet_t const *set = svg.GetDrawSet( u );
+		box[u][0] = box[u][1] = box[u][2] = 0;
+		bool first = true;
+		for (; set && set->type != 0; set++)
+		{
+			for (int i = 0; i < set->numPoints; i++)
+			{
+				double const *p = set->pt[i];
+				if (first || p[1] < box[u][0]) box[u][0] = p[1];
+				if (first || p[0] < box[u][1]) box[u][1] = p[0];
+				if (first || p[0] > box[u][2]) box[u][2] = p[0];
+				first = false;
+			}
+		}
+		if (u == 0 || box[u][0] < top) top = box[u][0];
+	}
+	for (u = 0; u < n; u++)
+	{
+		order[u] = u;
+		band[u] = (int)floor( (box[u][0] - top) / bandHeight );
+		key[u] = (band[u] & 1) ? -box[u][2] : box[u][1];
+	}
+	std::stable_sort( order, order + n, _band_less( band, key ) );
+
+	// Choose where each set starts, following the order
+	double pos[2] = { startX, startY };
+	for (int k = 0; k < n; k++)
+	{
+		drawSet_t *set = svg.ModifyDrawSet( order[k] );
+		double start[2], end[2];
+		if (!LicutGeom::Ends( set, start, end )) continue;
+		if (LicutGeom::IsClosed( set, 1e-3 ))
+		{
+			int count = LicutGeom::Count( set );
+			int best = 0;
+			double bestDist = Dist( pos, start );
+			for (int i = 1; i < count - 1; i++)
+			{
+				double d = Dist( pos, LicutGeom::EndPoint( &set[i] ) );
+				if (d < bestDist)
+				{
+					bestDist = d;
+					best = i;
+				}
+			}
+			if (best > 0) LicutGeom::Rotate( set, best );
+		}
+		else if (LicutGeom::IsReversible( set ) && Dist( pos, end ) < Dist( pos, start ))
+		{
+			LicutGeom::Reverse( set );
+		}
+		LicutGeom::Ends( set, start, end );
+		memcpy( pos, end, sizeof(pos) );
+	}
+	int r = svg.ReorderDrawSets( order );
+	free( order );
+	free( band );
+	free( key );
+	free( box );
+	if (r != 0)
+	{
+		LICUT_ERROR( "%s() failed to reorder %d draw sets\n", __FUNCTION__, n );
+		return -1;
+	}
+
+	m_travelAfter = LicutGeom::TravelLength( svg, startX, startY );
+	m_feedAfter = LicutGeom::FeedTravel( svg, startY, m_feedReversalsAfter );
+	m_elapsedMs = (int)((licut_now() - t0) * 1000);
+	return 0;
+}
@@ -0,0 +1,103 @@
+// $Id$
+// Draw set cut ordering
+
+#ifndef _LICUT_ORDER_H_
+#define _LICUT_ORDER_H_
+
+class LicutSVG;
+
+class LicutOrder
+{
+public:
+	LicutOrder( int verbose );
+	~LicutOrder();
+
+	// Reorder draw sets of svg and choose the direction of open sets and the
+	// start point of closed contours to reduce pen-up travel from startX,startY
+	// (svg units). A nearest neighbour tour is built using a k-d tree, then
+	// improved with windowed 2-opt and Or-opt until no gain is found or
+	// budgetMs has elapsed. Returns 0 if successful
+	int OptimizeTravel( LicutSVG& svg, int budgetMs, double startX = 0, double startY = 0 );
+
+	// Stop OptimizeTravel() after passes improvement passes, ignoring its time
+	// budget, so the same document always gives the same order. 0 for the budget
+	void SetMaxPasses( int passes ) { m_maxPasses = passes; }
+
+	// Reorder draw sets of svg into bands bandHeight high (svg units) along the mat
+	// feed (y) axis. Bands are visited in increasing y and sets within alternate bands
+	// taken left to right and right to left, so the mat moves mostly one way. Open sets
+	// are cut from the nearer end and closed contours from the nearest vertex.
+	// Returns 0 if successful
+	int OptimizeBands( LicutSVG& svg, double bandHeight, double startX = 0, double startY = 0 );
+
+	// Travel (svg units) before and after last optimization
+	double GetTravelBefore() const { return m_travelBefore; }
+	double GetTravelAfter() const { return m_travelAfter; }
+
+	// Feed axis travel (svg units) and feed direction changes before and after last optimization
+	double GetFeedBefore() const { return m_feedBefore; }
+	double GetFeedAfter() const { return m_feedAfter; }
+	int GetFeedReversalsBefore() const { return m_feedReversalsBefore; }
+	int GetFeedReversalsAfter() const { return m_feedReversalsAfter; }
+
+	// Elapsed time of last optimization
+	int GetElapsedMs() const { return m_elapsedMs; }
+
+protected:
+	// Entry point candidate for nearest neighbour search
+	typedef struct _candidate
+	{
+		double pt[2];
+		int unit; // Draw set index
+		int vertex; // -1 = start, -2 = end (reversed), else closed contour command index
+	} candidate_t;
+
+	// Build k-d tree over m_cand[lo..hi) splitting on axis
+	void BuildTree( int lo, int hi, int axis );
+	// Find nearest live candidate to pt in m_cand[lo..hi)
+	void Nearest( int lo, int hi, int axis, double const pt[2], int& best, double& bestDist2 ) const;
+	// Remove candidate at index from tree counts
+	void Remove( int index );
+
+	// Cost of travel between points
+	static double Dist( double const a[2], double const b[2] );
+
+	// Tour improvement passes. Return total gain
+	double TwoOptPass( double const start[2] );
+	double OrOptPass( double const start[2] );
+
+	// Reverse tour positions i..j inclusive, flipping open units
+	void ReverseSpan( int i, int j );
+
+	// Returns true if time budget exceeded, never with a pass limit
+	bool OutOfTime() const;
+
+	// Release working arrays
+	void Free();
+
+protected:
+	int m_verbose;
+	int m_units;
+	candidate_t *m_cand;
+	int *m_alive; // Live candidates in subtree whose median is at this index
+	bool *m_dead; // Candidate removed
+	int m_candCount;
+	int *m_tour; // Unit at each tour position
+	double (*m_entry)[2]; // Entry point of each unit in its current direction
+	double (*m_exit)[2];
+	bool *m_flipped; // Open unit is cut in reverse
+	bool *m_closed; // Unit is a closed contour - entry and exit are the same point
+	bool *m_fixed; // Unit cannot be reversed
+	int *m_rotate; // Command index closed contour starts from
+	double m_deadline;
+	int m_maxPasses;
+	double m_travelBefore;
+	double m_travelAfter;
+	double m_feedBefore;
+	double m_feedAfter;
+	int m_feedReversalsBefore;
+	int m_feedReversalsAfter;
+	int m_elapsedMs;
+};
+
+#endif // _LICUT_ORDER_H_
@@ -0,0 +1,378 @@
+// $Id$
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "licut_pipeline.h"
+#include "licut_io.h"
+#include "licut_log.h"
+#include "licut_time.h"
+
+// Wait for semaphore, restarting if interrupted. Returns seconds waited
+static double _sem_wait( sem_t *sem )
+{
+	if (sem_trywait( sem ) == 0) return 0;
+	double t0 = licut_now();
+	while (sem_wait( sem ) != 0 && errno == EINTR) {}
+	return licut_now() - t0;
+}
+
+LicutQueue::LicutQueue( int capacity )
+{
+	m_capacity = capacity > 0 ? capacity : 1;
+	m_slots = (void **)calloc( m_capacity, sizeof(void *) );
+	m_head = 0;
+	m_tail = 0;
+	sem_init( &m_items, 0, 0 );
+	sem_init( &m_space, 0, m_capacity );
+	m_pushes = 0;
+	m_full = 0;
+	m_depthSum = 0;
+	m_maxDepth = 0;
+}
+
+LicutQueue::~LicutQueue()
+{
+	sem_destroy( &m_space );
+	sem_destroy( &m_items );
+	free( m_slots );
+}
+
+// Append item, waiting while full. Returns seconds waited
+double LicutQueue::Push( void *item )
+{
+	double waited = _sem_wait( &m_space );
+	if (waited > 0) m_full++;
+	unsigned long head = m_head;
+	m_slots[head % m_capacity] = item;
+	__sync_synchronize();
+	m_head = head + 1;
+	int depth = (int)(head + 1 - m_tail);
+	m_pushes++;
+	m_depthSum += depth;
+	if (depth > m_maxDepth) m_maxDepth = depth;
+	sem_post( &m_items );
+	return waited;
+}
+
+// Remove oldest item, waiting while empty. Returns seconds waited
+double LicutQueue::Pop( void **item )
+{
+	double waited = _sem_wait( &m_items );
+	unsigned long tail = m_tail;
+	*item = m_slots[tail % m_capacity];
+	__sync_synchronize();
+	m_tail = tail + 1;
+	sem_post( &m_space );
+	return waited;
+}
+
+LicutPipeline::LicutPipeline( int verbose, int depth )
+	: m_svg( verbose )
+{
+	static const char *names[STAGES] = { "parse", "lower", "collapse", "encode", "send" };
+	m_verbose = verbose;
+	m_depth = depth > 0 ? depth : 1;
+	m_path[0] = '\0';
+	m_intercommand = 50;
+	m_intercurve = 10;
+	m_collapse = true;
+	m_transaction = 0;
+	m_transactionDrain = 5;
+	m_retries = 0;
+	int n;
+	for (n = 0; n < STAGES - 1; n++) m_queues[n] = new LicutQueue( m_depth );
+	m_threadCount = 0;
+	memset( m_stages, 0, sizeof(m_stages) );
+	for (n = 0; n < STAGES; n++) m_stages[n].name = names[n];
+	sem_init( &m_matReady, 0, 0 );
+	memset( m_mat, 0, sizeof(m_mat) );
+	m_stopping = 0;
+	pthread_mutex_init( &m_errorLock, NULL );
+	m_error[0] = '\0';
+	m_scaled = false;
+	m_havePen = false;
+	m_penX = 0;
+	m_penY = 0;
+	m_start = 0;
+	m_firstReady = 0;
+	m_elapsed = 0;
+	m_finished = false;
+	m_packets = 0;
+	m_collapsed = 0;
+	m_transactions = 0;
+	m_retryCount = 0;
+	m_resyncCount = 0;
+	m_svg.SetDrawSetSink( this );
+}
+
+LicutPipeline::~LicutPipeline()
+{
+	if (m_threadCount > 0 && !m_finished)
+	{
+		Stop( NULL );
+		while (LicutCmdList *cmds = Next()) delete cmds;
+	}
+	for (int n = 0; n < STAGES - 1; n++) delete m_queues[n];
+	pthread_mutex_destroy( &m_errorLock );
+	sem_destroy( &m_matReady );
+}
+
+// Start parsing path. Returns 0 if started
+int LicutPipeline::Start( const char *path )
+{
+	if (m_threadCount > 0) return -1;
+	snprintf( m_path, sizeof(m_path), "%s", path );
+	m_start = licut_now();
+	// Last stage first, so that if a thread cannot be started the stages after it
+	// can be ended and none waits on a stage which is not running
+	for (int stage = STAGE_ENCODE; stage >= STAGE_PARSE; stage--)
+	{
+		m_threadArgs[stage].pipeline = this;
+		m_threadArgs[stage].stage = stage;
+		if (pthread_create( &m_threads[m_threadCount], NULL, StageThread, &m_threadArgs[stage] ) != 0)
+		{
+			LICUT_ERROR( "%s() failed to start %s thread\n", __FUNCTION__, m_stages[stage].name );
+			Stop( "cannot start threads" );
+			if (m_threadCount > 0) Put( stage, NULL );
+			break;
+		}
+		m_threadCount++;
+	}
+	return m_threadCount == STAGES - 1 ? 0 : -1;
+}
+
+void LicutPipeline::SetMat( unsigned int const mat[4] )
+{
+	memcpy( m_mat, mat, sizeof(m_mat) );
+	sem_post( &m_matReady );
+}
+
+// Stop all stages early
+void LicutPipeline::Stop( const char *error )
+{
+	pthread_mutex_lock( &m_errorLock );
+	if (error && !m_error[0]) snprintf( m_error, sizeof(m_error), "%s", error );
+	pthread_mutex_unlock( &m_errorLock );
+	m_stopping = 1;
+	// Lower stage may still be waiting for the mat
+	sem_post( &m_matReady );
+}
+
+void *LicutPipeline::StageThread( void *arg )
+{
+	pipelineThread_t *thread = (pipelineThread_t *)arg;
+	thread->pipeline->Work( thread->stage );
+	return NULL;
+}
+
+// Run stage until its input ends
+void LicutPipeline::Work( int stage )
+{
+	pipelineStage_t& s = m_stages[stage];
+	if (stage == STAGE_PARSE)
+	{
+		// Draw sets are passed on by DrawSetParsed() as the parse goes
+		double t0 = licut_now();
+		int r = m_svg.Parse( m_path );
+		s.busy = licut_now() - t0 - s.blocked;
+		if (!m_stopping && r != 0) Stop( "parse failed" );
+		else if (!m_stopping && s.items == 0) Stop( "nothing to cut" );
+		if (m_verbose) LICUT_DEBUG( "%s() parsed %d draw sets in %.0fms\n", __FUNCTION__, s.items, s.busy * 1000 );
+		Put( stage, NULL );
+		return;
+	}
+	if (stage == STAGE_LOWER) s.starved += _sem_wait( &m_matReady );
+	for (;;)
+	{
+		void *item = Take( stage );
+		if (!item) break;
+		if (m_stopping)
+		{
+			Discard( stage - 1, item );
+			continue;
+		}
+		double t0 = licut_now();
+		void *out = Process( stage, item );
+		s.busy += licut_now() - t0;
+		if (!out) continue;
+		s.items++;
+		Put( stage, out );
+	}
+	Put( stage, NULL );
+}
+
+void *LicutPipeline::Take( int stage )
+{
+	void *item;
+	m_stages[stage].starved += m_queues[stage - 1]->Pop( &item );
+	return item;
+}
+
+void LicutPipeline::Put( int stage, void *item )
+{
+	m_stages[stage].blocked += m_queues[stage]->Push( item );
+}
+
+// Free item from the queue after stage
+void LicutPipeline::Discard( int stage, void *item )
+{
+	if (stage == STAGE_PARSE) free( item );
+	else delete (LicutCmdList *)item;
+}
+
+// Process item for stage. Returns item for the next stage or NULL on error
+void *LicutPipeline::Process( int stage, void *item )
+{
+	if (stage == STAGE_LOWER)
+	{
+		drawSet_t *set = (drawSet_t *)item;
+		// Width and height were parsed with the svg element, before any path
+		if (!m_scaled)
+		{
+			if (!m_svg.GetWidth() || !m_svg.GetHeight())
+			{
+				free( set );
+				Stop( "no svg width and height" );
+				return NULL;
+			}
+			m_svg.SetScaling( m_mat[0], m_mat[1], m_mat[2] - m_mat[0], m_mat[3] - m_mat[1] );
+			m_scaled = true;
+		}
+		LicutCmdList *cmds = new LicutCmdList( m_verbose );
+		int r = cmds->LowerDrawSet( m_svg, set, m_mat[0], m_mat[1], m_intercommand, m_intercurve );
+		free( set );
+		if (r != 0)
+		{
+			delete cmds;
+			Stop( "cannot lower draw set" );
+			return NULL;
+		}
+		return cmds;
+	}
+
+	LicutCmdList *cmds = (LicutCmdList *)item;
+	if (stage == STAGE_COLLAPSE)
+	{
+		if (m_collapse) m_collapsed += cmds->Collapse( m_havePen, m_penX, m_penY );
+		if (cmds->GetCount() > 0)
+		{
+			loweredCmd_t const *last = cmds->GetCmd( cmds->GetCount() - 1 );
+			m_havePen = true;
+			m_penX = last->x;
+			m_penY = last->y;
+		}
+	}
+	else if (stage == STAGE_ENCODE && cmds->Encode() != 0)
+	{
+		delete cmds;
+		Stop( "cannot encode packets" );
+		return NULL;
+	}
+	return cmds;
+}
+
+// Called by LicutSVG on the parse thread
+int LicutPipeline::DrawSetParsed( LicutSVG& svg, drawSet_t *set )
+{
+	(void)svg;
+	if (m_stopping)
+	{
+		free( set );
+		return -1;
+	}
+	m_stages[STAGE_PARSE].items++;
+	Put( STAGE_PARSE, set );
+	return 0;
+}
+
+// Next draw set ready to send, or NULL
+LicutCmdList *LicutPipeline::Next()
+{
+	if (m_finished || m_threadCount == 0) return NULL;
+	for (;;)
+	{
+		LicutCmdList *cmds = (LicutCmdList *)Take( STAGE_SEND );
+		if (!cmds)
+		{
+			Finish();
+			return NULL;
+		}
+		if (m_stopping)
+		{
+			delete cmds;
+			continue;
+		}
+		if (m_stages[STAGE_SEND].items++ == 0) m_firstReady = licut_now() - m_start;
+		m_packets += cmds->GetCount();
+		return cmds;
+	}
+}
+
+// Join stage threads once the last item has been taken
+void LicutPipeline::Finish()
+{
+	for (int n = 0; n < m_threadCount; n++) pthread_join( m_threads[n], NULL );
+	m_finished = true;
+	m_elapsed = licut_now() - m_start;
+}
+
+// Send draw sets as they become ready. Returns number of draw sets cut or -1 on error
+int LicutPipeline::Run( LicutIO& lio )
+{
+	int sets = 0;
+	while (LicutCmdList *cmds = Next())
+	{
+		double t0 = licut_now();
+		int r = 0;
+		// Collapse may leave nothing of a draw set
+		if (cmds->GetCount() > 0)
+		{
+			cmds->SetTransaction( m_transaction, m_transactionDrain );
+			cmds->SetRetries( m_retries );
+			r = cmds->Send( lio );
+			m_transactions += cmds->GetTransactionCount();
+			m_retryCount += cmds->GetRetryCount();
+			m_resyncCount += cmds->GetResyncCount();
+		}
+		m_stages[STAGE_SEND].busy += licut_now() - t0;
+		delete cmds;
+		if (r < 0) Stop( "cut interrupted" );
+		else sets += r;
+	}
+	return m_error[0] ? -1 : sets;
+}
+
+// Write per-stage time and queue occupancy
+void LicutPipeline::WriteReport( FILE *f ) const
+{
+	int n;
+	int limit = 0;
+	for (n = 1; n < STAGES; n++)
+	{
+		if (m_stages[n].busy > m_stages[limit].busy) limit = n;
+	}
+	double elapsed = m_elapsed > 0 ? m_elapsed : 1;
+	fprintf( f, "%-14s %6s %9s %10s %10s %6s\n", "stage", "sets", "busy_ms", "starved_ms", "blocked_ms", "busy%" );
+	for (n = 0; n < STAGES; n++)
+	{
+		pipelineStage_t const& s = m_stages[n];
+		fprintf( f, "%-14s %6d %9.0f %10.0f %10.0f %5.1f%%\n", s.name, s.items, s.busy * 1000, s.starved * 1000,
+			s.blocked * 1000, 100 * s.busy / elapsed );
+	}
+	fprintf( f, "%-14s %6s %9s %10s %10s\n", "queue", "size", "mean", "max", "full%" );
+	for (n = 0; n < STAGES - 1; n++)
+	{
+		LicutQueue const *q = m_queues[n];
+		char name[32];
+		snprintf( name, sizeof(name), "%s>%s", m_stages[n].name, m_stages[n + 1].name );
+		fprintf( f, "%-14s %6d %9.1f %10d %9.1f%%\n", name, q->GetCapacity(), q->GetMeanDepth(), q->GetMaxDepth(),
+			q->GetPushes() ? 100.0 * q->GetFullCount() / q->GetPushes() : 0 );
+	}
+	fprintf( f, "Pipeline: %d draw sets, %d packets (%d removed at device resolution), first ready after %.0fms, %.1fs in all, limited by %s (%.0f%% busy)%s%s\n",
+		m_stages[STAGE_SEND].items, m_packets, m_collapsed, m_firstReady * 1000, m_elapsed, m_stages[limit].name,
+		100 * m_stages[limit].busy / elapsed, m_error[0] ? ", stopped: " : "", m_error );
+}
@@ -0,0 +1,193 @@
+// $Id$
+// One file cut as a pipeline of stages on their own threads: parse, lower to
+// device commands, collapse and encode, with the caller sending. Stages pass
+// draw sets through bounded queues, so cutting starts with the first draw set
+// and memory is bounded by the queue depth rather than the file
+
+#ifndef _LICUT_PIPELINE_H_
+#define _LICUT_PIPELINE_H_
+
+#include <stdio.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "licut_svg.h"
+#include "licut_cmdlist.h"
+
+// Bounded queue for one producer and one consumer. Slots are counted by two
+// semaphores, so Push() and Pop() only wait when full or empty and never lock
+class LicutQueue
+{
+public:
+	LicutQueue( int capacity );
+	~LicutQueue();
+
+	// Append item, waiting while full. Returns seconds waited
+	double Push( void *item );
+	// Remove oldest item, waiting while empty. Returns seconds waited
+	double Pop( void **item );
+
+	int GetCapacity() const { return m_capacity; }
+	// Items queued when each was pushed, averaged and at most
+	double GetMeanDepth() const { return m_pushes ? (double)m_depthSum / m_pushes : 0; }
+	int GetMaxDepth() const { return m_maxDepth; }
+	// Pushes which found the queue full and waited
+	int GetPushes() const { return m_pushes; }
+	int GetFullCount() const { return m_full; }
+
+protected:
+	void **m_slots;
+	int m_capacity;
+	volatile unsigned long m_head; // Written by producer
+	volatile unsigned long m_tail; // Written by consumer
+	sem_t m_items;
+	sem_t m_space;
+	// Producer side statistics
+	int m_pushes;
+	int m_full;
+	long m_depthSum;
+	int m_maxDepth;
+};
+
+// Time spent by one stage
+typedef struct _pipelineStage
+{
+	const char *name;
+	int items; // Draw sets processed
+	double busy; // Seconds working
+	double starved; // Waiting for the previous stage
+	double blocked; // Waiting for room in the next stage's queue
+} pipelineStage_t;
+
+class LicutPipeline;
+
+// Argument of each stage thread
+typedef struct _pipelineThread
+{
+	LicutPipeline *pipeline;
+	int stage;
+} pipelineThread_t;
+
+class LicutPipeline : public LicutDrawSetSink
+{
+public:
+	enum
+	{
+		STAGE_PARSE,
+		STAGE_LOWER,
+		STAGE_COLLAPSE,
+		STAGE_ENCODE,
+		STAGE_SEND,
+		STAGES
+	};
+
+	// depth is the number of draw sets each queue between stages holds
+	LicutPipeline( int verbose, int depth );
+	~LicutPipeline();
+
+	// Svg used for parsing, e.g. for AddSelection() before Start()
+	LicutSVG& GetSVG() { return m_svg; }
+
+	void SetDelays( int intercommand, int intercurve ) { m_intercommand = intercommand; m_intercurve = intercurve; }
+	// Remove commands with no effect at device resolution
+	void SetCollapse( bool collapse ) { m_collapse = collapse; }
+	// See LicutCmdList::SetTransaction()
+	void SetTransaction( int batch, int replyDrainMs ) { m_transaction = batch; m_transactionDrain = replyDrainMs; }
+	// See LicutCmdList::SetRetries()
+	void SetRetries( int retries ) { m_retries = retries; }
+
+	// Start parsing path. Draw sets are lowered once SetMat() is called. Returns
+	// 0 if started
+	int Start( const char *path );
+
+	// Mat bounds xmin, ymin, xmax, ymax the design is scaled to
+	void SetMat( unsigned int const mat[4] );
+
+	// Next draw set ready to send, waiting for it, or NULL after the last one or
+	// an error. The caller deletes it
+	LicutCmdList *Next();
+
+	// Send draw sets as they become ready, until all are sent or one fails.
+	// Returns number of draw sets cut or -1 on error
+	int Run( LicutIO& lio );
+
+	// Stop all stages early, e.g. after a failed send. Next() returns NULL from here on
+	void Stop( const char *error );
+
+	// Message for the error which stopped the pipeline, empty if none
+	const char *GetError() const { return m_error; }
+
+	// Write per-stage time and queue occupancy
+	void WriteReport( FILE *f ) const;
+
+	pipelineStage_t const *GetStage( int stage ) const { return (stage >= 0 && stage < STAGES) ? &m_stages[stage] : NULL; }
+	LicutQueue const *GetQueue( int stage ) const { return (stage >= 0 && stage < STAGES - 1) ? m_queues[stage] : NULL; }
+	int GetPacketsSent() const { return m_packets; }
+	int GetPacketsCollapsed() const { return m_collapsed; }
+	int GetTransactionCount() const { return m_transactions; }
+	int GetRetryCount() const { return m_retryCount; }
+	int GetResyncCount() const { return m_resyncCount; }
+	// Seconds from Start() to the first draw set ready to send, and to the end
+	double GetFirstReady() const { return m_firstReady; }
+	double GetElapsed() const { return m_elapsed; }
+
+	// Called by LicutSVG on the parse thread
+	virtual int DrawSetParsed( LicutSVG& svg, drawSet_t *set );
+
+protected:
+	static void *StageThread( void *arg );
+	// Run stage until its input ends, passing each item on to the next stage
+	void Work( int stage );
+	// Take item for stage from the previous stage's queue
+	void *Take( int stage );
+	// Pass item to the next stage's queue
+	void Put( int stage, void *item );
+	// Process item for stage. Returns item for the next stage or NULL on error
+	void *Process( int stage, void *item );
+	// Free item from the queue after stage when stopping
+	void Discard( int stage, void *item );
+	// Join stage threads once the last item has been taken
+	void Finish();
+
+protected:
+	int m_verbose;
+	int m_depth;
+	LicutSVG m_svg;
+	char m_path[1024];
+	int m_intercommand;
+	int m_intercurve;
+	bool m_collapse;
+	int m_transaction;
+	int m_transactionDrain;
+	int m_retries;
+
+	LicutQueue *m_queues[STAGES - 1]; // m_queues[n] takes the output of stage n
+	pthread_t m_threads[STAGES - 1]; // Send runs on the caller's thread
+	int m_threadCount;
+	pipelineThread_t m_threadArgs[STAGES - 1];
+	pipelineStage_t m_stages[STAGES];
+	sem_t m_matReady;
+	unsigned int m_mat[4];
+	volatile int m_stopping;
+	pthread_mutex_t m_errorLock;
+	char m_error[128];
+
+	// Lower stage state
+	bool m_scaled;
+	// Collapse stage state: where the last command passed on left the pen
+	bool m_havePen;
+	unsigned int m_penX;
+	unsigned int m_penY;
+
+	double m_start;
+	double m_firstReady;
+	double m_elapsed;
+	bool m_finished;
+	int m_packets;
+	int m_collapsed;
+	int m_transactions;
+	int m_retryCount;
+	int m_resyncCount;
+};
+
+#endif // _LICUT_PIPELINE_H_
@@ -0,0 +1,149 @@
+// $Id$
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "licut_preflight.h"
+#include "licut_cmdlist.h"
+#include "licut_geom.h"
+
+// Steps used to measure curve length
+#define CURVE_STEPS	16
+
+// Write s as a JSON string
+static void _json_string( FILE *f, const char *s )
+{
+	fputc( '"', f );
+	for (; s && *s; s++)
+	{
+		unsigned char c = *s;
+		if (c == '"' || c == '\\') fprintf( f, "\\%c", c );
+		else if (c < 0x20) fprintf( f, "\\u%04x", c );
+		else fputc( c, f );
+	}
+	fputc( '"', f );
+}
+
+LicutPreflight::LicutPreflight()
+{
+	m_groups = 0;
+	m_packets = 0;
+	m_moves = 0;
+	m_lines = 0;
+	m_curves = 0;
+	m_collapsed = 0;
+	m_empty = true;
+	memset( m_box, 0, sizeof(m_box) );
+	m_cutLength = 0;
+	m_travelLength = 0;
+	m_transmitMs = 0;
+	m_replyMs = 0;
+	m_delayMs = 0;
+}
+
+// Add commands of one mat. Returns 0 if successful
+int LicutPreflight::Add( LicutCmdList const& cmds, int x, int y, int intercommand, double replyMs, int transactions /*= 0*/ )
+{
+	double pen[2] = { (double)x, (double)y };
+	m_groups += cmds.GetGroupCount();
+	m_packets += cmds.GetCount();
+	for (int n = 0; n < cmds.GetCount(); n++)
+	{
+		loweredCmd_t const *c = cmds.GetCmd( n );
+		if (c->groupStart) m_delayMs += intercommand * 6;
+		m_delayMs += c->delay;
+		if (m_empty || c->x < m_box[0]) m_box[0] = c->x;
+		if (m_empty || c->y < m_box[1]) m_box[1] = c->y;
+		if (m_empty || c->x > m_box[2]) m_box[2] = c->x;
+		if (m_empty || c->y > m_box[3]) m_box[3] = c->y;
+		m_empty = false;
+		double p[2] = { (double)c->x, (double)c->y };
+		switch (c->subCmd)
+		{
+			case 2:
+				m_moves++;
+				m_travelLength += LicutGeom::Distance( pen, p );
+				break;
+			case 0:
+				m_lines++;
+				m_cutLength += LicutGeom::Distance( pen, p );
+				break;
+			case 1:
+				// First of 4 packets: start, control points and end
+				if (n + 3 < cmds.GetCount())
+				{
+					double q[4][2];
+					for (int i = 0; i < 4; i++)
+					{
+						loweredCmd_t const *k = cmds.GetCmd( n + i );
+						q[i][0] = k->x;
+						q[i][1] = k->y;
+					}
+					double last[2] = { q[0][0], q[0][1] };
+					for (int step = 1; step <= CURVE_STEPS; step++)
+					{
+						double b[2];
+						LicutGeom::Bezier( q[0], q[1], q[2], q[3], (double)step / CURVE_STEPS, b );
+						m_cutLength += LicutGeom::Distance( last, b );
+						last[0] = b[0];
+						last[1] = b[1];
+					}
+					m_curves++;
+					// Remaining packets still count toward bounds and delays
+					for (int i = 1; i < 4; i++)
+					{
+						loweredCmd_t const *k = cmds.GetCmd( n + i );
+						m_delayMs += k->delay;
+						if (k->x < m_box[0]) m_box[0] = k->x;
+						if (k->y < m_box[1]) m_box[1] = k->y;
+						if (k->x > m_box[2]) m_box[2] = k->x;
+						if (k->y > m_box[3]) m_box[3] = k->y;
+					}
+					n += 3;
+					p[0] = q[3][0];
+					p[1] = q[3][1];
+				}
+				break;
+		}
+		pen[0] = p[0];
+		pen[1] = p[1];
+	}
+	m_transmitMs += cmds.GetCount() * LICUT_MOVECUT_PACKET * LICUT_BYTE_DELAY_US / 1000.0;
+	// Start and end of each transaction, which have no reply
+	m_transmitMs += transactions * (LicutCmd_StartTransaction::LENGTH + LicutCmd_EndTransaction::LENGTH) * LICUT_BYTE_DELAY_US / 1000.0;
+	m_replyMs += cmds.GetCount() * replyMs;
+	return 0;
+}
+
+bool LicutPreflight::Fits( unsigned int const mat[4] ) const
+{
+	return m_empty || (m_box[0] >= mat[0] && m_box[1] >= mat[1] && m_box[2] <= mat[2] && m_box[3] <= mat[3]);
+}
+
+// Write report as one line of JSON
+void LicutPreflight::WriteJson( FILE *f, const char *file, unsigned int const mat[4], int mats ) const
+{
+	fprintf( f, "{\"status\":\"ok\",\"file\":" );
+	_json_string( f, file );
+	fprintf( f, ",\"mats\":%d,\"draw_sets\":%d,\"packets\":%d,\"packets_by_subcmd\":{\"move\":%d,\"line\":%d,\"curve\":%d},\"curves\":%d,\"packets_collapsed\":%d",
+		mats, m_groups, m_packets, m_moves, m_lines, m_curves * 4, m_curves, m_collapsed );
+	fprintf( f, ",\"mat\":[%u,%u,%u,%u],\"bounds\":", mat[0], mat[1], mat[2], mat[3] );
+	if (m_empty) fprintf( f, "null" );
+	else fprintf( f, "[%u,%u,%u,%u]", m_box[0], m_box[1], m_box[2], m_box[3] );
+	fprintf( f, ",\"fits\":%s,\"cut_length\":%.0f,\"travel_length\":%.0f",
+		Fits( mat ) ? "true" : "false", m_cutLength, m_travelLength );
+	fprintf( f, ",\"estimate_ms\":{\"total\":%.0f,\"transmit\":%.0f,\"reply\":%.0f,\"delay\":%.0f}}\n",
+		GetEstimatedMs(), m_transmitMs, m_replyMs, m_delayMs );
+}
+
+// Write report for a job that cannot be cut
+void LicutPreflight::WriteError( FILE *f, const char *file, const char *error )
+{
+	fprintf( f, "{\"status\":\"error\",\"file\":" );
+	_json_string( f, file );
+	fprintf( f, ",\"error\":" );
+	_json_string( f, error );
+	fprintf( f, "}\n" );
+}
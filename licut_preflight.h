@@ -0,0 +1,51 @@
+// $Id$
+// Job report from lowered commands without a device
+
+#ifndef _LICUT_PREFLIGHT_H_
+#define _LICUT_PREFLIGHT_H_
+
+#include <stdio.h>
+
+class LicutCmdList;
+
+class LicutPreflight
+{
+public:
+	LicutPreflight();
+
+	// Add commands of one mat, cut from mat origin x, y. Counts, lengths and
+	// time accumulate over calls. replyMs is the estimated device reply time
+	// per packet, the drain inside a transaction if they are sent in
+	// transactions (0x21 ... 0x22) of which there are then transactions.
+	// Returns 0 if successful
+	int Add( LicutCmdList const& cmds, int x, int y, int intercommand, double replyMs, int transactions = 0 );
+
+	// Commands removed at device resolution before Add(), for the report
+	void AddCollapsed( int count ) { m_collapsed += count; }
+
+	// Write report as one line of JSON to f. mat is xmin, ymin, xmax, ymax
+	void WriteJson( FILE *f, const char *file, unsigned int const mat[4], int mats ) const;
+
+	// Write report for a job that cannot be cut
+	static void WriteError( FILE *f, const char *file, const char *error );
+
+	bool Fits( unsigned int const mat[4] ) const;
+	double GetEstimatedMs() const { return m_transmitMs + m_replyMs + m_delayMs; }
+
+protected:
+	int m_groups;
+	int m_packets;
+	int m_moves;
+	int m_lines;
+	int m_curves; // Curves, each sent as 4 packets
+	int m_collapsed;
+	bool m_empty;
+	unsigned int m_box[4]; // Bounds of all points sent including control points
+	double m_cutLength;
+	double m_travelLength;
+	double m_transmitMs;
+	double m_replyMs;
+	double m_delayMs;
+};
+
+#endif // _LICUT_PREFLIGHT_H_
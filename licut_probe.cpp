@@ -14,6 +14,7 @@
 #include <linux/serial.h>
 
 #include "licut_probe.h"
+#include "licut_log.h"
 
 char LicutProbe::errmsg[256] = {0};
 
@@ -34,7 +35,7 @@ int LicutProbe::Open( int verbose /*= 0*/ )
 	unsigned int bus, device, endpoint;
 	bool found_devname = false;
 	char devpath[256];
-	if (verbose) printf( "Opened lsusb -v\n" );
+	if (verbose) LICUT_DEBUG( "Opened lsusb -v\n" );
 	while (fgets( buff, sizeof(buff), lsusb ) && !found_devname)
 	{
 		// Pared down search from "ID 20d3:0011 Future Technology Devices International"
@@ -44,7 +45,7 @@ int LicutProbe::Open( int verbose /*= 0*/ )
 			found_ftdi = true;
 			endpoint = 0;
 			sscanf( buff, "Bus %u Device %u", &bus, &device );
-			if (verbose) printf( "Found FTDI entry bus %u device %u\n", bus, device );
+			if (verbose) LICUT_DEBUG( "Found FTDI entry bus %u device %u\n", bus, device );
 		}
 		else if (in_ftdi && !strncmp( buff, "Bus ", 4 ))
 		{
@@ -60,16 +61,16 @@ int LicutProbe::Open( int verbose /*= 0*/ )
 			{
 				char class_dirname[256];
 				sprintf( class_dirname, "/sys/class/usb_endpoint/usbdev%u.%u_ep%02x/device", bus, device, test_ep );
-				if (verbose) printf( "%s() lsusb -v output line: %s\nScanned endpoint %x\nOpening %s\n",
+				if (verbose) LICUT_DEBUG( "%s() lsusb -v output line: %s\nScanned endpoint %x\nOpening %s\n",
 					__FUNCTION__, buff, test_ep, class_dirname );
 				DIR *class_dir = opendir( class_dirname );
-				if (!class_dir) printf( "%s() - failed to open dir %s\n", __FUNCTION__, class_dirname );
+				if (!class_dir) LICUT_WARN( "%s() - failed to open dir %s\n", __FUNCTION__, class_dirname );
 				else
 				{
 					while (struct dirent *d = readdir( class_dir ))
 					{
 						if (d->d_name[0] == '.') continue;
-						if (verbose) printf( "%s/%s\n", class_dirname, d->d_name );
+						if (verbose) LICUT_DEBUG( "%s/%s\n", class_dirname, d->d_name );
                         if (!strncmp( d->d_name, "ttyACM1", 6 ))
 						{
 							found_devname = true;
@@ -83,7 +84,7 @@ int LicutProbe::Open( int verbose /*= 0*/ )
 			}
 			else
 			{
-				printf( "%s() - failed to scan address from %s", __FUNCTION__, buff );
+				LICUT_WARN( "%s() - failed to scan address from %s", __FUNCTION__, buff );
 			}
 		}
 	}
@@ -94,7 +95,7 @@ int LicutProbe::Open( int verbose /*= 0*/ )
 	{
 		if (found_ftdi)
 		{
-            printf( "Found FTDI USB serial port but no endpoint - assuming /dev/ttyACM1\n" );
+            LICUT_WARN( "Found FTDI USB serial port but no endpoint - assuming /dev/ttyACM1\n" );
             sprintf( devpath, "/dev/ttyACM1" );
 		}
 		else
@@ -104,20 +105,26 @@ int LicutProbe::Open( int verbose /*= 0*/ )
 		}
 	}
 
+	return OpenPath( devpath, verbose );
+}
+
+// Open and configure serial device at devpath
+int LicutProbe::OpenPath( const char *devpath, int verbose /*= 0*/ )
+{
 	int handle = open( devpath, O_RDWR | O_NOCTTY );
 	if (handle <= 0)
 	{
-		sprintf( errmsg, "Failed to open %s - %d (%s)\n", devpath, errno, strerror(errno) );
+		snprintf( errmsg, sizeof(errmsg), "Failed to open %s - %d (%s)\n", devpath, errno, strerror(errno) );
 		return -1;
 	}
 
-	if (verbose) printf( "Opened %s handle %d\n", devpath, handle );
+	if (verbose) LICUT_DEBUG( "Opened %s handle %d\n", devpath, handle );
 
         struct termios oldtio,newtio;
         
         tcgetattr( handle, &oldtio ); /* save current port settings */
     
-	if (verbose) printf( "setting parameters\n" );
+	if (verbose) LICUT_DEBUG( "setting parameters\n" );
         bzero( &newtio, sizeof(newtio) );
 	// Set custom rate to 200kbps 8N1 - we're actually sending 8N2 but get 8N1 back
         newtio.c_cflag = B38400 | /*CRTSCTS |*/ CS8 | CLOCAL | CREAD;
@@ -145,7 +152,7 @@ int LicutProbe::Open( int verbose /*= 0*/ )
 		return -1;
 	}
 
-	if (verbose) printf( "ioctl(TIOCGSERIAL) returned %d, flags was %04x, baud_base %u\n", ioctl_res, sio.flags, sio.baud_base );
+	if (verbose) LICUT_DEBUG( "ioctl(TIOCGSERIAL) returned %d, flags was %04x, baud_base %u\n", ioctl_res, sio.flags, sio.baud_base );
 	sio.flags = ((sio.flags & ~ASYNC_SPD_MASK) | ASYNC_SPD_CUST);
 	sio.custom_divisor = sio.baud_base / 200000;
 	ioctl_res = ioctl( handle, TIOCSSERIAL, &sio );
@@ -155,7 +162,7 @@ int LicutProbe::Open( int verbose /*= 0*/ )
 		close( handle );
 		return -1;
 	}
-	if (verbose) printf( "ioctl(TIOCSSERIAL) returned %d, new flags %04x, new custom_divisor %u\n", ioctl_res, sio.flags, sio.custom_divisor );
+	if (verbose) LICUT_DEBUG( "ioctl(TIOCSSERIAL) returned %d, new flags %04x, new custom_divisor %u\n", ioctl_res, sio.flags, sio.custom_divisor );
 
 	return handle;
 }
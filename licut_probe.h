@@ -4,7 +4,10 @@
 class LicutProbe
 {
 public:
+	// Find the device and open it. Returns handle, 0 if not found or -1 on error
 	static int Open( int verbose = 0 );
+	// Open serial device at devpath and set the device's line speed
+	static int OpenPath( const char *devpath, int verbose = 0 );
 	static void Close( int handle );
 	static const char *Errmsg() { return errmsg; }
 
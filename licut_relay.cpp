@@ -0,0 +1,254 @@
+// $Id$
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "licut_relay.h"
+#include "licut_io.h"
+#include "licut_log.h"
+#include "licut_time.h"
+
+// Bytes from the client waiting to be paced out
+#define RELAY_BUFFER	4096
+
+LicutRelay::LicutRelay( int verbose )
+{
+	m_verbose = verbose;
+	m_listen = -1;
+	m_port = 0;
+	m_clients = 0;
+	m_toDevice = 0;
+	m_fromDevice = 0;
+	m_maxLateUs = 0;
+	if (pipe( m_stopPipe ) != 0) m_stopPipe[0] = m_stopPipe[1] = -1;
+}
+
+LicutRelay::~LicutRelay()
+{
+	if (m_listen >= 0) close( m_listen );
+	if (m_stopPipe[0] >= 0) close( m_stopPipe[0] );
+	if (m_stopPipe[1] >= 0) close( m_stopPipe[1] );
+}
+
+// Listen on address and port. Returns 0 if successful
+int LicutRelay::Listen( const char *address, int port )
+{
+	char service[16];
+	snprintf( service, sizeof(service), "%d", port );
+	struct addrinfo hints, *addrs = NULL;
+	memset( &hints, 0, sizeof(hints) );
+	hints.ai_family = address ? AF_UNSPEC : AF_INET6;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	int res = getaddrinfo( address, service, &hints, &addrs );
+	if (res != 0 && !address)
+	{
+		// No IPv6 here
+		hints.ai_family = AF_INET;
+		res = getaddrinfo( address, service, &hints, &addrs );
+	}
+	if (res != 0)
+	{
+		LICUT_ERROR( "%s() cannot resolve %s: %s\n", __FUNCTION__, address ? address : "any", gai_strerror( res ) );
+		return -1;
+	}
+	int on = 1;
+	for (struct addrinfo *a = addrs; a && m_listen < 0; a = a->ai_next)
+	{
+		m_listen = socket( a->ai_family, a->ai_socktype, a->ai_protocol );
+		if (m_listen < 0) continue;
+		setsockopt( m_listen, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) );
+		if (bind( m_listen, a->ai_addr, a->ai_addrlen ) != 0 || listen( m_listen, 4 ) != 0)
+		{
+			LICUT_ERROR( "%s() cannot listen on port %d: %s\n", __FUNCTION__, port, strerror( errno ) );
+			close( m_listen );
+			m_listen = -1;
+		}
+	}
+	freeaddrinfo( addrs );
+	if (m_listen < 0) return -1;
+
+	struct sockaddr_storage bound;
+	socklen_t boundLength = sizeof(bound);
+	getsockname( m_listen, (struct sockaddr *)&bound, &boundLength );
+	m_port = ntohs( bound.ss_family == AF_INET6 ? ((struct sockaddr_in6 *)&bound)->sin6_port : ((struct sockaddr_in *)&bound)->sin_port );
+	LICUT_INFO( "Relaying to the device on port %d\n", m_port );
+	return 0;
+}
+
+void LicutRelay::Stop()
+{
+	if (m_stopPipe[1] >= 0 && write( m_stopPipe[1], "", 1 ) < 0) {}
+}
+
+// Read from device and pass it on to client if any. Returns bytes read or -1
+int LicutRelay::FromDevice( int device, int client )
+{
+	unsigned char buff[256];
+	int res = read( device, buff, sizeof(buff) );
+	if (res < 0 && errno == EINTR) return 0;
+	if (res <= 0)
+	{
+		LICUT_ERROR( "%s() device read failed: %s\n", __FUNCTION__, res ? strerror( errno ) : "closed" );
+		return -1;
+	}
+	m_fromDevice += res;
+	// A client that went away is noticed when its side is read
+	if (client >= 0 && send( client, buff, res, MSG_NOSIGNAL ) < 0 && m_verbose)
+	{
+		LICUT_DEBUG( "%s() client write failed: %s\n", __FUNCTION__, strerror( errno ) );
+	}
+	else if (client < 0 && m_verbose)
+	{
+		LICUT_DEBUG( "%s() discarded %d bytes with no client\n", __FUNCTION__, res );
+	}
+	return res;
+}
+
+// Pass bytes between client and device. Returns 0 when the client closes, 1 if
+// stopped or -1 if the device failed. Either way bytes received are written first
+int LicutRelay::Serve( int client, int device )
+{
+	unsigned char pending[RELAY_BUFFER];
+	int start = 0, end = 0;
+	bool clientOpen = true;
+	bool stopped = false;
+	double due = 0; // Earliest time for the next byte to the device
+	for (;;)
+	{
+		if (!clientOpen && start == end) return stopped ? 1 : 0;
+		struct pollfd fds[4];
+		memset( fds, 0, sizeof(fds) );
+		fds[0].fd = stopped ? -1 : m_stopPipe[0];
+		fds[1].fd = device;
+		fds[2].fd = m_listen;
+		fds[3].fd = client;
+		fds[0].events = fds[1].events = fds[2].events = POLLIN;
+		if (start > 0 && end == RELAY_BUFFER)
+		{
+			memmove( pending, &pending[start], end - start );
+			end -= start;
+			start = 0;
+		}
+		// Stop reading the client when full, so TCP holds it back
+		int count = (clientOpen && end < RELAY_BUFFER) ? 4 : 3;
+		if (count == 4) fds[3].events = POLLIN;
+
+		// Wait no longer than the next byte is due, to the microsecond
+		struct timespec wait, *timeout = NULL;
+		if (start < end)
+		{
+			double us = due - licut_now() * 1e6;
+			if (us < 0) us = 0;
+			wait.tv_sec = (time_t)(us / 1e6);
+			wait.tv_nsec = (long)((us - wait.tv_sec * 1e6) * 1000);
+			timeout = &wait;
+		}
+		if (ppoll( fds, count, timeout, NULL ) < 0 && errno != EINTR)
+		{
+			LICUT_ERROR( "%s() poll failed: %s\n", __FUNCTION__, strerror( errno ) );
+			return -1;
+		}
+		// Bytes already received still go out, so the device never sees half a packet
+		if (fds[0].revents)
+		{
+			stopped = true;
+			clientOpen = false;
+		}
+		if (fds[1].revents && FromDevice( device, client ) < 0) return -1;
+		if (fds[2].revents)
+		{
+			// One client at a time, like a serial server's port
+			int other = accept( m_listen, NULL, NULL );
+			if (other >= 0)
+			{
+				LICUT_WARN( "Refused a second client while one is connected\n" );
+				close( other );
+			}
+		}
+		if (count == 4 && fds[3].revents)
+		{
+			int res = read( client, &pending[end], RELAY_BUFFER - end );
+			if (res > 0)
+			{
+				// Bytes arriving while idle may go at once
+				if (start == end && due < licut_now() * 1e6) due = licut_now() * 1e6;
+				end += res;
+			}
+			else if (res == 0 || errno != EINTR)
+			{
+				clientOpen = false;
+			}
+		}
+
+		// Everything due, one byte at a time
+		while (start < end)
+		{
+			double now = licut_now() * 1e6;
+			if (now < due) break;
+			int res = write( device, &pending[start], 1 );
+			if (res < 0 && errno == EINTR) continue;
+			if (res < 1)
+			{
+				LICUT_ERROR( "%s() device write failed: %s\n", __FUNCTION__, strerror( errno ) );
+				return -1;
+			}
+			if (now - due > m_maxLateUs) m_maxLateUs = (long)(now - due);
+			start++;
+			m_toDevice++;
+			due = now + LICUT_BYTE_DELAY_US;
+		}
+		if (start == end) start = end = 0;
+	}
+}
+
+// Relay clients until Stop(). Returns 0 when stopped or -1 on error
+int LicutRelay::Run( int device )
+{
+	if (m_listen < 0 || m_stopPipe[0] < 0) return -1;
+	signal( SIGPIPE, SIG_IGN );
+	for (;;)
+	{
+		struct pollfd fds[3];
+		memset( fds, 0, sizeof(fds) );
+		fds[0].fd = m_stopPipe[0];
+		fds[1].fd = device;
+		fds[2].fd = m_listen;
+		fds[0].events = fds[1].events = fds[2].events = POLLIN;
+		if (poll( fds, 3, -1 ) < 0 && errno != EINTR)
+		{
+			LICUT_ERROR( "%s() poll failed: %s\n", __FUNCTION__, strerror( errno ) );
+			return -1;
+		}
+		if (fds[0].revents) return 0;
+		// Nobody to pass replies to
+		if (fds[1].revents && FromDevice( device, -1 ) < 0) return -1;
+		if (!fds[2].revents) continue;
+
+		int client = accept( m_listen, NULL, NULL );
+		if (client < 0) continue;
+		int on = 1;
+		setsockopt( client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on) );
+		setsockopt( client, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on) );
+		m_clients++;
+		LICUT_INFO( "Client %d connected\n", m_clients );
+		int res = Serve( client, device );
+		close( client );
+		LICUT_INFO( "Client %d %s, %ld bytes to device, %ld from device, pacing at most %ldus late\n", m_clients,
+			res == 0 ? "closed" : "dropped", m_toDevice, m_fromDevice, m_maxLateUs );
+		if (res > 0) return 0;
+		if (res < 0) return -1;
+	}
+}
@@ -0,0 +1,53 @@
+// $Id$
+// Relay run next to the cutter, e.g. on an ARM board, so a host can drive it
+// over TCP with --device=tcp:relay:port. One client at a time is passed through
+// to the device. Bytes from the client are paced to the device here, so network
+// delays between host and relay cannot bunch them up; replies go straight back
+
+#ifndef _LICUT_RELAY_H_
+#define _LICUT_RELAY_H_
+
+class LicutRelay
+{
+public:
+	LicutRelay( int verbose );
+	~LicutRelay();
+
+	// Listen on address (NULL for any) and port, 0 for any free port (see
+	// GetPort()). Returns 0 if successful
+	int Listen( const char *address, int port );
+	int GetPort() const { return m_port; }
+
+	// Relay clients to and from device descriptor until Stop(). Returns 0 when
+	// stopped or -1 on error
+	int Run( int device );
+
+	// Make Run() return once bytes already received are written. Safe from a
+	// signal handler or another thread
+	void Stop();
+
+	int GetClientCount() const { return m_clients; }
+	long GetBytesToDevice() const { return m_toDevice; }
+	long GetBytesFromDevice() const { return m_fromDevice; }
+	// Most any byte was written to the device after it was due, in microseconds
+	long GetMaxLateUs() const { return m_maxLateUs; }
+
+protected:
+	// Pass bytes between client and device until the client closes or Stop().
+	// Returns 0 if the client closed, 1 if stopped or -1 if the device failed
+	int Serve( int client, int device );
+	// Read from device, passing it to client unless -1. Returns bytes read or -1
+	int FromDevice( int device, int client );
+
+protected:
+	int m_verbose;
+	int m_listen;
+	int m_port;
+	int m_stopPipe[2];
+	int m_clients;
+	long m_toDevice;
+	long m_fromDevice;
+	long m_maxLateUs;
+};
+
+#endif // _LICUT_RELAY_H_
@@ -0,0 +1,494 @@
+// $Id$
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "licut_simplify.h"
+#include "licut_geom.h"
+#include "licut_log.h"
+
+// Packets sent per command type by LicutCmdList::Send()
+#define PACKETS_LINE	1
+#define PACKETS_CURVE	4
+
+// Approximate cost of one 0x40 exchange, not including intercommand delay:
+// 14 bytes with 1ms intercharacter delay plus the 250ms drain in ReadCmdReply
+#define PACKET_MS	(14 + 250)
+
+// Curve fitting is tried on at most this many points at once
+#define MAX_FIT_POINTS	256
+
+// Fraction of tolerance allowed for error from sampling fitted curves
+#define SAMPLE_MARGIN	0.1
+
+LicutSimplify::LicutSimplify( int verbose )
+{
+	m_verbose = verbose;
+	m_tolerance = 0;
+	m_fitCurves = false;
+	m_out = NULL;
+	m_outCount = 0;
+	m_outAlloc = 0;
+	m_keep = NULL;
+	m_keepAlloc = 0;
+	m_packetsBefore = 0;
+	m_packetsAfter = 0;
+	m_curvesFitted = 0;
+	m_maxDeviation = 0;
+}
+
+LicutSimplify::~LicutSimplify()
+{
+	free( m_out );
+	free( m_keep );
+}
+
+// Number of 0x40 packets LicutCmdList::Lower() makes of set
+int LicutSimplify::CountPackets( drawSet_t const *set )
+{
+	int packets = 0;
+	for (; set && set->type != 0; set++)
+	{
+		if (set->type == 'M' || set->type == 'L') packets += PACKETS_LINE;
+		else if (set->type == 'C') packets += PACKETS_CURVE;
+	}
+	return packets;
+}
+
+// Estimated ms LicutCmdList::Send() spends on set with the given delays
+double LicutSimplify::EstimateMs( drawSet_t const *set, int intercommand, int intercurve )
+{
+	double ms = 0;
+	for (; set && set->type != 0; set++)
+	{
+		if (set->type == 'M' || set->type == 'L') ms += PACKET_MS + intercommand;
+		else if (set->type == 'C') ms += PACKETS_CURVE * PACKET_MS + (PACKETS_CURVE - 1) * intercurve + intercommand;
+	}
+	return ms;
+}
+
+// Distance from p to segment a-b
+double LicutSimplify::SegmentDistance( double const p[2], double const a[2], double const b[2] )
+{
+	double dx = b[0] - a[0];
+	double dy = b[1] - a[1];
+	double length2 = dx * dx + dy * dy;
+	double t = 0;
+	if (length2 > 0)
+	{
+		t = ((p[0] - a[0]) * dx + (p[1] - a[1]) * dy) / length2;
+		if (t < 0) t = 0;
+		else if (t > 1) t = 1;
+	}
+	double q[2] = { a[0] + t * dx, a[1] + t * dy };
+	return LicutGeom::Distance( p, q );
+}
+
+// Append command to m_out. Returns 0 if successful
+int LicutSimplify::Emit( char type, double const *p0, double const *p1 /*= NULL*/, double const *p2 /*= NULL*/ )
+{
+	if (m_outCount + 1 >= m_outAlloc)
+	{
+		int newAlloc = m_outAlloc ? m_outAlloc * 2 : 256;
+		drawSet_t *out = (drawSet_t *)realloc( m_out, newAlloc * sizeof(drawSet_t) );
+		if (!out)
+		{
+			LICUT_ERROR( "%s() failed to allocate %d commands\n", __FUNCTION__, newAlloc );
+			return -1;
+		}
+		m_out = out;
+		m_outAlloc = newAlloc;
+	}
+	drawSet_t& t = m_out[m_outCount++];
+	t.type = type;
+	t.numPoints = p1 ? 3 : 1;
+	memcpy( t.pt[0], p0, sizeof(t.pt[0]) );
+	if (p1)
+	{
+		memcpy( t.pt[1], p1, sizeof(t.pt[1]) );
+		memcpy( t.pt[2], p2, sizeof(t.pt[2]) );
+	}
+	return 0;
+}
+
+// Fit cubic to pts[first..last] by least squares with fixed end points and
+// chord-length parameters refined once by Newton-Raphson. Accepted only if every
+// sample of the curve is within tolerance of the polyline and every polyline
+// vertex within tolerance of the curve, allowing for sampling error
+bool LicutSimplify::FitCubic( double (*pts)[2], int first, int last, double ctl[3][2] )
+{
+	int count = last - first + 1;
+	double *u = (double *)malloc( count * sizeof(double) );
+	if (!u) return false;
+	double const *p0 = pts[first];
+	double const *p3 = pts[last];
+	int i, iter;
+	u[0] = 0;
+	for (i = 1; i < count; i++) u[i] = u[i - 1] + LicutGeom::Distance( pts[first + i - 1], pts[first + i] );
+	if (u[count - 1] <= 0)
+	{
+		free( u );
+		return false;
+	}
+	for (i = 1; i < count; i++) u[i] /= u[count - 1];
+
+	bool solved = false;
+	for (iter = 0; iter < 2; iter++)
+	{
+		double c11 = 0, c12 = 0, c22 = 0, x1[2] = { 0, 0 }, x2[2] = { 0, 0 };
+		for (i = 0; i < count; i++)
+		{
+			double t = u[i], v = 1 - t;
+			double b0 = v * v * v, b1 = 3 * v * v * t, b2 = 3 * v * t * t, b3 = t * t * t;
+			c11 += b1 * b1;
+			c12 += b1 * b2;
+			c22 += b2 * b2;
+			for (int a = 0; a < 2; a++)
+			{
+				double r = pts[first + i][a] - b0 * p0[a] - b3 * p3[a];
+				x1[a] += b1 * r;
+				x2[a] += b2 * r;
+			}
+		}
+		double det = c11 * c22 - c12 * c12;
+		if (fabs( det ) < 1e-12) break;
+		for (int a = 0; a < 2; a++)
+		{
+			ctl[0][a] = (x1[a] * c22 - x2[a] * c12) / det;
+			ctl[1][a] = (c11 * x2[a] - c12 * x1[a]) / det;
+		}
+		memcpy( ctl[2], p3, sizeof(ctl[2]) );
+		solved = true;
+
+		// Newton-Raphson step on each parameter toward the closest point
+		for (i = 1; i < count - 1; i++)
+		{
+			double t = u[i], v = 1 - t;
+			double q[2], d1[2], d2[2];
+			LicutGeom::Bezier( p0, ctl[0], ctl[1], ctl[2], t, q );
+			for (int a = 0; a < 2; a++)
+			{
+				d1[a] = 3 * (v * v * (ctl[0][a] - p0[a]) + 2 * v * t * (ctl[1][a] - ctl[0][a]) + t * t * (p3[a] - ctl[1][a]));
+				d2[a] = 6 * (v * (ctl[1][a] - 2 * ctl[0][a] + p0[a]) + t * (p3[a] - 2 * ctl[1][a] + ctl[0][a]));
+			}
+			double num = (q[0] - pts[first + i][0]) * d1[0] + (q[1] - pts[first + i][1]) * d1[1];
+			double den = d1[0] * d1[0] + d1[1] * d1[1] + (q[0] - pts[first + i][0]) * d2[0] + (q[1] - pts[first + i][1]) * d2[1];
+			if (den != 0)
+			{
+				t -= num / den;
+				if (t > 0 && t < 1) u[i] = t;
+			}
+		}
+	}
+	free( u );
+	if (!solved) return false;
+
+	// Bound distance between curve and its sampled polyline: |B''| <= 6 * max second difference
+	// and chord error <= |B''| / (8 * N^2)
+	double dd = 0;
+	for (int a = 0; a < 2; a++)
+	{
+		double s1 = fabs( p0[a] - 2 * ctl[0][a] + ctl[1][a] );
+		double s2 = fabs( ctl[0][a] - 2 * ctl[1][a] + p3[a] );
+		dd += (s1 > s2 ? s1 : s2) * (s1 > s2 ? s1 : s2);
+	}
+	dd = sqrt( dd );
+	double allowed = m_tolerance * (1 - SAMPLE_MARGIN);
+	int samples = (int)ceil( sqrt( 0.75 * dd / (m_tolerance * SAMPLE_MARGIN) ) );
+	if (samples < 8) samples = 8;
+	if (samples > 2048) return false;
+
+	double (*curve)[2] = (double (*)[2])malloc( (samples + 1) * sizeof(curve[0]) );
+	if (!curve) return false;
+	for (i = 0; i <= samples; i++) LicutGeom::Bezier( p0, ctl[0], ctl[1], ctl[2], (double)i / samples, curve[i] );
+	double worst = 0;
+	bool ok = true;
+	// Curve to polyline
+	for (i = 0; i <= samples && ok; i++)
+	{
+		double best = HUGE_VAL;
+		for (int k = first; k < last && best > 0; k++)
+		{
+			double d = SegmentDistance( curve[i], pts[k], pts[k + 1] );
+			if (d < best) best = d;
+		}
+		if (best > allowed) ok = false;
+		if (best > worst) worst = best;
+	}
+	// Polyline vertices to curve
+	for (int k = first + 1; k < last && ok; k++)
+	{
+		double best = HUGE_VAL;
+		for (i = 0; i < samples && best > 0; i++)
+		{
+			double d = SegmentDistance( pts[k], curve[i], curve[i + 1] );
+			if (d < best) best = d;
+		}
+		if (best > allowed) ok = false;
+		if (best > worst) worst = best;
+	}
+	free( curve );
+	if (ok && worst + m_tolerance * SAMPLE_MARGIN > m_maxDeviation) m_maxDeviation = worst + m_tolerance * SAMPLE_MARGIN;
+	return ok;
+}
+
+// Simplify one run of points pts[0..count-1] (pts[0] is current position)
+// and append commands reaching pts[count-1] to m_out. Returns 0 if successful
+int LicutSimplify::SimplifyRun( double (*pts)[2], int count )
+{
+	int i;
+	// Drop zero-length segments
+	int unique = 1;
+	for (i = 1; i < count; i++)
+	{
+		if (pts[i][0] == pts[unique - 1][0] && pts[i][1] == pts[unique - 1][1]) continue;
+		if (unique != i) memcpy( pts[unique], pts[i], sizeof(pts[0]) );
+		unique++;
+	}
+	count = unique;
+	if (count < 2) return 0;
+
+	// Douglas-Peucker with explicit stack of [first,last] spans
+	if (count > m_keepAlloc)
+	{
+		bool *keep = (bool *)realloc( m_keep, count * 2 * sizeof(bool) );
+		if (!keep)
+		{
+			LICUT_ERROR( "%s() failed to allocate for %d points\n", __FUNCTION__, count );
+			return -1;
+		}
+		m_keep = keep;
+		m_keepAlloc = count * 2;
+	}
+	memset( m_keep, 0, count * sizeof(bool) );
+	m_keep[0] = m_keep[count - 1] = true;
+	int *stack = (int *)malloc( count * 2 * sizeof(int) );
+	if (!stack)
+	{
+		LICUT_ERROR( "%s() failed to allocate for %d points\n", __FUNCTION__, count );
+		return -1;
+	}
+	int top = 0;
+	stack[top++] = 0;
+	stack[top++] = count - 1;
+	while (top > 0)
+	{
+		int last = stack[--top];
+		int first = stack[--top];
+		double worst = -1;
+		int worstIndex = -1;
+		for (i = first + 1; i < last; i++)
+		{
+			double d = SegmentDistance( pts[i], pts[first], pts[last] );
+			if (d > worst)
+			{
+				worst = d;
+				worstIndex = i;
+			}
+		}
+		if (worstIndex < 0) continue;
+		if (worst > m_tolerance)
+		{
+			m_keep[worstIndex] = true;
+			stack[top++] = first;
+			stack[top++] = worstIndex;
+			stack[top++] = worstIndex;
+			stack[top++] = last;
+		}
+		else if (worst > m_maxDeviation)
+		{
+			m_maxDeviation = worst;
+		}
+	}
+	free( stack );
+
+	// Kept vertex indices
+	int *kept = (int *)malloc( count * sizeof(int) );
+	if (!kept)
+	{
+		LICUT_ERROR( "%s() failed to allocate for %d points\n", __FUNCTION__, count );
+		return -1;
+	}
+	int keptCount = 0;
+	for (i = 0; i < count; i++)
+	{
+		if (m_keep[i]) kept[keptCount++] = i;
+	}
+
+	// Replace stretches of more than PACKETS_CURVE lines with one curve where it fits.
+	// Stretch length is grown by doubling then refined by bisection
+	int a = 0;
+	while (a < keptCount - 1)
+	{
+		int best = -1;
+		double bestCtl[3][2];
+		if (m_fitCurves)
+		{
+			double ctl[3][2];
+			int good = -1;
+			int bad;
+			int b = a + PACKETS_CURVE + 1;
+			for (;;)
+			{
+				if (b >= keptCount)
+				{
+					bad = keptCount;
+					break;
+				}
+				if (kept[b] - kept[a] >= MAX_FIT_POINTS || !FitCubic( pts, kept[a], kept[b], ctl ))
+				{
+					bad = b;
+					break;
+				}
+				good = b;
+				memcpy( bestCtl, ctl, sizeof(ctl) );
+				b = a + (b - a) * 2;
+			}
+			while (good >= 0 && bad - good > 1)
+			{
+				int mid = (good + bad) / 2;
+				if (kept[mid] - kept[a] < MAX_FIT_POINTS && FitCubic( pts, kept[a], kept[mid], ctl ))
+				{
+					good = mid;
+					memcpy( bestCtl, ctl, sizeof(ctl) );
+				}
+				else
+				{
+					bad = mid;
+				}
+			}
+			best = good;
+		}
+		int r;
+		if (best > a)
+		{
+			r = Emit( 'C', bestCtl[0], bestCtl[1], bestCtl[2] );
+			m_curvesFitted++;
+			a = best;
+		}
+		else
+		{
+			r = Emit( 'L', pts[kept[a + 1]] );
+			a++;
+		}
+		if (r != 0)
+		{
+			free( kept );
+			return -1;
+		}
+	}
+	free( kept );
+	return 0;
+}
+
+// Simplify runs of L commands in all draw sets of svg. Returns 0 if successful
+int LicutSimplify::Run( LicutSVG& svg, double tolerance, bool fitCurves )
+{
+	m_tolerance = tolerance;
+	m_fitCurves = fitCurves;
+	m_packetsBefore = 0;
+	m_packetsAfter = 0;
+	m_curvesFitted = 0;
+	m_maxDeviation = 0;
+	if (tolerance <= 0) return -1;
+
+	double (*run)[2] = NULL;
+	int runAlloc = 0;
+	for (int n = 0; n < svg.GetDrawSetCount(); n++)
+	{
+		drawSet_t const *set = svg.GetDrawSet( n );
+		int count = LicutGeom::Count( set );
+		m_packetsBefore += CountPackets( set );
+		m_outCount = 0;
+		bool havePos = false;
+		double pos[2] = { 0, 0 };
+		int i = 0;
+		while (i < count)
+		{
+			if (set[i].type == 'L' && havePos)
+			{
+				int runCount = 1;
+				int j;
+				for (j = i; j < count && set[j].type == 'L'; j++) runCount++;
+				if (runCount > runAlloc)
+				{
+					double (*newRun)[2] = (double (*)[2])realloc( run, runCount * 2 * sizeof(run[0]) );
+					if (!newRun)
+					{
+						LICUT_ERROR( "%s() failed to allocate for %d points\n", __FUNCTION__, runCount );
+						free( run );
+						return -1;
+					}
+					run = newRun;
+					runAlloc = runCount * 2;
+				}
+				memcpy( run[0], pos, sizeof(run[0]) );
+				for (int k = i; k < j; k++) memcpy( run[k - i + 1], set[k].pt[0], sizeof(run[0]) );
+				if (SimplifyRun( run, runCount ) != 0)
+				{
+					free( run );
+					return -1;
+				}
+				memcpy( pos, set[j - 1].pt[0], sizeof(pos) );
+				i = j;
+				continue;
+			}
+			if (set[i].type == 'M')
+			{
+				// A move which is followed by another move, or goes nowhere, has no effect
+				bool redundant = (i + 1 < count && set[i + 1].type == 'M') ||
+					(havePos && m_outCount > 0 && set[i].pt[0][0] == pos[0] && set[i].pt[0][1] == pos[1]);
+				memcpy( pos, set[i].pt[0], sizeof(pos) );
+				havePos = true;
+				i++;
+				if (!redundant && Emit( 'M', pos ) != 0)
+				{
+					free( run );
+					return -1;
+				}
+				continue;
+			}
+			// Anything else is kept as is
+			if (Emit( set[i].type, set[i].pt[0] ) != 0)
+			{
+				free( run );
+				return -1;
+			}
+			m_out[m_outCount - 1] = set[i];
+			memcpy( pos, LicutGeom::EndPoint( &set[i] ), sizeof(pos) );
+			havePos = true;
+			i++;
+		}
+		if (m_outCount == 0 || m_outCount == count)
+		{
+			// Nothing removed; keep original unless curves were substituted
+			bool same = (m_outCount == count);
+			for (i = 0; i < m_outCount && same; i++)
+			{
+				same = (m_out[i].type == set[i].type && !memcmp( m_out[i].pt, set[i].pt, m_out[i].numPoints * sizeof(m_out[i].pt[0]) ));
+			}
+			if (same || m_outCount == 0)
+			{
+				m_packetsAfter += CountPackets( set );
+				continue;
+			}
+		}
+		drawSet_t *newSet = (drawSet_t *)malloc( (m_outCount + 1) * sizeof(drawSet_t) );
+		if (!newSet)
+		{
+			LICUT_ERROR( "%s() failed to allocate set %d\n", __FUNCTION__, n );
+			free( run );
+			return -1;
+		}
+		memcpy( newSet, m_out, m_outCount * sizeof(drawSet_t) );
+		newSet[m_outCount].type = 0;
+		newSet[m_outCount].numPoints = 0;
+		m_packetsAfter += CountPackets( newSet );
+		if (m_verbose) LICUT_DEBUG( "%s() set %d: %d commands -> %d\n", __FUNCTION__, n, count, m_outCount );
+		svg.ReplaceDrawSet( n, newSet );
+	}
+	free( run );
+	return 0;
+}
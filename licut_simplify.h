@@ -0,0 +1,65 @@
+// $Id$
+// Polyline simplification and curve fitting to reduce packet count
+
+#ifndef _LICUT_SIMPLIFY_H_
+#define _LICUT_SIMPLIFY_H_
+
+#include "licut_svg.h"
+
+class LicutSimplify
+{
+public:
+	LicutSimplify( int verbose );
+	~LicutSimplify();
+
+	// Simplify runs of L commands in all draw sets of svg. tolerance is in svg units.
+	// Duplicate points and redundant moves are removed, near-collinear segments merged
+	// (Douglas-Peucker) and if fitCurves is set, long runs replaced with cubic beziers
+	// where that needs fewer packets. Every point of the result lies within tolerance
+	// of the original path and every original vertex within tolerance of the result.
+	// Returns 0 if successful
+	int Run( LicutSVG& svg, double tolerance, bool fitCurves );
+
+	// Results of last Run()
+	int GetPacketsBefore() const { return m_packetsBefore; }
+	int GetPacketsAfter() const { return m_packetsAfter; }
+	int GetCurvesFitted() const { return m_curvesFitted; }
+	double GetMaxDeviation() const { return m_maxDeviation; }
+
+	// Number of 0x40 packets LicutCmdList::Lower() makes of set
+	static int CountPackets( drawSet_t const *set );
+
+	// Estimated ms LicutCmdList::Send() spends on set with the given delays
+	static double EstimateMs( drawSet_t const *set, int intercommand, int intercurve );
+
+protected:
+	// Simplify one run of points pts[0..count-1] (pts[0] is current position)
+	// and append commands reaching pts[count-1] to m_out. Returns 0 if successful
+	int SimplifyRun( double (*pts)[2], int count );
+
+	// Fit cubic to pts[first..last]. Returns true and sets control points if
+	// within tolerance of the polyline both ways
+	bool FitCubic( double (*pts)[2], int first, int last, double ctl[3][2] );
+
+	// Append command to m_out. Returns 0 if successful
+	int Emit( char type, double const *p0, double const *p1 = NULL, double const *p2 = NULL );
+
+	// Distance from p to segment a-b
+	static double SegmentDistance( double const p[2], double const a[2], double const b[2] );
+
+protected:
+	int m_verbose;
+	double m_tolerance;
+	bool m_fitCurves;
+	drawSet_t *m_out;
+	int m_outCount;
+	int m_outAlloc;
+	bool *m_keep;
+	int m_keepAlloc;
+	int m_packetsBefore;
+	int m_packetsAfter;
+	int m_curvesFitted;
+	double m_maxDeviation;
+};
+
+#endif // _LICUT_SIMPLIFY_H_
@@ -6,34 +6,87 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
-#include <alloca.h>
+#include <math.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #include "licut_svg.h"
 #include "licut_io.h"
+#include "licut_xml.h"
+#include "licut_input.h"
+#include "licut_hpgl.h"
+#include "licut_cmdlist.h"
+#include "licut_log.h"
 
-#define MAX_DRAWSETS	64
+// Draw set array grows by doubling from here
+#define INITIAL_DRAWSETS	64
+
+// Most draw sets <use> elements may place in one parse, so a few nested
+// <use> elements cannot place billions
+#define MAX_INSTANCES	(1 << 22)
+
+static const double _identity[6] = { 1, 0, 0, 1, 0, 0 };
 
 LicutSVG::LicutSVG( int verbose /* = 0*/)
 {
 	m_width = 0;
 	m_height = 0;
+	m_widthInches = 0;
+	m_heightInches = 0;
+	memset( m_viewBox, 0, sizeof(m_viewBox) );
 	m_drawSetCount = 0;
-	m_drawSets = (drawSet_t**)malloc( MAX_DRAWSETS * sizeof(drawSet_t*) );
-	memset( m_drawSets, 0, MAX_DRAWSETS * sizeof(drawSet_t*) );
+	m_drawSetAlloc = 0;
+	m_drawSets = NULL;
 	m_verbose = verbose;
 	m_intercommand = 100; // 100ms between commands (in addition to waiting for reply)
 	m_intercurve = 5; // 5ms betwen elements of a Bezier curve set
+	m_collapse = false;
+	m_transaction = 0;
+	m_transactionDrain = 5;
+	m_transactionsSent = 0;
+	m_retries = 0;
+	m_retryCount = 0;
+	m_resyncCount = 0;
+	m_packetsSent = 0;
+	m_packetsCollapsed = 0;
+	memset( m_select, 0, sizeof(m_select) );
+	memset( m_selectCount, 0, sizeof(m_selectCount) );
+	m_selectState = NULL;
+	m_selectStateAlloc = 0;
+	m_skippedElements = 0;
+	m_sink = NULL;
+	m_sinkStopped = false;
+	m_instances = NULL;
+	m_shared = NULL;
+	m_sharedCount = 0;
+	m_instanceCount = 0;
+	m_parseFirst = 0;
+	m_defsDepth = -1;
+	m_hidden = NULL;
+	m_hiddenAlloc = 0;
+	m_refs = NULL;
+	m_refCount = 0;
+	m_refAlloc = 0;
+	m_refsSorted = false;
+	m_openRefs = NULL;
+	m_openRefCount = 0;
+	m_openRefAlloc = 0;
+	m_uses = NULL;
+	m_useCount = 0;
+	m_useAlloc = 0;
+	m_referenced = NULL;
+	m_unresolved = 0;
+	m_placed = 0;
+	m_recordRefs = false;
 }
 
 LicutSVG::~LicutSVG()
 {
 	int n;
+	// Instances have no draw set of their own until expanded
 	if (m_drawSets != NULL)
 	  for (n = 0; n < m_drawSetCount; n++)
 	  {
-		if (m_drawSets[n] == NULL) break;
 		free( m_drawSets[n] );
 	  }
 	if (m_drawSets != NULL)
@@ -41,406 +94,849 @@ LicutSVG::~LicutSVG()
 		free( m_drawSets );
 		m_drawSets = NULL;
 	}
+	free( m_instances );
+	for (n = 0; n < m_sharedCount; n++) free( m_shared[n] );
+	free( m_shared );
+	free( m_hidden );
+	free( m_refs );
+	free( m_openRefs );
+	free( m_uses );
+	free( m_referenced );
+	for (int kind = 0; kind < SELECT_KINDS; kind++)
+	  for (int list = 0; list < 2; list++)
+	  {
+		for (n = 0; n < m_selectCount[kind][list]; n++) free( m_select[kind][list][n] );
+		free( m_select[kind][list] );
+	  }
+	free( m_selectState );
 }
 
 // Dump without control characters for debugging
-static const char *_fmt_sample( char *s, int length )
+static const char *_fmt_sample( const char *s, int length )
 {
 	static char buff[256];
 	int n;
-	buff[0] = '\0';
 	int buffLen = 0;
-	for (n = 0; n < length; n++)
+	// Longest expansion per character is {0xhh} or {NUL}
+	for (n = 0; n < length && buffLen < (int)sizeof(buff) - 7; n++)
 	{
-		buffLen = strlen( buff );
 		switch (s[n])
 		{
 			case '\n':
 				strcpy( &buff[buffLen], "{lf}" );
+				buffLen += 4;
 				break;
 			case '\r':
 				strcpy( &buff[buffLen], "{cr}" );
+				buffLen += 4;
 				break;
 			case '\t':
 				strcpy( &buff[buffLen], "{ht}" );
+				buffLen += 4;
 				break;
 			case '\0':
 				strcpy( &buff[buffLen], "{NUL}" );
+				buffLen += 5;
 				break;
 			default:
 				if (s[n] >= ' ' && s[n] < 127)
 				{
 					buff[buffLen++] = s[n];
-					buff[buffLen] = '\0';
 				}
 				else
 				{
-					sprintf( &buff[buffLen], "{0x%02x}", s[n] );
+					buffLen += sprintf( &buff[buffLen], "{0x%02x}", (unsigned char)s[n] );
 				}
 				break;
 		}
+		// Don't read past the end of the string
+		if (!s[n]) break;
 	}
+	buff[buffLen] = '\0';
 	return buff;
 }
 
 // Parse file - returns 0 if successful
 int LicutSVG::Parse( const char *svgPath )
 {
-	FILE *f = fopen( svgPath, "r" );
-	if (!f)
+	LicutInput input( m_verbose );
+	if (input.Read( svgPath ) != 0) return -1;
+	if (input.IsCompressed())
 	{
-		printf( "Failed to open %s (errno=%d: %s)\n", svgPath, errno, strerror(errno) );
-		return -1;
+		double seconds = input.GetSeconds() > 0 ? input.GetSeconds() : 1e-6;
+		LICUT_INFO( "Decompressed %s: %.2f MB to %.2f MB in %.1fms (%.1f MB/s compressed, %.1f MB/s uncompressed)\n",
+			svgPath, input.GetCompressedLength() / 1e6, input.GetLength() / 1e6, seconds * 1000,
+			input.GetCompressedLength() / 1e6 / seconds, input.GetLength() / 1e6 / seconds );
 	}
-	struct stat fileInfo;
-	if (0 != fstat( fileno(f), &fileInfo ))
+	if (LicutHPGL::IsHPGLPath( svgPath )) return ParseHPGL( input.GetData(), input.GetLength() );
+	return ParseBuffer( input.GetData(), input.GetLength() );
+}
+
+// Parse HPGL data into draw sets - returns 0 if successful
+int LicutSVG::ParseHPGL( const char *data, size_t length )
+{
+	m_instanceCount = 0;
+	LicutHPGL hpgl( m_verbose );
+	int r = hpgl.Parse( data, length, *this );
+	if (r != 0 && m_sinkStopped) return 0;
+	return r;
+}
+
+// Returns true if data has a <use> element
+static bool _has_use( const char *data, size_t length )
+{
+	const char *end = data + length;
+	for (const char *p = data; (p = (const char *)memchr( p, '<', end - p )) != NULL; p++)
 	{
-		printf( "Failed to get size of %s (errno=%d: %s)\n", svgPath, errno, strerror(errno) );
-		fclose( f );
-		return -1;
+		if (end - p > 4 && !strncmp( &p[1], "use", 3 ) && strchr( " \t\r\n/>", p[4] ) && p[4]) return true;
 	}
-	// If size is greater than the process stack limit we'll get a stack overflow fault
-	// here. Use malloc / free if over 1mb *FIXME*
-	if (fileInfo.st_size < 1  || fileInfo.st_size > 0x10000)
+	return false;
+}
+
+// Parse NUL-terminated svg data in memory, modifying it in place - returns 0 if successful
+int LicutSVG::ParseBuffer( char *data, size_t length )
+{
+	LicutXML xml( m_verbose );
+	int success = -1;
+	m_parseFirst = m_drawSetCount;
+	m_instanceCount = 0;
+	m_unresolved = 0;
+	m_placed = 0;
+	// Plotter files have no markup
+	if (LicutHPGL::IsHPGL( data, length )) return ParseHPGL( data, length );
+	// Ids are only recorded for <use> elements to refer to
+	m_recordRefs = _has_use( data, length );
+
+	if (xml.Parse( data, length, *this ) >= 1)
 	{
-		printf( "Invalid file size %lu for %s - must be > 0 and <= 1mb\n", fileInfo.st_size, svgPath );
-		fclose( f );
-		return -1;
+		success = 0;
 	}
-	char *data = (char *)alloca( fileInfo.st_size + 1 );
-	size_t bytesRead = fread( data, sizeof(char), fileInfo.st_size, f );
-	if (bytesRead < fileInfo.st_size)
+	else if (!m_sinkStopped)
 	{
-		printf( "Failed to read contents of %s (%lu requested, %d read, errno=%d: %s)\n",
-			svgPath, fileInfo.st_size, bytesRead, errno, strerror(errno) );
-		fclose( f );
-		return -1;
+		LICUT_ERROR( "Did not parse any tags!\n" );
 	}
+	// Ids point into data, so <use> elements are resolved before it goes
+	if (ResolveInstances() != 0) success = -1;
 
-	fclose( f );
-
-	// NULL-terminate it
-	data[bytesRead] = '\0';
+	if (m_verbose) LICUT_DEBUG( "Parsed %lu bytes, max depth %d\n", (unsigned long)length, xml.GetMaxDepth() );
+	if (m_skippedElements) LICUT_INFO( "Skipped %d elements by selection\n", m_skippedElements );
+	if (m_instanceCount && m_sink) LICUT_INFO( "Placed %d instances\n", m_instanceCount );
+	else if (m_instanceCount) LICUT_INFO( "Placed %d instances of %d shared draw sets\n", m_instanceCount, m_sharedCount );
+	if (m_unresolved)
+	{
+		LICUT_WARN( "%d <use> elements refer to undefined ids%s\n", m_unresolved,
+			m_sink ? " (only <defs> and <symbol> content before them can be placed while streaming)" : "" );
+	}
 
-	int success = -1;
+	return success;
+}
 
-	/****
-	Simple state machine parser
-	This is a simplistic, tiny xml parser which doesn't handle CDATA or escapes
-	It operates destructively on data, parsing recursively from the outside in
-	and setting the end of each tag (</{tagname}> or /> or --> or ?>) to '\0'
-	Also null-terminates the name of each tag
-	Limited to tag identification for 1024 levels
-	****/
-	char * tagStack[1024];
-	tagStack[0] = (char *)"";
-	int stackLevel = 0;
-	char * tagData = data;
-
-	if (ParseTags( tagData, stackLevel, tagStack, false ) >= 1)
+// Normalize colour for comparison: lower case, #rgb expanded to #rrggbb and
+// a few common names converted to hex
+static void _normalize_color( const char *s, int length, char out[16] )
+{
+	static const char *names[][2] = {
+		{ "black", "#000000" }, { "white", "#ffffff" }, { "red", "#ff0000" },
+		{ "green", "#008000" }, { "blue", "#0000ff" }, { NULL, NULL } };
+	int n;
+	while (length > 0 && (*s == ' ' || *s == '\t')) { s++; length--; }
+	while (length > 0 && (s[length-1] == ' ' || s[length-1] == '\t')) length--;
+	if (length > 15) length = 15;
+	for (n = 0; n < length; n++)
 	{
-		success = 0;
+		out[n] = (s[n] >= 'A' && s[n] <= 'Z') ? s[n] - 'A' + 'a' : s[n];
 	}
-	else
+	out[length] = '\0';
+	if (length == 4 && out[0] == '#')
+	{
+		char rgb[3] = { out[1], out[2], out[3] };
+		for (n = 0; n < 3; n++) out[1 + n * 2] = out[2 + n * 2] = rgb[n];
+		out[7] = '\0';
+	}
+	for (n = 0; names[n][0]; n++)
 	{
-		printf( "Did not parse any tags!\n" );
+		if (!strcmp( out, names[n][0] ))
+		{
+			strcpy( out, names[n][1] );
+			break;
+		}
 	}
+}
 
-	return success;
+// Find stroke: declaration in style attribute. Returns value and sets length, or NULL
+static const char *_style_stroke( const char *style, int *length )
+{
+	const char *s = style;
+	while (*s)
+	{
+		s += strspn( s, " \t\r\n;" );
+		int declLength = strcspn( s, ";" );
+		int nameLength = strcspn( s, ": \t" );
+		if (nameLength == 6 && !strncmp( s, "stroke", 6 ))
+		{
+			const char *value = strchr( s, ':' );
+			if (value && value < s + declLength)
+			{
+				value++;
+				*length = s + declLength - value;
+				return value;
+			}
+		}
+		s += declLength;
+	}
+	return NULL;
 }
 
-// Parse node tags at the current level recursively. See notes above
-// Return number of node tags parsed
-int LicutSVG::ParseTags( char *& s, int stackLevel, char *tagStack[1024], bool ignore )
+// Add comma-separated values to include or exclude list for kind (SELECT_LAYER etc.)
+void LicutSVG::AddSelection( int kind, bool include, const char *values )
 {
-	int tagsParsed = 0;
+	if (kind < 0 || kind >= SELECT_KINDS || !values) return;
+	int list = include ? 1 : 0;
+	const char *s = values;
 	while (*s)
 	{
-		if (m_verbose) printf( "calling [%s]\n", _fmt_sample( s, 6 ) );
-		int parsed = ParseTag( s, stackLevel, tagStack, ignore );
-		if (m_verbose) printf( "returned %d\n", parsed );
-		tagsParsed += parsed;
+		int length = strcspn( s, "," );
+		if (length > 0)
+		{
+			char **newList = (char **)realloc( m_select[kind][list], (m_selectCount[kind][list] + 1) * sizeof(char *) );
+			if (!newList) return;
+			m_select[kind][list] = newList;
+			char *value = (char *)malloc( length + 16 );
+			if (kind == SELECT_STROKE)
+			{
+				_normalize_color( s, length, value );
+			}
+			else
+			{
+				memcpy( value, s, length );
+				value[length] = '\0';
+			}
+			newList[m_selectCount[kind][list]++] = value;
+		}
+		s += length;
+		if (*s == ',') s++;
+	}
+}
+
+// Returns true if value is in include or exclude list for kind
+bool LicutSVG::IsSelected( int kind, bool include, const char *value ) const
+{
+	if (!value) return false;
+	int list = include ? 1 : 0;
+	for (int n = 0; n < m_selectCount[kind][list]; n++)
+	{
+		if (!strcmp( m_select[kind][list][n], value )) return true;
 	}
-	return tagsParsed;
+	return false;
 }
 
-// Parse a single node tag recursively at the current level
-// Returns 1 if parsed or 0 if not a tag
-int LicutSVG::ParseTag( char *& s, int stackLevel, char *tagStack[1024], bool ignore )
+// Length attribute in inches, or 0 if relative (%, em, ex) or invalid
+static double _length_inches( const char *s )
 {
-	if (!*s) return 0;
-	// Skip leading whitespace
-	s += strspn( s, " \t\r\n" );
-	if (!*s) return 0;
-	// Expected: <tag, <!-- or <?
-	if (s[0] != '<')
+	char *e;
+	double v = strtod( s, &e );
+	if (e == s || v <= 0) return 0;
+	while (*e == ' ') e++;
+	if (*e == '\0' || !strncmp( e, "px", 2 )) return v / 96;
+	if (!strncmp( e, "in", 2 )) return v;
+	if (!strncmp( e, "mm", 2 )) return v / 25.4;
+	if (!strncmp( e, "cm", 2 )) return v / 2.54;
+	if (!strncmp( e, "pt", 2 )) return v / 72;
+	if (!strncmp( e, "pc", 2 )) return v / 6;
+	return 0;
+}
+
+// Grow array of size byte elements to hold at least need, zeroing new elements.
+// Returns 0 if successful
+static int _grow( void **array, int *alloc, int need, size_t size )
+{
+	if (need <= *alloc) return 0;
+	int newAlloc = *alloc ? *alloc * 2 : 16;
+	while (newAlloc < need) newAlloc *= 2;
+	void *p = realloc( *array, newAlloc * size );
+	if (!p)
 	{
-		printf( "%s() level %d - unexpected character %c\n", __FUNCTION__, stackLevel, *s );
-		if (s[0]) s++;
-		return 0;
+		LICUT_ERROR( "%s() failed to allocate %d elements\n", __FUNCTION__, newAlloc );
+		return -1;
 	}
+	memset( (char *)p + *alloc * size, 0, (newAlloc - *alloc) * size );
+	*array = p;
+	*alloc = newAlloc;
+	return 0;
+}
 
-	int gotTag = 0;
+// Transform applying b then a into out, which may be either
+static void _multiply( double const a[6], double const b[6], double out[6] )
+{
+	double r[6];
+	r[0] = a[0] * b[0] + a[2] * b[1];
+	r[1] = a[1] * b[0] + a[3] * b[1];
+	r[2] = a[0] * b[2] + a[2] * b[3];
+	r[3] = a[1] * b[2] + a[3] * b[3];
+	r[4] = a[0] * b[4] + a[2] * b[5] + a[4];
+	r[5] = a[1] * b[4] + a[3] * b[5] + a[5];
+	memcpy( out, r, sizeof(r) );
+}
 
-	// Ignore comments
-	if (s[1] == '!' && s[2] == '-' && s[3] == '-')
+// Parse transform attribute: matrix, translate, scale, rotate, skewX and skewY
+// in any combination. Returns 0 if successful
+static int _parse_transform( const char *s, double m[6] )
+{
+	memcpy( m, _identity, sizeof(_identity) );
+	for (;;)
 	{
-		if (m_verbose) printf( "Skipping comment [%s]\n", _fmt_sample( s, 6 ) );
-		char *end = strstr( s, "-->" );
-		if (end)
+		s += strspn( s, " \t\r\n," );
+		if (!*s) return 0;
+		int nameLength = strcspn( s, " \t\r\n(" );
+		const char *p = strchr( s, '(' );
+		if (!p) return -1;
+		p++;
+		double v[6];
+		int count = 0;
+		while (count < 6)
 		{
-			s = &end[3];
+			p += strspn( p, " \t\r\n," );
+			char *e;
+			v[count] = strtod( p, &e );
+			if (e == p) break;
+			p = e;
+			count++;
 		}
-		else
+		p += strspn( p, " \t\r\n," );
+		if (*p != ')' || count == 0) return -1;
+		double t[6] = { 1, 0, 0, 1, 0, 0 };
+		if (nameLength == 6 && !strncmp( s, "matrix", 6 ) && count == 6)
 		{
-			s += strlen( s );
+			memcpy( t, v, sizeof(t) );
 		}
-	}
-	// Ignore directives
-	else if (s[1] == '?')
-	{
-		char *end = strstr( s, "?>" );
-		if (end)
+		else if (nameLength == 9 && !strncmp( s, "translate", 9 ) && count <= 2)
 		{
-			if (m_verbose)
-			{
-				printf( "Got directive [%s]...", _fmt_sample( s, 6 ) );
-				printf( "%s\n", _fmt_sample( &end[-4], 5 ) );
-			}
-			s = &end[2];
+			t[4] = v[0];
+			t[5] = (count > 1) ? v[1] : 0;
+		}
+		else if (nameLength == 5 && !strncmp( s, "scale", 5 ) && count <= 2)
+		{
+			t[0] = v[0];
+			t[3] = (count > 1) ? v[1] : v[0];
+		}
+		else if (nameLength == 6 && !strncmp( s, "rotate", 6 ) && (count == 1 || count == 3))
+		{
+			// About cx,cy if given
+			double a = v[0] * M_PI / 180;
+			double cx = (count == 3) ? v[1] : 0;
+			double cy = (count == 3) ? v[2] : 0;
+			t[0] = t[3] = cos( a );
+			t[1] = sin( a );
+			t[2] = -t[1];
+			t[4] = cx - t[0] * cx - t[2] * cy;
+			t[5] = cy - t[1] * cx - t[3] * cy;
+		}
+		else if (nameLength == 5 && !strncmp( s, "skewX", 5 ) && count == 1)
+		{
+			t[2] = tan( v[0] * M_PI / 180 );
+		}
+		else if (nameLength == 5 && !strncmp( s, "skewY", 5 ) && count == 1)
+		{
+			t[1] = tan( v[0] * M_PI / 180 );
 		}
 		else
 		{
-			printf( "Unexpected missing end for [%s]\n", _fmt_sample( s, 4 ) );
-			s += strlen( s );
+			return -1;
 		}
+		_multiply( m, t, m );
+		s = p + 1;
 	}
-	else
+}
+
+// Copy of terminated set with points transformed by m, or NULL
+static drawSet_t *_transform_copy( drawSet_t const *set, double const m[6] )
+{
+	int count = 0;
+	while (set[count].type != 0) count++;
+	drawSet_t *t = (drawSet_t *)malloc( (count + 1) * sizeof(drawSet_t) );
+	if (!t) return NULL;
+	memcpy( t, set, (count + 1) * sizeof(drawSet_t) );
+	for (int n = 0; n < count; n++)
 	{
-		gotTag = 1;
-		// Get tag name
-		char *tagName = &s[1];
-		tagName += strspn( tagName, " \t\r\n" );
-		// Name ends in whitespace or end of tag
-		s = &tagName[strcspn( tagName, "/> \t\r\n" )];
-		bool foundEnd = false;
-		bool closedTag = false; // tag ends with />
-		char *tagEnd;
-		char *tagNext = NULL;
-		if (*s == '/')
-		{
-			foundEnd = true;
-			closedTag = true;
-			tagEnd = &s[1];
-			tagEnd += strspn( tagEnd, " \t\r\n" );
-			tagNext = &tagEnd[1];
-		}
-		else if (*s == '>')
-		{
-			foundEnd = true;
-			tagEnd = s;
-			tagNext = &tagEnd[1];
-		}
-		// Terminate name
-		*s = '\0';
-		if (m_verbose) printf( "Tag: %s end:%c closed:%c\n", tagName, foundEnd?'Y' : 'n', closedTag ? 'Y' : 'n' );
-		// Find end of tag
-		if (!foundEnd)
-		{
-			s++;
-			int attrCount = 0;
-			int attrWithValueCount = 0;
-			if (m_verbose) printf( "Searching for end starting %s\n", _fmt_sample( s, 4 ) );
-			while (*s != '/' && *s != '>' && *s)
-			{
-				// Parse attribute [ = "value" ]
-				s += strspn( s, " \t\r\n" );
-				if (*s == '/' || *s == '>') break;
-				char *attrName = s;
-				int attrNameLength = strcspn( attrName, "= \t\r\n" );
-				s += attrNameLength;
-				s += strspn( s, " \t\r\n" );
-				attrCount++;
-				char *attrValue = NULL;
-				// Check for value
-				if (*s == '=')
-				{
-					attrWithValueCount++;
-					s++;
-					s += strspn( s, " \t\r\n" );
-					// Unquoted values are not kosher but we'll parse them anyway
-					if (*s == '"')
-					{
-						s++;
-						attrValue = s;
-						s += strcspn( s, "\"" );
-						*s = '\0';
-						s++;
-					}
-					else
-					{
-						attrValue = s;
-						s += strcspn( s, " \t\r\n" );
-						*s = '\0';
-						s++;				
-					}
-				}
-			
-				attrName[attrNameLength] = '\0';
+		for (int i = 0; i < set[n].numPoints; i++)
+		{
+			LicutSVG::TransformPoint( m, set[n].pt[i], t[n].pt[i] );
+		}
+	}
+	return t;
+}
 
-				if (m_verbose) printf( "  [%d] %s=%s\n", attrCount, attrName, attrValue );
-				if (!strcmp( tagName, "svg" ))
-				{
-					if (!strcmp( attrName, "width" ))
-					{
-						printf( "svg width=%s\n", attrValue );
-						m_width = atoi( attrValue );
-					}
-					else if (!strcmp( attrName, "height" ))
-					{
-						printf( "svg height=%s\n", attrValue );
-						m_height = atoi( attrValue );
-					}
-				}
-				if (!ignore && !strcmp( tagName, "g" ))
-				{
-					if (!strcmp( attrName, "id" ) && attrValue != NULL)
-					{
-						// FIXME if we wanted to use some layers as guide, the id or label could be 
-						// configurable
-						printf( "layer id=%s\n", attrValue );
-					}
-				}
-				if (!ignore && !strcmp( tagName, "path" ))
-				{
-					if (!strcmp( attrName, "d" ) && attrValue != NULL)
-					{
-						int setsParsed = ParseDrawList( attrValue );
-						printf( "path d len=%d sets=%d\n", strlen(attrValue), setsParsed );
-					}
-				}
-			}
-			if (m_verbose) printf( "Exited attr parse [%s]\n", _fmt_sample( s, 4 ) );
-			// Complain if end not found
-			if (*s == '>')
-			{
-				if (m_verbose) printf( "Got end > [%s]\n", _fmt_sample( s, 4 ) );
-				foundEnd = true;
-				tagNext = &s[1];
-			}
-			else if (*s == '/')
+// Handle element start from xml tokenizer. All attributes are collected before
+// selection is applied so unwanted elements are skipped before their path data is parsed
+int LicutSVG::StartElement( const char *name, int attrCount, const char * const *attrs, int depth, bool isEmpty )
+{
+	(void)isEmpty;
+	const char *id = NULL;
+	const char *label = NULL;
+	const char *groupMode = NULL;
+	const char *style = NULL;
+	const char *stroke = NULL;
+	const char *pathData = NULL;
+	const char *href = NULL;
+	const char *transform = NULL;
+	const char *useX = NULL;
+	const char *useY = NULL;
+	int n;
+	for (n = 0; n < attrCount; n++)
+	{
+		const char *attrName = attrs[n * 2];
+		const char *attrValue = attrs[n * 2 + 1];
+		if (attrValue == NULL) continue;
+		if (!strcmp( attrName, "id" )) id = attrValue;
+		else if (!strcmp( attrName, "inkscape:label" )) label = attrValue;
+		else if (!strcmp( attrName, "inkscape:groupmode" )) groupMode = attrValue;
+		else if (!strcmp( attrName, "style" )) style = attrValue;
+		else if (!strcmp( attrName, "stroke" )) stroke = attrValue;
+		else if (!strcmp( attrName, "d" )) pathData = attrValue;
+		else if (!strcmp( attrName, "xlink:href" ) || !strcmp( attrName, "href" )) href = attrValue;
+		else if (!strcmp( attrName, "transform" )) transform = attrValue;
+		else if (!strcmp( attrName, "x" )) useX = attrValue;
+		else if (!strcmp( attrName, "y" )) useY = attrValue;
+		else if (!strcmp( name, "svg" ))
+		{
+			if (!strcmp( attrName, "width" ))
 			{
-				if (m_verbose) printf( "Got end /> [%s]\n", _fmt_sample( s, 4 ) );
-				foundEnd = true;
-				closedTag = true;
-				tagNext = &s[1];
-				tagNext += strspn( tagNext, " \t\r\n" );
-				s = tagNext;
-				tagNext++;
+				if (m_verbose) LICUT_DEBUG( "svg width=%s\n", attrValue );
+				m_width = atoi( attrValue );
+				m_widthInches = _length_inches( attrValue );
 			}
-			else
+			else if (!strcmp( attrName, "height" ))
 			{
-				printf( "Error: tag %s is not properly closed, ends with [%s]\n", tagName, _fmt_sample( s, 4 ) );
-				if (!*s) s++;
+				if (m_verbose) LICUT_DEBUG( "svg height=%s\n", attrValue );
+				m_height = atoi( attrValue );
+				m_heightInches = _length_inches( attrValue );
 			}
-		}
-		// Recurse into container tag
-		if (foundEnd && !closedTag)
-		{
-			// Skip > from end of tag opening
-			// If we have a tag with no attributes, we may already have NUL
-			if (*s == '>' || *s == '\0') s++;
-			// Skip quoted values and find </tagname>
-			if (m_verbose) printf( "Searching for end of tag %s in %s\n", tagName, _fmt_sample( s, 8 ) );
-			char *containerStart = s;
-			char *containerEnd = s;
-			bool foundContainerEnd = false;
-			while (!foundContainerEnd && containerEnd != NULL)
+			else if (!strcmp( attrName, "viewBox" ))
 			{
-				containerEnd = strpbrk( containerEnd, "\"<" );
-				if (!containerEnd) break;
-				if (*containerEnd == '"')
-				{
-					containerEnd = strchr( &containerEnd[1], '"' );
-					if (containerEnd == NULL) break;
-					containerEnd++;
-				}
-				else
+				const char *p = attrValue;
+				int i;
+				for (i = 0; i < 4; i++)
 				{
-					char *containerEndTagStart = containerEnd;
-					containerEnd++;
-					if (*containerEnd == '/')
-					{
-						containerEnd++;
-						int closeLength = strcspn( containerEnd, "> \t\r\n" );
-						if (closeLength == strlen( tagName ) && !strncmp( containerEnd, tagName, closeLength ))
-						{
-							foundEnd = true;
-							foundContainerEnd = true;
-							tagNext = &containerEnd[closeLength];
-							tagNext += strspn( tagNext, " \t\r\n" );
-							// Skip final >
-							tagNext++;
-							*containerEndTagStart = '\0';
-						}
-					}
+					while (*p == ' ' || *p == ',' || *p == '\t' || *p == '\n' || *p == '\r') p++;
+					char *e;
+					m_viewBox[i] = strtod( p, &e );
+					if (e == p) break;
+					p = e;
 				}
+				if (i < 4 || m_viewBox[2] <= 0 || m_viewBox[3] <= 0) memset( m_viewBox, 0, sizeof(m_viewBox) );
 			}
-			if (foundContainerEnd)
+		}
+	}
+
+	// Selection state is inherited from the parent element
+	if (depth >= m_selectStateAlloc)
+	{
+		int newAlloc = (depth + 1) * 2;
+		selectState_t *newState = (selectState_t *)realloc( m_selectState, newAlloc * sizeof(selectState_t) );
+		if (!newState) return LICUT_XML_STOP;
+		m_selectState = newState;
+		m_selectStateAlloc = newAlloc;
+	}
+	selectState_t *state = &m_selectState[depth];
+	if (depth > 0)
+	{
+		*state = m_selectState[depth - 1];
+	}
+	else
+	{
+		state->stroke[0] = '\0';
+		state->inLayer = (m_selectCount[SELECT_LAYER][1] == 0);
+		state->inId = (m_selectCount[SELECT_ID][1] == 0);
+	}
+	// Presentation attribute is overridden by style
+	int strokeLength;
+	if (stroke) _normalize_color( stroke, strlen( stroke ), state->stroke );
+	if (style && (stroke = _style_stroke( style, &strokeLength )) != NULL) _normalize_color( stroke, strokeLength, state->stroke );
+
+	if (!strcmp( name, "g" ) && id != NULL)
+	{
+		if (m_verbose) LICUT_DEBUG( "layer id=%s\n", id );
+	}
+
+	// Layers are matched by id or label. A layer which is not included skips
+	// its sublayers too, but sublayers of an included layer need not be listed
+	if (!strcmp( name, "g" ) && groupMode != NULL && !strcmp( groupMode, "layer" ))
+	{
+		if (IsSelected( SELECT_LAYER, false, id ) || IsSelected( SELECT_LAYER, false, label ))
+		{
+			LICUT_INFO( "Excluding layer %s (%s)\n", id ? id : "", label ? label : "" );
+			m_skippedElements++;
+			return LICUT_XML_SKIP;
+		}
+		if (IsSelected( SELECT_LAYER, true, id ) || IsSelected( SELECT_LAYER, true, label ))
+		{
+			state->inLayer = true;
+		}
+		else if (!state->inLayer)
+		{
+			if (m_verbose) LICUT_DEBUG( "Skipping layer %s (%s) - not included\n", id ? id : "", label ? label : "" );
+			m_skippedElements++;
+			return LICUT_XML_SKIP;
+		}
+	}
+
+	if (IsSelected( SELECT_ID, false, id ))
+	{
+		if (m_verbose) LICUT_DEBUG( "Excluding <%s> id=%s\n", name, id );
+		m_skippedElements++;
+		return LICUT_XML_SKIP;
+	}
+	if (IsSelected( SELECT_ID, true, id ))
+	{
+		state->inId = true;
+	}
+
+	// <defs> and <symbol> content is cut only where <use> places it, so layer
+	// and id selection apply to the <use> instead
+	bool defining = (m_defsDepth >= 0);
+	if (!strcmp( name, "defs" ) || !strcmp( name, "symbol" ))
+	{
+		if (!defining) m_defsDepth = depth;
+		defining = true;
+		state->inLayer = true;
+		state->inId = true;
+	}
+
+	// Any element with an id may be placed by <use>, which may come later.
+	// It is closed by EndElement()
+	if (id != NULL && m_recordRefs)
+	{
+		if (_grow( (void **)&m_openRefs, &m_openRefAlloc, m_openRefCount + 1, sizeof(svgRef_t) )) return LICUT_XML_STOP;
+		svgRef_t *ref = &m_openRefs[m_openRefCount++];
+		ref->id = id;
+		ref->depth = depth;
+		ref->first = m_drawSetCount;
+		ref->count = 0;
+		ref->firstUse = m_useCount;
+		ref->useCount = 0;
+	}
+
+	if (!strcmp( name, "path" ))
+	{
+		bool selected = state->inLayer && state->inId;
+		if (IsSelected( SELECT_STROKE, false, state->stroke )) selected = false;
+		if (m_selectCount[SELECT_STROKE][1] > 0 && !IsSelected( SELECT_STROKE, true, state->stroke )) selected = false;
+		if (!selected)
+		{
+			if (m_verbose) LICUT_DEBUG( "Skipping path id=%s stroke=%s\n", id ? id : "", state->stroke );
+			m_skippedElements++;
+			return LICUT_XML_SKIP;
+		}
+		if (pathData != NULL)
+		{
+			int setsParsed = ParseDrawList( pathData );
+			if (setsParsed < 0) return LICUT_XML_STOP;
+			if (m_verbose) LICUT_DEBUG( "path d len=%lu sets=%d\n", (unsigned long)strlen(pathData), setsParsed );
+		}
+	}
+
+	if (!strcmp( name, "use" ) && href != NULL)
+	{
+		if (!state->inLayer || !state->inId)
+		{
+			if (m_verbose) LICUT_DEBUG( "Skipping use id=%s href=%s\n", id ? id : "", href );
+			m_skippedElements++;
+			return LICUT_XML_SKIP;
+		}
+		if (href[0] != '#')
+		{
+			if (m_verbose) LICUT_DEBUG( "<use> of external %s not supported\n", href );
+			m_unresolved++;
+			return LICUT_XML_CONTINUE;
+		}
+		svgUse_t use;
+		use.href = href + 1;
+		if (transform != NULL && _parse_transform( transform, use.m ) != 0)
+		{
+			LICUT_WARN( "Ignoring invalid transform=\"%s\" of <use> %s\n", transform, href );
+			memcpy( use.m, _identity, sizeof(_identity) );
+		}
+		else if (transform == NULL)
+		{
+			memcpy( use.m, _identity, sizeof(_identity) );
+		}
+		double t[6] = { 1, 0, 0, 1, useX ? atof( useX ) : 0, useY ? atof( useY ) : 0 };
+		_multiply( use.m, t, use.m );
+		use.position = m_drawSetCount;
+		use.hidden = defining;
+		if (m_sink && !defining)
+		{
+			// Placed at once like any path, so only what is defined by now can be
+			if (PlaceUse( &use, _identity, 0, PLACE_SINK, &m_drawSets[m_parseFirst] ) < 0) return LICUT_XML_STOP;
+		}
+		else
+		{
+			if (_grow( (void **)&m_uses, &m_useAlloc, m_useCount + 1, sizeof(svgUse_t) )) return LICUT_XML_STOP;
+			m_uses[m_useCount++] = use;
+		}
+	}
+	return LICUT_XML_CONTINUE;
+}
+
+// Handle element end from xml tokenizer
+void LicutSVG::EndElement( const char *name, int depth )
+{
+	(void)name;
+	if (m_defsDepth == depth) m_defsDepth = -1;
+	if (m_openRefCount == 0 || m_openRefs[m_openRefCount - 1].depth != depth) return;
+	svgRef_t ref = m_openRefs[--m_openRefCount];
+	ref.count = m_drawSetCount - ref.first;
+	ref.useCount = m_useCount - ref.firstUse;
+	// Elements placing nothing need not be found
+	if (ref.count == 0 && ref.useCount == 0) return;
+	if (_grow( (void **)&m_refs, &m_refAlloc, m_refCount + 1, sizeof(svgRef_t) ) == 0) m_refs[m_refCount++] = ref;
+}
+
+// Mark draw set index as parsed inside <defs> or <symbol>. Returns 0 if successful
+int LicutSVG::MarkHidden( int index )
+{
+	if (_grow( (void **)&m_hidden, &m_hiddenAlloc, index + 1, 1 )) return -1;
+	m_hidden[index] = 1;
+	return 0;
+}
+
+static int _compare_ref( const void *a, const void *b )
+{
+	return strcmp( ((svgRef_t const *)a)->id, ((svgRef_t const *)b)->id );
+}
+
+// Find element by id. Returns NULL if undefined
+svgRef_t const *LicutSVG::FindRef( const char *id ) const
+{
+	if (m_refsSorted)
+	{
+		svgRef_t key;
+		key.id = id;
+		return (svgRef_t const *)bsearch( &key, m_refs, m_refCount, sizeof(svgRef_t), _compare_ref );
+	}
+	// While streaming, only elements already closed
+	for (int n = 0; n < m_refCount; n++)
+	{
+		if (!strcmp( m_refs[n].id, id )) return &m_refs[n];
+	}
+	return NULL;
+}
+
+// Place what use refers to with transform m. Returns draw sets placed or -1
+int LicutSVG::PlaceUse( svgUse_t const *use, double const m[6], int nesting, int mode, drawSet_t **sets )
+{
+	// Problems are reported by the pass which places nothing
+	bool report = (mode != PLACE_ADD);
+	svgRef_t const *ref = FindRef( use->href );
+	if (!ref)
+	{
+		if (report && m_verbose) LICUT_DEBUG( "<use> refers to undefined id %s\n", use->href );
+		if (report) m_unresolved++;
+		return 0;
+	}
+	for (int n = 0; n < nesting; n++)
+	{
+		if (m_placing[n] == ref)
+		{
+			if (report) LICUT_WARN( "Not placing %s inside itself\n", use->href );
+			return 0;
+		}
+	}
+	if (nesting >= MAX_USE_NESTING)
+	{
+		if (report) LICUT_WARN( "Not placing %s - <use> nested more than %d deep\n", use->href, MAX_USE_NESTING );
+		return 0;
+	}
+	m_placing[nesting] = ref;
+	double t[6];
+	_multiply( m, use->m, t );
+	return PlaceRef( ref, t, nesting + 1, mode, sets );
+}
+
+// Place draw sets and <use> elements of ref with transform m. Returns draw sets placed or -1
+int LicutSVG::PlaceRef( svgRef_t const *ref, double const m[6], int nesting, int mode, drawSet_t **sets )
+{
+	int placed = 0;
+	int u = ref->firstUse;
+	int endUse = ref->firstUse + ref->useCount;
+	for (int q = ref->first; ; q++)
+	{
+		// A <use> comes before the draw set parsed after it
+		for (; u < endUse && m_uses[u].position <= q; u++)
+		{
+			int res = PlaceUse( &m_uses[u], m, nesting, mode, sets );
+			if (res < 0) return -1;
+			placed += res;
+		}
+		if (q >= ref->first + ref->count) break;
+		if (++m_placed > MAX_INSTANCES)
+		{
+			LICUT_ERROR( "%s() <use> elements place more than %d draw sets\n", __FUNCTION__, MAX_INSTANCES );
+			return -1;
+		}
+		placed++;
+		drawSet_t const *set = sets[q - m_parseFirst];
+		if (mode == PLACE_MARK)
+		{
+			m_referenced[q - m_parseFirst] = 1;
+		}
+		else if (mode == PLACE_ADD)
+		{
+			AddInstance( set, m );
+			m_instanceCount++;
+		}
+		else
+		{
+			drawSet_t *copy = _transform_copy( set, m );
+			if (!copy)
 			{
-				// containerStart is null-terminated
-				if (stackLevel >= 1023)
-				{
-					printf( "Error: cannot parse %s at level %d - stack overflow\n", tagName, stackLevel );
-				}
-				else
-				{
-					// If container starts with something other than <, treat it as an immediate value
-					char *valueCandidate = containerStart;
-					valueCandidate += strspn( valueCandidate, " \t\r\n" );
-					if (*valueCandidate != '<')
-					{
-						if (m_verbose) printf( "Got tag enclosed value [%s]\n", valueCandidate );
-					}
-					else
-					{
-						stackLevel++;
-						tagStack[stackLevel] = tagName;
-						if (m_verbose) printf( "Entering level %d container tag %s [%s]\n", stackLevel, tagName, _fmt_sample( containerStart, 4 ) );
-						ParseTags( containerStart, stackLevel, tagStack, ignore );
-						stackLevel--;
-						if (m_verbose) printf( "Returned to level %d tag %s\n", stackLevel, tagName );
-					}
-				}
+				LICUT_ERROR( "%s() failed to copy draw set for %s\n", __FUNCTION__, ref->id );
+				return -1;
 			}
-			else
+			m_instanceCount++;
+			if (m_sink->DrawSetParsed( *this, copy ) != 0)
 			{
-				printf( "Did not find container end\n" );
+				m_sinkStopped = true;
+				return -1;
 			}
-		} // Found container tag
-		// Skip to next tag
-		if (tagNext != NULL)
+		}
+	}
+	return placed;
+}
+
+// Place draw sets parsed outside <defs> and <symbol> and <use> elements between
+// them. Returns draw sets placed or -1
+int LicutSVG::PlaceParsed( int mode, drawSet_t **sets, int count )
+{
+	int placed = 0;
+	int u = 0;
+	for (int n = 0; ; n++)
+	{
+		for (; u < m_useCount && m_uses[u].position - m_parseFirst <= n; u++)
 		{
-			s = tagNext;
-			if (m_verbose) 
+			if (m_uses[u].hidden) continue;
+			// Inside what it refers to it would place itself
+			svgRef_t const *ref = FindRef( m_uses[u].href );
+			if (ref && u >= ref->firstUse && u < ref->firstUse + ref->useCount)
 			{
-				printf( "Ending parse with [%s] - ", _fmt_sample( &s[-4], 4 ) );
-				printf( "next [%s]\n", _fmt_sample( s, 4 ) );
+				if (mode == PLACE_MARK) LICUT_WARN( "Not placing %s inside itself\n", m_uses[u].href );
+				continue;
 			}
+			int res = PlaceUse( &m_uses[u], _identity, 0, mode, sets );
+			if (res < 0) return -1;
+			placed += res;
+		}
+		if (n >= count) break;
+		if (m_parseFirst + n < m_hiddenAlloc && m_hidden[m_parseFirst + n]) continue;
+		placed++;
+		if (mode != PLACE_ADD) continue;
+		// Geometry instances share is left as it is, so a pass which modifies
+		// the draw set gets a copy of its own
+		if (m_referenced[n]) AddInstance( sets[n], _identity );
+		else m_drawSets[m_drawSetCount++] = sets[n];
+	}
+	return placed;
+}
+
+// Replace draw sets parsed since m_parseFirst with instances of what <use>
+// elements refer to. Returns 0 if successful
+int LicutSVG::ResolveInstances()
+{
+	int r = 0;
+	int parsed = m_drawSetCount - m_parseFirst;
+	if (m_sink)
+	{
+		// Only definitions were kept, for <use> elements to place
+		for (int n = m_parseFirst; n < m_drawSetCount; n++)
+		{
+			free( m_drawSets[n] );
+			m_drawSets[n] = NULL;
+		}
+		m_drawSetCount = m_parseFirst;
+	}
+	else if (m_useCount > 0 || m_hidden != NULL)
+	{
+		qsort( m_refs, m_refCount, sizeof(svgRef_t), _compare_ref );
+		m_refsSorted = true;
+		drawSet_t **sets = (drawSet_t **)malloc( (parsed + 1) * sizeof(drawSet_t *) );
+		m_referenced = (unsigned char *)calloc( parsed + 1, 1 );
+		// Find what instances share and how many draw sets there will be first,
+		// so nothing can fail once draw sets are moved
+		int count = -1;
+		int referenced = 0;
+		if (sets && m_referenced) count = PlaceParsed( PLACE_MARK, &m_drawSets[m_parseFirst], parsed );
+		for (int n = 0; n < parsed; n++) referenced += m_referenced[n];
+		if (count < 0 || GrowDrawSets( count - parsed )
+			|| (referenced && !m_instances && (m_instances = (drawInstance_t *)calloc( m_drawSetAlloc, sizeof(drawInstance_t) )) == NULL)
+			|| (referenced && (m_shared = (drawSet_t **)realloc( m_shared, (m_sharedCount + referenced) * sizeof(drawSet_t *) )) == NULL))
+		{
+			LICUT_ERROR( "%s() failed to place <use> elements\n", __FUNCTION__ );
+			if (!m_shared) m_sharedCount = 0;
+			r = -1;
 		}
-		// else parsing error occurred
 		else
 		{
-			printf( "Parsing error occurred, no next tag\n" );
+			memcpy( sets, &m_drawSets[m_parseFirst], parsed * sizeof(drawSet_t *) );
+			memset( &m_drawSets[m_parseFirst], 0, parsed * sizeof(drawSet_t *) );
+			m_drawSetCount = m_parseFirst;
+			m_placed = 0;
+			PlaceParsed( PLACE_ADD, sets, parsed );
+			// Shared geometry is kept once however many instances there are
+			for (int n = 0; n < parsed; n++)
+			{
+				if (m_referenced[n]) m_shared[m_sharedCount++] = sets[n];
+				else if (m_parseFirst + n < m_hiddenAlloc && m_hidden[m_parseFirst + n]) free( sets[n] );
+			}
 		}
+		free( sets );
+		free( m_referenced );
+		m_referenced = NULL;
 	}
 
-	// Skip trailing whitespace
-	if (*s) s += strspn( s, " \t\r\n" );
+	free( m_hidden );
+	m_hidden = NULL;
+	m_hiddenAlloc = 0;
+	free( m_refs );
+	m_refs = NULL;
+	m_refCount = m_refAlloc = 0;
+	m_refsSorted = false;
+	free( m_openRefs );
+	m_openRefs = NULL;
+	m_openRefCount = m_openRefAlloc = 0;
+	free( m_uses );
+	m_uses = NULL;
+	m_useCount = m_useAlloc = 0;
+	m_defsDepth = -1;
+	return r;
+}
 
-	if (m_verbose) printf( "exiting %s() returning %d\n", __FUNCTION__, gotTag );
+// Append draw set sharing set with other instances. Returns 0 if successful
+int LicutSVG::AddInstance( drawSet_t const *set, double const m[6] )
+{
+	if (GrowDrawSets()) return -1;
+	if (!m_instances)
+	{
+		m_instances = (drawInstance_t *)calloc( m_drawSetAlloc, sizeof(drawInstance_t) );
+		if (!m_instances) return -1;
+	}
+	m_instances[m_drawSetCount].set = set;
+	memcpy( m_instances[m_drawSetCount].m, m, sizeof(m_instances[m_drawSetCount].m) );
+	m_drawSets[m_drawSetCount++] = NULL;
+	return 0;
+}
 
-	return gotTag;
+// Replace instance index with a transformed copy. Returns it or NULL
+drawSet_t *LicutSVG::ExpandInstance( int index )
+{
+	drawSet_t *copy = _transform_copy( m_instances[index].set, m_instances[index].m );
+	if (!copy)
+	{
+		LICUT_ERROR( "%s() failed to expand draw set %d\n", __FUNCTION__, index );
+		return NULL;
+	}
+	m_drawSets[index] = copy;
+	m_instances[index].set = NULL;
+	return copy;
 }
 
 // Get draw set or NULL if undefined
@@ -448,29 +944,220 @@ drawSet_t const *LicutSVG::GetDrawSet( int index ) const
 {
 	if (index < m_drawSetCount && m_drawSets != NULL)
 	{
+		// Expanding keeps the document the same, only its storage changes
+		if (m_drawSets[index] == NULL && m_instances != NULL && m_instances[index].set != NULL)
+		{
+			return const_cast<LicutSVG *>(this)->ExpandInstance( index );
+		}
 		return m_drawSets[index];
 	}
 	return NULL;
 }
 
+// Get draw set without expanding an instance, with *m set to its transform or NULL
+drawSet_t const *LicutSVG::GetDrawSetGeometry( int index, double const **m ) const
+{
+	*m = NULL;
+	if (index < 0 || index >= m_drawSetCount || m_drawSets == NULL) return NULL;
+	if (m_drawSets[index] == NULL && m_instances != NULL && m_instances[index].set != NULL)
+	{
+		*m = m_instances[index].m;
+		return m_instances[index].set;
+	}
+	return m_drawSets[index];
+}
+
+// Get draw set for in-place modification or NULL
+drawSet_t *LicutSVG::ModifyDrawSet( int index )
+{
+	if (index >= 0 && index < m_drawSetCount && m_drawSets != NULL)
+	{
+		// Shared geometry is never modified
+		if (m_drawSets[index] == NULL && m_instances != NULL && m_instances[index].set != NULL)
+		{
+			return ExpandInstance( index );
+		}
+		return m_drawSets[index];
+	}
+	return NULL;
+}
+
+// Replace draw set with malloc'd, terminated newSet. Returns 0 if successful
+int LicutSVG::ReplaceDrawSet( int index, drawSet_t *newSet )
+{
+	if (index < 0 || index >= m_drawSetCount || newSet == NULL) return -1;
+	free( m_drawSets[index] );
+	m_drawSets[index] = newSet;
+	if (m_instances) m_instances[index].set = NULL;
+	return 0;
+}
+
+// Get physical size of one user unit in inches. Returns false if unknown
+bool LicutSVG::GetInchesPerUnit( double& x, double& y ) const
+{
+	if (m_widthInches <= 0 || m_heightInches <= 0) return false;
+	if (m_viewBox[2] <= 0)
+	{
+		// Without viewBox user units are px
+		x = y = 1.0 / 96;
+		return true;
+	}
+	x = m_widthInches / m_viewBox[2];
+	y = m_heightInches / m_viewBox[3];
+	return true;
+}
+
+// Append copy of set with points transformed by m. Returns 0 if successful
+int LicutSVG::AddDrawSet( drawSet_t const *set, double const m[6] )
+{
+	if (!set || GrowDrawSets()) return -1;
+	drawSet_t *t = _transform_copy( set, m );
+	if (!t) return -1;
+	m_drawSets[m_drawSetCount++] = t;
+	return 0;
+}
+
+// Append set as parsed. Returns 0 if successful
+int LicutSVG::AppendDrawSet( drawSet_t *set )
+{
+	if (m_sink)
+	{
+		if (m_sink->DrawSetParsed( *this, set ) == 0) return 0;
+		m_sinkStopped = true;
+		return -1;
+	}
+	if (GrowDrawSets())
+	{
+		free( set );
+		return -1;
+	}
+	m_drawSets[m_drawSetCount++] = set;
+	return 0;
+}
+
+// Set physical size of the whole document
+void LicutSVG::SetPhysicalSize( double widthInches, double heightInches )
+{
+	m_widthInches = widthInches;
+	m_heightInches = heightInches;
+	m_viewBox[0] = m_viewBox[1] = 0;
+	m_viewBox[2] = m_width;
+	m_viewBox[3] = m_height;
+}
+
+// Reorder draw sets so that new set n is old set order[n]. Returns 0 if successful
+int LicutSVG::ReorderDrawSets( const int *order )
+{
+	if (m_drawSetCount == 0) return 0;
+	drawSet_t **newSets = (drawSet_t**)calloc( m_drawSetAlloc, sizeof(drawSet_t*) );
+	bool *used = (bool *)calloc( m_drawSetCount, sizeof(bool) );
+	drawInstance_t *newInstances = m_instances ? (drawInstance_t *)calloc( m_drawSetAlloc, sizeof(drawInstance_t) ) : NULL;
+	int n;
+	if (!newSets || !used || (m_instances && !newInstances))
+	{
+		free( newSets );
+		free( used );
+		free( newInstances );
+		return -1;
+	}
+	for (n = 0; n < m_drawSetCount; n++)
+	{
+		if (order[n] < 0 || order[n] >= m_drawSetCount || used[order[n]])
+		{
+			LICUT_ERROR( "%s() invalid order[%d]=%d\n", __FUNCTION__, n, order[n] );
+			free( newSets );
+			free( used );
+			free( newInstances );
+			return -1;
+		}
+		used[order[n]] = true;
+		newSets[n] = m_drawSets[order[n]];
+		if (newInstances) newInstances[n] = m_instances[order[n]];
+	}
+	free( used );
+	free( m_drawSets );
+	m_drawSets = newSets;
+	if (newInstances)
+	{
+		free( m_instances );
+		m_instances = newInstances;
+	}
+	return 0;
+}
+
+// Scan x,y pair from s. Leading whitespace is skipped; delim is ',' or ' '
+// Returns characters consumed or 0 if no pair found
+static int _scan_pair( const char *s, char delim, double pt[2] )
+{
+	char *e;
+	const char *p = s;
+	pt[0] = strtod( p, &e );
+	if (e == p) return 0;
+	p = e;
+	if (delim == ',')
+	{
+		if (*p != ',') return 0;
+		p++;
+	}
+	pt[1] = strtod( p, &e );
+	if (e == p) return 0;
+	return e - s;
+}
+
+// Make room for count more draw sets. Returns 0 if successful
+int LicutSVG::GrowDrawSets( int count /*= 1*/ )
+{
+	if (m_drawSetCount + count <= m_drawSetAlloc) return 0;
+	int newAlloc = m_drawSetAlloc ? m_drawSetAlloc * 2 : INITIAL_DRAWSETS;
+	while (newAlloc < m_drawSetCount + count) newAlloc *= 2;
+	if (m_instances)
+	{
+		drawInstance_t *newInstances = (drawInstance_t *)realloc( m_instances, newAlloc * sizeof(drawInstance_t) );
+		if (!newInstances)
+		{
+			LICUT_ERROR( "Failed to allocate %d draw sets\n", newAlloc );
+			return -1;
+		}
+		memset( &newInstances[m_drawSetAlloc], 0, (newAlloc - m_drawSetAlloc) * sizeof(drawInstance_t) );
+		m_instances = newInstances;
+	}
+	drawSet_t **newSets = (drawSet_t**)realloc( m_drawSets, newAlloc * sizeof(drawSet_t*) );
+	if (!newSets)
+	{
+		LICUT_ERROR( "Failed to allocate %d draw sets\n", newAlloc );
+		return -1;
+	}
+	memset( &newSets[m_drawSetAlloc], 0, (newAlloc - m_drawSetAlloc) * sizeof(drawSet_t*) );
+	m_drawSets = newSets;
+	m_drawSetAlloc = newAlloc;
+	return 0;
+}
+
 // Parse draw list set values from d attribute
 // Return number of sets parsed
-int LicutSVG::ParseDrawList( char *s )
+int LicutSVG::ParseDrawList( const char *s )
 {
-	if (m_drawSetCount >= MAX_DRAWSETS)
+	// Definitions are kept while streaming, for <use> elements to place
+	bool keep = (!m_sink || m_defsDepth >= 0);
+	if (keep && GrowDrawSets())
 	{
-		printf( "Maximum draw sets (%d) exceeded - discarding draw set\n", MAX_DRAWSETS );
+		LICUT_WARN( "Discarding draw set %d\n", m_drawSetCount );
 		return 0;
 	}
-	int index = m_drawSetCount;
 	int dataLength = strlen( s );
 
 	// Estimate draw commands in this set assuming there are at least 10 characters used per command:
 	// M 0.0,0.0
-	// Take 150% of that number and add 32 in case we have a low length
+	// Take 150% of that number and add 32 in case we have a low length.
+	// The array grows if the estimate is exceeded
 	int estimatedCommands = (dataLength + dataLength / 2) / 10 + 32;
 	int addedCommands = 0;
-	drawSet_t *t = (drawSet_t*)alloca( estimatedCommands * sizeof( drawSet_t ) );
+	drawSet_t *t = (drawSet_t*)malloc( estimatedCommands * sizeof( drawSet_t ) );
+	if (!t)
+	{
+		LICUT_ERROR( "%s() failed to allocate %d commands\n", __FUNCTION__, estimatedCommands );
+		return 0;
+	}
 
 	// Parse as
 	// type x,y
@@ -481,22 +1168,35 @@ int LicutSVG::ParseDrawList( char *s )
 	// C 597.15048,245.39021 605.13245,240.38659 606.08575,239.90988 
 	// Inkscape doesn't seem to use relative values
 	// Oh ya, and sometimes the pairs are space-separated rather than , - go figure
+	// Numbers are scanned with strtod() rather than sscanf() since sscanf()
+	// measures the entire remaining string on each call
 	int offset = 0;
-	const char *pair1Fmt = "%c %lf,%lf%n";
-	const char *pair2Fmt = " %lf,%lf%n";
+	char delim = ',';
 	if (!strchr( s, ',' ))
 	{
-		printf( "Warning: Pairs are space-delimited, not comma-delimited\n" );
-		pair1Fmt = "%c %lf %lf%n";
-		pair2Fmt = " %lf %lf%n";
+		if (m_verbose) LICUT_DEBUG( "Warning: Pairs are space-delimited, not comma-delimited\n" );
+		delim = ' ';
 	}
-	while (addedCommands < estimatedCommands && offset < dataLength)
+	while (offset < dataLength)
 	{
+		// Leave room for terminator
+		if (addedCommands + 1 >= estimatedCommands)
+		{
+			estimatedCommands *= 2;
+			drawSet_t *newT = (drawSet_t*)realloc( t, estimatedCommands * sizeof( drawSet_t ) );
+			if (!newT)
+			{
+				LICUT_ERROR( "%s() failed to grow to %d commands, truncating...\n", __FUNCTION__, estimatedCommands );
+				break;
+			}
+			t = newT;
+		}
 		int endPos;
-		if (sscanf( &s[offset], pair1Fmt, &t[addedCommands].type, &t[addedCommands].pt[0][0], &t[addedCommands].pt[0][1], &endPos ) < 3)
+		t[addedCommands].type = s[offset++];
+		if ((endPos = _scan_pair( &s[offset], delim, t[addedCommands].pt[0] )) == 0)
 		{
-			printf( "%s() error - got fewer elements than expected at offset %d (command #%d)\n",
-				__FUNCTION__, offset, addedCommands );
+			LICUT_ERROR( "%s() error - got fewer elements than expected at offset %d (command #%d) [%s]\n",
+				__FUNCTION__, offset - 1, addedCommands, _fmt_sample( &s[offset - 1], 16 ) );
 			break;
 		}
 		t[addedCommands].numPoints = 1;
@@ -505,17 +1205,17 @@ int LicutSVG::ParseDrawList( char *s )
 		// Scan two additional sets of points for C
 		if (t[addedCommands].type == 'c' || t[addedCommands].type == 'C')
 		{
-			if (sscanf( &s[offset], pair2Fmt, &t[addedCommands].pt[1][0], &t[addedCommands].pt[1][1], &endPos ) < 2)
+			if ((endPos = _scan_pair( &s[offset], delim, t[addedCommands].pt[1] )) == 0)
 			{
-				printf( "%s() error - unexpected short read of C control2 offset %d cmd #%d\n",
+				LICUT_ERROR( "%s() error - unexpected short read of C control2 offset %d cmd #%d\n",
 					__FUNCTION__, offset, addedCommands );
 				break;
 			}
 			offset += endPos;
 
-			if (sscanf( &s[offset], pair2Fmt, &t[addedCommands].pt[2][0], &t[addedCommands].pt[2][1], &endPos ) < 2)
+			if ((endPos = _scan_pair( &s[offset], delim, t[addedCommands].pt[2] )) == 0)
 			{
-				printf( "%s() error - unexpected short read of C point offset %d cmd #%d\n",
+				LICUT_ERROR( "%s() error - unexpected short read of C point offset %d cmd #%d\n",
 					__FUNCTION__, offset, addedCommands );
 				break;
 			}
@@ -537,133 +1237,86 @@ int LicutSVG::ParseDrawList( char *s )
 		}
 	}
 
-	if (addedCommands >= estimatedCommands)
-	{
-		printf( "Exceeded estimate %d, truncating...\n", estimatedCommands );
-		addedCommands = estimatedCommands - 1;
-	}
-
 	if (addedCommands == 0)
 	{
-		printf( "Empty chain\n" );
+		LICUT_WARN( "Empty chain\n" );
+		free( t );
 		return 0;
 	}
 
-	// Allocate actual array
-	m_drawSets[m_drawSetCount] = (drawSet_t*)malloc( (addedCommands + 1) * sizeof( drawSet_t ) );
+	// Trim to actual size
+	drawSet_t *trimmed = (drawSet_t*)realloc( t, (addedCommands + 1) * sizeof( drawSet_t ) );
+	if (trimmed) t = trimmed;
 
-	// Copy
-	for (int n = 0; n < addedCommands; n++)
+	if (m_verbose && LICUT_LOG_TRACE <= LICUT_LOG_LEVEL)
 	{
-		m_drawSets[m_drawSetCount][n] = t[n];
-		if (m_verbose)
+		for (int n = 0; n < addedCommands; n++)
 		{
-			printf( "draw[%d]={%c, %d, %.5f,%.5f", n, t[n].type, t[n].numPoints, t[n].pt[0][0], t[n].pt[0][1] );
-			for (int i = 1; i < t[n].numPoints; i++)
-			{
-				printf( " %.5f,%.5f", t[n].pt[i][0], t[n].pt[i][1] );
-			}
-			printf( "}\n" );
+			if (t[n].numPoints == 3) LICUT_TRACE( "draw[%d]={%c, %d, %.5f,%.5f %.5f,%.5f %.5f,%.5f}\n", n, t[n].type, t[n].numPoints,
+				t[n].pt[0][0], t[n].pt[0][1], t[n].pt[1][0], t[n].pt[1][1], t[n].pt[2][0], t[n].pt[2][1] );
+			else LICUT_TRACE( "draw[%d]={%c, %d, %.5f,%.5f}\n", n, t[n].type, t[n].numPoints, t[n].pt[0][0], t[n].pt[0][1] );
 		}
 	}
 
 	// Null-terminate
-	m_drawSets[m_drawSetCount][addedCommands].type = 0;
-	m_drawSets[m_drawSetCount][addedCommands].numPoints = 0;
+	t[addedCommands].type = 0;
+	t[addedCommands].numPoints = 0;
+
+	// Streamed sets are handed over as soon as they are complete
+	if (!keep)
+	{
+		if (m_sink->DrawSetParsed( *this, t ) == 0) return addedCommands;
+		m_sinkStopped = true;
+		return -1;
+	}
+
+	if (m_defsDepth >= 0 && MarkHidden( m_drawSetCount ))
+	{
+		free( t );
+		return 0;
+	}
 
 	// Update draw set count
+	m_drawSets[m_drawSetCount] = t;
 	m_drawSetCount++;
 
-	// Return number added (not including terminator)
+	// Return number added (not including terminator), -1 if the sink stopped the parse
 	return addedCommands;
 }
 
-// Cut a single draw set
-int LicutSVG::CutDrawSet( LicutIO& lio, int set, int x, int y, int width, int height )
-{
-	if (set < 0 || set >= m_drawSetCount) return -1;
-	SetScaling( x, y, width, height );
-	int oldVerbose = lio.GetVerbose();
-	lio.SetVerbose( m_verbose );
-	int n;
-	int send_res, reply_res;
-	unsigned int lastX, lastY, curX, curY, ctl1X, ctl1Y, ctl2X, ctl2Y;
-	lastX = x;
-	lastY = y;
-	lio.Drain( m_intercommand * 6, m_verbose );
-	for (n = 0; m_drawSets[set][n].type != 0; n++)
-	{
-		switch (m_drawSets[set][n].type)
-		{
-			case 'M':	// Move
-				ScalePoint( m_drawSets[set][n].pt[0], lastX, lastY );
-				send_res = lio.SendCmd_MoveCut( 2, lastX, lastY );
-				reply_res = lio.ReadCmdReply( m_verbose );
-				lio.Drain( m_verbose, m_intercommand );
-				break;
-			case 'L':	// Straight line from previous point
-				ScalePoint( m_drawSets[set][n].pt[0], lastX, lastY );
-				send_res = lio.SendCmd_MoveCut( 0, lastX, lastY );
-				reply_res = lio.ReadCmdReply( m_verbose );
-				lio.Drain( m_verbose, m_intercommand );
-				break;
-			case 'C':	// Bezier curve from previous point
-				ScalePoint( m_drawSets[set][n].pt[0], ctl1X, ctl1Y );
-				ScalePoint( m_drawSets[set][n].pt[1], ctl2X, ctl2Y );
-				ScalePoint( m_drawSets[set][n].pt[2], curX, curY );
-				// Bezier curve data are sent in sets of 4
-				send_res = lio.SendCmd_MoveCut( 1, lastX, lastY );
-				reply_res = lio.ReadCmdReply( m_verbose );
-				lio.Drain( m_verbose, m_intercurve ); // Very short wait to drain since no physical movement required
-				send_res = lio.SendCmd_MoveCut( 1, ctl1X, ctl1Y );
-				reply_res = lio.ReadCmdReply( m_verbose );
-				lio.Drain( m_verbose, m_intercurve ); // Very short wait to drain since no physical movement required
-				send_res = lio.SendCmd_MoveCut( 1, ctl2X, ctl2Y );
-				reply_res = lio.ReadCmdReply( m_verbose );
-				lio.Drain( m_verbose, m_intercurve ); // Very short wait to drain since no physical movement required
-				send_res = lio.SendCmd_MoveCut( 1, curX, curY );
-				reply_res = lio.ReadCmdReply( m_verbose );
-				lio.Drain( m_verbose, m_intercommand );
-				lastX = curX;
-				lastY = curY;
-				break;
-			default:
-				printf( "%s(..., %d...) warning: unhandled cut type %c at index %d\n",
-					__FUNCTION__, set, m_drawSets[set][n].type, n );
-				break;
-		}
-	}
-	lio.SetVerbose( oldVerbose );
-	// Return number of sets executed
-	return n;
-}
-
-// Cut all draw sets
+// Cut all draw sets. Commands are lowered and their packets encoded before the
+// first is sent, so nothing but I/O happens while the device is cutting
 int LicutSVG::CutAllDrawSets( LicutIO& lio, int x, int y, int width, int height )
 {
-	int n;
-	int returnValue = 0;
-	for (n = 0; n < m_drawSetCount; n++)
-	{
-		if (m_verbose) printf( "%s() cutting draw set %d\n", __FUNCTION__, n );
-		int r = CutDrawSet( lio, n, x, y, width, height );
-		if (m_verbose) printf( "%s() draw set %d returned %d\n", __FUNCTION__, n, r );
-		if (r < 0) return r;
-		returnValue++;
-	}
+	LicutCmdList cmds( m_verbose );
+	if (cmds.Lower( *this, x, y, width, height, m_intercommand, m_intercurve ) != 0) return -1;
+	m_packetsCollapsed = m_collapse ? cmds.Collapse() : 0;
+	m_packetsSent = cmds.GetCount();
+	if (cmds.Encode() != 0) return -1;
+	if (m_verbose) LICUT_DEBUG( "%s() sending %d commands in %d draw sets\n", __FUNCTION__, cmds.GetCount(), cmds.GetGroupCount() );
+	cmds.SetTransaction( m_transaction, m_transactionDrain );
+	cmds.SetRetries( m_retries );
+	int r = cmds.Send( lio );
+	m_transactionsSent = cmds.GetTransactionCount();
+	m_retryCount = cmds.GetRetryCount();
+	m_resyncCount = cmds.GetResyncCount();
+	if (r < 0) return r;
 
-	return returnValue;
+	return m_drawSetCount;
 }
 
-// Scale and translate SVG x,y pair to output absolute coordinates
-void LicutSVG::ScalePoint( double xy[2], unsigned int &x, unsigned int &y )
+// Scale and translate SVG x,y pair to output absolute coordinates. Returns 0 if successful
+int LicutSVG::ScalePoint( double xy[2], unsigned int &x, unsigned int &y )
 {
 	if (!m_width || !m_height)
 	{
-		printf( "Fatal error - cannot scale, no svg width and height\n" );
-		exit( -1 );
+		LICUT_ERROR( "Error - cannot scale, no svg width and height\n" );
+		x = m_outputX;
+		y = m_outputY;
+		return -1;
 	}
 	x = m_outputX + m_outputWidth * xy[0] / m_width;
 	y = m_outputY + m_outputHeight * xy[1] / m_height;
+	return 0;
 }
 
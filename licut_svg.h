@@ -1,5 +1,8 @@
 // $Id: licut_svg.h 1 2011-01-28 21:55:10Z henry_groover $
 
+#ifndef _LICUT_SVG_H_
+#define _LICUT_SVG_H_
+
 // ARM processor needs qword alignment for double access via strd
 #pragma pack(8)
 typedef struct _drawSet
@@ -10,29 +13,153 @@ typedef struct _drawSet
 } drawSet_t;
 #pragma pack()
 
+// Element selection state inherited by child elements during parse
+typedef struct _selectState
+{
+	char stroke[16]; // Normalized stroke colour
+	bool inLayer; // Inside an included layer (or no layers included)
+	bool inId; // Inside an element with included id (or no ids included)
+} selectState_t;
+
+// Draw set placed by <use>: geometry shared by every instance of the referenced
+// element, and the transform from it to user units
+typedef struct _drawInstance
+{
+	drawSet_t const *set; // NULL once expanded to a draw set of its own
+	double m[6];
+} drawInstance_t;
+
+// Element with an id during parse: draw sets first..first+count-1 and <use>
+// elements firstUse..firstUse+useCount-1 were parsed inside it
+typedef struct _svgRef
+{
+	const char *id; // In the parse buffer
+	int depth;
+	int first;
+	int count;
+	int firstUse;
+	int useCount;
+} svgRef_t;
+
+// <use> element during parse, placed before draw set position
+typedef struct _svgUse
+{
+	const char *href; // Id referred to, in the parse buffer
+	double m[6]; // transform attribute then x,y translation
+	int position;
+	bool hidden; // Inside <defs> or <symbol>, only placed with its parent
+} svgUse_t;
+
+#include "licut_xml.h"
+
+// Deepest <use> of an element containing <use> elements that is placed
+#define MAX_USE_NESTING	16
+
 class LicutIO;
+class LicutSVG;
 
-class LicutSVG
+// Receives draw sets as they are parsed instead of LicutSVG keeping them, see
+// LicutSVG::SetDrawSetSink()
+class LicutDrawSetSink
+{
+public:
+	virtual ~LicutDrawSetSink() {}
+	// Take malloc'd, terminated set, which the sink frees. svg attributes seen so far
+	// (width, height, viewBox) are set. Return 0 to continue or -1 to stop the parse
+	virtual int DrawSetParsed( LicutSVG& svg, drawSet_t *set ) = 0;
+};
+
+class LicutSVG : public LicutXMLHandler
 {
 public:
 	LicutSVG( int verbose );
 	~LicutSVG();
 
-	// Parse file - returns 0 if successful
+	// Parse file, - for standard input, decompressing gzip (.svgz) as it is
+	// read. HPGL plotter files (.plt) are read by LicutHPGL instead - returns 0
+	// if successful
 	int Parse( const char *svgPath );
 
+	// Parse NUL-terminated svg data in memory, modifying it in place, or HPGL
+	// if it looks like it - returns 0 if successful
+	int ParseBuffer( char *data, size_t length );
+
+	// Element selection kinds for AddSelection()
+	enum { SELECT_LAYER, SELECT_ID, SELECT_STROKE, SELECT_KINDS };
+
+	// Add comma-separated values to include or exclude list for kind. Must be
+	// called before Parse(). Layers match id or inkscape:label, strokes match
+	// stroke colour from style or stroke attribute (#rrggbb, #rgb or common names).
+	// Excluded elements are skipped with all content. If any layers or ids are
+	// included, only paths inside them are cut. If any strokes are included, only
+	// paths with those strokes are cut.
+	void AddSelection( int kind, bool include, const char *values );
+
+	// Pass each draw set to sink as soon as its path is parsed, so the document
+	// can be processed while parsing continues. Draw sets are then not kept and
+	// GetDrawSetCount() stays 0. Must be called before Parse()
+	void SetDrawSetSink( LicutDrawSetSink *sink ) { m_sink = sink; }
+
+	// Get number of elements skipped by selection
+	int GetSkippedElements() const { return m_skippedElements; }
+
 	// Get svg attributes
 	unsigned int GetWidth() const { return m_width; }
 	unsigned int GetHeight() const { return m_height; }
 
+	// Get physical size of one user unit in inches from width, height (with units
+	// in, mm, cm, pt, pc or px at 96 per inch) and viewBox. Returns false if unknown
+	bool GetInchesPerUnit( double& x, double& y ) const;
+
+	// Set size in user units, for a document built with AddDrawSet()
+	void SetSize( unsigned int width, unsigned int height ) { m_width = width; m_height = height; }
+
+	// Set physical size of the whole document, whose user units then span the
+	// width and height set by SetSize()
+	void SetPhysicalSize( double widthInches, double heightInches );
+
+	// Append copy of terminated set with points transformed by m (x' = m[0]x + m[2]y + m[4],
+	// y' = m[1]x + m[3]y + m[5]). Returns 0 if successful
+	int AddDrawSet( drawSet_t const *set, double const m[6] );
+
+	// Append malloc'd, terminated set as parsed, which LicutSVG, or the draw set
+	// sink if there is one, will free. Returns 0 if successful or -1 if it could
+	// not be added or the sink stopped the parse
+	int AppendDrawSet( drawSet_t *set );
+
 	// Get number of draw sets
 	int GetDrawSetCount() const { return m_drawSetCount; }
 
-	// Get draw set or NULL if undefined
+	// Get draw set or NULL if undefined. An instance placed by <use> is expanded
+	// to a transformed copy of its own the first time it is needed this way
 	drawSet_t const *GetDrawSet( int index ) const;
 
-	// Cut a single draw set
-	int CutDrawSet( LicutIO& lio, int set, int x, int y, int width, int height );
+	// Get draw set without expanding an instance: *m is set to the transform to
+	// apply to its points, or NULL if there is none. Cutting goes through this so
+	// instances share their geometry until it is scaled to device coordinates
+	drawSet_t const *GetDrawSetGeometry( int index, double const **m ) const;
+
+	// Get draw set for in-place modification (command count must not change) or NULL
+	drawSet_t *ModifyDrawSet( int index );
+
+	// Draw sets placed by <use> in the last parse, and distinct draw sets they share
+	int GetInstanceCount() const { return m_instanceCount; }
+	int GetSharedCount() const { return m_sharedCount; }
+
+	// Apply transform m (as for AddDrawSet()) to xy
+	static void TransformPoint( double const m[6], double const xy[2], double out[2] )
+	{
+		out[0] = m[0] * xy[0] + m[2] * xy[1] + m[4];
+		out[1] = m[1] * xy[0] + m[3] * xy[1] + m[5];
+	}
+
+	// Replace draw set with malloc'd, terminated newSet which LicutSVG will free.
+	// Returns 0 if successful
+	int ReplaceDrawSet( int index, drawSet_t *newSet );
+
+	// Reorder draw sets so that new set n is old set order[n]. order must be a
+	// permutation of 0..GetDrawSetCount()-1. Returns 0 if successful
+	int ReorderDrawSets( const int *order );
 
 	// Cut all draw sets
 	int CutAllDrawSets( LicutIO& lio, int x, int y, int width, int height );
@@ -40,8 +167,13 @@ public:
 	// Set scaling and origin
 	void SetScaling( int x, int y, int width, int height ) { m_outputX = x; m_outputY = y; m_outputWidth = width; m_outputHeight = height; }
 
-	// Scale and translate SVG x,y pair to output absolute coordinates
-	void ScalePoint( double xy[2], unsigned int &x, unsigned int &y );
+	// Output units per svg unit for current scaling
+	double GetScaleX() const { return m_width ? (double)m_outputWidth / m_width : 0; }
+	double GetScaleY() const { return m_height ? (double)m_outputHeight / m_height : 0; }
+
+	// Scale and translate SVG x,y pair to output absolute coordinates.
+	// Returns -1 (and the output origin) if there is no svg width and height
+	int ScalePoint( double xy[2], unsigned int &x, unsigned int &y );
 
 	// Intercommand delay in ms
 	int GetIntercommandDelay() const { return m_intercommand; }
@@ -50,24 +182,75 @@ public:
 	// Intercurve delay in ms - between elements of a Bezier curve set
 	int GetIntercurveDelay() const { return m_intercurve; }
 	void SetIntercurveDelay( int ms ) { m_intercurve = ms; }
-protected:
-	// Parse node tags at the current level recursively. See notes above
-	// Return number of node tags parsed
-	int ParseTags( char *& s, int stackLevel, char *tagStack[1024], bool ignore );
 
-	// Parse a single node tag recursively at the current level
-	// Returns 1 if parsed or 0 if not a tag
-	int ParseTag( char *& s, int stackLevel, char *tagStack[1024], bool ignore );
+	// Remove commands with no effect at device resolution in CutAllDrawSets()
+	bool GetCollapse() const { return m_collapse; }
+	void SetCollapse( bool collapse ) { m_collapse = collapse; }
+	// Commands sent and removed by last CutAllDrawSets()
+	int GetPacketsSent() const { return m_packetsSent; }
+	int GetPacketsCollapsed() const { return m_packetsCollapsed; }
+	// Send CutAllDrawSets() commands in transactions, see LicutCmdList::SetTransaction()
+	void SetTransaction( int batch, int replyDrainMs ) { m_transaction = batch; m_transactionDrain = replyDrainMs; }
+	int GetTransactionsSent() const { return m_transactionsSent; }
+	// Retransmit CutAllDrawSets() commands with missing replies, see LicutCmdList::SetRetries()
+	void SetRetries( int retries ) { m_retries = retries; }
+	int GetRetryCount() const { return m_retryCount; }
+	int GetResyncCount() const { return m_resyncCount; }
+
+	// Element handlers called by LicutXML::Parse()
+	virtual int StartElement( const char *name, int attrCount, const char * const *attrs, int depth, bool isEmpty );
+	virtual void EndElement( const char *name, int depth );
+
+protected:
+	// Parse HPGL data into draw sets - returns 0 if successful
+	int ParseHPGL( const char *data, size_t length );
 
 	// Parse draw list set values from d attribute
-	// Return number of sets parsed
-	int ParseDrawList( char *s );
+	// Return number of sets parsed, or -1 if the draw set sink stopped the parse
+	int ParseDrawList( const char *s );
+
+	// Make room for count more draw sets. Returns 0 if successful
+	int GrowDrawSets( int count = 1 );
+
+	// Returns true if value is in include or exclude list for kind
+	bool IsSelected( int kind, bool include, const char *value ) const;
+
+	// Mark draw set index as parsed inside <defs> or <symbol>. Returns 0 if successful
+	int MarkHidden( int index );
+
+	// Append draw set sharing set with other instances. Returns 0 if successful
+	int AddInstance( drawSet_t const *set, double const m[6] );
+
+	// Replace instance index with a transformed copy. Returns it or NULL
+	drawSet_t *ExpandInstance( int index );
+
+	// Replace draw sets parsed since m_parseFirst with instances of what <use>
+	// elements refer to, after the parse when forward references are known.
+	// Returns 0 if successful
+	int ResolveInstances();
+
+	// Find element by id. Returns NULL if undefined
+	svgRef_t const *FindRef( const char *id ) const;
+
+	// Place draw sets (sets[0] being the first of this parse) and <use> elements
+	// of ref, or what use refers to, with transform m. PLACE_MARK only marks
+	// m_referenced. Returns draw sets placed or -1
+	enum { PLACE_MARK, PLACE_ADD, PLACE_SINK };
+	int PlaceRef( svgRef_t const *ref, double const m[6], int nesting, int mode, drawSet_t **sets );
+	int PlaceUse( svgUse_t const *use, double const m[6], int nesting, int mode, drawSet_t **sets );
+	// Place count draw sets parsed outside <defs> and <symbol> and the <use>
+	// elements between them. Returns draw sets placed or -1
+	int PlaceParsed( int mode, drawSet_t **sets, int count );
 
 protected:
 	int m_verbose;
 	unsigned int m_width;
 	unsigned int m_height;
+	double m_widthInches; // Physical size if width and height have units, else 0
+	double m_heightInches;
+	double m_viewBox[4]; // min-x, min-y, width, height or all 0 if none
 	int m_drawSetCount;
+	int m_drawSetAlloc;
 	drawSet_t **m_drawSets;
 	int m_outputX;
 	int m_outputY;
@@ -75,5 +258,47 @@ protected:
 	int m_outputHeight;
 	int m_intercommand;
 	int m_intercurve;
+	bool m_collapse;
+	int m_transaction;
+	int m_transactionDrain;
+	int m_transactionsSent;
+	int m_retries;
+	int m_retryCount;
+	int m_resyncCount;
+	int m_packetsSent;
+	int m_packetsCollapsed;
+	// Selection lists [kind][0=exclude, 1=include]
+	char **m_select[SELECT_KINDS][2];
+	int m_selectCount[SELECT_KINDS][2];
+	selectState_t *m_selectState; // Indexed by element depth
+	int m_selectStateAlloc;
+	int m_skippedElements;
+	LicutDrawSetSink *m_sink;
+	bool m_sinkStopped; // Sink stopped the parse
+	drawInstance_t *m_instances; // Parallel to m_drawSets, or NULL if no instances
+	drawSet_t **m_shared; // Geometry referred to by instances
+	int m_sharedCount;
+	int m_instanceCount;
+	// Instancing state during parse
+	int m_parseFirst; // First draw set of this parse
+	int m_defsDepth; // Depth of outermost <defs> or <symbol>, or -1 if outside
+	unsigned char *m_hidden; // Per draw set, non-zero if parsed inside <defs> or <symbol>
+	int m_hiddenAlloc;
+	svgRef_t *m_refs; // Elements with an id and content, sorted by id after the parse
+	int m_refCount;
+	int m_refAlloc;
+	bool m_refsSorted;
+	bool m_recordRefs; // Document has <use> elements
+	svgRef_t *m_openRefs; // Elements with an id still open
+	int m_openRefCount;
+	int m_openRefAlloc;
+	svgUse_t *m_uses;
+	int m_useCount;
+	int m_useAlloc;
+	unsigned char *m_referenced; // Per draw set of this parse, non-zero if an instance uses it
+	int m_unresolved; // <use> elements referring to undefined ids
+	int m_placed; // Draw sets placed by PlaceRef() in this pass
+	svgRef_t const *m_placing[MAX_USE_NESTING]; // Elements being placed, to refuse cycles
 };
 
+#endif // _LICUT_SVG_H_
@@ -0,0 +1,431 @@
+// $Id$
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <algorithm>
+
+#include "licut_tile.h"
+#include "licut_log.h"
+#include "licut_time.h"
+
+// Intervals sampled per curve when looking for tile edge crossings
+#define CROSSING_SAMPLES	32
+// Bisection steps to locate a crossing
+#define CROSSING_STEPS	40
+// Slack in device units for points on a tile edge
+#define EDGE_EPSILON	1e-6
+
+// Point at t on cubic p
+static void _bezier_point( double const p[4][2], double t, double out[2] )
+{
+	double u = 1 - t;
+	for (int i = 0; i < 2; i++)
+	{
+		out[i] = u * u * u * p[0][i] + 3 * u * u * t * p[1][i] + 3 * u * t * t * p[2][i] + t * t * t * p[3][i];
+	}
+}
+
+// Split cubic p at t into left and right halves (de Casteljau)
+static void _bezier_split( double const p[4][2], double t, double left[4][2], double right[4][2] )
+{
+	for (int i = 0; i < 2; i++)
+	{
+		double a = p[0][i] + (p[1][i] - p[0][i]) * t;
+		double b = p[1][i] + (p[2][i] - p[1][i]) * t;
+		double c = p[2][i] + (p[3][i] - p[2][i]) * t;
+		double d = a + (b - a) * t;
+		double e = b + (c - b) * t;
+		double f = d + (e - d) * t;
+		left[0][i] = p[0][i];
+		left[1][i] = a;
+		left[2][i] = d;
+		left[3][i] = f;
+		right[0][i] = f;
+		right[1][i] = e;
+		right[2][i] = c;
+		right[3][i] = p[3][i];
+	}
+}
+
+// Part of cubic p between ta and tb
+static void _bezier_segment( double const p[4][2], double ta, double tb, double out[4][2] )
+{
+	double left[4][2], right[4][2];
+	_bezier_split( p, tb, left, right );
+	if (ta <= 0 || tb <= 0)
+	{
+		memcpy( out, left, sizeof(left) );
+		return;
+	}
+	_bezier_split( left, ta / tb, right, out );
+}
+
+static bool _inside( double const p[2], double const size[2] )
+{
+	return p[0] >= -EDGE_EPSILON && p[0] <= size[0] + EDGE_EPSILON &&
+		p[1] >= -EDGE_EPSILON && p[1] <= size[1] + EDGE_EPSILON;
+}
+
+// Snap point found on a tile edge into the tile so it does not round outside
+static void _clamp( double p[2], double const size[2] )
+{
+	for (int i = 0; i < 2; i++)
+	{
+		if (p[i] < 0) p[i] = 0;
+		else if (p[i] > size[i]) p[i] = size[i];
+	}
+}
+
+// Pieces of one clipped draw set
+typedef struct _pieces
+{
+	drawSet_t *t;
+	int count;
+	int alloc;
+	double pen[2];
+} pieces_t;
+
+// Append element, returns 0 if successful
+static int _pieces_add( pieces_t& p, char type, double const (*pt)[2], int numPoints )
+{
+	if (p.count + 2 > p.alloc)
+	{
+		int newAlloc = p.alloc ? p.alloc * 2 : 16;
+		drawSet_t *t = (drawSet_t *)realloc( p.t, newAlloc * sizeof(drawSet_t) );
+		if (!t) return -1;
+		p.t = t;
+		p.alloc = newAlloc;
+	}
+	drawSet_t& d = p.t[p.count++];
+	memset( &d, 0, sizeof(d) );
+	d.type = type;
+	d.numPoints = numPoints;
+	memcpy( d.pt, pt, numPoints * sizeof(pt[0]) );
+	p.pen[0] = pt[numPoints - 1][0];
+	p.pen[1] = pt[numPoints - 1][1];
+	return 0;
+}
+
+// Append line or curve piece starting at pt[0], moving there first if the pen is elsewhere
+static int _pieces_cut( pieces_t& p, char type, double const (*pt)[2], int numPoints )
+{
+	if (p.count == 0 || fabs( p.pen[0] - pt[0][0] ) > EDGE_EPSILON || fabs( p.pen[1] - pt[0][1] ) > EDGE_EPSILON)
+	{
+		if (_pieces_add( p, 'M', pt, 1 ) != 0) return -1;
+	}
+	return _pieces_add( p, type, pt + 1, numPoints - 1 );
+}
+
+LicutTile::LicutTile( int verbose )
+{
+	m_verbose = verbose;
+	m_svg = NULL;
+	m_scaleX = 0;
+	m_scaleY = 0;
+	memset( m_box, 0, sizeof(m_box) );
+	m_matWidth = 0;
+	m_matHeight = 0;
+	m_overlap = 0;
+	m_columns = 0;
+	m_rows = 0;
+	m_running = false;
+	m_index = 0;
+	m_x = 0;
+	m_y = 0;
+	m_intercommand = 0;
+	m_intercurve = 0;
+	m_result = 0;
+	m_cmds[0] = new LicutCmdList( verbose );
+	m_cmds[1] = new LicutCmdList( verbose );
+	m_prepareMs = 0;
+	m_waitMs = 0;
+	m_clipped = 0;
+	m_collapse = false;
+	m_collapsed = 0;
+}
+
+LicutTile::~LicutTile()
+{
+	if (m_running) pthread_join( m_thread, NULL );
+	delete m_cmds[0];
+	delete m_cmds[1];
+}
+
+// Divide design into tiles. Returns number of tiles or -1 on error
+int LicutTile::Setup( LicutSVG const& svg, double matWidth, double matHeight, double overlap )
+{
+	m_columns = 0;
+	m_rows = 0;
+	if (matWidth <= 0 || matHeight <= 0 || overlap < 0 || 2 * overlap >= matWidth || 2 * overlap >= matHeight)
+	{
+		LICUT_ERROR( "%s() overlap %.0f must be less than half of %.0f x %.0f\n", __FUNCTION__, overlap, matWidth, matHeight );
+		return -1;
+	}
+	m_svg = &svg;
+	m_scaleX = svg.GetScaleX();
+	m_scaleY = svg.GetScaleY();
+	m_matWidth = matWidth;
+	m_matHeight = matHeight;
+	m_overlap = overlap;
+	bool first = true;
+	for (int n = 0; n < svg.GetDrawSetCount(); n++)
+	{
+		for (drawSet_t const *set = svg.GetDrawSet( n ); set && set->type != 0; set++)
+		{
+			for (int i = 0; i < set->numPoints; i++)
+			{
+				double x = set->pt[i][0] * m_scaleX;
+				double y = set->pt[i][1] * m_scaleY;
+				if (first || x < m_box[0]) m_box[0] = x;
+				if (first || y < m_box[1]) m_box[1] = y;
+				if (first || x > m_box[2]) m_box[2] = x;
+				if (first || y > m_box[3]) m_box[3] = y;
+				first = false;
+			}
+		}
+	}
+	if (first) return -1;
+	// Tiles step by one mat less the overlap. Control points bound each curve, so
+	// every piece lands in some tile
+	double stepX = matWidth - overlap;
+	double stepY = matHeight - overlap;
+	m_columns = (int)ceil( (m_box[2] - m_box[0] - overlap) / stepX - EDGE_EPSILON );
+	m_rows = (int)ceil( (m_box[3] - m_box[1] - overlap) / stepY - EDGE_EPSILON );
+	if (m_columns < 1) m_columns = 1;
+	if (m_rows < 1) m_rows = 1;
+	if (m_verbose) LICUT_DEBUG( "%s() design %.0f x %.0f in %d x %d tiles\n", __FUNCTION__,
+		m_box[2] - m_box[0], m_box[3] - m_box[1], m_columns, m_rows );
+	return m_columns * m_rows;
+}
+
+// Clip one draw set to the tile at origin, adding it to out. Returns 0 if successful
+int LicutTile::ClipSet( drawSet_t const *set, double const origin[2], bool const ownEdge[2], LicutSVG& out, int *clipped ) const
+{
+	double size[2] = { m_matWidth, m_matHeight };
+	pieces_t p;
+	memset( &p, 0, sizeof(p) );
+	// A set without a leading move starts from the device origin
+	double cur[2] = { -origin[0], -origin[1] };
+	int r = 0;
+	for (; set->type != 0 && r == 0; set++)
+	{
+		double pt[4][2];
+		pt[0][0] = cur[0];
+		pt[0][1] = cur[1];
+		int i;
+		for (i = 0; i < set->numPoints; i++)
+		{
+			pt[i + 1][0] = set->pt[i][0] * m_scaleX - origin[0];
+			pt[i + 1][1] = set->pt[i][1] * m_scaleY - origin[1];
+		}
+		if (set->numPoints > 0)
+		{
+			cur[0] = pt[set->numPoints][0];
+			cur[1] = pt[set->numPoints][1];
+		}
+		if (set->type == 'L')
+		{
+			// Liang-Barsky
+			double d[2] = { pt[1][0] - pt[0][0], pt[1][1] - pt[0][1] };
+			double t0 = 0, t1 = 1;
+			bool visible = true;
+			for (int edge = 0; edge < 4 && visible; edge++)
+			{
+				int axis = edge / 2;
+				double q = (edge & 1) ? size[axis] - pt[0][axis] : pt[0][axis];
+				double pd = (edge & 1) ? d[axis] : -d[axis];
+				if (pd == 0)
+				{
+					if (q < -EDGE_EPSILON) visible = false;
+					continue;
+				}
+				double t = q / pd;
+				if (pd < 0)
+				{
+					if (t > t1) visible = false;
+					else if (t > t0) t0 = t;
+				}
+				else
+				{
+					if (t < t0) visible = false;
+					else if (t < t1) t1 = t;
+				}
+			}
+			if (!visible || t1 - t0 <= 0) continue;
+			double piece[2][2];
+			for (i = 0; i < 2; i++)
+			{
+				piece[0][i] = pt[0][i] + d[i] * t0;
+				piece[1][i] = pt[0][i] + d[i] * t1;
+			}
+			_clamp( piece[0], size );
+			_clamp( piece[1], size );
+			// Geometry on a shared far edge is cut with the next tile
+			bool onEdge = false;
+			for (i = 0; i < 2; i++)
+			{
+				if (!ownEdge[i] && piece[0][i] >= size[i] - EDGE_EPSILON && piece[1][i] >= size[i] - EDGE_EPSILON) onEdge = true;
+			}
+			if (onEdge) continue;
+			if (t0 > 0 || t1 < 1) (*clipped)++;
+			r = _pieces_cut( p, 'L', piece, 2 );
+		}
+		else if (set->type == 'C')
+		{
+			// Parameters where the curve crosses a tile edge line, by sampling and bisection
+			double ts[4 * CROSSING_SAMPLES + 2];
+			int tCount = 0;
+			ts[tCount++] = 0;
+			for (int edge = 0; edge < 4; edge++)
+			{
+				int axis = edge / 2;
+				double c = (edge & 1) ? size[axis] : 0;
+				double xy[2];
+				_bezier_point( pt, 0, xy );
+				double lastF = xy[axis] - c;
+				for (int s = 1; s <= CROSSING_SAMPLES; s++)
+				{
+					double t = (double)s / CROSSING_SAMPLES;
+					_bezier_point( pt, t, xy );
+					double f = xy[axis] - c;
+					if (f == 0 && s < CROSSING_SAMPLES)
+					{
+						ts[tCount++] = t;
+					}
+					else if ((lastF < 0 && f > 0) || (lastF > 0 && f < 0))
+					{
+						double lo = t - 1.0 / CROSSING_SAMPLES, hi = t;
+						for (int step = 0; step < CROSSING_STEPS; step++)
+						{
+							double mid = (lo + hi) / 2;
+							_bezier_point( pt, mid, xy );
+							if ((xy[axis] - c < 0) == (lastF < 0)) lo = mid;
+							else hi = mid;
+						}
+						ts[tCount++] = (lo + hi) / 2;
+					}
+					lastF = f;
+				}
+			}
+			ts[tCount++] = 1;
+			std::sort( ts, ts + tCount );
+			// Keep runs of intervals with their midpoint inside the tile
+			int k = 0;
+			while (k < tCount - 1)
+			{
+				double mid[2];
+				_bezier_point( pt, (ts[k] + ts[k + 1]) / 2, mid );
+				if (ts[k + 1] - ts[k] <= 0 || !_inside( mid, size ))
+				{
+					k++;
+					continue;
+				}
+				int end = k + 1;
+				while (end < tCount - 1)
+				{
+					_bezier_point( pt, (ts[end] + ts[end + 1]) / 2, mid );
+					if (!_inside( mid, size )) break;
+					end++;
+				}
+				double piece[4][2];
+				_bezier_segment( pt, ts[k], ts[end], piece );
+				_clamp( piece[0], size );
+				_clamp( piece[3], size );
+				bool onEdge = false;
+				for (i = 0; i < 2; i++)
+				{
+					if (!ownEdge[i] && piece[0][i] >= size[i] - EDGE_EPSILON && piece[1][i] >= size[i] - EDGE_EPSILON &&
+						piece[2][i] >= size[i] - EDGE_EPSILON && piece[3][i] >= size[i] - EDGE_EPSILON) onEdge = true;
+				}
+				if (!onEdge)
+				{
+					if (ts[k] > 0 || ts[end] < 1) (*clipped)++;
+					r = _pieces_cut( p, 'C', piece, 4 );
+				}
+				k = end;
+			}
+		}
+	}
+	if (r == 0 && p.count > 0)
+	{
+		// Drop a trailing move
+		if (p.t[p.count - 1].type == 'M') p.count--;
+		p.t[p.count].type = 0;
+		p.t[p.count].numPoints = 0;
+		double identity[6] = { 1, 0, 0, 1, 0, 0 };
+		if (p.count > 0) r = out.AddDrawSet( p.t, identity );
+	}
+	free( p.t );
+	return r;
+}
+
+// Add clipped draw sets of tile index to out. Returns number of draw sets added or -1 on error
+int LicutTile::BuildTile( int index, LicutSVG& out, int *clipped ) const
+{
+	if (!m_svg || index < 0 || index >= GetTileCount()) return -1;
+	double origin[2];
+	origin[0] = m_box[0] + GetColumn( index ) * (m_matWidth - m_overlap);
+	origin[1] = m_box[1] + GetRow( index ) * (m_matHeight - m_overlap);
+	bool ownEdge[2] = { GetColumn( index ) == m_columns - 1, GetRow( index ) == m_rows - 1 };
+	out.SetSize( (unsigned int)m_matWidth, (unsigned int)m_matHeight );
+	int before = out.GetDrawSetCount();
+	int pieces = 0;
+	for (int n = 0; n < m_svg->GetDrawSetCount(); n++)
+	{
+		if (ClipSet( m_svg->GetDrawSet( n ), origin, ownEdge, out, &pieces ) != 0) return -1;
+	}
+	if (clipped) *clipped = pieces;
+	return out.GetDrawSetCount() - before;
+}
+
+void *LicutTile::PrepareThread( void *arg )
+{
+	LicutTile *tile = (LicutTile *)arg;
+	double t0 = licut_now();
+	LicutCmdList *cmds = tile->m_cmds[tile->m_index & 1];
+	cmds->Clear();
+	LicutSVG out( 0 );
+	tile->m_result = -1;
+	if (tile->BuildTile( tile->m_index, out, &tile->m_clipped ) >= 0 &&
+		cmds->Lower( out, tile->m_x, tile->m_y, (int)tile->m_matWidth, (int)tile->m_matHeight, tile->m_intercommand, tile->m_intercurve ) == 0)
+	{
+		tile->m_collapsed = tile->m_collapse ? cmds->Collapse() : 0;
+		if (cmds->Encode() == 0) tile->m_result = 0;
+	}
+	tile->m_prepareMs = (int)((licut_now() - t0) * 1000);
+	return NULL;
+}
+
+// Build, lower and encode tile index in a background thread. Returns 0 if started
+int LicutTile::StartPrepare( int index, int x, int y, int intercommand, int intercurve )
+{
+	if (m_running || index < 0 || index >= GetTileCount()) return -1;
+	m_index = index;
+	m_x = x;
+	m_y = y;
+	m_intercommand = intercommand;
+	m_intercurve = intercurve;
+	m_clipped = 0;
+	m_collapsed = 0;
+	if (pthread_create( &m_thread, NULL, PrepareThread, this ) != 0)
+	{
+		LICUT_ERROR( "%s() failed to start thread for tile %d\n", __FUNCTION__, index );
+		return -1;
+	}
+	m_running = true;
+	return 0;
+}
+
+// Wait for tile started by StartPrepare(). Returns its commands or NULL if preparation failed
+LicutCmdList *LicutTile::FinishPrepare()
+{
+	if (!m_running) return NULL;
+	double t0 = licut_now();
+	pthread_join( m_thread, NULL );
+	m_running = false;
+	m_waitMs = (int)((licut_now() - t0) * 1000);
+	return m_result == 0 ? m_cmds[m_index & 1] : NULL;
+}
@@ -0,0 +1,91 @@
+// $Id$
+// Splitting of designs larger than one mat into per-mat tiles
+
+#ifndef _LICUT_TILE_H_
+#define _LICUT_TILE_H_
+
+#include <pthread.h>
+
+#include "licut_cmdlist.h"
+#include "licut_svg.h"
+
+class LicutTile
+{
+public:
+	LicutTile( int verbose );
+	~LicutTile();
+
+	// Divide design into tiles of matWidth x matHeight device units. svg scaling
+	// must already map user units to device units at true size, and svg must not
+	// change while tiles are built. Consecutive tiles share overlap device units
+	// of geometry for registration. Returns number of tiles or -1 on error
+	int Setup( LicutSVG const& svg, double matWidth, double matHeight, double overlap );
+
+	int GetTileCount() const { return m_columns * m_rows; }
+	int GetColumns() const { return m_columns; }
+	int GetRows() const { return m_rows; }
+	// Column across the mat and row along the feed of tile index
+	int GetColumn( int index ) const { return m_columns ? index % m_columns : 0; }
+	int GetRow( int index ) const { return m_columns ? index / m_columns : 0; }
+
+	// Add draw sets of tile index clipped to the tile, in device units from the
+	// tile origin, with the size of out set to one mat. Returns number of draw sets
+	// added or -1 on error
+	int BuildTile( int index, LicutSVG& out, int *clipped = NULL ) const;
+
+	// Build, lower and encode tile index in a background thread, for cutting at
+	// mat origin x, y. Only one tile may be in preparation. Returns 0 if started
+	int StartPrepare( int index, int x, int y, int intercommand, int intercurve );
+
+	// Remove commands with no effect at device resolution from prepared tiles
+	void SetCollapse( bool collapse ) { m_collapse = collapse; }
+
+	// Wait for tile started by StartPrepare(). Returns its commands, valid until
+	// the next call, or NULL if preparation failed
+	LicutCmdList *FinishPrepare();
+
+	// Time last prepared tile took to build and encode, and time FinishPrepare()
+	// had to wait for it
+	int GetPrepareMs() const { return m_prepareMs; }
+	int GetWaitMs() const { return m_waitMs; }
+	// Curve and line pieces cut at tile edges in last prepared tile
+	int GetClippedCount() const { return m_clipped; }
+	// Commands removed by SetCollapse() from last prepared tile
+	int GetCollapsedCount() const { return m_collapsed; }
+
+protected:
+	// Clip one draw set to the tile with origin in device units, adding the pieces
+	// to out as one draw set. Geometry lying on the far edges is dropped unless
+	// ownEdge is set for that axis. Returns 0 if successful
+	int ClipSet( drawSet_t const *set, double const origin[2], bool const ownEdge[2], LicutSVG& out, int *clipped ) const;
+
+	static void *PrepareThread( void *arg );
+
+protected:
+	int m_verbose;
+	LicutSVG const *m_svg;
+	double m_scaleX;
+	double m_scaleY;
+	double m_box[4]; // Design bounds in device units: xmin, ymin, xmax, ymax
+	double m_matWidth;
+	double m_matHeight;
+	double m_overlap;
+	int m_columns;
+	int m_rows;
+
+	// Tile preparation state
+	pthread_t m_thread;
+	bool m_running;
+	int m_index;
+	int m_x, m_y;
+	int m_intercommand, m_intercurve;
+	int m_result;
+	LicutCmdList *m_cmds[2]; // Alternate so one is sent while the next is prepared
+	int m_prepareMs;
+	int m_waitMs;
+	int m_clipped;
+	bool m_collapse;
+	int m_collapsed;
+};
+
+#endif // _LICUT_TILE_H_
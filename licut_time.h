@@ -0,0 +1,17 @@
+// $Id$
+// Monotonic clock for timing and deadlines
+
+#ifndef _LICUT_TIME_H_
+#define _LICUT_TIME_H_
+
+#include <time.h>
+
+// Seconds on CLOCK_MONOTONIC, from an arbitrary start
+inline double licut_now()
+{
+	struct timespec t;
+	clock_gettime( CLOCK_MONOTONIC, &t );
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+#endif // _LICUT_TIME_H_
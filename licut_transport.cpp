@@ -0,0 +1,179 @@
+// $Id$
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "licut_transport.h"
+#include "licut_probe.h"
+#include "licut_io.h"
+#include "licut_log.h"
+
+char LicutTransport::errmsg[256] = {0};
+
+// Open pseudo terminal at path in raw mode. Returns handle or -1 on error
+static int _open_pty( const char *path, char *errmsg, int size )
+{
+	int handle = open( path, O_RDWR | O_NOCTTY );
+	if (handle < 0)
+	{
+		snprintf( errmsg, size, "Failed to open %s - %d (%s)", path, errno, strerror(errno) );
+		return -1;
+	}
+	struct termios tio;
+	if (tcgetattr( handle, &tio ) == 0)
+	{
+		cfmakeraw( &tio );
+		tio.c_cc[VTIME] = 0;
+		tio.c_cc[VMIN] = 1;
+		tcsetattr( handle, TCSANOW, &tio );
+	}
+	return handle;
+}
+
+// Open transport for spec. Returns NULL on error
+LicutTransport *LicutTransport::Open( const char *spec, int verbose /*= 0*/ )
+{
+	errmsg[0] = '\0';
+	int handle;
+	if (!spec || !spec[0])
+	{
+		handle = LicutProbe::Open( verbose );
+		if (handle <= 0)
+		{
+			snprintf( errmsg, sizeof(errmsg), "%s", LicutProbe::Errmsg() );
+			return NULL;
+		}
+		return new LicutTtyTransport( handle, "tty" );
+	}
+	if (!strncmp( spec, "tcp:", 4 ) || !strncmp( spec, "ser2net:", 8 ))
+	{
+		bool relay = (spec[0] == 't');
+		handle = LicutTcpTransport::Connect( strchr( spec, ':' ) + 1, verbose );
+		if (handle < 0) return NULL;
+		return new LicutTcpTransport( handle, relay ? "tcp" : "ser2net", !relay );
+	}
+	if (!strncmp( spec, "pty:", 4 ))
+	{
+		handle = _open_pty( &spec[4], errmsg, sizeof(errmsg) );
+		if (handle < 0) return NULL;
+		if (verbose) LICUT_DEBUG( "Opened %s handle %d\n", &spec[4], handle );
+		return new LicutTtyTransport( handle, "pty" );
+	}
+	if (!strncmp( spec, "tty:", 4 )) spec += 4;
+	handle = LicutProbe::OpenPath( spec, verbose );
+	if (handle <= 0)
+	{
+		snprintf( errmsg, sizeof(errmsg), "%s", LicutProbe::Errmsg() );
+		return NULL;
+	}
+	return new LicutTtyTransport( handle, "tty" );
+}
+
+// Write one byte at a time with the device's intercharacter delay. Returns bytes written
+int LicutTransport::WritePaced( int fd, const unsigned char *bytes, int length )
+{
+	int n;
+	int actual_sent = 0;
+	for (n = 0; n < length; n++)
+	{
+		int write_res = write( fd, &bytes[n], 1 );
+		if (write_res < 1)
+		{
+			LICUT_ERROR( "%s(%p,%u) - write returned %d, errno=%d (%s)\n", __FUNCTION__, bytes, length, write_res, errno, strerror(errno) );
+		}
+		else
+		{
+			actual_sent++;
+		}
+		// Add intercharacter delay after each character, including the last
+		usleep( LICUT_BYTE_DELAY_US );
+	}
+	return actual_sent;
+}
+
+// Write all of length, retrying short writes. Returns bytes written
+int LicutTransport::WriteAll( int fd, const unsigned char *bytes, int length )
+{
+	int sent = 0;
+	while (sent < length)
+	{
+		int res = write( fd, &bytes[sent], length - sent );
+		if (res < 0 && errno == EINTR) continue;
+		if (res <= 0)
+		{
+			LICUT_ERROR( "%s(%p,%u) - write returned %d, errno=%d (%s)\n", __FUNCTION__, bytes, length, res, errno, strerror(errno) );
+			break;
+		}
+		sent += res;
+	}
+	return sent;
+}
+
+LicutTtyTransport::~LicutTtyTransport()
+{
+	LicutProbe::Close( m_fd );
+}
+
+LicutTcpTransport::~LicutTcpTransport()
+{
+	close( m_fd );
+}
+
+// Whole packet in one segment, unless a serial server in between needs pacing
+int LicutTcpTransport::Write( const unsigned char *bytes, int length )
+{
+	return m_paced ? WritePaced( m_fd, bytes, length ) : WriteAll( m_fd, bytes, length );
+}
+
+// Connect to host:port ([host]:port for IPv6). Returns socket or -1 on error
+int LicutTcpTransport::Connect( const char *hostPort, int verbose )
+{
+	char host[256];
+	const char *colon = strrchr( hostPort, ':' );
+	if (!colon || colon == hostPort || !colon[1] || colon - hostPort >= (int)sizeof(host))
+	{
+		snprintf( errmsg, sizeof(errmsg), "Invalid address %s, expected host:port", hostPort );
+		return -1;
+	}
+	if (hostPort[0] == '[' && colon[-1] == ']') snprintf( host, sizeof(host), "%.*s", (int)(colon - hostPort - 2), &hostPort[1] );
+	else snprintf( host, sizeof(host), "%.*s", (int)(colon - hostPort), hostPort );
+
+	struct addrinfo hints, *addrs = NULL;
+	memset( &hints, 0, sizeof(hints) );
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	int res = getaddrinfo( host, colon + 1, &hints, &addrs );
+	if (res != 0)
+	{
+		snprintf( errmsg, sizeof(errmsg), "Cannot resolve %s: %s", hostPort, gai_strerror( res ) );
+		return -1;
+	}
+	int fd = -1;
+	for (struct addrinfo *a = addrs; a; a = a->ai_next)
+	{
+		fd = socket( a->ai_family, a->ai_socktype, a->ai_protocol );
+		if (fd < 0) continue;
+		if (connect( fd, a->ai_addr, a->ai_addrlen ) == 0) break;
+		snprintf( errmsg, sizeof(errmsg), "Cannot connect to %s - %d (%s)", hostPort, errno, strerror(errno) );
+		close( fd );
+		fd = -1;
+	}
+	freeaddrinfo( addrs );
+	if (fd < 0) return -1;
+
+	int on = 1;
+	setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on) );
+	setsockopt( fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on) );
+	if (verbose) LICUT_DEBUG( "Connected to %s handle %d\n", hostPort, fd );
+	return fd;
+}
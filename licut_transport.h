@@ -0,0 +1,73 @@
+// $Id$
+// Connection to the cutter. Bytes must reach the device at most one per
+// LICUT_BYTE_DELAY_US, so a transport either paces writes itself (local tty or
+// pty, or a plain ser2net port) or leaves it to licut_relay on the far end of a
+// TCP connection, where network delays cannot bunch bytes up
+
+#ifndef _LICUT_TRANSPORT_H_
+#define _LICUT_TRANSPORT_H_
+
+class LicutTransport
+{
+public:
+	virtual ~LicutTransport() {}
+
+	// Open transport for spec:
+	//	(empty)			find the USB device
+	//	path or tty:path	serial device, with the device's line speed set
+	//	pty:path		pseudo terminal, e.g. an emulator, in raw mode
+	//	tcp:host:port		licut_relay, which paces what it passes on
+	//	ser2net:host:port	raw TCP port of a serial server, paced here
+	// Returns NULL on error, see Errmsg()
+	static LicutTransport *Open( const char *spec, int verbose = 0 );
+	static const char *Errmsg() { return errmsg; }
+
+	// Descriptor to poll and read replies from
+	int GetFd() const { return m_fd; }
+	// Scheme of the spec opened, e.g. "tcp"
+	const char *GetKind() const { return m_kind; }
+
+	// Write a whole packet. Returns bytes written
+	virtual int Write( const unsigned char *bytes, int length ) = 0;
+
+	// Write one byte at a time to fd with LICUT_BYTE_DELAY_US after each. Returns
+	// bytes written
+	static int WritePaced( int fd, const unsigned char *bytes, int length );
+	// Write all of length to fd, retrying short writes. Returns bytes written
+	static int WriteAll( int fd, const unsigned char *bytes, int length );
+
+protected:
+	LicutTransport( int fd, const char *kind ) : m_fd( fd ), m_kind( kind ) {}
+
+	int m_fd;
+	const char *m_kind;
+
+	static char errmsg[256];
+};
+
+// Local serial device or pseudo terminal, paced here
+class LicutTtyTransport : public LicutTransport
+{
+public:
+	LicutTtyTransport( int fd, const char *kind ) : LicutTransport( fd, kind ) {}
+	virtual ~LicutTtyTransport();
+	virtual int Write( const unsigned char *bytes, int length ) { return WritePaced( m_fd, bytes, length ); }
+};
+
+// TCP connection with Nagle disabled so each packet leaves in one segment as
+// soon as it is written. If paced, bytes are sent one at a time as to a tty
+class LicutTcpTransport : public LicutTransport
+{
+public:
+	LicutTcpTransport( int fd, const char *kind, bool paced ) : LicutTransport( fd, kind ), m_paced( paced ) {}
+	virtual ~LicutTcpTransport();
+	virtual int Write( const unsigned char *bytes, int length );
+
+	// Connect to host:port. Returns socket or -1 on error
+	static int Connect( const char *hostPort, int verbose );
+
+protected:
+	bool m_paced;
+};
+
+#endif // _LICUT_TRANSPORT_H_
@@ -0,0 +1,367 @@
+// $Id$
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "licut_xml.h"
+#include "licut_log.h"
+
+/****
+Single-pass tokenizer
+Operates destructively on data, scanning it exactly once from start to end
+and NUL-terminating element names, attribute names and attribute values in place.
+Open elements are tracked on an explicit stack which grows as needed, so
+there is no recursion and no fixed depth limit. Text, comments, CDATA and
+directives are skipped with memchr() / memmem() which are vectorized in
+most C libraries. Character and entity references are not decoded.
+****/
+
+static inline bool _is_space( char c )
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+LicutXML::LicutXML( int verbose )
+{
+	m_verbose = verbose;
+	m_stack = NULL;
+	m_stackLevel = 0;
+	m_stackAlloc = 0;
+	m_attrs = NULL;
+	m_attrCount = 0;
+	m_attrAlloc = 0;
+	m_ends = NULL;
+	m_endCount = 0;
+	m_endAlloc = 0;
+	m_maxDepth = 0;
+	m_skipCount = 0;
+}
+
+LicutXML::~LicutXML()
+{
+	free( m_stack );
+	free( m_attrs );
+	free( m_ends );
+}
+
+int LicutXML::PushElement( char *name )
+{
+	if (m_stackLevel >= m_stackAlloc)
+	{
+		int newAlloc = m_stackAlloc ? m_stackAlloc * 2 : 64;
+		char **newStack = (char **)realloc( m_stack, newAlloc * sizeof(char *) );
+		if (!newStack)
+		{
+			LICUT_ERROR( "%s() failed to grow element stack to %d\n", __FUNCTION__, newAlloc );
+			return -1;
+		}
+		m_stack = newStack;
+		m_stackAlloc = newAlloc;
+	}
+	m_stack[m_stackLevel++] = name;
+	if (m_stackLevel > m_maxDepth) m_maxDepth = m_stackLevel;
+	return 0;
+}
+
+int LicutXML::AddAttr( const char *name, const char *value )
+{
+	if (m_attrCount >= m_attrAlloc)
+	{
+		int newAlloc = m_attrAlloc ? m_attrAlloc * 2 : 16;
+		const char **newAttrs = (const char **)realloc( m_attrs, newAlloc * 2 * sizeof(char *) );
+		if (!newAttrs)
+		{
+			LICUT_ERROR( "%s() failed to grow attribute list to %d\n", __FUNCTION__, newAlloc );
+			return -1;
+		}
+		m_attrs = newAttrs;
+		m_attrAlloc = newAlloc;
+	}
+	m_attrs[m_attrCount * 2 + 0] = name;
+	m_attrs[m_attrCount * 2 + 1] = value;
+	m_attrCount++;
+	return 0;
+}
+
+int LicutXML::AddEnd( char *end )
+{
+	if (m_endCount >= m_endAlloc)
+	{
+		int newAlloc = m_endAlloc ? m_endAlloc * 2 : 32;
+		char **newEnds = (char **)realloc( m_ends, newAlloc * sizeof(char *) );
+		if (!newEnds)
+		{
+			LICUT_ERROR( "%s() failed to grow terminator list to %d\n", __FUNCTION__, newAlloc );
+			return -1;
+		}
+		m_ends = newEnds;
+		m_endAlloc = newAlloc;
+	}
+	m_ends[m_endCount++] = end;
+	return 0;
+}
+
+// Find needle in [s,end) or return NULL
+char *LicutXML::FindSeq( char *s, char *end, const char *needle, size_t needleLength )
+{
+	if (s >= end) return NULL;
+	return (char *)memmem( s, end - s, needle, needleLength );
+}
+
+// Raw scan past the end tag of the element whose content starts at s.
+// Only markup boundaries are located; nothing is terminated or decoded
+char *LicutXML::SkipContent( char *s, char *end )
+{
+	int level = 1;
+	char *close;
+	while (s < end)
+	{
+		s = (char *)memchr( s, '<', end - s );
+		if (!s) break;
+		if (s[1] == '!')
+		{
+			if (s[2] == '-' && s[3] == '-')
+			{
+				close = FindSeq( s + 4, end, "-->", 3 );
+				s = close ? close + 3 : end;
+			}
+			else if (!strncmp( &s[2], "[CDATA[", 7 ))
+			{
+				close = FindSeq( s + 9, end, "]]>", 3 );
+				s = close ? close + 3 : end;
+			}
+			else
+			{
+				close = (char *)memchr( s, '>', end - s );
+				s = close ? close + 1 : end;
+			}
+			continue;
+		}
+		if (s[1] == '?')
+		{
+			close = FindSeq( s + 2, end, "?>", 2 );
+			s = close ? close + 2 : end;
+			continue;
+		}
+		if (s[1] == '/')
+		{
+			close = (char *)memchr( s, '>', end - s );
+			s = close ? close + 1 : end;
+			if (--level == 0) return s;
+			continue;
+		}
+		// Start tag - find > outside of quoted values
+		s++;
+		char quote = 0;
+		while (s < end && (quote || *s != '>'))
+		{
+			if (quote)
+			{
+				close = (char *)memchr( s, quote, end - s );
+				s = close ? close + 1 : end;
+				quote = 0;
+				continue;
+			}
+			if (*s == '"' || *s == '\'') quote = *s;
+			s++;
+		}
+		if (s >= end) break;
+		if (s[-1] != '/') level++;
+		s++;
+	}
+	return end;
+}
+
+// Tokenize data[0..length-1] destructively. data[length] must be '\0'.
+// Returns number of elements parsed or -1 if the handler stopped the parse
+int LicutXML::Parse( char *data, size_t length, LicutXMLHandler& handler )
+{
+	char *s = data;
+	char *end = data + length;
+	int elementCount = 0;
+	char *close;
+
+	m_stackLevel = 0;
+	m_maxDepth = 0;
+	m_skipCount = 0;
+
+	while (s < end)
+	{
+		// Skip text up to the next markup
+		s = (char *)memchr( s, '<', end - s );
+		if (!s) break;
+
+		if (s[1] == '!')
+		{
+			if (s[2] == '-' && s[3] == '-')
+			{
+				close = FindSeq( s + 4, end, "-->", 3 );
+				s = close ? close + 3 : end;
+			}
+			else if (!strncmp( &s[2], "[CDATA[", 7 ))
+			{
+				close = FindSeq( s + 9, end, "]]>", 3 );
+				s = close ? close + 3 : end;
+			}
+			else
+			{
+				// <!DOCTYPE ...> possibly with [internal subset]
+				close = (char *)memchr( s, '>', end - s );
+				char *subset = (char *)memchr( s, '[', (close ? close : end) - s );
+				if (subset)
+				{
+					close = FindSeq( subset, end, "]", 1 );
+					if (close) close = (char *)memchr( close, '>', end - close );
+				}
+				s = close ? close + 1 : end;
+			}
+			continue;
+		}
+
+		if (s[1] == '?')
+		{
+			close = FindSeq( s + 2, end, "?>", 2 );
+			if (!close) LICUT_WARN( "Unexpected missing end for directive at offset %ld\n", (long)(s - data) );
+			s = close ? close + 2 : end;
+			continue;
+		}
+
+		if (s[1] == '/')
+		{
+			char *name = &s[2];
+			close = (char *)memchr( name, '>', end - name );
+			if (!close)
+			{
+				LICUT_ERROR( "Error: end tag at offset %ld is not closed\n", (long)(s - data) );
+				break;
+			}
+			char *nameEnd = name;
+			while (nameEnd < close && !_is_space( *nameEnd )) nameEnd++;
+			*nameEnd = '\0';
+			s = close + 1;
+			// Match against open elements, tolerating unbalanced documents
+			int level = m_stackLevel - 1;
+			while (level >= 0 && strcmp( m_stack[level], name )) level--;
+			if (level < 0)
+			{
+				LICUT_WARN( "Warning: unmatched end tag </%s>\n", name );
+				continue;
+			}
+			while (m_stackLevel > level)
+			{
+				m_stackLevel--;
+				if (m_stackLevel > level) LICUT_WARN( "Warning: <%s> closed by </%s>\n", m_stack[m_stackLevel], name );
+				if (m_verbose > 1) LICUT_TRACE( "%*s</%s>\n", m_stackLevel, "", m_stack[m_stackLevel] );
+				handler.EndElement( m_stack[m_stackLevel], m_stackLevel );
+			}
+			continue;
+		}
+
+		// Start tag. Terminators for the name and unquoted tokens may be the
+		// / or > we need to find the end of the tag, so they are collected
+		// and applied only once the whole tag has been scanned
+		char *name = &s[1];
+		s = name;
+		while (*s && !_is_space( *s ) && *s != '/' && *s != '>') s++;
+		m_attrCount = 0;
+		m_endCount = 0;
+		AddEnd( s );
+		for (;;)
+		{
+			while (_is_space( *s )) s++;
+			if (*s == '/' || *s == '>' || !*s) break;
+			char *attrName = s;
+			while (*s && !_is_space( *s ) && *s != '=' && *s != '/' && *s != '>') s++;
+			AddEnd( s );
+			while (_is_space( *s )) s++;
+			char *attrValue = NULL;
+			if (*s == '=')
+			{
+				s++;
+				while (_is_space( *s )) s++;
+				if (*s == '"' || *s == '\'')
+				{
+					close = (char *)memchr( &s[1], *s, end - &s[1] );
+					if (!close)
+					{
+						LICUT_ERROR( "Error: unterminated value for %s in <%s>\n", attrName, name );
+						s = end;
+						break;
+					}
+					attrValue = &s[1];
+					*close = '\0';
+					s = close + 1;
+				}
+				else
+				{
+					// Unquoted values are not kosher but we'll parse them anyway
+					attrValue = s;
+					while (*s && !_is_space( *s ) && *s != '>') s++;
+					AddEnd( s );
+				}
+			}
+			AddAttr( attrName, attrValue );
+		}
+
+		bool isEmpty = false;
+		if (*s == '/')
+		{
+			isEmpty = true;
+			s++;
+			while (_is_space( *s )) s++;
+		}
+		if (*s != '>')
+		{
+			LICUT_ERROR( "Error: tag at offset %ld is not properly closed\n", (long)(name - data) );
+			break;
+		}
+		s++;
+		for (int n = 0; n < m_endCount; n++) *m_ends[n] = '\0';
+
+		int depth = m_stackLevel;
+		elementCount++;
+		if (m_verbose > 1 && LICUT_LOG_TRACE <= LICUT_LOG_LEVEL)
+		{
+			char attrNames[512];
+			int used = 0;
+			attrNames[0] = '\0';
+			for (int n = 0; n < m_attrCount && used < (int)sizeof(attrNames); n++)
+			{
+				used += snprintf( &attrNames[used], sizeof(attrNames) - used, " %s", m_attrs[n * 2] );
+			}
+			LICUT_TRACE( "%*s<%s%s%s>\n", depth, "", name, attrNames, isEmpty ? "/" : "" );
+		}
+		int action = handler.StartElement( name, m_attrCount, m_attrs, depth, isEmpty );
+		if (action == LICUT_XML_STOP)
+		{
+			return -1;
+		}
+		if (isEmpty)
+		{
+			handler.EndElement( name, depth );
+		}
+		else if (action == LICUT_XML_SKIP)
+		{
+			if (m_verbose > 1) LICUT_TRACE( "%*s(skipping content of <%s>)\n", depth, "", name );
+			m_skipCount++;
+			s = SkipContent( s, end );
+			handler.EndElement( name, depth );
+		}
+		else if (PushElement( name ))
+		{
+			break;
+		}
+	}
+
+	// Close anything left open so handler state is consistent
+	while (m_stackLevel > 0)
+	{
+		m_stackLevel--;
+		LICUT_WARN( "Warning: <%s> not closed at end of document\n", m_stack[m_stackLevel] );
+		handler.EndElement( m_stack[m_stackLevel], m_stackLevel );
+	}
+
+	return elementCount;
+}
+
@@ -0,0 +1,79 @@
+// $Id$
+// Single-pass, non-recursive SAX-style xml tokenizer
+
+#ifndef _LICUT_XML_H_
+#define _LICUT_XML_H_
+
+#include <stddef.h>
+
+// Return values from LicutXMLHandler::StartElement()
+enum
+{
+	LICUT_XML_CONTINUE = 0,	// Parse element content normally
+	LICUT_XML_SKIP = 1,	// Skip element content without tokenizing it
+	LICUT_XML_STOP = -1	// Abort parse
+};
+
+// Receives element events from LicutXML::Parse(). Names and values
+// are NUL-terminated in place and remain valid until the parse buffer is freed
+class LicutXMLHandler
+{
+public:
+	virtual ~LicutXMLHandler() {}
+
+	// Element opened. attrs[] holds attrCount name,value pairs (value NULL if
+	// attribute has no value). depth is 0 for the document element.
+	// isEmpty is true for <tag ... /> which will not get content.
+	// Return LICUT_XML_CONTINUE, LICUT_XML_SKIP or LICUT_XML_STOP
+	virtual int StartElement( const char *name, int attrCount, const char * const *attrs, int depth, bool isEmpty ) = 0;
+
+	// Element closed, including empty and skipped elements
+	virtual void EndElement( const char * /*name*/, int /*depth*/ ) {}
+};
+
+class LicutXML
+{
+public:
+	LicutXML( int verbose );
+	~LicutXML();
+
+	// Tokenize data[0..length-1] destructively. data[length] must be '\0'.
+	// Text, comments, CDATA, directives and DOCTYPE are skipped.
+	// Returns number of elements parsed or -1 if the handler stopped the parse
+	int Parse( char *data, size_t length, LicutXMLHandler& handler );
+
+	// Deepest element nesting seen by the last Parse()
+	int GetMaxDepth() const { return m_maxDepth; }
+
+	// Number of elements whose content was skipped by the last Parse()
+	int GetSkipCount() const { return m_skipCount; }
+
+protected:
+	// Grow element stack / attribute / terminator arrays. Return 0 if successful
+	int PushElement( char *name );
+	int AddAttr( const char *name, const char *value );
+	int AddEnd( char *end );
+
+	// Raw scan past the end tag of the element whose content starts at s.
+	// Returns position after the end tag or end if not found
+	static char *SkipContent( char *s, char *end );
+
+	// Find needle in [s,end) or return NULL
+	static char *FindSeq( char *s, char *end, const char *needle, size_t needleLength );
+
+protected:
+	int m_verbose;
+	char **m_stack;
+	int m_stackLevel;
+	int m_stackAlloc;
+	const char **m_attrs;
+	int m_attrCount;
+	int m_attrAlloc;
+	char **m_ends; // Deferred terminators for the current start tag
+	int m_endCount;
+	int m_endAlloc;
+	int m_maxDepth;
+	int m_skipCount;
+};
+
+#endif // _LICUT_XML_H_
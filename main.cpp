@@ -7,12 +7,29 @@
 #include <string.h>
 #include <signal.h>
 #include <errno.h>
+#include <time.h>
 
 #include <gflags/gflags.h>
 
-#include "licut_probe.h"
+#include "licut_transport.h"
 #include "licut_io.h"
 #include "licut_svg.h"
+#include "licut_order.h"
+#include "licut_simplify.h"
+#include "licut_dedupe.h"
+#include "licut_contain.h"
+#include "licut_nest.h"
+#include "licut_tile.h"
+#include "licut_journal.h"
+#include "licut_preflight.h"
+#include "licut_daemon.h"
+#include "licut_batch.h"
+#include "licut_pipeline.h"
+#include "licut_log.h"
+#include "licut_time.h"
+
+// Travel order improvement passes with --journal, for the same order each run
+#define JOURNAL_ORDER_PASSES	8
 
 const char version_str[] = "0.15";
 
@@ -24,6 +41,139 @@ DEFINE_int32( intercmd, 50, "Set intercommand delay for command sets (in ms)" );
 DEFINE_int32( noise, 0, "Use fixed noise starting with specified value" );
 DEFINE_int32( xxtea_unittest, 0, "Run XXTEA unit test with specified uint32 value" );
 DEFINE_string( xxtea_unittest_str, "", "Pass string to XXTEA unit test" );
+DEFINE_string( include_layers, "", "Cut only layers with these comma-separated ids or labels" );
+DEFINE_string( exclude_layers, "", "Skip layers with these comma-separated ids or labels" );
+DEFINE_string( include_ids, "", "Cut only elements with these comma-separated ids and their children" );
+DEFINE_string( exclude_ids, "", "Skip elements with these comma-separated ids and their children" );
+DEFINE_string( include_strokes, "", "Cut only paths with these comma-separated stroke colours" );
+DEFINE_string( exclude_strokes, "", "Skip paths with these comma-separated stroke colours" );
+DEFINE_string( order, "none", "Cut order: none (document order), travel (minimize pen-up travel) or band (sweep the mat feed one way)" );
+DEFINE_int32( order_budget, 1000, "Time limit for travel order improvement (in ms)" );
+DEFINE_int32( order_passes, 0, "Travel order improvement passes instead of --order_budget, so every run gives the same order (default 8 with --journal)" );
+DEFINE_double( band_height, 500, "Height of bands along the mat feed for --order=band (in device units)" );
+DEFINE_int32( nest, 0, "Pack copies of designs given as file[:quantity] onto the mat at true size" );
+DEFINE_double( nest_spacing, 20, "Gap between nested copies (in device units)" );
+DEFINE_int32( nest_rotate, 1, "Allow nested copies to be turned by 90 degrees" );
+DEFINE_double( device_dpi, 400, "Device units per inch, for true size nesting and tiling" );
+DEFINE_int32( tile, 0, "Cut at true size, splitting designs larger than the mat across several mats" );
+DEFINE_double( tile_overlap, 0, "Geometry repeated on adjacent mats with --tile for registration (in device units)" );
+DEFINE_int32( inside_out, 0, "Cut contours nested inside others before the contours containing them" );
+DEFINE_double( dedupe, 0, "Cut edges shared by adjacent shapes once, matching within this tolerance (in device units, 0 to disable)" );
+DEFINE_double( simplify, 0, "Merge near-collinear segments within this tolerance (in device units, 0 to disable)" );
+DEFINE_int32( collapse, 1, "Drop commands with no effect at device resolution: repeated points, straight curves and collinear lines" );
+DEFINE_string( journal, "", "Record acknowledged commands in this file so an interrupted cut can be resumed" );
+DEFINE_int32( resume, 0, "Continue the job recorded in --journal from the last acknowledged command" );
+DEFINE_int32( journal_sync, 16, "Commands recorded between syncs of --journal to disk" );
+DEFINE_int32( preflight, 0, "Report draw sets, packets, bounds and estimated time as JSON without opening a device" );
+DEFINE_string( preflight_json, "-", "File for the --preflight report, - for the last line of stdout" );
+DEFINE_string( mat, "316,50,4962,4696", "Mat bounds xmin,ymin,xmax,ymax for --preflight (in device units)" );
+DEFINE_double( reply_ms, 250, "Estimated device reply time per packet outside a transaction, for time estimates (in ms)" );
+DEFINE_int32( daemon, 0, "Keep the device open and cut jobs submitted to --socket until interrupted" );
+DEFINE_int32( submit, 0, "Submit files (- for stdin) to a --daemon and show progress" );
+DEFINE_string( socket, "/tmp/licut.sock", "Unix socket for --daemon and --submit" );
+DEFINE_int32( batch, 0, "Cut every file given in one device session, preparing later files while earlier ones are cut" );
+DEFINE_string( manifest, "", "Cut the files listed in this file as a --batch, one per line with an optional x,y,width,height mat area (in device units)" );
+DEFINE_int32( batch_threads, 2, "Threads parsing and preparing files ahead with --batch" );
+DEFINE_string( batch_report, "", "Write the --batch timing report to this file instead of stdout" );
+DEFINE_int32( transaction, 0, "Send commands in transactions of up to this many packets, -1 for one per draw set (0 to disable)" );
+DEFINE_int32( transaction_drain, 5, "Wait after each reply inside a transaction (in ms, 250 outside)" );
+DEFINE_int32( reply_timeout, 3000, "Time allowed for each device reply before resynchronizing (in ms, 0 to wait indefinitely)" );
+DEFINE_int32( retries, 3, "Times a command with a missing reply is sent again before the cut stops (0 to carry on without it)" );
+DEFINE_string( device, "", "Cutter to use: a tty path, pty:path, tcp:host:port of a licut_relay, or ser2net:host:port of a raw serial server (default: find the USB device)" );
+DEFINE_int32( log_async, 1, "Queue log messages for a background thread so output does not delay the device" );
+DEFINE_int32( pipeline, 0, "Parse, lower and encode on separate threads while cutting, starting with the first draw set" );
+DEFINE_int32( pipeline_depth, 16, "Draw sets queued between --pipeline stages" );
+DEFINE_int32( fit_curves, 1, "With --simplify, replace long runs of segments with curves where that saves packets" );
+
+// Apply element selection flags to svg before parsing
+static void _add_selection( LicutSVG& svg )
+{
+	svg.AddSelection( LicutSVG::SELECT_LAYER, true, FLAGS_include_layers.c_str() );
+	svg.AddSelection( LicutSVG::SELECT_LAYER, false, FLAGS_exclude_layers.c_str() );
+	svg.AddSelection( LicutSVG::SELECT_ID, true, FLAGS_include_ids.c_str() );
+	svg.AddSelection( LicutSVG::SELECT_ID, false, FLAGS_exclude_ids.c_str() );
+	svg.AddSelection( LicutSVG::SELECT_STROKE, true, FLAGS_include_strokes.c_str() );
+	svg.AddSelection( LicutSVG::SELECT_STROKE, false, FLAGS_exclude_strokes.c_str() );
+}
+
+// Geometry passes and ordering, on the final scaling so tolerances can be
+// given in device units
+static void _geometry_passes( LicutSVG& svg )
+{
+	double scale = svg.GetScaleX() > svg.GetScaleY() ? svg.GetScaleX() : svg.GetScaleY();
+	if (FLAGS_dedupe > 0)
+	{
+		LicutDedupe dedupe( FLAGS_verbose );
+		if (dedupe.Run( svg, FLAGS_dedupe / scale, 1 / scale ) == 0)
+		{
+			printf( "Shared edges: %.0f of %.0f device units cut length removed (%.1f%%) from %d segments in %d draw sets\n",
+				dedupe.GetRemovedLength() * scale, dedupe.GetCutLength() * scale,
+				dedupe.GetCutLength() > 0 ? 100 * dedupe.GetRemovedLength() / dedupe.GetCutLength() : 0,
+				dedupe.GetSegmentsRemoved(), dedupe.GetSetsChanged() );
+		}
+	}
+	if (FLAGS_simplify > 0)
+	{
+		double msBefore = 0, msAfter = 0;
+		int n;
+		for (n = 0; n < svg.GetDrawSetCount(); n++) msBefore += LicutSimplify::EstimateMs( svg.GetDrawSet( n ), FLAGS_intercmd, FLAGS_intercurve );
+		LicutSimplify simplify( FLAGS_verbose );
+		if (simplify.Run( svg, FLAGS_simplify / scale, FLAGS_fit_curves != 0 ) == 0)
+		{
+			for (n = 0; n < svg.GetDrawSetCount(); n++) msAfter += LicutSimplify::EstimateMs( svg.GetDrawSet( n ), FLAGS_intercmd, FLAGS_intercurve );
+			printf( "Simplified: %d -> %d packets (%d curves fitted, max deviation %.2f device units), est. %.1fs saved\n",
+				simplify.GetPacketsBefore(), simplify.GetPacketsAfter(), simplify.GetCurvesFitted(),
+				simplify.GetMaxDeviation() * scale, (msBefore - msAfter) / 1000 );
+		}
+	}
+
+	LicutOrder order( FLAGS_verbose );
+	int r = 1;
+	if (FLAGS_order == "travel")
+	{
+		// A journaled job must lower to the same commands when it is resumed
+		int passes = FLAGS_order_passes;
+		if (passes <= 0 && !FLAGS_journal.empty()) passes = JOURNAL_ORDER_PASSES;
+		order.SetMaxPasses( passes );
+		r = order.OptimizeTravel( svg, FLAGS_order_budget );
+	}
+	else if (FLAGS_order == "band")
+	{
+		r = order.OptimizeBands( svg, FLAGS_band_height / svg.GetScaleY() );
+	}
+	else if (FLAGS_order != "none")
+	{
+		printf( "Unknown --order=%s, using document order\n", FLAGS_order.c_str() );
+	}
+	if (r == 0)
+	{
+		printf( "%s order: travel %.0f -> %.0f (%.1f%% less), feed travel %.0f -> %.0f with %d -> %d reversals (device units) in %dms\n",
+			FLAGS_order.c_str(), order.GetTravelBefore() * scale, order.GetTravelAfter() * scale,
+			order.GetTravelBefore() > 0 ? 100 * (1 - order.GetTravelAfter() / order.GetTravelBefore()) : 0,
+			order.GetFeedBefore() * svg.GetScaleY(), order.GetFeedAfter() * svg.GetScaleY(),
+			order.GetFeedReversalsBefore(), order.GetFeedReversalsAfter(), order.GetElapsedMs() );
+	}
+
+	// After ordering, so that only containers are moved
+	if (FLAGS_inside_out)
+	{
+		LicutContain contain( FLAGS_verbose );
+		if (contain.OrderInsideOut( svg ) == 0)
+		{
+			printf( "Inside-out order: %d of %d closed contours contain others, %d sets nested (max depth %d), %d moved in %dms\n",
+				contain.GetContainerCount(), contain.GetContourCount(), contain.GetNestedCount(), contain.GetMaxDepth(),
+				contain.GetMovedCount(), contain.GetElapsedMs() );
+		}
+	}
+}
+
+// Per-job processing in --daemon mode, with the same options as a single run
+class _DaemonHandler : public LicutDaemonHandler
+{
+public:
+	void JobSetup( LicutSVG& svg ) { _add_selection( svg ); }
+	int JobPrepare( LicutSVG& svg ) { _geometry_passes( svg ); return 0; }
+};
 
 int main( int argc, char *argv[] )
 {
@@ -45,8 +195,11 @@ int main( int argc, char *argv[] )
 
 	int n;
 	const char *svgPath = NULL;
+	char **designArgs = (char **)calloc( argc, sizeof(char *) );
+	int designCount = 0;
 	// Rearrange args with options removed
 	google::ParseCommandLineFlags( &argc, &argv, true );
+	if (FLAGS_log_async && LicutLog::Start() == 0) atexit( LicutLog::Stop );
 	for (n = 1; n < argc; n++)
 	{
 #if 0
@@ -73,7 +226,8 @@ int main( int argc, char *argv[] )
 					printf( "	-q	Quick mode - do not wait for pressure adjustment\n" );
 					printf( "	-h	Show this message\n" );
 					printf( "and [svg-file] is an Inkscape svg file. See doc/Using_Inkscape.txt for notes\n" );
-					printf( "on creating .svg files for use with licut for cutting.\n" );
+					printf( "on creating .svg files for use with licut for cutting. It may be gzipped (.svgz),\n" );
+					printf( "or an HPGL plotter file (.plt) instead.\n" );
 					exit( 0 );
 			}
 		}
@@ -81,6 +235,7 @@ int main( int argc, char *argv[] )
 #endif
 		{
 			svgPath = argv[n];
+			designArgs[designCount++] = argv[n];
 		}
 	}
 
@@ -115,69 +270,366 @@ int main( int argc, char *argv[] )
 		LicutIO::dump_hex( "Cryptext: ", (unsigned char *)&v[0], 12, "\n" );
 		return 0;
 	}
+	// With --batch files are parsed on worker threads from here on, while the
+	// device is opened and the mat loaded
+	bool batchMode = FLAGS_batch || !FLAGS_manifest.empty();
+	_DaemonHandler batchHandler;
+	LicutBatch batch( batchHandler, verbose );
+	if (batchMode)
+	{
+		if (FLAGS_nest || FLAGS_tile || FLAGS_preflight || FLAGS_daemon || FLAGS_submit || !FLAGS_journal.empty())
+		{
+			printf( "--batch cannot be combined with --nest, --tile, --journal, --preflight, --daemon or --submit\n" );
+			return -1;
+		}
+		for (n = 0; n < designCount; n++) batch.Add( designArgs[n] );
+		if (!FLAGS_manifest.empty() && batch.LoadManifest( FLAGS_manifest.c_str() ) < 0) return -1;
+		if (batch.GetCount() == 0)
+		{
+			printf( "No files to cut\n" );
+			return -1;
+		}
+		batch.SetDelays( interCmd, interCurve );
+		batch.SetCollapse( FLAGS_collapse != 0 );
+		batch.SetTransaction( FLAGS_transaction, FLAGS_transaction_drain );
+		batch.SetRetries( FLAGS_retries );
+		if (batch.Start( FLAGS_batch_threads ) != 0)
+		{
+			printf( "Failed to start --batch threads\n" );
+			return -1;
+		}
+		svgPath = NULL;
+	}
+
+	// With --pipeline the file is parsed on its own thread from here on and each
+	// draw set is lowered and encoded once the mat is known, while earlier ones
+	// are cut. Passes over the whole document cannot run on a stream
+	LicutPipeline pipeline( verbose, FLAGS_pipeline_depth );
+	if (FLAGS_pipeline)
+	{
+		if (batchMode || FLAGS_nest || FLAGS_tile || FLAGS_preflight || FLAGS_daemon || FLAGS_submit || !FLAGS_journal.empty() ||
+			FLAGS_order != "none" || FLAGS_inside_out || FLAGS_dedupe > 0 || FLAGS_simplify > 0)
+		{
+			printf( "--pipeline cannot be combined with --batch, --nest, --tile, --journal, --preflight, --daemon, --submit, --order, --inside_out, --dedupe or --simplify\n" );
+			return -1;
+		}
+		if (!svgPath)
+		{
+			printf( "No file to cut\n" );
+			return -1;
+		}
+		_add_selection( pipeline.GetSVG() );
+		pipeline.SetDelays( interCmd, interCurve );
+		pipeline.SetCollapse( FLAGS_collapse != 0 );
+		pipeline.SetTransaction( FLAGS_transaction, FLAGS_transaction_drain );
+		pipeline.SetRetries( FLAGS_retries );
+		if (pipeline.Start( svgPath ) != 0)
+		{
+			printf( "Failed to start --pipeline threads\n" );
+			return -1;
+		}
+		svgPath = NULL;
+	}
 
 	LicutSVG svg( verbose );
+	// Files are submitted as they are, for the daemon to parse. Nothing is read
+	// here, so standard input (-) reaches the daemon
+	if (FLAGS_submit)
+	{
+		int failed = 0;
+		for (n = 0; n < designCount; n++)
+		{
+			if (LicutDaemon::Submit( FLAGS_socket.c_str(), designArgs[n] ) != 0) failed++;
+		}
+		free( designArgs );
+		return failed ? -1 : 0;
+	}
+
 	bool hasSvg = false;
-	if (svgPath)
+	_add_selection( svg );
+
+	// With --nest each argument is file[:quantity] and copies are packed onto the
+	// mat once its boundaries are known
+	LicutSVG **designs = (LicutSVG **)calloc( designCount + 1, sizeof(LicutSVG *) );
+	int *designQuantity = (int *)calloc( designCount + 1, sizeof(int) );
+	if (FLAGS_nest)
+	{
+		for (n = 0; n < designCount; n++)
+		{
+			designQuantity[n] = 1;
+			char *colon = strrchr( designArgs[n], ':' );
+			if (colon && colon[1] && strspn( colon + 1, "0123456789" ) == strlen( colon + 1 ))
+			{
+				designQuantity[n] = atoi( colon + 1 );
+				*colon = '\0';
+			}
+			designs[n] = new LicutSVG( verbose );
+			_add_selection( *designs[n] );
+			if (designs[n]->Parse( designArgs[n] ) != 0)
+			{
+				printf( "Result of parsing %s = failed\n", designArgs[n] );
+				return -1;
+			}
+			printf( "Design %s: %d copies\n", designArgs[n], designQuantity[n] );
+		}
+	}
+	else if (svgPath)
 	{
 		hasSvg = (svg.Parse( svgPath ) == 0);
 		printf( "Result of parsing %s = %s\n", svgPath, hasSvg ? "OK" : "failed" );
 	}
 
-	int handle = LicutProbe::Open( verbose );
-	if (handle <= 0)
+	// --preflight analyzes the job against given mat bounds without a device
+	int handle = -1;
+	LicutTransport *transport = NULL;
+	unsigned int XMin, YMin, XMax, YMax;
+	if (FLAGS_preflight)
 	{
-		fprintf( stderr, "Failed to open: %s\n", LicutProbe::Errmsg() );
-		return -1;
+		if (sscanf( FLAGS_mat.c_str(), "%u,%u,%u,%u", &XMin, &YMin, &XMax, &YMax ) != 4 || XMax <= XMin || YMax <= YMin)
+		{
+			printf( "Invalid --mat=%s, expected xmin,ymin,xmax,ymax\n", FLAGS_mat.c_str() );
+			return -1;
+		}
 	}
+	else
+	{
+		transport = LicutTransport::Open( FLAGS_device.c_str(), verbose );
+		if (!transport)
+		{
+			fprintf( stderr, "Failed to open: %s\n", LicutTransport::Errmsg() );
+			return -1;
+		}
+		handle = transport->GetFd();
 
-	if (verbose) printf( "Opened handle %d\n", handle );
+		if (verbose) printf( "Opened handle %d\n", handle );
+	}
 
 	LicutIO lio( handle );
-
-	// Drain anything waiting in read buffer
-	lio.Drain( verbose, 500 );
-
-	// Get status
+	lio.SetTransport( transport );
+	lio.SetReplyTimeout( FLAGS_reply_timeout );
 	int send_res, reply_res;
-	unsigned int cartridgeLoaded = 0;
-	unsigned int matLoaded = 0;
-	send_res = lio.SendCmd_StatusRequest( &cartridgeLoaded, &matLoaded );
-	reply_res = lio.ReadCmdReply( verbose );
-	printf( "Mat is %sloaded, cartridge %spresent\n", matLoaded ? "" : "not ", cartridgeLoaded ? "" : "not " );
-
-	// Get model and firmware version
-	unsigned int version_data[3];
-	send_res = lio.SendCmd_FirmwareVersion( version_data );
-	reply_res = lio.ReadCmdReply( verbose );
-	printf( "Model #%u, firmware ver %u.%u\n", version_data[0], version_data[1], version_data[2] );
-
-	// Get cartridge name
-	char cartridgeName[256];
-	unsigned int cartridgePresent, cartridgeVersion;
-	send_res = lio.SendCmd_CartridgeName( &cartridgePresent, cartridgeName, &cartridgeVersion );
-	reply_res = lio.ReadCmdReply( verbose );
-	printf( "Cartridge present: %u", cartridgePresent );
-	if (cartridgePresent) printf( " rev:%u name:%s", cartridgeVersion, cartridgeName );
-	printf( "\n" );
-
-	// Wait until mat loaded
-	bool wasLoaded = matLoaded;
-	while (!matLoaded)
+	bool wasLoaded = true;
+
+	if (!FLAGS_preflight)
 	{
+		// Drain anything waiting in read buffer
+		lio.Drain( verbose, 500 );
+
+		// Get status
+		unsigned int cartridgeLoaded = 0;
+		unsigned int matLoaded = 0;
 		send_res = lio.SendCmd_StatusRequest( &cartridgeLoaded, &matLoaded );
 		reply_res = lio.ReadCmdReply( verbose );
-		if (matLoaded) break;
-		printf( "\nMat not loaded, insert and press 'Load mat' key:" );
-		sleep( 5 );
+		printf( "Mat is %sloaded, cartridge %spresent\n", matLoaded ? "" : "not ", cartridgeLoaded ? "" : "not " );
+
+		// Get model and firmware version
+		unsigned int version_data[3];
+		send_res = lio.SendCmd_FirmwareVersion( version_data );
+		reply_res = lio.ReadCmdReply( verbose );
+		printf( "Model #%u, firmware ver %u.%u\n", version_data[0], version_data[1], version_data[2] );
+
+		// Get cartridge name
+		char cartridgeName[256];
+		unsigned int cartridgePresent, cartridgeVersion;
+		send_res = lio.SendCmd_CartridgeName( &cartridgePresent, cartridgeName, &cartridgeVersion );
+		reply_res = lio.ReadCmdReply( verbose );
+		printf( "Cartridge present: %u", cartridgePresent );
+		if (cartridgePresent) printf( " rev:%u name:%s", cartridgeVersion, cartridgeName );
+		printf( "\n" );
+
+		// Wait until mat loaded
+		wasLoaded = matLoaded;
+		while (!matLoaded)
+		{
+			send_res = lio.SendCmd_StatusRequest( &cartridgeLoaded, &matLoaded );
+			reply_res = lio.ReadCmdReply( verbose );
+			if (matLoaded) break;
+			printf( "\nMat not loaded, insert and press 'Load mat' key:" );
+			sleep( 5 );
+		}
+
+		printf( "\nMat loaded, getting boundaries...\n" );
+
+		send_res = lio.SendCmd_MatBoundaries( &XMin, &YMin, &XMax, &YMax );
+		reply_res = lio.ReadCmdReply( verbose );
+		printf( "Mat boundaries: (%u,%u) to (%u,%u)\n", XMin, YMin, XMax, YMax );
 	}
 
-	printf( "\nMat loaded, getting boundaries...\n" );
+	if (FLAGS_pipeline)
+	{
+		// Lowering starts now, during the pressure wait
+		unsigned int mat[4] = { XMin, YMin, XMax, YMax };
+		pipeline.SetMat( mat );
+	}
 
-	unsigned int XMin, YMin, XMax, YMax;
-	send_res = lio.SendCmd_MatBoundaries( &XMin, &YMin, &XMax, &YMax );
-	reply_res = lio.ReadCmdReply( verbose );
-	printf( "Mat boundaries: (%u,%u) to (%u,%u)\n", XMin, YMin, XMax, YMax );
+	if (batchMode)
+	{
+		unsigned int mat[4] = { XMin, YMin, XMax, YMax };
+		batch.SetMat( mat );
+		if (!wasLoaded && !quick)
+		{
+			printf( "\nSet pressure via bottom wheel:" );
+			fflush( stdout );
+			sleep( 15 );
+			printf( " ...continuing\n" );
+		}
+		printf( "\nCutting %d files with inter-command delay of %dms...\n", batch.GetCount(), interCmd );
+		int cut = batch.Run( lio, eject != 0 );
+		lio.Drain( verbose, 1000 );
+		if (verbose) printf( "Closing handle %d\n", handle );
+		delete transport;
+		LicutLog::Flush();
+		FILE *f = FLAGS_batch_report.empty() ? stdout : fopen( FLAGS_batch_report.c_str(), "w" );
+		if (!f)
+		{
+			printf( "Cannot write %s: %s\n", FLAGS_batch_report.c_str(), strerror( errno ) );
+			f = stdout;
+		}
+		batch.WriteReport( f );
+		if (f != stdout) fclose( f );
+		free( designs );
+		free( designQuantity );
+		free( designArgs );
+		return cut == batch.GetCount() ? 0 : -1;
+	}
+
+	if (FLAGS_daemon)
+	{
+		// Device identity and mat state found above are kept for every job
+		_DaemonHandler handler;
+		LicutDaemon daemon( lio, handler, verbose );
+		unsigned int mat[4] = { XMin, YMin, XMax, YMax };
+		daemon.SetMat( mat, true );
+		daemon.SetDelays( interCmd, interCurve );
+		daemon.SetOptions( FLAGS_collapse != 0, eject != 0, quick != 0 );
+		daemon.SetTransaction( FLAGS_transaction, FLAGS_transaction_drain );
+		daemon.SetRetries( FLAGS_retries );
+		if (!wasLoaded && !quick)
+		{
+			printf( "\nSet pressure via bottom wheel:" );
+			fflush( stdout );
+			sleep( 15 );
+			printf( " ...continuing\n" );
+		}
+		int r = -1;
+		if (daemon.Listen( FLAGS_socket.c_str() ) == 0) r = daemon.Run();
+		if (verbose) printf( "Closing handle %d\n", handle );
+		delete transport;
+		free( designs );
+		free( designQuantity );
+		free( designArgs );
+		return r < 0 ? -1 : 0;
+	}
+
+	if (FLAGS_nest && designCount > 0)
+	{
+		LicutNest nest( verbose );
+		for (n = 0; n < designCount; n++)
+		{
+			double inchesX, inchesY;
+			if (!designs[n]->GetInchesPerUnit( inchesX, inchesY ))
+			{
+				printf( "%s has no physical width and height, assuming 96 user units per inch\n", designArgs[n] );
+				inchesX = inchesY = 1.0 / 96;
+			}
+			nest.AddDesign( designs[n], designArgs[n], designQuantity[n], inchesX * FLAGS_device_dpi, inchesY * FLAGS_device_dpi );
+		}
+		nest.Pack( XMax - XMin, YMax - YMin, FLAGS_nest_spacing, FLAGS_nest_rotate != 0 );
+		int requested = 0;
+		for (n = 0; n < nest.GetDesignCount(); n++)
+		{
+			requested += nest.GetRequested( n );
+			printf( "Nested %s: %d of %d copies\n", nest.GetDesignName( n ), nest.GetPlaced( n ), nest.GetRequested( n ) );
+		}
+		printf( "Nested %d of %d copies per mat (%d turned), %.1f%% mat utilization, %.0f of %u device units of feed used\n",
+			nest.GetPlacedCount(), requested, nest.GetRotatedCount(), 100 * nest.GetUtilization(), nest.GetUsedHeight(), YMax - YMin );
+		if (nest.GetPlacedCount() > 0 && nest.GetPlacedCount() < requested)
+		{
+			printf( "About %d mats needed for all copies\n", (requested + nest.GetPlacedCount() - 1) / nest.GetPlacedCount() );
+		}
+		hasSvg = (nest.BuildSheet( svg ) == 0 && svg.GetDrawSetCount() > 0);
+	}
+
+	// With --tile the design keeps its physical size and is split across mats
+	bool tiled = false;
+	bool cutInterrupted = false;
+	if (FLAGS_tile && FLAGS_nest)
+	{
+		printf( "--tile ignored with --nest\n" );
+	}
+	else if (FLAGS_tile && hasSvg && svg.GetWidth() && svg.GetHeight())
+	{
+		double inchesX, inchesY;
+		if (!svg.GetInchesPerUnit( inchesX, inchesY ))
+		{
+			printf( "%s has no physical width and height, assuming 96 user units per inch\n", svgPath );
+			inchesX = inchesY = 1.0 / 96;
+		}
+		tiled = true;
+		svg.SetScaling( 0, 0, (int)(svg.GetWidth() * inchesX * FLAGS_device_dpi + 0.5), (int)(svg.GetHeight() * inchesY * FLAGS_device_dpi + 0.5) );
+	}
+
+	if (hasSvg && svg.GetWidth() && svg.GetHeight())
+	{
+		if (!tiled) svg.SetScaling( XMin, YMin, XMax - XMin, YMax - YMin );
+		_geometry_passes( svg );
+	}
+
+	if (FLAGS_preflight)
+	{
+		// Report must be the last line of stdout
+		LicutLog::Flush();
+		FILE *f = (FLAGS_preflight_json == "-") ? stdout : fopen( FLAGS_preflight_json.c_str(), "w" );
+		if (!f)
+		{
+			printf( "Cannot write %s: %s\n", FLAGS_preflight_json.c_str(), strerror( errno ) );
+			return -1;
+		}
+		const char *name = FLAGS_nest ? "nest" : (svgPath ? svgPath : "");
+		unsigned int mat[4] = { XMin, YMin, XMax, YMax };
+		int status = 0;
+		LicutPreflight preflight;
+		if (!hasSvg || !svg.GetWidth() || !svg.GetHeight())
+		{
+			LicutPreflight::WriteError( f, name, !hasSvg ? "parse failed or nothing to cut" : "no svg width and height" );
+			status = -1;
+		}
+		else if (tiled)
+		{
+			LicutTile tile( verbose );
+			int tiles = tile.Setup( svg, XMax - XMin, YMax - YMin, FLAGS_tile_overlap );
+			for (n = 0; n < tiles && status == 0; n++)
+			{
+				LicutSVG out( 0 );
+				LicutCmdList cmds( 0 );
+				if (tile.BuildTile( n, out ) < 0 || cmds.Lower( out, XMin, YMin, XMax - XMin, YMax - YMin, interCmd, interCurve ) != 0) status = -1;
+				if (FLAGS_collapse) preflight.AddCollapsed( cmds.Collapse() );
+				cmds.SetTransaction( FLAGS_transaction, FLAGS_transaction_drain );
+				preflight.Add( cmds, XMin, YMin, interCmd, FLAGS_transaction ? FLAGS_transaction_drain : FLAGS_reply_ms, cmds.CountTransactions() );
+			}
+			if (tiles < 0 || status != 0)
+			{
+				LicutPreflight::WriteError( f, name, "cannot split into tiles" );
+				status = -1;
+			}
+			else preflight.WriteJson( f, name, mat, tiles );
+		}
+		else
+		{
+			LicutCmdList cmds( 0 );
+			cmds.Lower( svg, XMin, YMin, XMax - XMin, YMax - YMin, interCmd, interCurve );
+			if (FLAGS_collapse) preflight.AddCollapsed( cmds.Collapse() );
+			cmds.SetTransaction( FLAGS_transaction, FLAGS_transaction_drain );
+			preflight.Add( cmds, XMin, YMin, interCmd, FLAGS_transaction ? FLAGS_transaction_drain : FLAGS_reply_ms, cmds.CountTransactions() );
+			preflight.WriteJson( f, name, mat, 1 );
+		}
+		if (f != stdout) fclose( f );
+		for (n = 0; n < designCount; n++) delete designs[n];
+		free( designs );
+		free( designQuantity );
+		free( designArgs );
+		return status;
+	}
 
 	// If we just loaded, allow operator to set pressure
 	if (!wasLoaded && !quick)
@@ -188,16 +640,168 @@ int main( int argc, char *argv[] )
 		printf( " ...continuing" );
 	}
 
-	if (hasSvg && svg.GetDrawSetCount() > 0)
+	if (FLAGS_pipeline)
+	{
+		printf( "\nCutting draw sets as they are parsed with inter-command delay of %dms...\n", interCmd );
+		int r = pipeline.Run( lio );
+		printf( "Pipeline cut %d draw sets\n", r );
+		if (FLAGS_transaction)
+		{
+			printf( "Sent %d packets in %d transactions\n", pipeline.GetPacketsSent(), pipeline.GetTransactionCount() );
+		}
+		if (pipeline.GetRetryCount() || pipeline.GetResyncCount())
+		{
+			printf( "Reply errors: %d commands sent again after %d resyncs\n", pipeline.GetRetryCount(), pipeline.GetResyncCount() );
+		}
+		LicutLog::Flush();
+		pipeline.WriteReport( stdout );
+	}
+	else if (tiled && svg.GetDrawSetCount() > 0)
+	{
+		// Each tile is clipped, lowered and encoded in the background while the
+		// previous one is cut and the operator swaps mats
+		LicutTile tile( verbose );
+		tile.SetCollapse( FLAGS_collapse != 0 );
+		int tiles = tile.Setup( svg, XMax - XMin, YMax - YMin, FLAGS_tile_overlap );
+		if (tiles > 0)
+		{
+			printf( "\nCutting %d draw sets at true size on %d mats (%d across, %d along the feed) with inter-command delay of %dms...\n",
+				svg.GetDrawSetCount(), tiles, tile.GetColumns(), tile.GetRows(), interCmd );
+			tile.StartPrepare( 0, XMin, YMin, interCmd, interCurve );
+			for (n = 0; n < tiles; n++)
+			{
+				LicutCmdList *cmds = tile.FinishPrepare();
+				int prepareMs = tile.GetPrepareMs();
+				int waitMs = tile.GetWaitMs();
+				int clipped = tile.GetClippedCount();
+				int collapsed = tile.GetCollapsedCount();
+				if (!cmds)
+				{
+					printf( "Failed to prepare mat %d of %d\n", n + 1, tiles );
+					break;
+				}
+				if (n + 1 < tiles) tile.StartPrepare( n + 1, XMin, YMin, interCmd, interCurve );
+				if (n > 0)
+				{
+					char matName[32];
+					snprintf( matName, sizeof(matName), "mat %d of %d", n + 1, tiles );
+					if (lio.WaitMatChange( verbose, matName ) != 0)
+					{
+						printf( "Mat %d of %d not loaded\n", n + 1, tiles );
+						break;
+					}
+				}
+				printf( "Mat %d of %d (column %d, row %d): %d draw sets, %d packets (%d removed at device resolution), %d pieces clipped, prepared in %dms, waited %dms\n",
+					n + 1, tiles, tile.GetColumn( n ) + 1, tile.GetRow( n ) + 1, cmds->GetGroupCount(), cmds->GetCount(),
+					collapsed, clipped, prepareMs, waitMs );
+				cmds->SetTransaction( FLAGS_transaction, FLAGS_transaction_drain );
+				cmds->SetRetries( FLAGS_retries );
+				int r = cmds->Send( lio );
+				if (cmds->GetRetryCount() || cmds->GetResyncCount())
+				{
+					printf( "Mat %d of %d: %d commands sent again after %d resyncs\n", n + 1, tiles, cmds->GetRetryCount(), cmds->GetResyncCount() );
+				}
+				if (r < 0)
+				{
+					printf( "Cutting mat %d of %d failed\n", n + 1, tiles );
+					break;
+				}
+				if (n + 1 < tiles)
+				{
+					printf( "Ejecting mat %d of %d...\n", n + 1, tiles );
+					send_res = lio.SendCmd_MoveCut( 2, 0, 0 );
+					reply_res = lio.ReadCmdReply( verbose );
+				}
+			}
+		}
+	}
+	else if (hasSvg && svg.GetDrawSetCount() > 0 && !FLAGS_journal.empty())
+	{
+		// Journaled job: identity is the commands to send plus mat and options, and
+		// every acknowledged command is recorded so a rerun with --resume continues
+		// where this one stopped
+		LicutCmdList cmds( verbose );
+		cmds.Lower( svg, XMin, YMin, XMax - XMin, YMax - YMin, interCmd, interCurve );
+		int collapsed = FLAGS_collapse ? cmds.Collapse() : 0;
+		unsigned int mat[4] = { XMin, YMin, XMax, YMax };
+		char options[512];
+		snprintf( options, sizeof(options), "file=%s order=%s dedupe=%g simplify=%g inside_out=%d collapse=%d intercmd=%d intercurve=%d",
+			svgPath, FLAGS_order.c_str(), FLAGS_dedupe, FLAGS_simplify, FLAGS_inside_out, FLAGS_collapse, interCmd, interCurve );
+		uint64_t hash = LicutJournal::Hash( cmds, mat, options );
+		LicutJournal journal( verbose );
+		journal.SetSyncEvery( FLAGS_journal_sync );
+		int start = 0;
+		bool complete = false;
+		if (FLAGS_resume)
+		{
+			int last = journal.Load( FLAGS_journal.c_str(), hash, complete );
+			if (last < -1)
+			{
+				printf( "Cannot resume: %s does not match this job (same file, mat and options needed)\n", FLAGS_journal.c_str() );
+				cutInterrupted = true;
+			}
+			else if (complete)
+			{
+				printf( "Job in %s already completed, nothing to cut\n", FLAGS_journal.c_str() );
+			}
+			else
+			{
+				start = cmds.ResumeIndex( last );
+				printf( "Resuming job %016llx at command %d of %d (last acknowledged %d)\n",
+					(unsigned long long)hash, start, cmds.GetCount(), last );
+			}
+		}
+		if (!cutInterrupted && !complete &&
+			journal.Start( FLAGS_journal.c_str(), hash, cmds.GetCount(), mat, options, FLAGS_resume != 0 ) == 0)
+		{
+			printf( "\nCutting %d draw sets (%d packets, %d removed at device resolution) with journal %s...\n",
+				cmds.GetGroupCount(), cmds.GetCount(), collapsed, FLAGS_journal.c_str() );
+			double t0 = licut_now();
+			cmds.SetTransaction( FLAGS_transaction, FLAGS_transaction_drain );
+			cmds.SetRetries( FLAGS_retries );
+			int r = cmds.Send( lio, start, &journal );
+			double seconds = licut_now() - t0;
+			journal.Finish( r >= 0 );
+			printf( "Journal: %d records, %d syncs, %.1fms overhead (%.3f%% of %.1fs cutting)\n",
+				journal.GetRecordCount(), journal.GetSyncCount(), journal.GetOverheadMs(),
+				seconds > 0 ? journal.GetOverheadMs() / (seconds * 10) : 0, seconds );
+			if (cmds.GetRetryCount() || cmds.GetResyncCount())
+			{
+				printf( "Reply errors: %d commands sent again after %d resyncs\n", cmds.GetRetryCount(), cmds.GetResyncCount() );
+			}
+			if (r < 0)
+			{
+				printf( "Cut interrupted, run again with --resume=1 to continue\n" );
+				cutInterrupted = true;
+			}
+		}
+	}
+	else if (hasSvg && svg.GetDrawSetCount() > 0)
 	{
 		svg.SetIntercurveDelay( interCurve );
 		svg.SetIntercommandDelay( interCmd );
+		svg.SetCollapse( FLAGS_collapse != 0 );
+		svg.SetTransaction( FLAGS_transaction, FLAGS_transaction_drain );
+		svg.SetRetries( FLAGS_retries );
 		printf( "\nCutting %d draw sets from svg file with inter-command delay of %dms...\n", svg.GetDrawSetCount(), svg.GetIntercommandDelay() );
 		int r = svg.CutAllDrawSets( lio, XMin, YMin, XMax - XMin, YMax - YMin );
 		printf( "CutAllDrawSets() returned %d\n", r );
+		if (r >= 0 && FLAGS_collapse)
+		{
+			printf( "Device resolution: %d packets sent, %d removed\n", svg.GetPacketsSent(), svg.GetPacketsCollapsed() );
+		}
+		if (r >= 0 && FLAGS_transaction)
+		{
+			printf( "Sent %d packets in %d transactions\n", svg.GetPacketsSent(), svg.GetTransactionsSent() );
+		}
+		if (svg.GetRetryCount() || svg.GetResyncCount())
+		{
+			printf( "Reply errors: %d commands sent again after %d resyncs\n", svg.GetRetryCount(), svg.GetResyncCount() );
+		}
 	}
 
-	if (eject)
+	// An interrupted journaled cut leaves the mat in place for --resume
+	if (eject && !cutInterrupted)
 	{
 		printf( "Ejecting...\n" );
 
@@ -210,9 +814,13 @@ int main( int argc, char *argv[] )
 	lio.Drain( verbose, 1000 );
 
 	if (verbose) printf( "Closing handle %d\n", handle );
-	LicutProbe::Close( handle );
+	delete transport;
 	if (verbose) printf( "Handle %d closed, exiting...\n", handle );
 
+	for (n = 0; n < designCount; n++) delete designs[n];
+	free( designs );
+	free( designQuantity );
+	free( designArgs );
 	return 0;
 }
 
@@ -0,0 +1,62 @@
+// $Id$
+// licut_relay: run next to the cutter to let licut drive it over TCP with
+// --device=tcp:host:port
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+
+#include <gflags/gflags.h>
+
+#include "../licut_relay.h"
+#include "../licut_transport.h"
+#include "../licut_log.h"
+
+DEFINE_string( device, "", "Cutter to relay: a tty path or pty:path (default: find the USB device)" );
+DEFINE_string( address, "", "Address to listen on (default: all)" );
+DEFINE_int32( port, 2300, "TCP port to listen on" );
+DEFINE_int32( verbose, 0, "Verbose mode" );
+
+static LicutRelay *g_relay = NULL;
+
+static void _stop_handler( int sig )
+{
+	(void)sig;
+	if (g_relay) g_relay->Stop();
+}
+
+int main( int argc, char *argv[] )
+{
+	google::ParseCommandLineFlags( &argc, &argv, true );
+	setvbuf( stdout, NULL, _IOLBF, 0 );
+	if (!strncmp( FLAGS_device.c_str(), "tcp:", 4 ) || !strncmp( FLAGS_device.c_str(), "ser2net:", 8 ))
+	{
+		printf( "--device must be local to the relay\n" );
+		return -1;
+	}
+	LicutTransport *device = LicutTransport::Open( FLAGS_device.c_str(), FLAGS_verbose );
+	if (!device)
+	{
+		fprintf( stderr, "Failed to open: %s\n", LicutTransport::Errmsg() );
+		return -1;
+	}
+
+	LicutRelay relay( FLAGS_verbose );
+	if (relay.Listen( FLAGS_address.empty() ? NULL : FLAGS_address.c_str(), FLAGS_port ) != 0)
+	{
+		delete device;
+		return -1;
+	}
+	g_relay = &relay;
+	struct sigaction sa;
+	memset( &sa, 0, sizeof(sa) );
+	sa.sa_handler = _stop_handler;
+	sigaction( SIGINT, &sa, NULL );
+	sigaction( SIGTERM, &sa, NULL );
+
+	int res = relay.Run( device->GetFd() );
+	printf( "Relay stopping after %d clients\n", relay.GetClientCount() );
+	LicutLog::Flush();
+	delete device;
+	return res;
+}